@@ -0,0 +1,471 @@
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "batch.h"
+#include "fs.h"
+#include "hash.h"
+#include "utils.h"
+
+/* Data structures and types. */
+
+/* The result of processing one disk image. */
+struct batch_result {
+    struct string_buffer record;  /* The JSON record of the image. */
+    struct hash_list hashes;      /* The hashes of the files (kept to
+                                   * find the duplicate files).
+                                   */
+    int done;                     /* If the image was processed. */
+    int success;                  /* If the processing succeeded. */
+};
+
+/* The state shared by the worker threads. */
+struct batch_context {
+    const struct batch_options *opts; /* The options. */
+    const char * const *images;   /* The disk image filenames. */
+    size_t num_images;            /* Number of disk images. */
+    size_t next;                  /* The next image to process. */
+    struct batch_result *results; /* The results of each image. */
+    pthread_mutex_t lock;         /* Protects `next` and `done`. */
+    pthread_cond_t cond;          /* Signals a finished image. */
+};
+
+/* Auxiliary data structure used by the per-image callbacks. */
+struct image_context {
+    const struct batch_options *opts; /* The options. */
+    struct string_buffer errors;  /* The errors (as a JSON list). */
+    struct string_buffer listing; /* The files (as a JSON list). */
+    size_t num_files;             /* Number of files. */
+    size_t num_bytes;             /* Total length of the files. */
+};
+
+/* A reference to the hash of a file of an image
+ * (see print_duplicates()).
+ */
+struct hash_ref {
+    const struct file_hash *fh;   /* The hash of the file. */
+    size_t image;                 /* The index of the image. */
+};
+
+/* Functions. */
+
+void manifest_initvar(struct manifest *m)
+{
+    m->data = NULL;
+    m->images = NULL;
+    m->num_images = 0;
+}
+
+void manifest_destroy(struct manifest *m)
+{
+    if (m->data) free((void *) m->data);
+    m->data = NULL;
+
+    if (m->images) free((void *) m->images);
+    m->images = NULL;
+}
+
+int manifest_create(struct manifest *m, const char *filename)
+{
+    FILE *fp;
+    long size;
+    size_t i, num_lines;
+    char *line;
+
+    manifest_initvar(m);
+
+    fp = fopen(filename, "rb");
+    if (!fp) {
+        report_error("batch: could not open manifest `%s`", filename);
+        return FALSE;
+    }
+
+    if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0
+        || fseek(fp, 0, SEEK_SET) != 0) {
+        report_error("batch: could not read manifest `%s`", filename);
+        fclose(fp);
+        return FALSE;
+    }
+
+    m->data = (char *) malloc(((size_t) size) + 1);
+    if (unlikely(!m->data)) {
+        report_error("batch: memory exhausted");
+        fclose(fp);
+        return FALSE;
+    }
+
+    if (fread(m->data, 1, (size_t) size, fp) != (size_t) size) {
+        report_error("batch: could not read manifest `%s`", filename);
+        fclose(fp);
+        manifest_destroy(m);
+        return FALSE;
+    }
+    fclose(fp);
+    m->data[size] = '\0';
+
+    num_lines = 1;
+    for (i = 0; i < (size_t) size; i++) {
+        if (m->data[i] == '\n') num_lines++;
+    }
+
+    m->images = (const char **) malloc(num_lines * sizeof(const char *));
+    if (unlikely(!m->images)) {
+        report_error("batch: memory exhausted");
+        manifest_destroy(m);
+        return FALSE;
+    }
+
+    /* Split the lines in place. */
+    line = m->data;
+    for (i = 0; i <= (size_t) size; i++) {
+        if (m->data[i] != '\n' && m->data[i] != '\0') continue;
+        if (i > 0 && m->data[i - 1] == '\r') m->data[i - 1] = '\0';
+        m->data[i] = '\0';
+
+        if (line[0] != '\0' && line[0] != '#')
+            m->images[m->num_images++] = line;
+        line = &m->data[i + 1];
+    }
+
+    return TRUE;
+}
+
+/* Callback to summarize (and list) the files of one image. */
+static
+int summarize_cb(const struct fs *fs,
+                 const struct file_entry *fe,
+                 void *arg)
+{
+    struct image_context *ictx;
+    struct file_info finfo;
+    struct string_buffer *sb;
+    size_t length;
+
+    ictx = (struct image_context *) arg;
+    if (!fs_file_info(fs, fe, &finfo)) return -1;
+    if (!fs_file_length(fs, fe, ictx->opts->strict, &length)) return -1;
+
+    ictx->num_files++;
+    ictx->num_bytes += length;
+    if (!ictx->opts->list_files) return 1;
+
+    sb = &ictx->listing;
+    if ((sb->len > 0 && !strbuf_printf(sb, ", "))
+        || !strbuf_printf(sb, "{\"vda\": %u, \"sn\": %u, "
+                          "\"version\": %u, \"length\": %u, "
+                          "\"name\": ", fe->leader_vda,
+                          ((fe->sn.word1 & SN_PART1_MASK) << 16)
+                          | fe->sn.word2,
+                          fe->version, (unsigned int) length)
+        || !strbuf_append_json(sb, finfo.filename)
+        || !strbuf_printf(sb, "}")) {
+        report_error("batch: memory exhausted");
+        return -1;
+    }
+    return 1;
+}
+
+/* Prepares the filesystem `fs` of a worker thread for an image with
+ * the disk geometry `dg`. The memory of `fs` is reused when it has
+ * the same geometry as the previous image.
+ * Returns TRUE on success.
+ */
+static
+int prepare_fs(struct fs *fs, struct geometry dg)
+{
+    if (fs->storage
+        && fs->dg.num_cylinders == dg.num_cylinders
+        && fs->dg.num_heads == dg.num_heads
+        && fs->dg.num_sectors == dg.num_sectors
+        && fs->dg.num_disks == dg.num_disks) {
+        fs_reset(fs);
+        return TRUE;
+    }
+
+    fs_destroy(fs);
+    return fs_create(fs, dg);
+}
+
+/* Processes the disk image `image` with the filesystem `fs` (of the
+ * worker thread) and stores the result in `res`.
+ * The options are given by `opts`.
+ */
+static
+void process_image(const struct batch_options *opts, const char *image,
+                   struct fs *fs, struct batch_result *res)
+{
+    struct image_context ictx;
+    struct geometry dg;
+    size_t i;
+    uint16_t pages;
+    int success;
+
+    ictx.opts = opts;
+    ictx.num_files = 0;
+    ictx.num_bytes = 0;
+    pages = 0;
+
+    res->success = FALSE;
+    if (!strbuf_create(&res->record, 256)) return;
+    if (!strbuf_create(&ictx.errors, 64)) return;
+    if (!strbuf_create(&ictx.listing, (opts->list_files) ? 4096 : 0)) {
+        strbuf_destroy(&ictx.errors);
+        return;
+    }
+
+    /* Route the errors of this image to its record. */
+    set_error_handler(&collect_json_error, &ictx.errors);
+    dg = opts->dg;
+    success = (!opts->detect_geometry || fs_detect_geometry(image, &dg))
+        && prepare_fs(fs, dg);
+    if (success) {
+        pages = fs->length;
+        success = fs_open_image_mmap(fs, image)
+            && fs_check_integrity(fs, 1)
+            && fs_scan_files(fs, &summarize_cb, &ictx)
+            && (!opts->hash_files || hash_list_create(&res->hashes, fs));
+    }
+    set_error_handler(NULL, NULL);
+
+    strbuf_printf(&res->record, "{\"image\": ");
+    strbuf_append_json(&res->record, image);
+    strbuf_printf(&res->record, ", \"status\": \"%s\", \"pages\": %u, "
+                  "\"files\": %u, \"bytes\": %u",
+                  (success) ? "ok" : "error", (unsigned int) pages,
+                  (unsigned int) ictx.num_files,
+                  (unsigned int) ictx.num_bytes);
+    if (opts->list_files && success) {
+        strbuf_printf(&res->record, ", \"listing\": [%s]",
+                      ictx.listing.str);
+    }
+    if (opts->hash_files && success) {
+        strbuf_printf(&res->record, ", \"hashes\": [");
+        for (i = 0; i < res->hashes.num_hashes; i++) {
+            if (i > 0) strbuf_printf(&res->record, ", ");
+            hash_append_json(&res->record, NULL, &res->hashes.hashes[i]);
+        }
+        strbuf_printf(&res->record, "]");
+    }
+    strbuf_printf(&res->record, ", \"errors\": [%s]}\n", ictx.errors.str);
+
+    res->success = success;
+    strbuf_destroy(&ictx.listing);
+    strbuf_destroy(&ictx.errors);
+
+    /* Only the memory is kept for the next image. */
+    fs_reset(fs);
+}
+
+/* Compares two hash references, by the hash and then by the image
+ * and the position of the file in the image.
+ */
+static
+int compare_refs(const void *p1, const void *p2)
+{
+    const struct hash_ref *r1, *r2;
+    int cmp;
+
+    r1 = (const struct hash_ref *) p1;
+    r2 = (const struct hash_ref *) p2;
+    cmp = memcmp(r1->fh->digest, r2->fh->digest, HASH_SIZE);
+    if (cmp != 0) return cmp;
+    if (r1->image != r2->image) return (r1->image < r2->image) ? -1 : 1;
+    if (r1->fh != r2->fh) return (r1->fh < r2->fh) ? -1 : 1;
+    return 0;
+}
+
+/* Prints one JSON object per group of identical files found in more
+ * than one of the `num_images` images (with the hashes in `results`).
+ * The empty files are not reported (they are all alike).
+ * Returns TRUE on success.
+ */
+static
+int print_duplicates(const char * const *images,
+                     const struct batch_result *results,
+                     size_t num_images)
+{
+    char hex[2 * HASH_SIZE + 1];
+    struct string_buffer sb;
+    struct hash_ref *refs;
+    const struct hash_list *hl;
+    const struct file_hash *fh;
+    size_t i, j, k, num_refs, num_distinct;
+
+    num_refs = 0;
+    for (i = 0; i < num_images; i++)
+        num_refs += results[i].hashes.num_hashes;
+
+    refs = (struct hash_ref *) malloc((num_refs + 1)
+                                      * sizeof(struct hash_ref));
+    if (unlikely(!refs)) {
+        report_error("batch: memory exhausted");
+        return FALSE;
+    }
+
+    num_refs = 0;
+    for (i = 0; i < num_images; i++) {
+        hl = &results[i].hashes;
+        for (j = 0; j < hl->num_hashes; j++) {
+            if (hl->hashes[j].length == 0) continue;
+            refs[num_refs].fh = &hl->hashes[j];
+            refs[num_refs].image = i;
+            num_refs++;
+        }
+    }
+    qsort(refs, num_refs, sizeof(struct hash_ref), &compare_refs);
+
+    if (!strbuf_create(&sb, 256)) {
+        free((void *) refs);
+        return FALSE;
+    }
+
+    for (i = 0; i < num_refs; i = j) {
+        num_distinct = 1;
+        for (j = i + 1; j < num_refs; j++) {
+            if (memcmp(refs[j].fh->digest, refs[i].fh->digest,
+                       HASH_SIZE) != 0) break;
+            if (refs[j].image != refs[j - 1].image) num_distinct++;
+        }
+        if (num_distinct < 2) continue;
+
+        hash_format(hex, refs[i].fh->digest);
+        sb.len = 0;
+        sb.str[0] = '\0';
+        strbuf_printf(&sb, "{\"sha256\": \"%s\", \"length\": %u, "
+                      "\"images\": %u, \"copies\": [", hex,
+                      (unsigned int) refs[i].fh->length,
+                      (unsigned int) num_distinct);
+        for (k = i; k < j; k++) {
+            fh = refs[k].fh;
+            if (k > i) strbuf_printf(&sb, ", ");
+            strbuf_printf(&sb, "{\"image\": ");
+            strbuf_append_json(&sb, images[refs[k].image]);
+            strbuf_printf(&sb, ", \"path\": ");
+            if (fh->path)
+                strbuf_append_json(&sb, fh->path);
+            else
+                strbuf_printf(&sb, "null");
+            strbuf_printf(&sb, ", \"sn\": %u}",
+                          ((fh->fe.sn.word1 & SN_PART1_MASK) << 16)
+                          | fh->fe.sn.word2);
+        }
+        strbuf_printf(&sb, "]}\n");
+        fputs(sb.str, stdout);
+    }
+
+    strbuf_destroy(&sb);
+    free((void *) refs);
+    return TRUE;
+}
+
+/* The main function of the worker threads.
+ * The `arg` is a pointer to the batch_context structure.
+ */
+static
+void *batch_worker(void *arg)
+{
+    struct batch_context *ctx;
+    struct fs fs;
+    size_t i;
+
+    ctx = (struct batch_context *) arg;
+    fs_initvar(&fs);
+    while (TRUE) {
+        pthread_mutex_lock(&ctx->lock);
+        i = ctx->next++;
+        pthread_mutex_unlock(&ctx->lock);
+        if (i >= ctx->num_images) break;
+
+        process_image(ctx->opts, ctx->images[i], &fs, &ctx->results[i]);
+
+        pthread_mutex_lock(&ctx->lock);
+        ctx->results[i].done = TRUE;
+        pthread_cond_broadcast(&ctx->cond);
+        pthread_mutex_unlock(&ctx->lock);
+    }
+
+    fs_destroy(&fs);
+    return NULL;
+}
+
+int batch_process(const char * const *images, size_t num_images,
+                  const struct batch_options *opts)
+{
+    struct batch_context ctx;
+    struct batch_result *res;
+    pthread_t *threads;
+    unsigned int num_threads, t;
+    size_t i;
+    int success;
+
+    num_threads = MAX(opts->num_threads, 1U);
+    if (num_threads > num_images) num_threads = (unsigned int) num_images;
+
+    ctx.opts = opts;
+    ctx.images = images;
+    ctx.num_images = num_images;
+    ctx.next = 0;
+    ctx.results = (struct batch_result *)
+        calloc(num_images + 1, sizeof(struct batch_result));
+    threads = (pthread_t *) malloc((num_threads + 1) * sizeof(pthread_t));
+    if (unlikely(!ctx.results || !threads)) {
+        report_error("batch: memory exhausted");
+        if (ctx.results) free((void *) ctx.results);
+        if (threads) free((void *) threads);
+        return FALSE;
+    }
+
+    for (i = 0; i < num_images; i++) {
+        strbuf_initvar(&ctx.results[i].record);
+        hash_list_initvar(&ctx.results[i].hashes);
+    }
+
+    pthread_mutex_init(&ctx.lock, NULL);
+    pthread_cond_init(&ctx.cond, NULL);
+
+    for (t = 0; t < num_threads; t++) {
+        if (pthread_create(&threads[t], NULL, &batch_worker, &ctx) != 0) {
+            report_error("batch: could not create thread");
+            break;
+        }
+    }
+
+    /* Process the images in this thread if there are no workers. */
+    if (t == 0) batch_worker(&ctx);
+
+    /* Print the results in order, as soon as they are ready. */
+    success = TRUE;
+    for (i = 0; i < num_images; i++) {
+        res = &ctx.results[i];
+
+        pthread_mutex_lock(&ctx.lock);
+        while (!res->done)
+            pthread_cond_wait(&ctx.cond, &ctx.lock);
+        pthread_mutex_unlock(&ctx.lock);
+
+        if (res->record.str) fputs(res->record.str, stdout);
+        if (!res->success) success = FALSE;
+        strbuf_destroy(&res->record);
+    }
+
+    if (opts->hash_files) {
+        if (!print_duplicates(images, ctx.results, num_images))
+            success = FALSE;
+
+        for (i = 0; i < num_images; i++)
+            hash_list_destroy(&ctx.results[i].hashes);
+    }
+    fflush(stdout);
+
+    while (t-- > 0)
+        pthread_join(threads[t], NULL);
+
+    pthread_cond_destroy(&ctx.cond);
+    pthread_mutex_destroy(&ctx.lock);
+    free((void *) threads);
+    free((void *) ctx.results);
+    return success;
+}
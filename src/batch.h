@@ -0,0 +1,69 @@
+
+#ifndef __BATCH_H
+#define __BATCH_H
+
+#include <stddef.h>
+#include "fs.h"
+
+/* Data structures and types. */
+
+/* Options for the batch processing of disk images. */
+struct batch_options {
+    struct geometry dg;           /* The disk geometry. */
+    int detect_geometry;          /* Detect the geometry of each image
+                                   * instead of using `dg`.
+                                   */
+    unsigned int num_threads;     /* Number of worker threads. */
+    int list_files;               /* Include the list of files. */
+    int strict;                   /* Do not trust the length hints. */
+    int hash_files;               /* Include the hashes of the files,
+                                   * and report the duplicate files
+                                   * across the images.
+                                   */
+};
+
+/* A list of filenames read from a manifest file (disk images, or
+ * the host files of a new disk).
+ */
+struct manifest {
+    char *data;                   /* The contents of the manifest. */
+    const char **images;          /* The image filenames (pointing
+                                   * to the lines in `data`).
+                                   */
+    size_t num_images;            /* Number of image filenames. */
+};
+
+/* Functions. */
+
+/* Initializes the manifest variable.
+ * This obeys the initvar / destroy / create protocol.
+ */
+void manifest_initvar(struct manifest *m);
+
+/* Destroys the manifest object (and releases the used memory).
+ * This obeys the initvar / destroy / create protocol.
+ */
+void manifest_destroy(struct manifest *m);
+
+/* Creates a manifest object by reading the file named `filename`.
+ * The manifest contains one filename per line (empty lines
+ * and lines starting with `#` are ignored).
+ * This obeys the initvar / destroy / create protocol.
+ * Returns TRUE on success.
+ */
+int manifest_create(struct manifest *m, const char *filename);
+
+/* Processes the disk images in `images` (there are `num_images`
+ * of them) using a pool of worker threads, each one with its own
+ * filesystem object. The results are written to the standard output
+ * as one JSON object per line, in the same order as `images`.
+ * With `opts->hash_files`, these are followed by one JSON object
+ * per group of identical (non-empty) files found in more than one
+ * image.
+ * The options are given by `opts`.
+ * Returns TRUE if all images were processed successfully.
+ */
+int batch_process(const char * const *images, size_t num_images,
+                  const struct batch_options *opts);
+
+#endif /* __BATCH_H */
@@ -0,0 +1,648 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "fs.h"
+#include "utils.h"
+
+/* Constants. */
+#define MAX_DEPTH                                    16U
+#define MAX_FILES                                 65535U
+#define MAX_FILE_SIZE                          1048576U
+#define MAX_FRAGMENTS                              256U
+#define MAX_REPS                                  1000U
+#define MAX_THREADS                                 64U
+
+/* The small reads at random offsets done on each file (see
+ * read_ranges()).
+ */
+#define SEEK_READS                                   16U
+#define SEEK_READ_SIZE                               64U
+
+/* Data structures and types. */
+
+/* The parameters of the synthetic filesystem. */
+struct bench_options {
+    struct geometry dg;           /* The disk geometry. */
+    unsigned int num_files;       /* Number of files. */
+    unsigned int file_size;       /* Average size of the files. */
+    unsigned int fragments;       /* Number of pieces of each file. */
+    unsigned int depth;           /* Depth of the directory tree. */
+    unsigned int num_replace;     /* Number of files replaced. */
+    unsigned int reps;            /* Repetitions of each benchmark. */
+    unsigned int num_threads;     /* Threads for the integrity check. */
+    uint32_t seed;                /* The seed of the generator. */
+    const char *output_filename;  /* Where to keep the image (or NULL). */
+};
+
+/* The state of a benchmark run. */
+struct bench {
+    struct bench_options opts;    /* The parameters. */
+    char tmpdir[MAX_PATH_LENGTH]; /* The scratch directory. */
+    char image[MAX_PATH_LENGTH];  /* The synthetic disk image. */
+    char host[MAX_PATH_LENGTH];   /* The scratch host file. */
+    char **names;                 /* The paths of the files. */
+    unsigned int *sizes;          /* The sizes of the files. */
+    uint8_t *data;                /* The contents (of any file). */
+    size_t total_bytes;           /* The sum of the sizes. */
+    uint32_t rng;                 /* The state of the generator. */
+    double *times;                /* The time of each repetition. */
+};
+
+/* Auxiliary data structure used by list_cb(). */
+struct list_context {
+    size_t count;                 /* Number of files listed. */
+    size_t bytes;                 /* Sum of the file lengths. */
+};
+
+/* Functions. */
+
+/* Obtains the next pseudo-random number (xorshift32), so that the
+ * same seed always generates the same filesystem.
+ */
+static
+uint32_t next_random(struct bench *b)
+{
+    b->rng ^= b->rng << 13;
+    b->rng ^= b->rng >> 17;
+    b->rng ^= b->rng << 5;
+    return b->rng;
+}
+
+/* Obtains the current time (in seconds). */
+static
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((double) ts.tv_sec) + 1e-9 * ((double) ts.tv_nsec);
+}
+
+/* Prints the result of the benchmark `op`, in which each of the
+ * `reps` repetitions (with times in `b->times`) performs `ops`
+ * operations over `bytes` bytes, as one JSON line.
+ */
+static
+void print_result(const struct bench *b, const char *op, size_t ops,
+                  size_t bytes)
+{
+    double best, mean;
+    unsigned int i;
+
+    best = b->times[0];
+    mean = 0;
+    for (i = 0; i < b->opts.reps; i++) {
+        if (b->times[i] < best) best = b->times[i];
+        mean += b->times[i];
+    }
+    mean /= (double) b->opts.reps;
+    if (best <= 0) best = 1e-9;
+
+    printf("{\"op\": \"%s\", \"reps\": %u, \"ops\": %lu, "
+           "\"bytes\": %lu, \"first_s\": %.6f, \"best_s\": %.6f, "
+           "\"mean_s\": %.6f, \"latency_us\": %.3f, "
+           "\"ops_per_s\": %.1f, \"mb_per_s\": %.2f}\n",
+           op, b->opts.reps, (unsigned long) ops, (unsigned long) bytes,
+           b->times[0], best, mean,
+           1e6 * best / ((double) MAX(ops, 1)),
+           ((double) ops) / best, ((double) bytes) / best / 1e6);
+    fflush(stdout);
+}
+
+/* Writes the first `len` bytes of the file contents to the
+ * scratch host file (to be used with fs_replace_file()).
+ * Returns TRUE on success.
+ */
+static
+int write_host_file(const struct bench *b, size_t len)
+{
+    FILE *fp;
+    int ret;
+
+    fp = fopen(b->host, "wb");
+    if (!fp) {
+        report_error("bench: could not open `%s`: %s",
+                     b->host, strerror(errno));
+        return FALSE;
+    }
+
+    ret = (len == 0 || fwrite(b->data, 1, len, fp) == len);
+    if (fclose(fp) != 0) ret = FALSE;
+    if (!ret) report_error("bench: could not write `%s`", b->host);
+    return ret;
+}
+
+/* Chooses the paths and sizes of the files. The files are spread
+ * over a chain of `depth` nested directories (below SysDir).
+ * Returns TRUE on success.
+ */
+static
+int plan_files(struct bench *b)
+{
+    char path[MAX_PATH_LENGTH];
+    unsigned int i, j, level, max_size;
+    size_t len;
+
+    b->names = (char **) calloc(b->opts.num_files, sizeof(char *));
+    b->sizes = (unsigned int *)
+        calloc(b->opts.num_files, sizeof(unsigned int));
+    if (unlikely(!b->names || !b->sizes)) {
+        report_error("bench: memory exhausted");
+        return FALSE;
+    }
+
+    max_size = 0;
+    b->total_bytes = 0;
+    for (i = 0; i < b->opts.num_files; i++) {
+        level = i % (b->opts.depth + 1);
+        len = 0;
+        for (j = 1; j <= level; j++)
+            len += (size_t) sprintf(&path[len], "Dir%u>", j);
+        sprintf(&path[len], "File%05u.dat", i);
+
+        b->names[i] = (char *) malloc(strlen(path) + 1);
+        if (unlikely(!b->names[i])) {
+            report_error("bench: memory exhausted");
+            return FALSE;
+        }
+        strcpy(b->names[i], path);
+
+        /* Sizes between zero and twice the average. */
+        b->sizes[i] = next_random(b) % (2 * b->opts.file_size + 1);
+        b->total_bytes += b->sizes[i];
+        if (b->sizes[i] > max_size) max_size = b->sizes[i];
+    }
+
+    b->data = (uint8_t *) malloc(MAX(max_size, 1U));
+    if (unlikely(!b->data)) {
+        report_error("bench: memory exhausted");
+        return FALSE;
+    }
+
+    for (i = 0; i < max_size; i++)
+        b->data[i] = (uint8_t) next_random(b);
+    return TRUE;
+}
+
+/* Generates the synthetic filesystem in `fs`. All the files are
+ * created first, and then they grow in `fragments` rounds (one file
+ * after the other), so that each file ends up in that many pieces.
+ * Returns TRUE on success.
+ */
+static
+int generate(struct bench *b, struct fs *fs)
+{
+    char path[MAX_PATH_LENGTH];
+    struct file_entry fe;
+    unsigned int i, j, round;
+    size_t len;
+
+    if (!fs_create(fs, b->opts.dg)) return FALSE;
+    if (!fs_format(fs, NULL, 0)) return FALSE;
+
+    len = 0;
+    for (j = 1; j <= b->opts.depth; j++) {
+        len += (size_t) sprintf(&path[len], "Dir%u", j);
+        if (!fs_create_file(fs, path, TRUE, &fe)) return FALSE;
+        path[len++] = '>';
+    }
+
+    for (i = 0; i < b->opts.num_files; i++) {
+        if (!fs_create_file(fs, b->names[i], FALSE, &fe)) return FALSE;
+    }
+
+    for (round = 1; round <= b->opts.fragments; round++) {
+        for (i = 0; i < b->opts.num_files; i++) {
+            len = (((size_t) b->sizes[i]) * round) / b->opts.fragments;
+            if (!write_host_file(b, len)) return FALSE;
+            if (!fs_find_file(fs, b->names[i], &fe)) return FALSE;
+            if (!fs_replace_file(fs, &fe, b->host)) return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* Loads the synthetic image into `fs` (not timed).
+ * Returns TRUE on success.
+ */
+static
+int reload(const struct bench *b, struct fs *fs)
+{
+    fs_destroy(fs);
+    fs_initvar(fs);
+    if (!fs_create(fs, b->opts.dg)) return FALSE;
+    return fs_load_image(fs, b->image);
+}
+
+/* Opens the synthetic image in place into `fs` (which must be
+ * created already) and checks it.
+ * Returns TRUE on success.
+ */
+static
+int open_and_check(const struct bench *b, struct fs *fs)
+{
+    return fs_open_image_mmap(fs, b->image)
+        && fs_check_integrity(fs, b->opts.num_threads);
+}
+
+/* Auxiliary function to bench_list(), called for each file. */
+static
+int list_cb(const struct fs *fs, const struct file_entry *fe, void *arg)
+{
+    struct list_context *ctx;
+    struct file_info finfo;
+    size_t length;
+
+    ctx = (struct list_context *) arg;
+    if (!fs_file_info(fs, fe, &finfo)) return -1;
+    if (!fs_file_length(fs, fe, FALSE, &length)) return -1;
+
+    ctx->count++;
+    ctx->bytes += length;
+    return 1;
+}
+
+/* Reads SEEK_READS small ranges at random offsets of the file
+ * number `i` (with fs_seek()), checking their contents.
+ * The number of bytes read is added to `bytes`.
+ * Returns TRUE on success.
+ */
+static
+int read_ranges(struct bench *b, const struct fs *fs, unsigned int i,
+                size_t *bytes)
+{
+    uint8_t buffer[SEEK_READ_SIZE];
+    struct file_entry fe;
+    struct open_file of;
+    size_t offset, len;
+    unsigned int j;
+    int ret;
+
+    if (!fs_find_file(fs, b->names[i], &fe)) return FALSE;
+    if (!fs_open(fs, &fe, &of, FALSE)) return FALSE;
+
+    ret = TRUE;
+    for (j = 0; j < SEEK_READS && ret; j++) {
+        offset = next_random(b) % (b->sizes[i] + 1);
+        len = MIN(b->sizes[i] - offset, (size_t) SEEK_READ_SIZE);
+        ret = fs_seek(fs, &of, offset)
+            && fs_read(fs, &of, buffer, len) == len
+            && memcmp(buffer, &b->data[offset], len) == 0;
+        *bytes += len;
+    }
+
+    fs_close(&of);
+    if (!ret) report_error("bench: could not read `%s`", b->names[i]);
+    return ret;
+}
+
+/* Runs all the benchmarks over the image generated before.
+ * Returns TRUE on success.
+ */
+static
+int run_benchmarks(struct bench *b)
+{
+    struct list_context ctx;
+    struct file_entry fe;
+    struct fs fs;
+    unsigned int i, rep, n;
+    size_t bytes, image_bytes;
+    double start;
+    int fd, ret;
+
+    fs_initvar(&fs);
+    ret = FALSE;
+    fd = -1;
+
+    image_bytes = 0;
+    for (rep = 0; rep < b->opts.reps; rep++) {
+        fs_destroy(&fs);
+        fs_initvar(&fs);
+        if (!fs_create(&fs, b->opts.dg)) goto done;
+
+        start = now();
+        if (!fs_load_image(&fs, b->image)) goto done;
+        b->times[rep] = now() - start;
+        image_bytes = ((size_t) fs.length) * sizeof(struct page);
+    }
+    print_result(b, "load", 1, image_bytes);
+
+    for (rep = 0; rep < b->opts.reps; rep++) {
+        if (!reload(b, &fs)) goto done;
+
+        start = now();
+        if (!fs_check_integrity(&fs, b->opts.num_threads)) goto done;
+        b->times[rep] = now() - start;
+    }
+    print_result(b, "check", 1, image_bytes);
+
+    /* Opening each image with a new fs object, or reusing the memory
+     * of the previous one (as the workers of the batch mode do).
+     */
+    for (rep = 0; rep < b->opts.reps; rep++) {
+        start = now();
+        fs_destroy(&fs);
+        if (!fs_create(&fs, b->opts.dg)) goto done;
+        if (!open_and_check(b, &fs)) goto done;
+        b->times[rep] = now() - start;
+    }
+    print_result(b, "open", 1, image_bytes);
+
+    for (rep = 0; rep < b->opts.reps; rep++) {
+        start = now();
+        fs_reset(&fs);
+        if (!open_and_check(b, &fs)) goto done;
+        b->times[rep] = now() - start;
+    }
+    print_result(b, "reopen", 1, image_bytes);
+
+    ctx.count = 0;
+    ctx.bytes = 0;
+    for (rep = 0; rep < b->opts.reps; rep++) {
+        if (!reload(b, &fs)) goto done;
+
+        ctx.count = 0;
+        ctx.bytes = 0;
+        start = now();
+        if (!fs_scan_files(&fs, &list_cb, &ctx)) goto done;
+        b->times[rep] = now() - start;
+    }
+    print_result(b, "list", ctx.count, ctx.bytes);
+
+    for (rep = 0; rep < b->opts.reps; rep++) {
+        if (!reload(b, &fs)) goto done;
+
+        start = now();
+        for (i = 0; i < b->opts.num_files; i++) {
+            if (!fs_find_file(&fs, b->names[i], &fe)) goto done;
+        }
+        b->times[rep] = now() - start;
+    }
+    print_result(b, "find", b->opts.num_files, 0);
+
+    fd = open("/dev/null", O_WRONLY);
+    if (fd < 0) {
+        report_error("bench: could not open /dev/null");
+        goto done;
+    }
+
+    for (rep = 0; rep < b->opts.reps; rep++) {
+        if (!reload(b, &fs)) goto done;
+
+        start = now();
+        for (i = 0; i < b->opts.num_files; i++) {
+            if (!fs_find_file(&fs, b->names[i], &fe)) goto done;
+            if (!fs_extract_file_fd(&fs, &fe, fd)) goto done;
+        }
+        b->times[rep] = now() - start;
+    }
+    print_result(b, "extract", b->opts.num_files, b->total_bytes);
+
+    bytes = 0;
+    for (rep = 0; rep < b->opts.reps; rep++) {
+        if (!reload(b, &fs)) goto done;
+
+        bytes = 0;
+        start = now();
+        for (i = 0; i < b->opts.num_files; i++) {
+            if (!read_ranges(b, &fs, i, &bytes)) goto done;
+        }
+        b->times[rep] = now() - start;
+    }
+    print_result(b, "seek", SEEK_READS * b->opts.num_files, bytes);
+
+    n = MIN(b->opts.num_replace, b->opts.num_files);
+    bytes = 0;
+    for (rep = 0; rep < b->opts.reps; rep++) {
+        if (!reload(b, &fs)) goto done;
+
+        /* Replace the files with new contents of the same size. */
+        bytes = 0;
+        start = now();
+        for (i = 0; i < n; i++) {
+            if (!write_host_file(b, b->sizes[i])) goto done;
+            if (!fs_find_file(&fs, b->names[i], &fe)) goto done;
+            if (!fs_replace_file(&fs, &fe, b->host)) goto done;
+            bytes += b->sizes[i];
+        }
+        b->times[rep] = now() - start;
+    }
+    print_result(b, "replace", n, bytes);
+
+    for (rep = 0; rep < b->opts.reps; rep++) {
+        if (!reload(b, &fs)) goto done;
+
+        start = now();
+        if (!fs_save_image(&fs, b->host)) goto done;
+        b->times[rep] = now() - start;
+    }
+    print_result(b, "save", 1, image_bytes);
+
+    ret = TRUE;
+
+done:
+    if (fd >= 0) close(fd);
+    fs_destroy(&fs);
+    return ret;
+}
+
+/* Prints the usage information to the console output. */
+static
+void usage(const char *prog_name)
+{
+    printf("Usage:\n");
+    printf(" %s [options]\n", prog_name);
+    printf("where:\n");
+    printf("  -g geometry   Sets the disk geometry (default diablo44x2)\n");
+    printf("  -n files      Number of files (default 1000)\n");
+    printf("  -s size       Average size of the files in bytes\n");
+    printf("                (default 4096)\n");
+    printf("  -f pieces     Number of pieces in which each file is\n");
+    printf("                scattered over the disk (default 1)\n");
+    printf("  -d depth      Depth of the directory tree (default 2)\n");
+    printf("  -m files      Number of files to replace (default 100)\n");
+    printf("  -r reps       Repetitions of each benchmark (default 5)\n");
+    printf("  -j threads    Threads for the integrity check (default 1)\n");
+    printf("  -S seed       Seed of the generator (default 1)\n");
+    printf("  -o output     Keeps the generated disk in output\n");
+    printf("  --help        Print this help\n");
+}
+
+/* Parses the number in `str` (between `min` and `max`) into `value`.
+ * Returns TRUE on success.
+ */
+static
+int parse_number(const char *str, unsigned long min, unsigned long max,
+                 unsigned int *value)
+{
+    char *end;
+    unsigned long v;
+
+    errno = 0;
+    v = strtoul(str, &end, 10);
+    if (errno != 0 || end == str || *end != '\0' || v < min || v > max)
+        return FALSE;
+
+    *value = (unsigned int) v;
+    return TRUE;
+}
+
+int main(int argc, char **argv)
+{
+    struct bench b;
+    struct fs fs;
+    unsigned int seed;
+    double start;
+    int i, is_last, ret;
+
+    memset(&b, 0, sizeof(b));
+    fs_initvar(&fs);
+    ret = 1;
+
+    fs_parse_geometry("diablo44x2", &b.opts.dg);
+    b.opts.num_files = 1000;
+    b.opts.file_size = 4096;
+    b.opts.fragments = 1;
+    b.opts.depth = 2;
+    b.opts.num_replace = 100;
+    b.opts.reps = 5;
+    b.opts.num_threads = 1;
+    b.opts.seed = 1;
+    b.opts.output_filename = NULL;
+    seed = 1;
+
+    for (i = 1; i < argc; i++) {
+        is_last = (i + 1 == argc);
+        if (strcmp("--help", argv[i]) == 0
+            || strcmp("-h", argv[i]) == 0) {
+            usage(argv[0]);
+            return 0;
+        }
+
+        if (is_last) {
+            report_error("bench: invalid option `%s`", argv[i]);
+            return 1;
+        }
+
+        if (strcmp("-g", argv[i]) == 0) {
+            if (!fs_parse_geometry(argv[++i], &b.opts.dg)) {
+                report_error("bench: invalid geometry `%s`", argv[i]);
+                return 1;
+            }
+            continue;
+        } else if (strcmp("-o", argv[i]) == 0) {
+            b.opts.output_filename = argv[++i];
+            continue;
+        }
+
+        if (strcmp("-n", argv[i]) == 0) {
+            ret = parse_number(argv[++i], 1, MAX_FILES, &b.opts.num_files);
+        } else if (strcmp("-s", argv[i]) == 0) {
+            ret = parse_number(argv[++i], 0, MAX_FILE_SIZE,
+                               &b.opts.file_size);
+        } else if (strcmp("-f", argv[i]) == 0) {
+            ret = parse_number(argv[++i], 1, MAX_FRAGMENTS,
+                               &b.opts.fragments);
+        } else if (strcmp("-d", argv[i]) == 0) {
+            ret = parse_number(argv[++i], 0, MAX_DEPTH, &b.opts.depth);
+        } else if (strcmp("-m", argv[i]) == 0) {
+            ret = parse_number(argv[++i], 0, MAX_FILES,
+                               &b.opts.num_replace);
+        } else if (strcmp("-r", argv[i]) == 0) {
+            ret = parse_number(argv[++i], 1, MAX_REPS, &b.opts.reps);
+        } else if (strcmp("-j", argv[i]) == 0) {
+            ret = parse_number(argv[++i], 1, MAX_THREADS,
+                               &b.opts.num_threads);
+        } else if (strcmp("-S", argv[i]) == 0) {
+            ret = parse_number(argv[++i], 1, 0xFFFFFFFFUL, &seed);
+        } else {
+            report_error("bench: invalid option `%s`", argv[i]);
+            return 1;
+        }
+
+        if (!ret) {
+            report_error("bench: invalid value for `%s`: `%s`",
+                         argv[i - 1], argv[i]);
+            return 1;
+        }
+    }
+
+    ret = 1;
+    b.opts.seed = (uint32_t) seed;
+    b.rng = b.opts.seed;
+
+    b.times = (double *) calloc(b.opts.reps, sizeof(double));
+    if (unlikely(!b.times)) {
+        report_error("bench: memory exhausted");
+        goto error;
+    }
+
+    strcpy(b.tmpdir, "/tmp/adar-bench.XXXXXX");
+    if (!mkdtemp(b.tmpdir)) {
+        report_error("bench: could not create a temporary directory");
+        b.tmpdir[0] = '\0';
+        goto error;
+    }
+
+    sprintf(b.host, "%s/host.dat", b.tmpdir);
+    if (b.opts.output_filename) {
+        if (strlen(b.opts.output_filename) >= sizeof(b.image)) {
+            report_error("bench: output filename too long");
+            goto error;
+        }
+        strcpy(b.image, b.opts.output_filename);
+    } else {
+        sprintf(b.image, "%s/bench.dsk", b.tmpdir);
+    }
+
+    if (!plan_files(&b)) goto error;
+
+    start = now();
+    if (!generate(&b, &fs)) {
+        report_error("bench: could not generate the filesystem");
+        goto error;
+    }
+    if (!fs_check_integrity(&fs, 1)) {
+        report_error("bench: the generated filesystem is invalid");
+        goto error;
+    }
+    if (!fs_save_image(&fs, b.image)) goto error;
+    b.times[0] = now() - start;
+
+    printf("{\"op\": \"generate\", \"files\": %u, \"file_size\": %u, "
+           "\"fragments\": %u, \"depth\": %u, \"pages\": %u, "
+           "\"bytes\": %lu, \"seconds\": %.6f}\n",
+           b.opts.num_files, b.opts.file_size, b.opts.fragments,
+           b.opts.depth, fs.length, (unsigned long) b.total_bytes,
+           b.times[0]);
+    fs_destroy(&fs);
+    fs_initvar(&fs);
+
+    if (run_benchmarks(&b)) ret = 0;
+
+error:
+    fs_destroy(&fs);
+    if (b.tmpdir[0] != '\0') {
+        unlink(b.host);
+        if (!b.opts.output_filename) unlink(b.image);
+        rmdir(b.tmpdir);
+    }
+
+    if (b.names) {
+        for (i = 0; i < (int) b.opts.num_files; i++) {
+            if (b.names[i]) free((void *) b.names[i]);
+        }
+        free((void *) b.names);
+    }
+    if (b.sizes) free((void *) b.sizes);
+    if (b.data) free((void *) b.data);
+    if (b.times) free((void *) b.times);
+    return ret;
+}
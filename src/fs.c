@@ -4,25 +4,331 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "fs.h"
 #include "utils.h"
 
 /* Data structures and types. */
 
-/* Auxiliary data structure used by fs_find_file(). */
-struct find_result {
-    const char *filename;         /* The name of the searched file. */
-    size_t flen;                  /* Length of the filename. */
-    struct file_entry fe;         /* The file_entry of the file. */
-    int found;                    /* If the file was found. */
+/* An entry of the file index. */
+struct index_entry {
+    struct file_entry fe;           /* The file_entry of the file. */
+    char filename[FILENAME_LENGTH]; /* The name of the file (hint). */
+    uint16_t num_pages;             /* Number of pages of the file
+                                     * (including the leader page),
+                                     * or zero if unknown.
+                                     */
+    uint16_t last_nbytes;           /* Used bytes in the last page. */
+    int ambiguous;                  /* If more than one last page was
+                                     * found for the file.
+                                     */
+    uint32_t next_sn;               /* Next entry in the same bucket
+                                     * of the serial number table.
+                                     */
+    uint32_t next_name;             /* Next entry in the same bucket
+                                     * of the filename table.
+                                     */
 };
 
-/* Auxiliary data structure used by fs_scavenge_file(). */
-struct scavenge_result {
-    const char *filename;         /* The name of the searched file. */
-    struct file_entry fe;         /* The file_entry of the file. */
-    int found;                    /* If the file was found. */
+/* The index of the files in the filesystem.
+ * It is built lazily from the labels of the pages in a single pass,
+ * and it is invalidated whenever the filesystem is modified.
+ */
+struct file_index {
+    int valid;                    /* If the index is up to date. */
+    struct index_entry *entries;  /* The entries (sorted by the
+                                   * leader VDA).
+                                   */
+    uint32_t num_entries;         /* Number of entries. */
+    uint32_t *leaders;            /* Maps the leader VDA to the
+                                   * index of the entry.
+                                   */
+    uint32_t *sn_buckets;         /* Hash table by serial number. */
+    uint32_t *name_buckets;       /* Hash table by filename. */
+    uint32_t num_buckets;         /* Number of buckets in the hash
+                                   * tables (a power of two).
+                                   */
+};
+
+/* A directory in the directory cache. */
+struct cached_dir {
+    struct file_entry fe;         /* The file_entry of the directory. */
+    struct directory_entry *entries; /* The entries of the directory. */
+    uint32_t num_entries;         /* Number of entries. */
+    uint32_t capacity;            /* Capacity of the `entries` array. */
+    uint32_t *buckets;            /* Hash table by filename. */
+    uint32_t *next;               /* Next entry in the same bucket. */
+    uint32_t num_buckets;         /* Number of buckets of the hash
+                                   * table (a power of two).
+                                   */
+};
+
+/* The cache of the directories used by fs_find_file().
+ * A directory is added to the cache in the first time it is
+ * scanned, and the cache is cleared whenever the filesystem
+ * is modified.
+ */
+struct dir_cache {
+    struct cached_dir *dirs;      /* The cached directories. */
+    size_t num_dirs;              /* Number of cached directories. */
+    size_t capacity;              /* Capacity of the `dirs` array. */
+};
+
+/* The labels of all the pages as a structure of arrays, so that
+ * the scans that only look at the labels read densely packed data
+ * (see build_label_table()). Each array has room for a multiple of
+ * LABEL_GROUP pages, and the extra entries are zero.
+ */
+struct label_table {
+    int valid;                    /* If the table was built. */
+    uint16_t *words;              /* The storage of all the arrays. */
+    uint16_t *next_rda;           /* The fields of the labels, */
+    uint16_t *prev_rda;           /* indexed by the VDA. */
+    uint16_t *nbytes;
+    uint16_t *file_pgnum;
+    uint16_t *version;
+    uint16_t *sn_word1;
+    uint16_t *sn_word2;
+};
+
+/* Auxiliary data structure used by build_index(), to keep
+ * the last pages of the files.
+ */
+struct index_tail {
+    struct serial_number sn;      /* The file serial number. */
+    uint16_t version;             /* The file version. */
+    uint16_t file_pgnum;          /* Page number of the last page. */
+    uint16_t nbytes;              /* Number of used bytes. */
+};
+
+/* The storage of the tables built for each image, taken from the
+ * arena of the filesystem when it is created, with room for the
+ * largest table the geometry allows. The tables point here while
+ * they are built, so they are rebuilt in place (also for the next
+ * image, see fs_reset()).
+ */
+struct table_storage {
+    struct page *pages;           /* For `fs->pages`. */
+    uint8_t *page_state;          /* For `fs->page_state`. */
+    unsigned long *free_map;      /* For `fs->free_map`. */
+    uint16_t *label_words;        /* For the label table. */
+    struct index_entry *entries;  /* For the entries of the index. */
+    uint32_t *leaders;            /* For the leaders of the index. */
+    uint32_t *sn_buckets;         /* For the hash tables */
+    uint32_t *name_buckets;       /* of the index. */
+    struct index_tail *tails;     /* For build_index(). */
+};
+
+/* A range of pages checked by one thread. */
+struct check_chunk {
+    struct fs fs;                 /* A shallow copy of the filesystem,
+                                   * with its own `stats`.
+                                   */
+    struct fs_stats stats;        /* The work done on the range. */
+    uint16_t start;               /* The first page of the range. */
+    uint16_t end;                 /* One past the last page. */
+    int result;                   /* The result of check_range(). */
+    struct string_buffer errors;  /* The errors found (one per line). */
+    pthread_t thread;             /* The thread checking the range. */
+    int started;                  /* If the thread was created. */
+};
+
+/* An entry of a directory as stored in the directory file
+ * (see walk_directory()).
+ */
+struct raw_dir_entry {
+    size_t offset;                /* The offset of the entry (in bytes)
+                                   * within the directory file.
+                                   */
+    uint16_t length;              /* The length of the entry in words. */
+    int is_valid;                 /* If the entry is in use. */
+    struct directory_entry de;    /* The entry (only if valid). */
+};
+
+/* Defines the type of the callback function for walk_directory(). */
+typedef int (*walk_directory_cb)(const struct fs *fs,
+                                 const struct raw_dir_entry *re,
+                                 void *arg);
+
+/* Auxiliary data structure used by fs_scan_directory(). */
+struct scan_directory_context {
+    scan_directory_cb cb;         /* The callback of the caller. */
+    void *arg;                    /* The extra parameter of `cb`. */
+};
+
+/* Auxiliary data structure used to find the entries of
+ * a directory (see insert_directory_entry()).
+ */
+struct dir_slot {
+    const char *name;             /* The name of the entry to find. */
+    size_t offset;                /* The offset of the entry found. */
+    size_t end;                   /* The end of the last entry. */
+    uint16_t length;              /* The length in words of the entry
+                                   * (to insert or found).
+                                   */
+    uint16_t free_length;         /* The length of the free entry. */
+    struct file_entry fe;         /* The file of the entry found. */
+    int found;                    /* If an entry was found. */
+};
+
+/* The entries collected from a directory (see collect_entry_cb()). */
+struct entry_list {
+    struct raw_dir_entry *entries; /* The valid entries. */
+    size_t num_entries;           /* Number of entries. */
+    size_t capacity;              /* Capacity of `entries`. */
+    size_t end;                   /* The end of the last entry (valid
+                                   * or not) in the directory file.
+                                   */
+    int exhausted;                /* If the memory was exhausted. */
+};
+
+/* The new layout of the pages planned by fs_defrag(). */
+struct defrag_plan {
+    uint16_t *new_vda;            /* The new VDA of each page (by the
+                                   * current VDA), or INVALID_VDA for
+                                   * the pages that become free.
+                                   */
+    uint8_t *reserved;            /* The pages that do not move (the
+                                   * boot page and the bad pages).
+                                   */
+    uint8_t *queued;              /* The directories already queued
+                                   * (by the leader VDA).
+                                   */
+    struct file_entry *dirs;      /* The queue of directories. */
+    size_t num_dirs;              /* Number of queued directories. */
+    struct entry_list list;       /* The entries of a directory. */
+    uint16_t next;                /* The next VDA to assign. */
+};
+
+/* A used page, as collected by fs_repair() to rebuild the chains. */
+struct repair_page {
+    struct serial_number sn;      /* The file serial number. */
+    uint16_t version;             /* The file version. */
+    uint16_t file_pgnum;          /* The page number within the file. */
+    uint16_t vda;                 /* The virtual disk address. */
+};
+
+/* A file recovered by fs_repair(). */
+struct repair_file {
+    struct file_entry fe;         /* The file (with its leader page). */
+    int has_entry;                /* If some directory lists it. */
+    int is_orphan;                /* If it must be entered in SysDir. */
+    int queued;                   /* If the directory was queued. */
+    uint32_t root;                /* The directory through which it was
+                                   * reached (itself for SysDir and
+                                   * the orphan directories).
+                                   */
+};
+
+/* An orphan file to enter in SysDir (see enter_orphans()). */
+struct repair_orphan {
+    char name[FILENAME_LENGTH];   /* The name of the entry. */
+    uint32_t file;                /* The index of the file. */
+};
+
+/* Auxiliary data structure used by fs_repair(). */
+struct repair_context {
+    struct fs_repair_report *rep; /* The repairs done. */
+    struct repair_page *pages;    /* The used pages (sorted). */
+    size_t num_pages;             /* Number of used pages. */
+    struct repair_file *files;    /* The files (sorted by serial
+                                   * number and version).
+                                   */
+    uint32_t num_files;           /* Number of files. */
+    uint32_t *file_of;            /* The index of the file of each
+                                   * leader page (or INDEX_NONE).
+                                   */
+    uint32_t *dirs;               /* The queue of directories (by the
+                                   * index of the file).
+                                   */
+    uint32_t num_dirs;            /* Number of queued directories. */
+    struct entry_list list;       /* The entries of a directory. */
+    size_t sysdir_end;            /* The end of the entries of SysDir. */
+};
+
+/* A known type of disk (see fs_parse_geometry()). */
+struct disk_type {
+    const char *name;             /* The name of the type. */
+    struct geometry dg;           /* The geometry of the disk. */
+};
+
+/* A compression format of the disk images. */
+struct image_codec {
+    const char *suffix;           /* The suffix of the filenames. */
+    uint8_t magic[4];             /* The magic number of the format. */
+    size_t magic_len;             /* The length of the magic number. */
+    const char *compress[4];      /* The program to compress. */
+    const char *decompress[4];    /* The program to decompress. */
+};
+
+/* A disk image being read or written as a stream of pages
+ * (see open_image_stream()).
+ */
+struct image_stream {
+    FILE *fp;                     /* The stream of pages. */
+    struct filter flt;            /* The (de)compression filter. */
+    const struct image_codec *codec; /* The compression format, or
+                                      * NULL for plain images.
+                                      */
+};
+
+/* The header of the sidecar cache of a disk image (see
+ * fs_write_cache()). The rest of the cache holds the sections at
+ * the given offsets, in the native layout of this machine.
+ */
+struct cache_header {
+    char magic[8];                /* The magic string (CACHE_MAGIC). */
+    uint32_t version;             /* The version of the format. */
+    uint32_t byte_order;          /* CACHE_BYTE_ORDER (native). */
+    uint32_t page_size;           /* The size of struct page. */
+    uint32_t entry_size;          /* The size of struct index_entry. */
+    struct geometry dg;           /* The disk geometry. */
+    uint16_t length;              /* The length in pages. */
+
+    /* The key of the image (from stat()). */
+    unsigned long image_size;     /* The size of the image. */
+    unsigned long image_dev;      /* The device of the image. */
+    unsigned long image_ino;      /* The inode of the image. */
+    unsigned long mtime_sec;      /* The modification time. */
+    unsigned long mtime_nsec;
+    unsigned long ctime_sec;      /* The status change time. */
+    unsigned long ctime_nsec;
+
+    uint32_t num_entries;         /* Entries of the file index. */
+    uint32_t num_buckets;         /* Buckets of the file index. */
+
+    unsigned long pages_offset;   /* The decoded pages. */
+    unsigned long free_map_offset; /* The bitmap of the free pages. */
+    unsigned long entries_offset; /* The entries of the file index. */
+    unsigned long leaders_offset; /* The leaders of the file index. */
+    unsigned long sn_buckets_offset;   /* The hash tables of the */
+    unsigned long name_buckets_offset; /* file index. */
+    unsigned long total_size;     /* The size of the cache. */
+};
+
+/* The contents of a host file (see open_host_file()). */
+struct host_file {
+    const uint8_t *data;          /* The contents of the file. */
+    size_t size;                  /* The size of the file. */
+    int mapped;                   /* If the file is mapped in memory. */
+};
+
+/* Auxiliary data structure used by check_directory_entries(). */
+struct dir_check_context {
+    unsigned long *dir_map;       /* Bitmap of the visited directories
+                                   * (by the leader VDA).
+                                   */
+    struct file_entry *dirs;      /* The queue of directories. */
+    size_t num_dirs;              /* Number of queued directories. */
+    int success;                  /* If all entries are valid. */
 };
 
 /* Constants. */
@@ -32,6 +338,55 @@ struct scavenge_result {
 #define PAGE_LABEL          offsetof(struct page, label)
 #define PAGE_DATA            offsetof(struct page, data)
 
+/* Size of a page in the disk image file. */
+#define PAGE_DISK_SIZE          (PAGE_DATA + PAGE_DATA_SIZE)
+
+/* Number of pages transferred at once when loading or saving
+ * the disk image.
+ */
+#define IMAGE_CHUNK_PAGES                           128U
+
+/* Decoding state of the pages of memory-mapped images. */
+#define PAGE_STATE_META                               1U
+#define PAGE_STATE_DATA                               2U
+
+/* If the words of the host are in little endian format (as in
+ * the disk images).
+ */
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HOST_LITTLE_ENDIAN                            1
+#else
+#define HOST_LITTLE_ENDIAN                            0
+#endif
+
+/* Counts one event of the kind `field` in the statistics of `fs`. */
+#ifdef FS_NO_STATS
+#define COUNT_STAT(fs, field)                  ((void) 0)
+#else
+#define COUNT_STAT(fs, field)        ((fs)->stats->field++)
+#endif
+
+/* Number of pages of the label table examined at once. */
+#define LABEL_GROUP                                   8U
+
+/* Number of bits per word of the bitmap of free pages. */
+#define FREE_MAP_BITS            (8U * sizeof(unsigned long))
+
+/* Number of possible real disk addresses. */
+#define NUM_RDAS                                  65536U
+
+/* Marks the invalid real disk addresses in the translation table. */
+#define INVALID_VDA                              0xFFFFU
+
+/* Size of the blocks used to read host files that cannot be mapped. */
+#define HOST_FILE_BLOCK                           65536U
+
+/* Number of pages written at once by fs_extract_file(). */
+#define EXTRACT_SPANS                                64U
+
+/* Minimum number of pages checked by each thread. */
+#define CHECK_CHUNK_PAGES                           256U
+
 /* Offsets within the leader page data. */
 #define LEADER_CREATED                                0U
 #define LEADER_WRITTEN                                4U
@@ -52,1055 +407,5769 @@ struct scavenge_result {
 #define DIRECTORY_LEADER_VDA                         10U
 #define DIRECTORY_FILENAME                           12U
 
+/* Marks the end of the chains of the file index and missing
+ * entries.
+ */
+#define INDEX_NONE                           0xFFFFFFFFU
+
+/* Minimum number of buckets of the hash tables. */
+#define MIN_BUCKETS                                  16U
+
 /* Other constants. */
 #define DIR_ENTRY_VALID                               1U
 #define DIR_ENTRY_MISSING                             0U
 #define DIR_ENTRY_LEN_MASK                        0x3FFU
+#define DIR_ENTRY_MAX_LENGTH     (DIRECTORY_FILENAME / 2 + FILENAME_LENGTH)
+#define MAX_DIRNAME_LENGTH                         1024U
+
+/* Limits of the disk geometry (given by the format of the real
+ * disk addresses).
+ */
+#define MAX_CYLINDERS                               511U
+#define MAX_HEADS                                     2U
+#define MAX_SECTORS                                  15U
+#define MAX_DISKS                                     2U
+#define MAX_PAGES \
+    (MAX_CYLINDERS * MAX_HEADS * MAX_SECTORS * MAX_DISKS)
+
+/* Constants of the sidecar cache. */
+#define CACHE_MAGIC                          "ADARCACH"
+#define CACHE_VERSION                                 1U
+#define CACHE_BYTE_ORDER                     0x01020304U
+#define CACHE_ALIGN                                  64U
+#define CACHE_SUFFIX                           ".cache"
+
+/* Offsets within the header of the DiskDescriptor (KDH). */
+#define KDH_LAST_SN                                   8U
+#define KDH_DISK_BT_SIZE                             14U
+#define KDH_FREE_PAGES                               18U
+#define KDH_SIZE                                     32U
+
+
+/* Global variables. */
+
+/* The known disk types. A double disk is a pair of packs used
+ * as a single filesystem (the image holds the first pack followed
+ * by the second one).
+ */
+static const struct disk_type disk_types[] = {
+    { "diablo31",   { 203, 2, 12, 1 } },
+    { "diablo44",   { 406, 2, 12, 1 } },
+    { "diablo31x2", { 203, 2, 12, 2 } },
+    { "diablo44x2", { 406, 2, 12, 2 } }
+};
+
+#define NUM_DISK_TYPES (sizeof(disk_types) / sizeof(disk_types[0]))
+
+/* The compression formats of the disk images. They are handled by
+ * running the usual programs as filters.
+ */
+static const struct image_codec image_codecs[] = {
+    { ".gz", { 0x1F, 0x8B, 0x00, 0x00 }, 2,
+      { "gzip", "-c", NULL, NULL }, { "gzip", "-dc", NULL, NULL } },
+    { ".zst", { 0x28, 0xB5, 0x2F, 0xFD }, 4,
+      { "zstd", "-qc", NULL, NULL }, { "zstd", "-qdc", NULL, NULL } }
+};
 
+#define NUM_IMAGE_CODECS (sizeof(image_codecs) / sizeof(image_codecs[0]))
 
 /* Forward declarations. */
 static int real_to_virtual(const struct fs *fs, uint16_t rda,
                            uint16_t *vda);
 static int virtual_to_real(const struct fs *fs, uint16_t vda,
                            uint16_t *rda);
+static void release_image(struct fs *fs);
+static void invalidate_state(struct fs *fs);
+static void mark_page_free(struct fs *fs, uint16_t vda);
+static void release_index(struct file_index *idx);
+static void release_dir_cache(struct dir_cache *dc);
+static void release_label_table(struct label_table *lt);
+static uint16_t compute_rda(const struct geometry *dg, uint16_t vda);
 static void copy_name(char *dst, const char *src);
 static uint16_t read_word_bs(const uint8_t *data, size_t offset);
+static void write_word_bs(uint8_t *data, size_t offset, uint16_t w);
+static int build_index(const struct fs *fs);
+static uint32_t hash_sn(const struct serial_number *sn);
+static uint32_t hash_name(const char *name);
+static int build_free_map(struct fs *fs);
+static int update_disk_descriptor(struct fs *fs,
+                                  const struct serial_number *last_sn);
+static int lookup_directory(const struct fs *fs,
+                            const struct file_entry *dir_fe,
+                            const char *name, struct file_entry *fe);
 static time_t read_alto_time(const uint8_t *data, size_t offset);
+static const struct image_codec *detect_codec(int fd);
+static int open_image_stream(struct image_stream *is, int fd,
+                             const struct image_codec *codec,
+                             int is_writer);
+static int close_image_stream(struct image_stream *is);
 
 /* Functions. */
 
 void fs_initvar(struct fs *fs)
 {
     fs->pages = NULL;
+    fs->image = NULL;
+    fs->image_size = 0;
+    fs->page_state = NULL;
+    fs->cache = NULL;
+    fs->cache_size = 0;
+    fs->free_map = NULL;
+    fs->dirty_map = NULL;
+    fs->vda_to_rda = NULL;
+    fs->rda_to_vda = NULL;
+    fs->index = NULL;
+    fs->dir_cache = NULL;
+    fs->labels = NULL;
+    fs->stats = NULL;
+    fs->storage = NULL;
+    arena_initvar(&fs->arena);
 }
 
 void fs_destroy(struct fs *fs)
 {
-    if (fs->pages) free((void *) fs->pages);
-    fs->pages = NULL;
+    invalidate_state(fs);
+    release_image(fs);
+
+    /* All the rest of the memory is released at once. */
+    arena_destroy(&fs->arena);
+    fs_initvar(fs);
 }
 
-int fs_create(struct fs *fs, struct geometry dg)
+void fs_reset(struct fs *fs)
 {
-    size_t size;
-    fs_initvar(fs);
+    invalidate_state(fs);
+    release_image(fs);
+    if (fs->stats) memset(fs->stats, 0, sizeof(struct fs_stats));
+}
 
-    if (unlikely(dg.num_heads > 2
-                 || dg.num_sectors > 15
-                 || dg.num_cylinders >= 512)) {
-        report_error("fs: create: invalid disk geometry");
-        return FALSE;
-    }
+/* Checks if the disk geometry `dg` is within the limits.
+ * Returns TRUE if it is valid.
+ */
+static
+int valid_geometry(const struct geometry *dg)
+{
+    return (dg->num_cylinders > 0 && dg->num_cylinders <= MAX_CYLINDERS
+            && dg->num_heads > 0 && dg->num_heads <= MAX_HEADS
+            && dg->num_sectors > 0 && dg->num_sectors <= MAX_SECTORS
+            && dg->num_disks > 0 && dg->num_disks <= MAX_DISKS);
+}
 
-    fs->dg = dg;
+int fs_parse_geometry(const char *str, struct geometry *dg)
+{
+    unsigned long values[4];
+    const char *p;
+    char *end;
+    size_t i, num_values;
+
+    for (i = 0; i < NUM_DISK_TYPES; i++) {
+        if (strcmp(disk_types[i].name, str) == 0) {
+            *dg = disk_types[i].dg;
+            return TRUE;
+        }
+    }
 
-    fs->length = dg.num_cylinders * dg.num_heads * dg.num_sectors;
-    size = ((size_t) fs->length) * sizeof(struct page);
+    /* Otherwise, it is cylinders:heads:sectors[:disks]. */
+    p = str;
+    values[3] = 1;
+    for (num_values = 0; num_values < 4; num_values++) {
+        values[num_values] = strtoul(p, &end, 10);
+        if (end == p) break;
+        p = end;
+        if (*p != ':') {
+            num_values++;
+            break;
+        }
+        p++;
+    }
 
-    fs->pages = (struct page *) malloc(size);
-    if (unlikely(!fs->pages)) {
-        report_error("fs: create: memory exhausted");
+    if (*p != '\0' || num_values < 3) {
+        report_error("fs: parse_geometry: invalid geometry: %s", str);
         return FALSE;
     }
 
+    dg->num_cylinders = (uint16_t) MIN(values[0], 0xFFFFUL);
+    dg->num_heads = (uint16_t) MIN(values[1], 0xFFFFUL);
+    dg->num_sectors = (uint16_t) MIN(values[2], 0xFFFFUL);
+    dg->num_disks = (uint16_t) MIN(values[3], 0xFFFFUL);
+    if (!valid_geometry(dg)) {
+        report_error("fs: parse_geometry: invalid geometry: %s", str);
+        return FALSE;
+    }
     return TRUE;
 }
 
-int fs_load_image(struct fs *fs, const char *filename)
+/* Auxiliary function to fs_detect_geometry().
+ * Checks if the page headers of the disk image in `fd` agree with
+ * the geometry `dg` (only a few pages are probed). If `rdas` is not
+ * NULL, it holds the real disk addresses of the headers instead.
+ * Returns TRUE if they agree.
+ */
+static
+int probe_geometry(int fd, const uint16_t *rdas,
+                   const struct geometry *dg)
 {
-    FILE *fp;
-    struct page *pg;
-    uint16_t vda, j, meta_len;
-    uint16_t w, *meta_ptr;
-    int c;
+    uint8_t buf[PAGE_LABEL];
+    uint16_t probes[3], length, rda;
+    size_t i;
 
-    fp = fopen(filename, "rb");
-    if (!fp) {
-        report_error("fs: load_image: could not open `%s`",
-                     filename);
-        return FALSE;
+    length = dg->num_cylinders * dg->num_heads * dg->num_sectors
+        * dg->num_disks;
+
+    /* The last page of each pack and the first of the last pack. */
+    probes[0] = length / dg->num_disks - 1;
+    probes[1] = length - length / dg->num_disks;
+    probes[2] = length - 1;
+
+    for (i = 0; i < 3; i++) {
+        if (rdas) {
+            if (rdas[probes[i]] != compute_rda(dg, probes[i]))
+                return FALSE;
+            continue;
+        }
+
+        if (pread(fd, buf, sizeof(buf),
+                  ((off_t) probes[i]) * PAGE_DISK_SIZE) != sizeof(buf))
+            return FALSE;
+
+        /* The header holds the real disk address (little endian). */
+        rda = (uint16_t) (buf[PAGE_HEADER + 2]
+                          | (buf[PAGE_HEADER + 3] << 8));
+        if (rda != compute_rda(dg, probes[i])) return FALSE;
     }
+    return TRUE;
+}
 
-    meta_len = PAGE_DATA / sizeof(uint16_t);
-    for (vda = 0; vda < fs->length; vda++) {
-        pg = &fs->pages[vda];
+/* Auxiliary function to fs_detect_geometry().
+ * Reads the whole (compressed) disk image in `fd` to find its size
+ * (returned in `image_size`), and the real disk addresses in the
+ * headers of the pages (returned in `rdas`, which must have room
+ * for the largest disk).
+ * Returns TRUE on success.
+ */
+static
+int read_image_headers(int fd, const struct image_codec *codec,
+                       uint16_t *rdas, size_t *image_size)
+{
+    struct image_stream is;
+    uint8_t buf[PAGE_DISK_SIZE];
+    size_t nbytes, num_pages;
+    int ret;
 
-        c = fgetc(fp);
-        if (c == EOF) goto error;
+    if (!open_image_stream(&is, fd, codec, FALSE)) return FALSE;
 
-        c = fgetc(fp);
-        if (c == EOF) goto error;
+    *image_size = 0;
+    num_pages = 0;
+    while (TRUE) {
+        nbytes = fread(buf, 1, sizeof(buf), is.fp);
+        *image_size += nbytes;
+        if (nbytes < sizeof(buf)) break;
 
-        /* Discard the first word and use the loop index instead. */
-        pg->page_vda = vda;
+        if (num_pages < MAX_PAGES) {
+            rdas[num_pages] = (uint16_t) (buf[PAGE_HEADER + 2]
+                                          | (buf[PAGE_HEADER + 3] << 8));
+        }
+        num_pages++;
+    }
 
-        meta_ptr = (uint16_t *) pg;
-        for (j = 1; j < meta_len; j++) {
-            /* Process data in little endian format. */
-            c = fgetc(fp);
-            if (c == EOF) goto error;
-            w = (uint16_t) (c & 0xFF);
+    ret = !ferror(is.fp);
+    if (!close_image_stream(&is)) ret = FALSE;
+    return ret;
+}
 
-            c = fgetc(fp);
-            if (c == EOF) goto error;
-            w |= (uint16_t) ((c & 0xFF) << 8);
+int fs_detect_geometry(const char *filename, struct geometry *dg)
+{
+    const struct image_codec *codec;
+    const struct geometry *found;
+    struct stat st;
+    uint16_t *rdas;
+    size_t i, size, image_size;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        report_error("fs: detect_geometry: could not open `%s`",
+                     filename);
+        return FALSE;
+    }
 
-            meta_ptr[j] = w;
+    if (fstat(fd, &st) < 0) {
+        report_error("fs: detect_geometry: could not stat `%s`",
+                     filename);
+        close(fd);
+        return FALSE;
+    }
+    image_size = (size_t) st.st_size;
+
+    /* The size of compressed images is only known after reading
+     * them, so the headers are collected along the way.
+     */
+    rdas = NULL;
+    codec = detect_codec(fd);
+    if (codec) {
+        rdas = (uint16_t *) malloc(MAX_PAGES * sizeof(uint16_t));
+        if (unlikely(!rdas)) {
+            report_error("fs: detect_geometry: memory exhausted");
+            close(fd);
+            return FALSE;
         }
 
-        for (j = 0; j < PAGE_DATA_SIZE; j++) {
-            c = fgetc(fp);
-            if (c == EOF) goto error;
+        if (!read_image_headers(fd, codec, rdas, &image_size)) {
+            report_error("fs: detect_geometry: could not decompress "
+                         "`%s`", filename);
+            free((void *) rdas);
+            close(fd);
+            return FALSE;
+        }
+    }
 
-            /* Byte swap the data here. */
-            pg->data[j ^ 1] = (uint8_t) c;
+    /* Some disk types have the same size, so the page headers are
+     * used to tell them apart. If the headers are damaged, the first
+     * disk type of the same size is used.
+     */
+    found = NULL;
+    for (i = 0; i < NUM_DISK_TYPES; i++) {
+        size = ((size_t) disk_types[i].dg.num_cylinders)
+            * disk_types[i].dg.num_heads * disk_types[i].dg.num_sectors
+            * disk_types[i].dg.num_disks * PAGE_DISK_SIZE;
+        if (image_size != size) continue;
+
+        if (probe_geometry(fd, rdas, &disk_types[i].dg)) {
+            found = &disk_types[i].dg;
+            break;
         }
+        if (!found) found = &disk_types[i].dg;
     }
+    close(fd);
+    if (rdas) free((void *) rdas);
 
-    c = fgetc(fp);
-    if (c != EOF) goto error;
+    if (!found) {
+        report_error("fs: detect_geometry: unknown disk size in `%s`",
+                     filename);
+        return FALSE;
+    }
 
-    fclose(fp);
+    *dg = *found;
     return TRUE;
+}
 
-error:
-    report_error("fs: load_image: premature end of file in `%s`",
-                 filename);
-    fclose(fp);
-    return FALSE;
+/* Computes the number of buckets of the hash tables of the index
+ * with room for `num_entries` entries.
+ * Returns the number of buckets.
+ */
+static
+uint32_t index_buckets(uint32_t num_entries)
+{
+    uint32_t num_buckets;
+
+    num_buckets = MIN_BUCKETS;
+    while (num_buckets < 2 * num_entries)
+        num_buckets *= 2;
+    return num_buckets;
 }
 
-int fs_save_image(const struct fs *fs, const char *filename)
+/* Computes the size of the memory (from the arena) used by a
+ * filesystem of `length` pages, as allocated by fs_create().
+ * Returns the size in bytes.
+ */
+static
+size_t arena_size(uint16_t length)
 {
-    FILE *fp;
-    const struct page *pg;
-    uint16_t vda, j, meta_len, w;
-    const uint16_t *meta_ptr;
-    int c;
+    size_t map_size, stride, size;
+
+    map_size = (((size_t) length) + FREE_MAP_BITS - 1) / FREE_MAP_BITS;
+    stride = (((size_t) length) + LABEL_GROUP - 1) / LABEL_GROUP;
+    stride *= LABEL_GROUP;
+
+    size = ARENA_ROUND(((size_t) length) * sizeof(struct page))
+        + 2 * ARENA_ROUND(map_size * sizeof(unsigned long))
+        + ARENA_ROUND(((size_t) length) * sizeof(uint16_t))
+        + ARENA_ROUND(NUM_RDAS * sizeof(uint16_t))
+        + ARENA_ROUND(sizeof(struct file_index))
+        + ARENA_ROUND(sizeof(struct dir_cache))
+        + ARENA_ROUND(sizeof(struct label_table))
+        + ARENA_ROUND(sizeof(struct fs_stats))
+        + ARENA_ROUND(sizeof(struct table_storage))
+        + ARENA_ROUND(length)
+        + ARENA_ROUND(7 * stride * sizeof(uint16_t))
+        + ARENA_ROUND(((size_t) length) * sizeof(struct index_entry))
+        + ARENA_ROUND(((size_t) length) * sizeof(uint32_t))
+        + 2 * ARENA_ROUND(index_buckets(length) * sizeof(uint32_t))
+        + ARENA_ROUND(((size_t) length) * sizeof(struct index_tail));
+    return size;
+}
 
-    fp = fopen(filename, "wb");
-    if (!fp) {
-        report_error("fs: save_image: could not open file `%s` "
-                     "for writing", filename);
+int fs_create(struct fs *fs, struct geometry dg)
+{
+    struct table_storage *ts;
+    struct arena *a;
+    size_t map_size, stride, rda;
+    uint16_t vda;
+
+    fs_initvar(fs);
+
+    if (unlikely(!valid_geometry(&dg))) {
+        report_error("fs: create: invalid disk geometry");
         return FALSE;
     }
 
-    meta_len = PAGE_DATA / sizeof(uint16_t);
-    for (vda = 0; vda < fs->length; vda++) {
-        pg = &fs->pages[vda];
+    fs->dg = dg;
 
-        /* Discard the first word. */
-        c = fputc((int) (vda & 0xFF), fp);
-        if (c == EOF) goto error;
+    /* This is at most 30660 pages (so it fits in 16 bits). */
+    fs->length = dg.num_cylinders * dg.num_heads * dg.num_sectors
+        * dg.num_disks;
 
-        c = fputc((int) ((vda >> 8) & 0xFF), fp);
-        if (c == EOF) goto error;
+    /* Everything comes from a single block (only the memory that is
+     * used is ever touched).
+     */
+    a = &fs->arena;
+    if (unlikely(!arena_create(a, arena_size(fs->length)))) {
+        report_error("fs: create: memory exhausted");
+        return FALSE;
+    }
 
-        meta_ptr = (const uint16_t *) pg;
-        for (j = 1; j < meta_len; j++) {
-            w = meta_ptr[j];
+    map_size = (((size_t) fs->length) + FREE_MAP_BITS - 1) / FREE_MAP_BITS;
+    stride = (((size_t) fs->length) + LABEL_GROUP - 1) / LABEL_GROUP;
+    stride *= LABEL_GROUP;
+
+    fs->dirty_map = (unsigned long *)
+        arena_alloc(a, map_size * sizeof(unsigned long));
+    fs->vda_to_rda = (uint16_t *)
+        arena_alloc(a, fs->length * sizeof(uint16_t));
+    fs->rda_to_vda = (uint16_t *) arena_alloc(a, NUM_RDAS * sizeof(uint16_t));
+    fs->index = (struct file_index *)
+        arena_alloc(a, sizeof(struct file_index));
+    fs->dir_cache = (struct dir_cache *)
+        arena_alloc(a, sizeof(struct dir_cache));
+    fs->labels = (struct label_table *)
+        arena_alloc(a, sizeof(struct label_table));
+    fs->stats = (struct fs_stats *) arena_alloc(a, sizeof(struct fs_stats));
+    fs->storage = ts = (struct table_storage *)
+        arena_alloc(a, sizeof(struct table_storage));
+    if (unlikely(!fs->dirty_map || !fs->vda_to_rda || !fs->rda_to_vda
+                 || !fs->index || !fs->dir_cache || !fs->labels
+                 || !fs->stats || !ts)) {
+        report_error("fs: create: memory exhausted");
+        fs_destroy(fs);
+        return FALSE;
+    }
 
-            /* Process data in little endian format. */
-            c = fputc((int) (w & 0xFF), fp);
-            if (c == EOF) goto error;
+    memset(fs->dirty_map, 0, map_size * sizeof(unsigned long));
+    memset(fs->index, 0, sizeof(struct file_index));
+    memset(fs->dir_cache, 0, sizeof(struct dir_cache));
+    memset(fs->labels, 0, sizeof(struct label_table));
+    memset(fs->stats, 0, sizeof(struct fs_stats));
+
+    ts->pages = (struct page *)
+        arena_alloc(a, ((size_t) fs->length) * sizeof(struct page));
+    ts->page_state = (uint8_t *) arena_alloc(a, fs->length);
+    ts->free_map = (unsigned long *)
+        arena_alloc(a, map_size * sizeof(unsigned long));
+    ts->label_words = (uint16_t *)
+        arena_alloc(a, 7 * stride * sizeof(uint16_t));
+    ts->entries = (struct index_entry *)
+        arena_alloc(a, ((size_t) fs->length) * sizeof(struct index_entry));
+    ts->leaders = (uint32_t *)
+        arena_alloc(a, ((size_t) fs->length) * sizeof(uint32_t));
+    ts->sn_buckets = (uint32_t *)
+        arena_alloc(a, index_buckets(fs->length) * sizeof(uint32_t));
+    ts->name_buckets = (uint32_t *)
+        arena_alloc(a, index_buckets(fs->length) * sizeof(uint32_t));
+    ts->tails = (struct index_tail *)
+        arena_alloc(a, ((size_t) fs->length) * sizeof(struct index_tail));
+    if (unlikely(!ts->pages || !ts->page_state || !ts->free_map
+                 || !ts->label_words || !ts->entries || !ts->leaders
+                 || !ts->sn_buckets || !ts->name_buckets || !ts->tails)) {
+        report_error("fs: create: memory exhausted");
+        fs_destroy(fs);
+        return FALSE;
+    }
+    fs->pages = ts->pages;
 
-            c = fputc((int) ((w >> 8) & 0xFF), fp);
-            if (c == EOF) goto error;
-        }
+    /* Precompute the translation of the disk addresses. */
+    for (rda = 0; rda < NUM_RDAS; rda++)
+        fs->rda_to_vda[rda] = INVALID_VDA;
 
-        for (j = 0; j < PAGE_DATA_SIZE; j++) {
-            /* Byte swap the data here. */
-            c = fputc((int) pg->data[j ^ 1], fp);
-            if (c == EOF) goto error;
-        }
+    for (vda = 0; vda < fs->length; vda++) {
+        rda = compute_rda(&dg, vda);
+        fs->vda_to_rda[vda] = (uint16_t) rda;
+        fs->rda_to_vda[rda] = vda;
     }
 
-    fclose(fp);
     return TRUE;
-
-error:
-    report_error("fs: save_image: error while writing `%s`",
-                 filename);
-    fclose(fp);
-    return FALSE;
 }
 
-/* Auxiliary function to fs_check_integrity() [stage1].
- * Checks some basic filesystem consistency.
- * Returns TRUE on success.
+/* Decodes the header and label of one page from its on-disk
+ * representation in `src` into `pg`. The virtual disk address of
+ * the page is given by `vda`.
  */
 static
-int check_integrity_stage1(const struct fs *fs)
+void decode_page_meta(struct page *pg, const uint8_t *src, uint16_t vda)
 {
-    const struct page *pg, *other_pg;
-    uint16_t vda, rda, other_vda;
-    uint8_t slen;
-    int success;
+    uint16_t *meta_ptr;
+    size_t j, meta_len;
 
-    success = TRUE;
-    for (vda = 0; vda < fs->length; vda++) {
-        pg = &fs->pages[vda];
+    /* Discard the first word and use the virtual address instead. */
+    pg->page_vda = vda;
 
-        if (!virtual_to_real(fs, vda, &rda)) {
-            report_error("fs: check_integrity: could not convert "
-                         "virtual to real disk address: %u", vda);
-            return FALSE;
-        }
+    meta_ptr = (uint16_t *) pg;
+    if (HOST_LITTLE_ENDIAN) {
+        /* The words are already in the host order. */
+        memcpy(&meta_ptr[1], &src[2], PAGE_DATA - sizeof(uint16_t));
+        return;
+    }
 
-        if (pg->header[1] != rda || pg->header[0] != 0) {
-            report_error("fs: check_integrity: "
-                         "invalid page header at VDA = %u", vda);
-            success = FALSE;
-            continue;
-        }
+    meta_len = PAGE_DATA / sizeof(uint16_t);
+    for (j = 1; j < meta_len; j++) {
+        /* Process data in little endian format. */
+        meta_ptr[j] = (uint16_t) (src[2 * j] | (src[2 * j + 1] << 8));
+    }
+}
 
-        if (pg->label.version == VERSION_FREE) continue;
-        if (pg->label.version == VERSION_BAD) {
-            if (pg->label.sn.word1 != VERSION_BAD
-                || pg->label.sn.word2 != VERSION_BAD) {
+/* Decodes the data of one page from its on-disk representation
+ * in `src` into `pg`.
+ */
+static
+void decode_page_data(struct page *pg, const uint8_t *src)
+{
+    /* Byte swap the data here. */
+    swap_bytes(pg->data, &src[PAGE_DATA], PAGE_DATA_SIZE);
+}
 
-                report_error("fs: check_integrity: "
-                             "invalid bad page at VDA = %u", vda);
-                success = FALSE;
-            }
-            continue;
-        }
+/* Decodes one page from its on-disk representation in `src` into
+ * `pg`. The virtual disk address of the page is given by `vda`.
+ */
+static
+void decode_page(struct page *pg, const uint8_t *src, uint16_t vda)
+{
+    decode_page_meta(pg, src, vda);
+    decode_page_data(pg, src);
+}
 
-        if (pg->label.version == 0) {
-            report_error("fs: check_integrity: "
-                         "invalid label version at VDA = %u", vda);
-            success = FALSE;
-            continue;
-        }
+/* Encodes the page `pg` into its on-disk representation in `dst`.
+ * The virtual disk address of the page is given by `vda`.
+ */
+static
+void encode_page(uint8_t *dst, const struct page *pg, uint16_t vda)
+{
+    const uint16_t *meta_ptr;
+    size_t j, meta_len;
+    uint16_t w;
 
-        if (pg->label.nbytes > PAGE_DATA_SIZE) {
-            report_error("fs: check_integrity: "
-                         "invalid label used bytes at VDA = %u", vda);
-            success = FALSE;
-            continue;
-        }
+    /* The first word is not used (but write the VDA anyway). */
+    dst[0] = (uint8_t) (vda & 0xFF);
+    dst[1] = (uint8_t) ((vda >> 8) & 0xFF);
 
-        if (pg->label.prev_rda != 0) {
-            if (!real_to_virtual(fs, pg->label.prev_rda, &other_vda)) {
-                report_error("fs: check_integrity: "
-                             "invalid prev_rda at VDA = %u", vda);
-                success = FALSE;
-                continue;
-            }
+    meta_ptr = (const uint16_t *) pg;
+    if (HOST_LITTLE_ENDIAN) {
+        /* The words are already in the host order. */
+        memcpy(&dst[2], &meta_ptr[1], PAGE_DATA - sizeof(uint16_t));
+    } else {
+        meta_len = PAGE_DATA / sizeof(uint16_t);
+        for (j = 1; j < meta_len; j++) {
+            w = meta_ptr[j];
 
-            other_pg = &fs->pages[other_vda];
-            if (other_pg->label.file_pgnum + 1 != pg->label.file_pgnum) {
-                report_error("fs: check_integrity: "
-                             "discontiguous file_pgnum (backwards) "
-                             "at VDA = %u", vda);
+            /* Process data in little endian format. */
+            dst[2 * j] = (uint8_t) (w & 0xFF);
+            dst[2 * j + 1] = (uint8_t) ((w >> 8) & 0xFF);
+        }
+    }
+
+    /* Byte swap the data here. */
+    swap_bytes(&dst[PAGE_DATA], pg->data, PAGE_DATA_SIZE);
+}
+
+/* Releases the memory-mapped disk image (if any). */
+static
+void release_image(struct fs *fs)
+{
+    if (fs->image) munmap((void *) fs->image, fs->image_size);
+    fs->image = NULL;
+    fs->image_size = 0;
+
+    fs->page_state = NULL;
+
+    /* The pages lived in the cache, so use the own array again. */
+    if (fs->cache) {
+        munmap((void *) fs->cache, fs->cache_size);
+        fs->pages = (fs->storage) ? fs->storage->pages : NULL;
+    }
+    fs->cache = NULL;
+    fs->cache_size = 0;
+}
+
+/* Discards all the state derived from the contents of the pages
+ * (such as the bitmap of free pages). This is used when the whole
+ * contents of the filesystem are replaced.
+ */
+static
+void invalidate_state(struct fs *fs)
+{
+    size_t size;
+
+    fs->free_map = NULL;
+
+    if (fs->dirty_map) {
+        size = (((size_t) fs->length) + FREE_MAP_BITS - 1) / FREE_MAP_BITS;
+        memset(fs->dirty_map, 0, size * sizeof(unsigned long));
+    }
+
+    if (fs->index) release_index(fs->index);
+    if (fs->dir_cache) release_dir_cache(fs->dir_cache);
+    if (fs->labels) release_label_table(fs->labels);
+}
+
+/* Discards the state that depends on the contents of the files,
+ * such as the file index and the directory cache. This is used
+ * whenever the filesystem is modified.
+ */
+static
+void mark_modified(struct fs *fs)
+{
+    fs->index->valid = FALSE;
+    release_dir_cache(fs->dir_cache);
+}
+
+/* Marks the page at `vda` as modified, so that it is written by
+ * fs_update_image().
+ */
+static
+void mark_page_dirty(struct fs *fs, uint16_t vda)
+{
+    fs->dirty_map[vda / FREE_MAP_BITS] |= 1UL << (vda % FREE_MAP_BITS);
+}
+
+/* Obtains the page at `vda` with (at least) its header and label
+ * decoded. For memory-mapped images, they are decoded on demand.
+ * Returns the page.
+ */
+static
+struct page *get_page_label(const struct fs *fs, uint16_t vda)
+{
+    struct page *pg;
+
+    pg = &fs->pages[vda];
+    if (likely(!fs->page_state)) return pg;
+
+    if (!(fs->page_state[vda] & PAGE_STATE_META)) {
+        decode_page_meta(pg, &fs->image[((size_t) vda) * PAGE_DISK_SIZE],
+                         vda);
+        fs->page_state[vda] |= PAGE_STATE_META;
+    }
+    return pg;
+}
+
+/* Obtains the page at `vda` with all its contents decoded.
+ * For memory-mapped images, the page is decoded on demand.
+ * Returns the page.
+ */
+static
+struct page *get_page(const struct fs *fs, uint16_t vda)
+{
+    struct page *pg;
+
+    pg = get_page_label(fs, vda);
+    if (likely(!fs->page_state)) return pg;
+
+    if (!(fs->page_state[vda] & PAGE_STATE_DATA)) {
+        decode_page_data(pg, &fs->image[((size_t) vda) * PAGE_DISK_SIZE]);
+        fs->page_state[vda] |= PAGE_STATE_DATA;
+    }
+    return pg;
+}
+
+/* Obtains the page at `vda` to overwrite all its data.
+ * For memory-mapped images, the data is not decoded (since the
+ * caller replaces it).
+ * Returns the page.
+ */
+static
+struct page *get_page_for_write(const struct fs *fs, uint16_t vda)
+{
+    struct page *pg;
+
+    pg = get_page_label(fs, vda);
+    if (fs->page_state) fs->page_state[vda] |= PAGE_STATE_DATA;
+    return pg;
+}
+
+/* Discards the label table `lt` (its memory belongs to the storage
+ * of the filesystem, and it is reused when the table is rebuilt).
+ */
+static
+void release_label_table(struct label_table *lt)
+{
+    lt->words = NULL;
+    lt->valid = FALSE;
+}
+
+/* Builds the label table (if not built yet) from the labels of
+ * the pages. For memory-mapped images, the labels that were not
+ * decoded yet are read directly from the image.
+ * Returns TRUE on success.
+ */
+static
+int build_label_table(const struct fs *fs)
+{
+    struct label_table *lt;
+    const struct page *pg;
+    const uint8_t *src;
+    uint16_t w[8];
+    size_t stride, j;
+    uint16_t vda;
+
+    lt = fs->labels;
+    if (lt->valid) return TRUE;
+
+    stride = (((size_t) fs->length) + LABEL_GROUP - 1) / LABEL_GROUP;
+    stride *= LABEL_GROUP;
+    lt->words = fs->storage->label_words;
+    memset(lt->words, 0, 7 * stride * sizeof(uint16_t));
+
+    lt->next_rda = lt->words;
+    lt->prev_rda = &lt->words[stride];
+    lt->nbytes = &lt->words[2 * stride];
+    lt->file_pgnum = &lt->words[3 * stride];
+    lt->version = &lt->words[4 * stride];
+    lt->sn_word1 = &lt->words[5 * stride];
+    lt->sn_word2 = &lt->words[6 * stride];
+
+    for (vda = 0; vda < fs->length; vda++) {
+        if (fs->page_state && !(fs->page_state[vda] & PAGE_STATE_META)) {
+            src = &fs->image[((size_t) vda) * PAGE_DISK_SIZE + PAGE_LABEL];
+            for (j = 0; j < 8; j++)
+                w[j] = (uint16_t) (src[2 * j] | (src[2 * j + 1] << 8));
+        } else {
+            pg = &fs->pages[vda];
+            w[0] = pg->label.next_rda;
+            w[1] = pg->label.prev_rda;
+            w[3] = pg->label.nbytes;
+            w[4] = pg->label.file_pgnum;
+            w[5] = pg->label.version;
+            w[6] = pg->label.sn.word1;
+            w[7] = pg->label.sn.word2;
+        }
+
+        lt->next_rda[vda] = w[0];
+        lt->prev_rda[vda] = w[1];
+        lt->nbytes[vda] = w[3];
+        lt->file_pgnum[vda] = w[4];
+        lt->version[vda] = w[5];
+        lt->sn_word1[vda] = w[6];
+        lt->sn_word2[vda] = w[7];
+    }
+
+    lt->valid = TRUE;
+    return TRUE;
+}
+
+/* Copies the label of the page at `vda` to the label table (if it
+ * was built). This must be called whenever the label is modified.
+ */
+static
+void update_label(const struct fs *fs, uint16_t vda)
+{
+    struct label_table *lt;
+    const struct page *pg;
+
+    lt = fs->labels;
+    if (!lt->valid) return;
+
+    pg = &fs->pages[vda];
+    lt->next_rda[vda] = pg->label.next_rda;
+    lt->prev_rda[vda] = pg->label.prev_rda;
+    lt->nbytes[vda] = pg->label.nbytes;
+    lt->file_pgnum[vda] = pg->label.file_pgnum;
+    lt->version[vda] = pg->label.version;
+    lt->sn_word1[vda] = pg->label.sn.word1;
+    lt->sn_word2[vda] = pg->label.sn.word2;
+}
+
+/* Compares the LABEL_GROUP entries of the array `words` (of the
+ * label table) starting at `vda` (a multiple of LABEL_GROUP) with
+ * `value`.
+ * Returns a bitmask with the bit `i` set if the entry `vda + i`
+ * is equal to `value`.
+ */
+static
+unsigned int label_mask(const uint16_t *words, uint16_t vda, uint16_t value)
+{
+#ifdef __SSE2__
+    __m128i v;
+
+    v = _mm_loadu_si128((const __m128i *) &words[vda]);
+    v = _mm_cmpeq_epi16(v, _mm_set1_epi16((short) value));
+    return (unsigned int)
+        _mm_movemask_epi8(_mm_packs_epi16(v, _mm_setzero_si128()));
+#else
+    unsigned int i, mask;
+
+    mask = 0;
+    for (i = 0; i < LABEL_GROUP; i++) {
+        if (words[vda + i] == value) mask |= 1U << i;
+    }
+    return mask;
+#endif
+}
+
+/* Obtains the pages that belong to files (that are neither free
+ * nor bad) in the LABEL_GROUP pages starting at `vda` (a multiple
+ * of LABEL_GROUP), using the label table.
+ * Returns the bitmask with the bit `i` set for the page `vda + i`.
+ */
+static
+unsigned int used_label_mask(const struct fs *fs, uint16_t vda)
+{
+    const struct label_table *lt;
+    unsigned int mask;
+
+    lt = fs->labels;
+    mask = label_mask(lt->version, vda, VERSION_FREE)
+        | label_mask(lt->version, vda, VERSION_BAD)
+        | label_mask(lt->version, vda, 0);
+    return ~mask & ((1U << LABEL_GROUP) - 1);
+}
+
+/* Detects the compression format of the disk image in the file
+ * descriptor `fd` from its magic number.
+ * Returns the format, or NULL for plain images.
+ */
+static
+const struct image_codec *detect_codec(int fd)
+{
+    uint8_t magic[4];
+    ssize_t ret;
+    size_t i;
+
+    ret = pread(fd, magic, sizeof(magic), 0);
+    if (ret <= 0) return NULL;
+
+    for (i = 0; i < NUM_IMAGE_CODECS; i++) {
+        if (((size_t) ret) >= image_codecs[i].magic_len
+            && memcmp(magic, image_codecs[i].magic,
+                      image_codecs[i].magic_len) == 0)
+            return &image_codecs[i];
+    }
+    return NULL;
+}
+
+/* Obtains the compression format of an image from the suffix
+ * of its `filename`.
+ * Returns the format, or NULL for plain images.
+ */
+static
+const struct image_codec *codec_from_filename(const char *filename)
+{
+    size_t i, len, suffix_len;
+
+    len = strlen(filename);
+    for (i = 0; i < NUM_IMAGE_CODECS; i++) {
+        suffix_len = strlen(image_codecs[i].suffix);
+        if (len > suffix_len
+            && strcmp(&filename[len - suffix_len],
+                      image_codecs[i].suffix) == 0)
+            return &image_codecs[i];
+    }
+    return NULL;
+}
+
+/* Opens the disk image in the file descriptor `fd` for reading or
+ * writing (if `is_writer` is TRUE) as a stream of pages in `is`.
+ * A compressed image (of format `codec`, if not NULL) is decoded
+ * (or encoded) by a filter. The stream does not take ownership
+ * of `fd`.
+ * Returns TRUE on success.
+ */
+static
+int open_image_stream(struct image_stream *is, int fd,
+                      const struct image_codec *codec, int is_writer)
+{
+    int dup_fd;
+
+    is->fp = NULL;
+    is->flt.pid = -1;
+    is->flt.fp = NULL;
+    is->flt.is_writer = FALSE;
+    is->codec = codec;
+
+    if (codec) {
+        if (!filter_start(&is->flt, (is_writer) ? codec->compress
+                          : codec->decompress, fd, is_writer))
+            return FALSE;
+        is->fp = is->flt.fp;
+        return TRUE;
+    }
+
+    dup_fd = dup(fd);
+    if (dup_fd < 0) return FALSE;
+
+    is->fp = fdopen(dup_fd, (is_writer) ? "wb" : "rb");
+    if (!is->fp) {
+        close(dup_fd);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Closes the stream of pages `is` (see open_image_stream()).
+ * Returns TRUE if all the data was transferred successfully (and
+ * the filter exited with success).
+ */
+static
+int close_image_stream(struct image_stream *is)
+{
+    int ret;
+
+    if (is->codec) {
+        is->fp = NULL;
+        return filter_finish(&is->flt);
+    }
+
+    ret = (fclose(is->fp) == 0);
+    is->fp = NULL;
+    return ret;
+}
+
+int fs_load_image(struct fs *fs, const char *filename)
+{
+    struct image_stream is;
+    uint8_t *buffer;
+    uint16_t vda, i, count;
+    size_t nbytes;
+    int fd, ret;
+
+    invalidate_state(fs);
+    release_image(fs);
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        report_error("fs: load_image: could not open `%s`",
+                     filename);
+        return FALSE;
+    }
+
+    buffer = (uint8_t *) malloc(IMAGE_CHUNK_PAGES * PAGE_DISK_SIZE);
+    if (unlikely(!buffer)) {
+        report_error("fs: load_image: memory exhausted");
+        close(fd);
+        return FALSE;
+    }
+
+    if (!open_image_stream(&is, fd, detect_codec(fd), FALSE)) {
+        report_error("fs: load_image: could not read `%s`", filename);
+        free((void *) buffer);
+        close(fd);
+        return FALSE;
+    }
+    close(fd);
+
+    /* Read the image in large chunks of pages and decode them.
+     * For compressed images, the decompression goes on (in another
+     * process) while the pages are decoded.
+     */
+    ret = TRUE;
+    for (vda = 0; ret && vda < fs->length; vda += count) {
+        count = MIN(fs->length - vda, IMAGE_CHUNK_PAGES);
+        nbytes = ((size_t) count) * PAGE_DISK_SIZE;
+        if (fread(buffer, 1, nbytes, is.fp) != nbytes) {
+            ret = FALSE;
+            break;
+        }
+
+        for (i = 0; i < count; i++) {
+            decode_page(&fs->pages[vda + i],
+                        &buffer[((size_t) i) * PAGE_DISK_SIZE],
+                        vda + i);
+        }
+    }
+
+    if (ret && fgetc(is.fp) != EOF) ret = FALSE;
+    free((void *) buffer);
+
+    if (!close_image_stream(&is) && ret) {
+        report_error("fs: load_image: could not decompress `%s`",
+                     filename);
+        return FALSE;
+    }
+
+    if (!ret) {
+        report_error("fs: load_image: premature end of file in `%s`",
+                     filename);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+int fs_open_image_mmap(struct fs *fs, const char *filename)
+{
+    struct stat st;
+    void *ptr;
+    size_t size;
+    int fd;
+
+    invalidate_state(fs);
+    release_image(fs);
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        report_error("fs: open_image_mmap: could not open `%s`",
+                     filename);
+        return FALSE;
+    }
+
+    /* Compressed images cannot be mapped, so they are loaded. */
+    if (detect_codec(fd)) {
+        close(fd);
+        return fs_load_image(fs, filename);
+    }
+
+    size = ((size_t) fs->length) * PAGE_DISK_SIZE;
+    if (fstat(fd, &st) < 0 || ((size_t) st.st_size) != size) {
+        report_error("fs: open_image_mmap: invalid image size in `%s`",
+                     filename);
+        close(fd);
+        return FALSE;
+    }
+
+    ptr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        report_error("fs: open_image_mmap: could not map `%s`",
+                     filename);
+        return FALSE;
+    }
+
+    fs->page_state = fs->storage->page_state;
+    memset(fs->page_state, 0, fs->length);
+
+    fs->image = (const uint8_t *) ptr;
+    fs->image_size = size;
+    return TRUE;
+}
+
+/* Auxiliary function to fs_save_image() and fs_update_image().
+ * Writes all pages of the filesystem to `fp`.
+ * Returns TRUE on success.
+ */
+static
+int write_image(const struct fs *fs, FILE *fp)
+{
+    uint8_t *buffer;
+    uint16_t vda, i, count;
+    size_t nbytes;
+
+    buffer = (uint8_t *) malloc(IMAGE_CHUNK_PAGES * PAGE_DISK_SIZE);
+    if (unlikely(!buffer)) {
+        report_error("fs: save_image: memory exhausted");
+        return FALSE;
+    }
+
+    /* Encode the pages in large chunks and write them at once. */
+    for (vda = 0; vda < fs->length; vda += count) {
+        count = MIN(fs->length - vda, IMAGE_CHUNK_PAGES);
+        nbytes = ((size_t) count) * PAGE_DISK_SIZE;
+
+        for (i = 0; i < count; i++) {
+            encode_page(&buffer[((size_t) i) * PAGE_DISK_SIZE],
+                        get_page(fs, vda + i), vda + i);
+        }
+
+        if (fwrite(buffer, 1, nbytes, fp) != nbytes) {
+            free((void *) buffer);
+            return FALSE;
+        }
+    }
+
+    free((void *) buffer);
+    return TRUE;
+}
+
+int fs_save_image(const struct fs *fs, const char *filename)
+{
+    struct image_stream is;
+    int fd, ret;
+
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        report_error("fs: save_image: could not open file `%s` "
+                     "for writing", filename);
+        return FALSE;
+    }
+
+    if (!open_image_stream(&is, fd, codec_from_filename(filename), TRUE)) {
+        close(fd);
+        remove(filename);
+        return FALSE;
+    }
+
+    ret = write_image(fs, is.fp);
+    if (!close_image_stream(&is)) ret = FALSE;
+    if (close(fd) != 0) ret = FALSE;
+
+    if (!ret) {
+        /* Do not leave a truncated image behind. */
+        report_error("fs: save_image: error while writing `%s`",
+                     filename);
+        remove(filename);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Auxiliary function to fs_update_image().
+ * Writes the whole image to a temporary file in the same directory
+ * as `filename` (compressed with `codec`, if not NULL), flushes it
+ * and renames it to `filename`.
+ * Returns TRUE on success.
+ */
+static
+int replace_image(const struct fs *fs, const char *filename,
+                  const struct image_codec *codec)
+{
+    struct image_stream is;
+    char *tmp_filename;
+    size_t len;
+    int fd, ret;
+
+    len = strlen(filename);
+    tmp_filename = (char *) malloc(len + 8);
+    if (unlikely(!tmp_filename)) {
+        report_error("fs: update_image: memory exhausted");
+        return FALSE;
+    }
+
+    memcpy(tmp_filename, filename, len);
+    memcpy(&tmp_filename[len], ".XXXXXX", 8);
+
+    fd = mkstemp(tmp_filename);
+    if (fd < 0) {
+        report_error("fs: update_image: could not create a temporary "
+                     "file for `%s`", filename);
+        free((void *) tmp_filename);
+        return FALSE;
+    }
+
+    if (!open_image_stream(&is, fd, codec, TRUE)) {
+        close(fd);
+        goto error;
+    }
+
+    ret = write_image(fs, is.fp);
+    if (!close_image_stream(&is)) ret = FALSE;
+    if (ret && fsync(fd) != 0) ret = FALSE;
+    if (close(fd) != 0) ret = FALSE;
+    if (!ret) goto error;
+
+    if (rename(tmp_filename, filename) != 0) {
+        report_error("fs: update_image: could not rename `%s` to `%s`",
+                     tmp_filename, filename);
+        remove(tmp_filename);
+        free((void *) tmp_filename);
+        return FALSE;
+    }
+
+    free((void *) tmp_filename);
+    return TRUE;
+
+error:
+    report_error("fs: update_image: error while writing `%s`",
+                 tmp_filename);
+    remove(tmp_filename);
+    free((void *) tmp_filename);
+    return FALSE;
+}
+
+/* Auxiliary function to fs_update_image().
+ * Writes `nbytes` bytes from `buffer` at `offset` in the file `fd`.
+ * Returns TRUE on success.
+ */
+static
+int write_at(int fd, const uint8_t *buffer, size_t nbytes, off_t offset)
+{
+    ssize_t ret;
+
+    while (nbytes > 0) {
+        ret = pwrite(fd, buffer, nbytes, offset);
+        if (ret <= 0) return FALSE;
+
+        buffer = &buffer[ret];
+        nbytes -= (size_t) ret;
+        offset += ret;
+    }
+    return TRUE;
+}
+
+int fs_update_image(const struct fs *fs, const char *filename,
+                    unsigned int flags)
+{
+    const struct image_codec *codec;
+    struct stat st;
+    uint8_t *buffer;
+    uint16_t vda, count;
+    size_t size;
+    int fd;
+
+    /* Compressed images must be rewritten as a whole. */
+    codec = NULL;
+    fd = open(filename, O_RDONLY);
+    if (fd >= 0) {
+        codec = detect_codec(fd);
+        close(fd);
+    }
+
+    if ((flags & SAVE_ATOMIC) || codec) {
+        if (!replace_image(fs, filename, codec)) return FALSE;
+        goto success;
+    }
+
+    fd = open(filename, O_WRONLY);
+    if (fd < 0) {
+        report_error("fs: update_image: could not open file `%s` "
+                     "for writing", filename);
+        return FALSE;
+    }
+
+    size = ((size_t) fs->length) * PAGE_DISK_SIZE;
+    if (fstat(fd, &st) < 0 || ((size_t) st.st_size) != size) {
+        report_error("fs: update_image: invalid image size in `%s`",
+                     filename);
+        close(fd);
+        return FALSE;
+    }
+
+    buffer = (uint8_t *) malloc(IMAGE_CHUNK_PAGES * PAGE_DISK_SIZE);
+    if (unlikely(!buffer)) {
+        report_error("fs: update_image: memory exhausted");
+        close(fd);
+        return FALSE;
+    }
+
+    /* Write each run of consecutive modified pages at once. */
+    for (vda = 0; vda < fs->length; vda++) {
+        count = 0;
+        while (vda + count < fs->length && count < IMAGE_CHUNK_PAGES
+               && (fs->dirty_map[(vda + count) / FREE_MAP_BITS]
+                   & (1UL << ((vda + count) % FREE_MAP_BITS)))) {
+            encode_page(&buffer[((size_t) count) * PAGE_DISK_SIZE],
+                        get_page(fs, vda + count), vda + count);
+            count++;
+        }
+        if (count == 0) continue;
+
+        if (!write_at(fd, buffer, ((size_t) count) * PAGE_DISK_SIZE,
+                      ((off_t) vda) * PAGE_DISK_SIZE)) {
+            goto error;
+        }
+        vda += count - 1;
+    }
+
+    if ((flags & SAVE_FSYNC) && fsync(fd) != 0) goto error;
+
+    free((void *) buffer);
+    if (close(fd) != 0) {
+        report_error("fs: update_image: error while writing `%s`",
+                     filename);
+        return FALSE;
+    }
+
+success:
+    size = (((size_t) fs->length) + FREE_MAP_BITS - 1) / FREE_MAP_BITS;
+    memset(fs->dirty_map, 0, size * sizeof(unsigned long));
+    return TRUE;
+
+error:
+    report_error("fs: update_image: error while writing `%s`",
+                 filename);
+    free((void *) buffer);
+    close(fd);
+    return FALSE;
+}
+
+/* Obtains the name of the sidecar cache of the image `filename`.
+ * Returns the name (to be released with free()), or NULL if out
+ * of memory.
+ */
+static
+char *cache_filename(const char *filename)
+{
+    char *name;
+    size_t len;
+
+    len = strlen(filename);
+    name = (char *) malloc(len + sizeof(CACHE_SUFFIX));
+    if (unlikely(!name)) return NULL;
+
+    memcpy(name, filename, len);
+    memcpy(&name[len], CACHE_SUFFIX, sizeof(CACHE_SUFFIX));
+    return name;
+}
+
+/* Fills the key of the image `filename` in the cache header `hdr`.
+ * The image is identified by its inode, size and times, so that
+ * the key can be checked without reading the image.
+ * Returns TRUE on success.
+ */
+static
+int cache_key(const char *filename, struct cache_header *hdr)
+{
+    struct stat st;
+
+    if (stat(filename, &st) != 0) return FALSE;
+
+    hdr->image_size = (unsigned long) st.st_size;
+    hdr->image_dev = (unsigned long) st.st_dev;
+    hdr->image_ino = (unsigned long) st.st_ino;
+    hdr->mtime_sec = (unsigned long) st.st_mtim.tv_sec;
+    hdr->mtime_nsec = (unsigned long) st.st_mtim.tv_nsec;
+    hdr->ctime_sec = (unsigned long) st.st_ctim.tv_sec;
+    hdr->ctime_nsec = (unsigned long) st.st_ctim.tv_nsec;
+    return TRUE;
+}
+
+/* Computes the offset following a section at `offset` with `size`
+ * bytes (aligned to CACHE_ALIGN).
+ * Returns the offset.
+ */
+static
+unsigned long cache_next_offset(unsigned long offset, size_t size)
+{
+    offset += (unsigned long) size;
+    return (offset + CACHE_ALIGN - 1) & ~((unsigned long) CACHE_ALIGN - 1);
+}
+
+/* Auxiliary function to fs_write_cache().
+ * Writes `size` bytes of `data` to `fp` at `offset` (padding the
+ * file with zeros up to `offset`).
+ * Returns TRUE on success.
+ */
+static
+int write_cache_section(FILE *fp, const void *data, size_t size,
+                        unsigned long offset)
+{
+    long pos;
+
+    pos = ftell(fp);
+    if (pos < 0 || ((unsigned long) pos) > offset) return FALSE;
+    while (((unsigned long) pos) < offset) {
+        if (fputc(0, fp) == EOF) return FALSE;
+        pos++;
+    }
+
+    if (size == 0) return TRUE;
+    return (fwrite(data, 1, size, fp) == size);
+}
+
+int fs_write_cache(struct fs *fs, const char *filename)
+{
+    struct cache_header hdr;
+    const struct file_index *idx;
+    char *name, *tmp_filename;
+    size_t i, len, map_size;
+    uint16_t vda;
+    FILE *fp;
+    int fd, ret;
+
+    map_size = (((size_t) fs->length) + FREE_MAP_BITS - 1) / FREE_MAP_BITS;
+    for (i = 0; i < map_size; i++) {
+        if (fs->dirty_map[i] != 0) {
+            report_error("fs: write_cache: the filesystem was modified");
+            return FALSE;
+        }
+    }
+
+    /* Decode all the pages and build the file index and free map. */
+    for (vda = 0; vda < fs->length; vda++)
+        get_page(fs, vda);
+    if (!build_index(fs) || !build_free_map(fs)) return FALSE;
+    idx = fs->index;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+    hdr.version = CACHE_VERSION;
+    hdr.byte_order = CACHE_BYTE_ORDER;
+    hdr.page_size = (uint32_t) sizeof(struct page);
+    hdr.entry_size = (uint32_t) sizeof(struct index_entry);
+    hdr.dg = fs->dg;
+    hdr.length = fs->length;
+    hdr.num_entries = idx->num_entries;
+    hdr.num_buckets = idx->num_buckets;
+
+    if (!cache_key(filename, &hdr)) {
+        report_error("fs: write_cache: could not stat `%s`", filename);
+        return FALSE;
+    }
+
+    hdr.pages_offset = cache_next_offset(0, sizeof(hdr));
+    hdr.free_map_offset = cache_next_offset(hdr.pages_offset,
+        ((size_t) fs->length) * sizeof(struct page));
+    hdr.entries_offset = cache_next_offset(hdr.free_map_offset,
+        map_size * sizeof(unsigned long));
+    hdr.leaders_offset = cache_next_offset(hdr.entries_offset,
+        idx->num_entries * sizeof(struct index_entry));
+    hdr.sn_buckets_offset = cache_next_offset(hdr.leaders_offset,
+        ((size_t) fs->length) * sizeof(uint32_t));
+    hdr.name_buckets_offset = cache_next_offset(hdr.sn_buckets_offset,
+        idx->num_buckets * sizeof(uint32_t));
+    hdr.total_size = hdr.name_buckets_offset
+        + idx->num_buckets * sizeof(uint32_t);
+
+    name = cache_filename(filename);
+    len = (name) ? strlen(name) : 0;
+    tmp_filename = (name) ? (char *) malloc(len + 8) : NULL;
+    if (unlikely(!tmp_filename)) {
+        report_error("fs: write_cache: memory exhausted");
+        if (name) free((void *) name);
+        return FALSE;
+    }
+
+    /* Write to a temporary file, so that other processes never see
+     * a partial cache.
+     */
+    memcpy(tmp_filename, name, len);
+    memcpy(&tmp_filename[len], ".XXXXXX", 8);
+    fd = mkstemp(tmp_filename);
+    fp = (fd >= 0) ? fdopen(fd, "wb") : NULL;
+    if (!fp) {
+        report_error("fs: write_cache: could not create `%s`", name);
+        if (fd >= 0) {
+            close(fd);
+            remove(tmp_filename);
+        }
+        free((void *) tmp_filename);
+        free((void *) name);
+        return FALSE;
+    }
+
+    ret = write_cache_section(fp, &hdr, sizeof(hdr), 0)
+        && write_cache_section(fp, fs->pages,
+                               ((size_t) fs->length) * sizeof(struct page),
+                               hdr.pages_offset)
+        && write_cache_section(fp, fs->free_map,
+                               map_size * sizeof(unsigned long),
+                               hdr.free_map_offset)
+        && write_cache_section(fp, idx->entries,
+                               idx->num_entries * sizeof(struct index_entry),
+                               hdr.entries_offset)
+        && write_cache_section(fp, idx->leaders,
+                               ((size_t) fs->length) * sizeof(uint32_t),
+                               hdr.leaders_offset)
+        && write_cache_section(fp, idx->sn_buckets,
+                               idx->num_buckets * sizeof(uint32_t),
+                               hdr.sn_buckets_offset)
+        && write_cache_section(fp, idx->name_buckets,
+                               idx->num_buckets * sizeof(uint32_t),
+                               hdr.name_buckets_offset);
+    if (fclose(fp) != 0) ret = FALSE;
+
+    if (ret && rename(tmp_filename, name) != 0) ret = FALSE;
+    if (!ret) {
+        report_error("fs: write_cache: error while writing `%s`", name);
+        remove(tmp_filename);
+    }
+
+    free((void *) tmp_filename);
+    free((void *) name);
+    return ret;
+}
+
+/* Auxiliary function to fs_open_image_cached().
+ * Checks if the cache header `hdr` (of a cache with `size` bytes)
+ * is valid for the image `filename` and the filesystem `fs`.
+ * Returns TRUE if the cache can be used.
+ */
+static
+int valid_cache(const struct fs *fs, const char *filename,
+                const struct cache_header *hdr, size_t size)
+{
+    struct cache_header key;
+    size_t map_size;
+
+    if (size < sizeof(*hdr)
+        || memcmp(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic)) != 0
+        || hdr->version != CACHE_VERSION
+        || hdr->byte_order != CACHE_BYTE_ORDER
+        || hdr->page_size != sizeof(struct page)
+        || hdr->entry_size != sizeof(struct index_entry)
+        || hdr->total_size != size)
+        return FALSE;
+
+    if (hdr->dg.num_cylinders != fs->dg.num_cylinders
+        || hdr->dg.num_heads != fs->dg.num_heads
+        || hdr->dg.num_sectors != fs->dg.num_sectors
+        || hdr->dg.num_disks != fs->dg.num_disks
+        || hdr->length != fs->length)
+        return FALSE;
+
+    if (!cache_key(filename, &key)
+        || key.image_size != hdr->image_size
+        || key.image_dev != hdr->image_dev
+        || key.image_ino != hdr->image_ino
+        || key.mtime_sec != hdr->mtime_sec
+        || key.mtime_nsec != hdr->mtime_nsec
+        || key.ctime_sec != hdr->ctime_sec
+        || key.ctime_nsec != hdr->ctime_nsec)
+        return FALSE;
+
+    /* The sections must be inside the cache. */
+    map_size = (((size_t) fs->length) + FREE_MAP_BITS - 1) / FREE_MAP_BITS;
+    if (hdr->num_entries > fs->length
+        || hdr->num_buckets == 0
+        || hdr->num_buckets > index_buckets(fs->length)
+        || (hdr->num_buckets & (hdr->num_buckets - 1)) != 0
+        || hdr->pages_offset < sizeof(*hdr)
+        || hdr->free_map_offset < hdr->pages_offset
+           + ((size_t) fs->length) * sizeof(struct page)
+        || hdr->entries_offset < hdr->free_map_offset
+           + map_size * sizeof(unsigned long)
+        || hdr->leaders_offset < hdr->entries_offset
+           + hdr->num_entries * sizeof(struct index_entry)
+        || hdr->sn_buckets_offset < hdr->leaders_offset
+           + ((size_t) fs->length) * sizeof(uint32_t)
+        || hdr->name_buckets_offset < hdr->sn_buckets_offset
+           + hdr->num_buckets * sizeof(uint32_t)
+        || hdr->total_size < hdr->name_buckets_offset
+           + hdr->num_buckets * sizeof(uint32_t))
+        return FALSE;
+    return TRUE;
+}
+
+/* Auxiliary function to fs_open_image_cached().
+ * Checks the tables of `fs` copied from the cache (the file index
+ * and the bitmap of free pages), which are used without the checks
+ * of fs_check_integrity(): every link and leader of the index must
+ * be in range and consistent with the entries, every entry must be
+ * in exactly one chain of each hash table, and the bitmap must agree
+ * with the labels of the pages.
+ * Returns TRUE if the tables can be used.
+ */
+static
+int valid_cache_tables(const struct fs *fs)
+{
+    const struct file_index *idx;
+    const struct index_entry *e;
+    uint8_t *seen;
+    uint32_t i, h, count;
+    size_t vda, map_size;
+    unsigned long bit;
+    int pass, ret;
+
+    idx = fs->index;
+    for (i = 0; i < idx->num_entries; i++) {
+        e = &idx->entries[i];
+        if (e->fe.leader_vda >= fs->length
+            || idx->leaders[e->fe.leader_vda] != i
+            || !memchr(e->filename, '\0', sizeof(e->filename))
+            || (e->next_sn != INDEX_NONE
+                && e->next_sn >= idx->num_entries)
+            || (e->next_name != INDEX_NONE
+                && e->next_name >= idx->num_entries))
+            return FALSE;
+    }
+
+    map_size = (((size_t) fs->length) + FREE_MAP_BITS - 1) / FREE_MAP_BITS;
+    for (vda = 0; vda < map_size * FREE_MAP_BITS; vda++) {
+        bit = (fs->free_map[vda / FREE_MAP_BITS] >> (vda % FREE_MAP_BITS))
+            & 1UL;
+        if (vda >= fs->length) {
+            if (bit) return FALSE;
+            continue;
+        }
+
+        i = idx->leaders[vda];
+        if (i != INDEX_NONE && (i >= idx->num_entries
+                                || idx->entries[i].fe.leader_vda != vda))
+            return FALSE;
+        if (bit != (vda != 0
+                    && fs->pages[vda].label.version == VERSION_FREE))
+            return FALSE;
+    }
+
+    seen = (uint8_t *) malloc(((size_t) idx->num_entries) + 1);
+    if (unlikely(!seen)) return FALSE;
+
+    /* First the chains by serial number, then the ones by name. */
+    ret = TRUE;
+    for (pass = 0; pass < 2 && ret; pass++) {
+        memset(seen, 0, idx->num_entries);
+        count = 0;
+        for (h = 0; h < idx->num_buckets && ret; h++) {
+            i = (pass == 0) ? idx->sn_buckets[h] : idx->name_buckets[h];
+            while (i != INDEX_NONE) {
+                if (i >= idx->num_entries || seen[i]) {
+                    ret = FALSE;
+                    break;
+                }
+
+                e = &idx->entries[i];
+                if ((((pass == 0) ? hash_sn(&e->fe.sn)
+                      : hash_name(e->filename))
+                     & (idx->num_buckets - 1)) != h) {
+                    ret = FALSE;
+                    break;
+                }
+
+                seen[i] = TRUE;
+                count++;
+                i = (pass == 0) ? e->next_sn : e->next_name;
+            }
+        }
+        if (count != idx->num_entries) ret = FALSE;
+    }
+
+    free((void *) seen);
+    return ret;
+}
+
+int fs_open_image_cached(struct fs *fs, const char *filename,
+                         int *from_cache)
+{
+    const struct cache_header *hdr;
+    struct table_storage *ts;
+    struct file_index *idx;
+    struct stat st;
+    char *name;
+    uint8_t *ptr;
+    size_t size, map_size;
+    int fd;
+
+    *from_cache = FALSE;
+    name = cache_filename(filename);
+    if (unlikely(!name)) {
+        report_error("fs: open_image_cached: memory exhausted");
+        return FALSE;
+    }
+
+    /* Any problem with the cache just means it cannot be used. */
+    fd = open(name, O_RDONLY);
+    free((void *) name);
+    if (fd < 0) return fs_open_image_mmap(fs, filename);
+
+    if (fstat(fd, &st) != 0 || ((size_t) st.st_size) < sizeof(*hdr)) {
+        close(fd);
+        return fs_open_image_mmap(fs, filename);
+    }
+
+    /* The pages are used in place, and modified copy-on-write. */
+    size = (size_t) st.st_size;
+    ptr = (uint8_t *) mmap(NULL, size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) return fs_open_image_mmap(fs, filename);
+
+    hdr = (const struct cache_header *) ptr;
+    if (!valid_cache(fs, filename, hdr, size)) {
+        munmap((void *) ptr, size);
+        return fs_open_image_mmap(fs, filename);
+    }
+
+    invalidate_state(fs);
+    release_image(fs);
+    fs->pages = (struct page *) &ptr[hdr->pages_offset];
+    fs->cache = ptr;
+    fs->cache_size = size;
+
+    /* The tables are copied, since they are modified in place. */
+    ts = fs->storage;
+    map_size = (((size_t) fs->length) + FREE_MAP_BITS - 1) / FREE_MAP_BITS;
+    memcpy(ts->free_map, &ptr[hdr->free_map_offset],
+           map_size * sizeof(unsigned long));
+    fs->free_map = ts->free_map;
+
+    idx = fs->index;
+    memcpy(ts->entries, &ptr[hdr->entries_offset],
+           hdr->num_entries * sizeof(struct index_entry));
+    memcpy(ts->leaders, &ptr[hdr->leaders_offset],
+           ((size_t) fs->length) * sizeof(uint32_t));
+    memcpy(ts->sn_buckets, &ptr[hdr->sn_buckets_offset],
+           hdr->num_buckets * sizeof(uint32_t));
+    memcpy(ts->name_buckets, &ptr[hdr->name_buckets_offset],
+           hdr->num_buckets * sizeof(uint32_t));
+    idx->entries = ts->entries;
+    idx->leaders = ts->leaders;
+    idx->sn_buckets = ts->sn_buckets;
+    idx->name_buckets = ts->name_buckets;
+    idx->num_entries = hdr->num_entries;
+    idx->num_buckets = hdr->num_buckets;
+
+    /* A damaged cache is not used (this releases it). */
+    if (!valid_cache_tables(fs)) return fs_open_image_mmap(fs, filename);
+
+    idx->valid = TRUE;
+    *from_cache = TRUE;
+    return TRUE;
+}
+
+/* Auxiliary function to check_integrity_stage1().
+ * Checks the header and label of the page at `vda` (and the links
+ * to its neighbours).
+ * Returns 1 if the page is fine, 0 if it has errors, and -1 if
+ * the check cannot continue.
+ */
+static
+int check_page(const struct fs *fs, uint16_t vda)
+{
+    const struct page *pg, *other_pg;
+    uint16_t rda, other_vda;
+    uint8_t slen;
+
+    pg = get_page_label(fs, vda);
+
+    if (!virtual_to_real(fs, vda, &rda)) {
+        report_error("fs: check_integrity: could not convert "
+                     "virtual to real disk address: %u", vda);
+        return -1;
+    }
+
+    if (pg->header[1] != rda || pg->header[0] != 0) {
+        report_error("fs: check_integrity: "
+                     "invalid page header at VDA = %u", vda);
+        return 0;
+    }
+
+    if (pg->label.version == VERSION_FREE) return 1;
+    if (pg->label.version == VERSION_BAD) {
+        if (pg->label.sn.word1 != VERSION_BAD
+            || pg->label.sn.word2 != VERSION_BAD) {
+
+            report_error("fs: check_integrity: "
+                         "invalid bad page at VDA = %u", vda);
+            return 0;
+        }
+        return 1;
+    }
+
+    if (pg->label.version == 0) {
+        report_error("fs: check_integrity: "
+                     "invalid label version at VDA = %u", vda);
+        return 0;
+    }
+
+    if (pg->label.nbytes > PAGE_DATA_SIZE) {
+        report_error("fs: check_integrity: "
+                     "invalid label used bytes at VDA = %u", vda);
+        return 0;
+    }
+
+    if (pg->label.prev_rda != 0) {
+        if (!real_to_virtual(fs, pg->label.prev_rda, &other_vda)) {
+            report_error("fs: check_integrity: "
+                         "invalid prev_rda at VDA = %u", vda);
+            return 0;
+        }
+
+        other_pg = get_page_label(fs, other_vda);
+        if (other_pg->label.file_pgnum + 1 != pg->label.file_pgnum) {
+            report_error("fs: check_integrity: "
+                         "discontiguous file_pgnum (backwards) "
+                         "at VDA = %u", vda);
+            return 0;
+        }
+
+        if (other_pg->label.sn.word1 != pg->label.sn.word1
+            || other_pg->label.sn.word2 != pg->label.sn.word2) {
+            report_error("fs: check_integrity: "
+                         "differing file serial numbers (backwards) "
+                         "at VDA = %u", vda);
+            return 0;
+        }
+
+        /* First page is special, so not test it. */
+        if (other_pg->label.next_rda != rda && vda != 0) {
+            report_error("fs: check_integrity: "
+                         "broken link (backwards) at VDA = %u",
+                         vda);
+            return 0;
+        }
+    } else {
+        if (pg->label.nbytes < PAGE_DATA_SIZE) {
+            report_error("fs: check_integrity: "
+                         "short leader page at VDA = %u", vda);
+            return 0;
+        }
+
+        if (pg->label.file_pgnum != 0) {
+            report_error("fs: check_integrity: "
+                         "file_pgnum is not zero at VDA = %u", vda);
+            return 0;
+        }
+
+        slen = get_page(fs, vda)->data[LEADER_FILENAME];
+        if (slen == 0 || slen >= FILENAME_LENGTH) {
+            report_error("fs: check_integrity: "
+                         "invalid filename at VDA = %u", vda);
+            return 0;
+        }
+    }
+
+    if (pg->label.next_rda != 0) {
+        if (pg->label.nbytes < PAGE_DATA_SIZE) {
+            report_error("fs: check_integrity: "
+                         "short page at VDA = %u", vda);
+            return 0;
+        }
+
+        if (!real_to_virtual(fs, pg->label.next_rda, &other_vda)) {
+            report_error("fs: check_integrity: "
+                         "invalid next_rda at VDA = %u", vda);
+            return 0;
+        }
+
+        other_pg = get_page_label(fs, other_vda);
+        if (other_pg->label.file_pgnum != pg->label.file_pgnum + 1) {
+            report_error("fs: check_integrity: "
+                         "discontiguous file_pgnum (forward) "
+                         "at VDA = %u", vda);
+            return 0;
+        }
+
+        if (other_pg->label.sn.word1 != pg->label.sn.word1
+            || other_pg->label.sn.word2 != pg->label.sn.word2) {
+            report_error("fs: check_integrity: "
+                         "differing file serial numbers (forward) "
+                         "at VDA = %u", vda);
+            return 0;
+        }
+
+        /* First page is special, so not test it. */
+        if (other_pg->label.prev_rda != rda && vda != 0) {
+            report_error("fs: check_integrity: "
+                         "broken link (forward) at VDA = %u",
+                         vda);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Auxiliary function to check_integrity_stage1().
+ * Checks the pages from `start` up to (but not including) `end`.
+ * Returns 1 if all pages are fine, 0 if some have errors and -1 if
+ * the check was aborted.
+ */
+static
+int check_range(const struct fs *fs, uint16_t start, uint16_t end)
+{
+    uint16_t vda;
+    int ret, result;
+
+    result = 1;
+    for (vda = start; vda < end; vda++) {
+        ret = check_page(fs, vda);
+        if (ret < 0) return -1;
+        if (ret == 0) result = 0;
+    }
+    return result;
+}
+
+/* Error handler that collects the errors of a check_chunk. */
+static
+void collect_check_error(const char *msg, void *arg)
+{
+    struct check_chunk *chunk;
+
+    chunk = (struct check_chunk *) arg;
+    strbuf_printf(&chunk->errors, "%s\n", msg);
+}
+
+/* Decodes the labels (and the data of the leader pages) of the
+ * pages in a check_chunk, so that the workers can later access
+ * any page without decoding it.
+ * This is the thread function, the `arg` is the check_chunk.
+ */
+static
+void *decode_chunk_pages(void *arg)
+{
+    struct check_chunk *chunk;
+    const struct page *pg;
+    uint16_t vda;
+
+    chunk = (struct check_chunk *) arg;
+    for (vda = chunk->start; vda < chunk->end; vda++) {
+        pg = get_page_label(&chunk->fs, vda);
+        if (pg->label.prev_rda == 0) get_page(&chunk->fs, vda);
+    }
+    return NULL;
+}
+
+/* Checks the pages in a check_chunk, collecting the errors.
+ * This is the thread function, the `arg` is the check_chunk.
+ */
+static
+void *check_chunk_pages(void *arg)
+{
+    struct check_chunk *chunk;
+    error_handler handler;
+    void *handler_arg;
+
+    chunk = (struct check_chunk *) arg;
+    get_error_handler(&handler, &handler_arg);
+    set_error_handler(&collect_check_error, chunk);
+    chunk->result = check_range(&chunk->fs, chunk->start, chunk->end);
+    set_error_handler(handler, handler_arg);
+    return NULL;
+}
+
+/* Adds the counters in `src` to the ones in `dst`. */
+static
+void add_stats(struct fs_stats *dst, const struct fs_stats *src)
+{
+    dst->pages_read += src->pages_read;
+    dst->pages_written += src->pages_written;
+    dst->translations += src->translations;
+    dst->dir_entries += src->dir_entries;
+    dst->leaders_decoded += src->leaders_decoded;
+    dst->free_probes += src->free_probes;
+}
+
+/* Runs the function `fn` over the `num_chunks` chunks in `chunks`,
+ * each one in its own thread. The chunks whose thread could not be
+ * created are processed in the calling thread.
+ */
+static
+void run_chunks(struct check_chunk *chunks, unsigned int num_chunks,
+                void *(*fn)(void *))
+{
+    unsigned int i;
+
+    for (i = 1; i < num_chunks; i++) {
+        chunks[i].started =
+            (pthread_create(&chunks[i].thread, NULL, fn, &chunks[i]) == 0);
+    }
+
+    fn(&chunks[0]);
+    for (i = 1; i < num_chunks; i++) {
+        if (chunks[i].started)
+            pthread_join(chunks[i].thread, NULL);
+        else
+            fn(&chunks[i]);
+    }
+}
+
+/* Auxiliary function to fs_check_integrity() [stage1].
+ * Checks some basic filesystem consistency.
+ * The pages are split in contiguous ranges checked by up to
+ * `num_threads` threads. The errors are reported in VDA order,
+ * as if the pages were checked sequentially.
+ * Returns TRUE on success.
+ */
+static
+int check_integrity_stage1(const struct fs *fs, unsigned int num_threads)
+{
+    struct check_chunk *chunks;
+    unsigned int i, num_chunks;
+    char *msg, *eol;
+    int success;
+
+    num_chunks = MIN(num_threads, fs->length / CHECK_CHUNK_PAGES);
+    if (num_chunks <= 1)
+        return (check_range(fs, 0, fs->length) > 0);
+
+    chunks = (struct check_chunk *)
+        malloc(num_chunks * sizeof(struct check_chunk));
+    if (unlikely(!chunks)) {
+        report_error("fs: check_integrity: memory exhausted");
+        return FALSE;
+    }
+
+    /* The workers count their statistics apart, and they are added
+     * to the ones of `fs` after all of them have finished.
+     */
+    for (i = 0; i < num_chunks; i++) {
+        chunks[i].fs = *fs;
+        memset(&chunks[i].stats, 0, sizeof(struct fs_stats));
+        chunks[i].fs.stats = &chunks[i].stats;
+        chunks[i].start = (uint16_t)
+            ((((uint32_t) fs->length) * i) / num_chunks);
+        chunks[i].end = (uint16_t)
+            ((((uint32_t) fs->length) * (i + 1)) / num_chunks);
+        chunks[i].result = -1;
+        if (!strbuf_create(&chunks[i].errors, 0)) {
+            while (i-- > 0) strbuf_destroy(&chunks[i].errors);
+            free((void *) chunks);
+            return FALSE;
+        }
+    }
+
+    /* The lazy decoding of mapped images is not thread-safe, so each
+     * worker decodes its own range before any page is checked.
+     */
+    if (fs->page_state) run_chunks(chunks, num_chunks, &decode_chunk_pages);
+    run_chunks(chunks, num_chunks, &check_chunk_pages);
+
+    success = TRUE;
+    for (i = 0; i < num_chunks; i++) {
+        if (fs->stats) add_stats(fs->stats, &chunks[i].stats);
+        for (msg = chunks[i].errors.str; *msg; msg = &eol[1]) {
+            eol = strchr(msg, '\n');
+            *eol = '\0';
+            report_error("%s", msg);
+        }
+
+        if (chunks[i].result <= 0) success = FALSE;
+        if (chunks[i].result < 0) break;
+    }
+
+    for (i = 0; i < num_chunks; i++)
+        strbuf_destroy(&chunks[i].errors);
+    free((void *) chunks);
+    return success;
+}
+
+/* Auxiliary function to fs_check_integrity() [stage2].
+ * Tests if the page label `pg` is the label of a leader page.
+ */
+static
+int is_leader_page(const struct page *pg)
+{
+    if (pg->label.version == VERSION_FREE
+        || pg->label.version == VERSION_BAD
+        || pg->label.version == 0) return FALSE;
+    return (pg->label.prev_rda == 0 && pg->label.file_pgnum == 0);
+}
+
+/* Auxiliary function to fs_check_integrity() [stage2].
+ * Follows the chain of every leader page, marking the visited pages
+ * in the bitmap `visited`. Since each page is visited at most once,
+ * this runs in time proportional to the number of pages.
+ * Returns TRUE on success.
+ */
+static
+int check_file_chains(const struct fs *fs, unsigned long *visited)
+{
+    const struct page *pg;
+    uint16_t vda, leader_vda, next_vda, orphan_vda;
+    unsigned int mask;
+    int success;
+
+    success = TRUE;
+    for (leader_vda = 1; leader_vda < fs->length; leader_vda++) {
+        pg = get_page_label(fs, leader_vda);
+        if (!is_leader_page(pg)) continue;
+
+        vda = leader_vda;
+        visited[vda / FREE_MAP_BITS] |= 1UL << (vda % FREE_MAP_BITS);
+        while (pg->label.next_rda != 0) {
+            if (!real_to_virtual(fs, pg->label.next_rda, &next_vda)) {
+                report_error("fs: check_integrity: "
+                             "invalid next_rda at VDA = %u", vda);
                 success = FALSE;
-                continue;
+                break;
+            }
+
+            if (visited[next_vda / FREE_MAP_BITS]
+                & (1UL << (next_vda % FREE_MAP_BITS))) {
+                report_error("fs: check_integrity: "
+                             "cycle or shared page at VDA = %u "
+                             "(file at VDA = %u)", next_vda, leader_vda);
+                success = FALSE;
+                break;
+            }
+
+            vda = next_vda;
+            visited[vda / FREE_MAP_BITS] |= 1UL << (vda % FREE_MAP_BITS);
+            pg = get_page_label(fs, vda);
+        }
+    }
+
+    if (!build_label_table(fs)) return FALSE;
+
+    /* The page at VDA 0 (the boot page) is special. */
+    for (vda = 0; vda < fs->length; vda += LABEL_GROUP) {
+        mask = ~(label_mask(fs->labels->version, vda, VERSION_FREE)
+                 | label_mask(fs->labels->version, vda, VERSION_BAD));
+        if (vda == 0) mask &= ~1U;
+        if (fs->length - vda < LABEL_GROUP)
+            mask &= (1U << (fs->length - vda)) - 1;
+        else
+            mask &= (1U << LABEL_GROUP) - 1;
+
+        while (mask != 0) {
+            orphan_vda = vda + __builtin_ctz(mask);
+            mask &= mask - 1;
+            if (visited[orphan_vda / FREE_MAP_BITS]
+                & (1UL << (orphan_vda % FREE_MAP_BITS))) continue;
+
+            report_error("fs: check_integrity: "
+                         "orphan page at VDA = %u", orphan_vda);
+            success = FALSE;
+        }
+    }
+
+    return success;
+}
+
+/* Auxiliary function to check_directory_entries().
+ * Checks that the directory entry `de` points to a live leader page,
+ * and queues the subdirectories that were not visited yet.
+ */
+static
+int check_directory_entry_cb(const struct fs *fs,
+                             const struct directory_entry *de,
+                             void *arg)
+{
+    struct dir_check_context *ctx;
+    const struct page *pg;
+    uint16_t vda;
+
+    ctx = (struct dir_check_context *) arg;
+    vda = de->fe.leader_vda;
+    if (vda >= fs->length || !is_leader_page(get_page_label(fs, vda))) {
+        report_error("fs: check_integrity: directory entry `%s` "
+                     "points to an invalid leader at VDA = %u",
+                     de->filename, vda);
+        ctx->success = FALSE;
+        return 1;
+    }
+
+    pg = get_page_label(fs, vda);
+    if (pg->label.sn.word1 != de->fe.sn.word1
+        || pg->label.sn.word2 != de->fe.sn.word2
+        || pg->label.version != de->fe.version) {
+        report_error("fs: check_integrity: directory entry `%s` does "
+                     "not match the leader at VDA = %u",
+                     de->filename, vda);
+        ctx->success = FALSE;
+        return 1;
+    }
+
+    if (!(de->fe.sn.word1 & SN_DIRECTORY)) return 1;
+    if (ctx->dir_map[vda / FREE_MAP_BITS] & (1UL << (vda % FREE_MAP_BITS)))
+        return 1;
+
+    ctx->dir_map[vda / FREE_MAP_BITS] |= 1UL << (vda % FREE_MAP_BITS);
+    ctx->dirs[ctx->num_dirs++] = de->fe;
+    return 1;
+}
+
+/* Auxiliary function to fs_check_integrity() [stage2].
+ * Checks the entries of all directories reachable from SysDir.
+ * Each directory is scanned once (they are marked in the bitmap
+ * `dir_map`).
+ * Returns TRUE on success.
+ */
+static
+int check_directory_entries(const struct fs *fs, unsigned long *dir_map)
+{
+    struct dir_check_context ctx;
+    size_t i;
+
+    if (fs->length <= 1 || !is_leader_page(get_page_label(fs, 1))) {
+        report_error("fs: check_integrity: invalid SysDir leader");
+        return FALSE;
+    }
+
+    ctx.dirs = (struct file_entry *)
+        malloc(((size_t) fs->length) * sizeof(struct file_entry));
+    if (unlikely(!ctx.dirs)) {
+        report_error("fs: check_integrity: memory exhausted");
+        return FALSE;
+    }
+
+    ctx.dir_map = dir_map;
+    ctx.success = TRUE;
+    ctx.num_dirs = 1;
+    if (!fs_file_entry(fs, 1, &ctx.dirs[0])) {
+        free((void *) ctx.dirs);
+        return FALSE;
+    }
+    dir_map[0] |= 1UL << 1;
+
+    /* The queue only grows while scanning (each directory once). */
+    for (i = 0; i < ctx.num_dirs; i++) {
+        if (!fs_scan_directory(fs, &ctx.dirs[i],
+                               &check_directory_entry_cb, &ctx)) {
+            report_error("fs: check_integrity: could not scan "
+                         "directory at VDA = %u", ctx.dirs[i].leader_vda);
+            ctx.success = FALSE;
+        }
+    }
+
+    free((void *) ctx.dirs);
+    return ctx.success;
+}
+
+/* Auxiliary function to fs_check_integrity() [stage2].
+ * Checks the files as a whole: the chains of all files, the pages
+ * that do not belong to any file, and the directory entries.
+ * This assumes that stage1 succeeded.
+ * Returns TRUE on success.
+ */
+static
+int check_integrity_stage2(const struct fs *fs)
+{
+    unsigned long *visited, *dir_map;
+    size_t size;
+    int success;
+
+    size = (((size_t) fs->length) + FREE_MAP_BITS - 1) / FREE_MAP_BITS;
+    visited = (unsigned long *) calloc(size, sizeof(unsigned long));
+    dir_map = (unsigned long *) calloc(size, sizeof(unsigned long));
+    if (unlikely(!visited || !dir_map)) {
+        report_error("fs: check_integrity: memory exhausted");
+        if (visited) free((void *) visited);
+        if (dir_map) free((void *) dir_map);
+        return FALSE;
+    }
+
+    success = check_file_chains(fs, visited);
+    if (success) success = check_directory_entries(fs, dir_map);
+
+    free((void *) visited);
+    free((void *) dir_map);
+    return success;
+}
+
+int fs_check_integrity(const struct fs *fs, unsigned int num_threads)
+{
+    if (!check_integrity_stage1(fs, num_threads)) return FALSE;
+    if (!check_integrity_stage2(fs)) return FALSE;
+    return TRUE;
+}
+
+int fs_open(const struct fs *fs, const struct file_entry *fe,
+            struct open_file *of, int include_leader)
+{
+    const struct page *pg;
+    uint16_t rda;
+
+    of->page_map = NULL;
+    of->num_pages = 0;
+    if (fe->leader_vda >= fs->length) {
+        of->error = TRUE;
+        return FALSE;
+    }
+
+    of->fe = *fe;
+    of->pos.pgnum = 1;
+    of->pos.pos = 0;
+
+    if (!include_leader) {
+        pg = get_page_label(fs, fe->leader_vda);
+        rda = pg->label.next_rda;
+        if (!real_to_virtual(fs, rda, &of->pos.vda)) {
+            of->error = TRUE;
+            return FALSE;
+        }
+    } else {
+        of->pos.vda = of->fe.leader_vda;
+    }
+
+    of->error = FALSE;
+    return TRUE;
+}
+
+void fs_close(struct open_file *of)
+{
+    if (of->page_map) free((void *) of->page_map);
+    of->page_map = NULL;
+    of->num_pages = 0;
+}
+
+/* Builds the page map of the open file `of` (if not built yet),
+ * walking the chain of pages from the leader page. The number of
+ * pages in the file index (when available) gives the initial size.
+ * Returns TRUE on success.
+ */
+static
+int build_page_map(const struct fs *fs, struct open_file *of)
+{
+    const struct page *pg;
+    uint16_t *map;
+    uint32_t i, capacity;
+    uint16_t vda, pgnum;
+
+    if (of->page_map) return TRUE;
+
+    capacity = 16;
+    if (fs->index->valid) {
+        i = fs->index->leaders[of->fe.leader_vda];
+        if (i != INDEX_NONE && fs->index->entries[i].num_pages > 0)
+            capacity = fs->index->entries[i].num_pages;
+    }
+
+    of->page_map = (uint16_t *) malloc(capacity * sizeof(uint16_t));
+    if (unlikely(!of->page_map)) goto error_mem;
+
+    vda = of->fe.leader_vda;
+    for (pgnum = 0; vda != 0; pgnum++) {
+        if (vda >= fs->length || pgnum >= fs->length) {
+            report_error("fs: seek: broken chain of pages");
+            fs_close(of);
+            return FALSE;
+        }
+
+        pg = get_page_label(fs, vda);
+        if (pg->label.file_pgnum != pgnum) {
+            report_error("fs: seek: inconsistent page numbers");
+            fs_close(of);
+            return FALSE;
+        }
+
+        if (pgnum == capacity) {
+            capacity *= 2;
+            map = (uint16_t *)
+                realloc(of->page_map, capacity * sizeof(uint16_t));
+            if (unlikely(!map)) goto error_mem;
+            of->page_map = map;
+        }
+        of->page_map[pgnum] = vda;
+
+        if (!real_to_virtual(fs, pg->label.next_rda, &vda)) {
+            report_error("fs: seek: could not convert real "
+                         "to virtual disk address");
+            fs_close(of);
+            return FALSE;
+        }
+    }
+
+    of->num_pages = pgnum;
+    return TRUE;
+
+error_mem:
+    report_error("fs: seek: memory exhausted");
+    fs_close(of);
+    return FALSE;
+}
+
+int fs_seek(const struct fs *fs, struct open_file *of, size_t offset)
+{
+    const struct page *pg;
+    size_t pgnum, pos;
+
+    if (of->error) {
+        report_error("fs: seek: error on file");
+        return FALSE;
+    }
+
+    if (!build_page_map(fs, of)) return FALSE;
+
+    /* All the pages except the last one are full. */
+    pgnum = offset / PAGE_DATA_SIZE + 1;
+    pos = offset % PAGE_DATA_SIZE;
+    if (pgnum == of->num_pages && pos == 0 && pgnum > 1) {
+        /* At the end of the last page. */
+        pgnum--;
+        pos = PAGE_DATA_SIZE;
+    }
+
+    if (pgnum >= of->num_pages) return FALSE;
+
+    pg = get_page_label(fs, of->page_map[pgnum]);
+    if (pos > pg->label.nbytes) return FALSE;
+
+    of->pos.vda = of->page_map[pgnum];
+    of->pos.pgnum = (uint16_t) pgnum;
+    of->pos.pos = (uint16_t) pos;
+    return TRUE;
+}
+
+size_t fs_read(const struct fs *fs, struct open_file *of,
+               uint8_t *dst, size_t len)
+{
+    const struct page *pg;
+    uint16_t vda, rda, nbytes;
+    size_t pos;
+
+    if (of->error) {
+        report_error("fs: read: error on file");
+        return FALSE;
+    }
+
+    pos = 0;
+    while (len > 0) {
+        vda = of->pos.vda;
+
+        /* Checks if reached the end of the file. */
+        if (vda == 0) break;
+        if (vda >= fs->length) {
+            of->error = TRUE;
+            report_error("fs: read: invalid VDA: %u", vda);
+            break;
+        }
+
+        pg = (dst) ? get_page(fs, vda) : get_page_label(fs, vda);
+        COUNT_STAT(fs, pages_read);
+
+        /* Sanity check. */
+        if (pg->label.file_pgnum != of->pos.pgnum) {
+            of->error = TRUE;
+            report_error("fs: read: inconsistent page numbers");
+            break;
+        }
+
+        /* Another sanity check. */
+        if (of->pos.pos > pg->label.nbytes) {
+            of->error = TRUE;
+            report_error("fs: read: inconsistent offset in page");
+            break;
+        }
+
+        /* If has not reached the end of the page. */
+        if (of->pos.pos < pg->label.nbytes) {
+            nbytes = pg->label.nbytes - of->pos.pos;
+            if (nbytes > len) nbytes = len;
+
+            if (dst) {
+                memcpy(&dst[pos], &pg->data[of->pos.pos],
+                       nbytes);
+            }
+
+            of->pos.pos += nbytes;
+            pos += nbytes;
+            len -= nbytes;
+            continue;
+        }
+
+        /* Go to the next page. */
+        rda = pg->label.next_rda;
+        if (!real_to_virtual(fs, rda, &of->pos.vda)) {
+            of->error = TRUE;
+            report_error("fs: read: could not convert real "
+                         "to virtual disk address");
+            break;
+        }
+
+        /* If there is a valid next page. */
+        if (of->pos.vda != 0) {
+            of->pos.pos = 0;
+            of->pos.pgnum += 1;
+            continue;
+        }
+
+        /* Reached the end of file. */
+        of->pos.pgnum = 0;
+    }
+
+    return pos;
+}
+
+size_t fs_read_spans(const struct fs *fs, struct open_file *of,
+                     struct file_span *spans, size_t max_spans)
+{
+    const struct page *pg;
+    uint16_t vda, rda;
+    size_t count;
+
+    if (of->error) {
+        report_error("fs: read_spans: error on file");
+        return 0;
+    }
+
+    count = 0;
+    while (count < max_spans) {
+        vda = of->pos.vda;
+
+        /* Checks if reached the end of the file. */
+        if (vda == 0) break;
+        if (vda >= fs->length) {
+            of->error = TRUE;
+            report_error("fs: read_spans: invalid VDA: %u", vda);
+            break;
+        }
+
+        pg = get_page(fs, vda);
+        COUNT_STAT(fs, pages_read);
+
+        /* Sanity check. */
+        if (pg->label.file_pgnum != of->pos.pgnum) {
+            of->error = TRUE;
+            report_error("fs: read_spans: inconsistent page numbers");
+            break;
+        }
+
+        /* Another sanity check. */
+        if (of->pos.pos > pg->label.nbytes) {
+            of->error = TRUE;
+            report_error("fs: read_spans: inconsistent offset in page");
+            break;
+        }
+
+        /* Take the rest of the page. */
+        if (of->pos.pos < pg->label.nbytes) {
+            spans[count].data = &pg->data[of->pos.pos];
+            spans[count].length = pg->label.nbytes - of->pos.pos;
+            count++;
+
+            of->pos.pos = pg->label.nbytes;
+            continue;
+        }
+
+        /* Go to the next page. */
+        rda = pg->label.next_rda;
+        if (!real_to_virtual(fs, rda, &of->pos.vda)) {
+            of->error = TRUE;
+            report_error("fs: read_spans: could not convert real "
+                         "to virtual disk address");
+            break;
+        }
+
+        /* If there is a valid next page. */
+        if (of->pos.vda != 0) {
+            of->pos.pos = 0;
+            of->pos.pgnum += 1;
+            continue;
+        }
+
+        /* Reached the end of file. */
+        of->pos.pgnum = 0;
+    }
+
+    return count;
+}
+
+/* Builds the bitmap of free pages (if not built yet).
+ * Note that the VDA 0 is never considered free, since it is used
+ * to mark the end of the files.
+ * Returns TRUE on success.
+ */
+static
+int build_free_map(struct fs *fs)
+{
+    unsigned int mask;
+    size_t size;
+    uint16_t vda;
+
+    if (fs->free_map) return TRUE;
+
+    size = (((size_t) fs->length) + FREE_MAP_BITS - 1) / FREE_MAP_BITS;
+    if (!build_label_table(fs)) return FALSE;
+    fs->free_map = fs->storage->free_map;
+    memset(fs->free_map, 0, size * sizeof(unsigned long));
+
+    /* The extra entries of the label table are never free. */
+    for (vda = 0; vda < fs->length; vda += LABEL_GROUP) {
+        mask = label_mask(fs->labels->version, vda, VERSION_FREE);
+        while (mask != 0) {
+            mark_page_free(fs, vda + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+    return TRUE;
+}
+
+/* Marks the page at `vda` as free in the bitmap of free pages. */
+static
+void mark_page_free(struct fs *fs, uint16_t vda)
+{
+    if (!fs->free_map || vda == 0) return;
+    fs->free_map[vda / FREE_MAP_BITS] |= 1UL << (vda % FREE_MAP_BITS);
+}
+
+/* Marks the page at `vda` as used in the bitmap of free pages. */
+static
+void mark_page_used(struct fs *fs, uint16_t vda)
+{
+    if (!fs->free_map) return;
+    fs->free_map[vda / FREE_MAP_BITS] &= ~(1UL << (vda % FREE_MAP_BITS));
+}
+
+/* Finds the first free page in the bitmap of free pages within
+ * the range of virtual disk addresses [`start`, `end`).
+ * The virtual disk address is returned in `free_vda`.
+ * Returns TRUE if a free page was found.
+ */
+static
+int scan_free_map(const struct fs *fs, uint16_t start, uint16_t end,
+                  uint16_t *free_vda)
+{
+    unsigned long w;
+    size_t i, last, vda;
+
+    if (start >= end) return FALSE;
+
+    i = start / FREE_MAP_BITS;
+    last = (((size_t) end) - 1) / FREE_MAP_BITS;
+    w = fs->free_map[i] & (~0UL << (start % FREE_MAP_BITS));
+    while (TRUE) {
+        COUNT_STAT(fs, free_probes);
+        if (w != 0) {
+            vda = i * FREE_MAP_BITS + ((size_t) __builtin_ctzl(w));
+            if (vda >= end) return FALSE;
+            *free_vda = (uint16_t) vda;
+            return TRUE;
+        }
+        if (++i > last) return FALSE;
+        w = fs->free_map[i];
+    }
+}
+
+/* Finds a free page within the filesystem.
+ * To keep the files contiguous, the search starts right after the
+ * page `near_vda` and prefers the pages in the same cylinder,
+ * similarly to the allocator of the Alto.
+ * The virtual disk address is returned in `free_vda`.
+ * Returns TRUE on success.
+ */
+static
+int find_free_page(struct fs *fs, uint16_t near_vda, uint16_t *free_vda)
+{
+    uint16_t cyl_pages, cyl_start, cyl_end;
+
+    if (!build_free_map(fs)) return FALSE;
+    if (near_vda >= fs->length) near_vda = 0;
+
+    cyl_pages = fs->dg.num_heads * fs->dg.num_sectors;
+    cyl_start = (near_vda / cyl_pages) * cyl_pages;
+    cyl_end = MIN(cyl_start + cyl_pages, fs->length);
+
+    if (scan_free_map(fs, near_vda + 1, cyl_end, free_vda)) return TRUE;
+    if (scan_free_map(fs, cyl_start, near_vda, free_vda)) return TRUE;
+    if (scan_free_map(fs, cyl_end, fs->length, free_vda)) return TRUE;
+    if (scan_free_map(fs, 0, cyl_start, free_vda)) return TRUE;
+    return FALSE;
+}
+
+/* Finds a run of `count` consecutive free pages within the range of
+ * virtual disk addresses [`start`, `end`).
+ * The first page of the run is returned in `first_vda`.
+ * Returns TRUE if such run was found.
+ */
+static
+int find_free_run(const struct fs *fs, uint16_t start, uint16_t end,
+                  uint16_t count, uint16_t *first_vda)
+{
+    uint16_t vda, run, next;
+
+    while (scan_free_map(fs, start, end, &vda)) {
+        for (run = 1; run < count && vda + run < end; run++) {
+            next = vda + run;
+            if (!(fs->free_map[next / FREE_MAP_BITS]
+                  & (1UL << (next % FREE_MAP_BITS)))) break;
+        }
+
+        if (run == count) {
+            *first_vda = vda;
+            return TRUE;
+        }
+        start = vda + run;
+    }
+    return FALSE;
+}
+
+/* Allocates `count` free pages at once, marking them as used.
+ * A contiguous run of pages after `near_vda` is preferred, otherwise
+ * the pages are taken one by one, each close to the previous one.
+ * The virtual disk addresses are returned in `vdas`.
+ * Returns TRUE on success.
+ */
+static
+int allocate_pages(struct fs *fs, uint16_t near_vda, uint16_t count,
+                   uint16_t *vdas)
+{
+    uint16_t i, vda;
+
+    if (count == 0) return TRUE;
+    if (!build_free_map(fs)) return FALSE;
+    if (near_vda >= fs->length) near_vda = 0;
+
+    if (find_free_run(fs, near_vda + 1, fs->length, count, &vda)
+        || find_free_run(fs, 1, near_vda, count, &vda)) {
+        for (i = 0; i < count; i++) {
+            vdas[i] = vda + i;
+            mark_page_used(fs, vda + i);
+        }
+        return TRUE;
+    }
+
+    vda = near_vda;
+    for (i = 0; i < count; i++) {
+        if (!find_free_page(fs, vda, &vda)) {
+            /* Give back the pages taken so far. */
+            while (i-- > 0) mark_page_free(fs, vdas[i]);
+            report_error("fs: allocate_pages: disk full");
+            return FALSE;
+        }
+        vdas[i] = vda;
+        mark_page_used(fs, vda);
+    }
+    return TRUE;
+}
+
+size_t fs_write(struct fs *fs, struct open_file *of,
+                const uint8_t *src, size_t len, int extend)
+{
+    struct page *pg, *new_pg;
+    uint16_t vda, rda, nbytes;
+    size_t pos;
+
+    if (of->error) {
+        report_error("fs: write: error on file");
+        return FALSE;
+    }
+
+    mark_modified(fs);
+
+    pos = 0;
+    while (len > 0) {
+        vda = of->pos.vda;
+
+        /* Checks if reached the end of the file. */
+        if (vda == 0) break;
+        if (vda >= fs->length) {
+            of->error = TRUE;
+            report_error("fs: write: invalid VDA: %u", vda);
+            break;
+        }
+
+        pg = get_page(fs, vda);
+        COUNT_STAT(fs, pages_written);
+
+        /* Sanity check. */
+        if (pg->label.file_pgnum != of->pos.pgnum) {
+            of->error = TRUE;
+            report_error("fs: write: inconsistent page numbers");
+            break;
+        }
+
+        /* Another sanity check. */
+        if (of->pos.pos > pg->label.nbytes) {
+            of->error = TRUE;
+            report_error("fs: write: inconsistent offset in page");
+            break;
+        }
+
+        /* If has not reached the end of the page. */
+        if (of->pos.pos < pg->label.nbytes) {
+            nbytes = pg->label.nbytes - of->pos.pos;
+            if (nbytes > len) nbytes = len;
+
+            if (src) {
+                memcpy(&pg->data[of->pos.pos], &src[pos], nbytes);
+                mark_page_dirty(fs, vda);
+            }
+
+            of->pos.pos += nbytes;
+            pos += nbytes;
+            len -= nbytes;
+            continue;
+        }
+
+        /* Go to the next page. */
+        rda = pg->label.next_rda;
+        if (!real_to_virtual(fs, rda, &of->pos.vda)) {
+            of->error = TRUE;
+            report_error("fs: write: could not convert real "
+                         "to virtual disk address");
+            break;
+        }
+
+
+        /* If there is a valid next page. */
+        if (of->pos.vda != 0) {
+            of->pos.pos = 0;
+            of->pos.pgnum += 1;
+            continue;
+        }
+
+        if (!extend) break;
+
+        /* Check if the last page can be extended. */
+        of->pos.vda = vda;
+        if (pg->label.nbytes < PAGE_DATA_SIZE) {
+            nbytes = PAGE_DATA_SIZE - pg->label.nbytes;
+            if (nbytes > len) nbytes = len;
+
+            pg->label.nbytes += nbytes;
+            mark_page_dirty(fs, vda);
+            update_label(fs, vda);
+            continue;
+        }
+
+        /* Otherwise, allocate a new page. */
+        if (!find_free_page(fs, pg->page_vda, &vda)) {
+            of->error = TRUE;
+            report_error("fs: write: disk full");
+            break;
+        }
+
+        new_pg = get_page(fs, vda);
+        fs_close(of);
+        mark_page_used(fs, vda);
+        mark_page_dirty(fs, vda);
+        mark_page_dirty(fs, pg->page_vda);
+
+        if (!virtual_to_real(fs, pg->page_vda, &new_pg->label.prev_rda)) {
+            update_label(fs, new_pg->page_vda);
+            of->error = TRUE;
+            report_error("fs: write: could not convert virtual "
+                         "to real disk address");
+            break;
+        }
+
+        if (!virtual_to_real(fs, new_pg->page_vda, &pg->label.next_rda)) {
+            update_label(fs, pg->page_vda);
+            update_label(fs, new_pg->page_vda);
+            of->error = TRUE;
+            report_error("fs: write: could not convert virtual "
+                         "to real disk address");
+            break;
+        }
+
+        nbytes = len;
+        if (nbytes > PAGE_DATA_SIZE)
+            nbytes = PAGE_DATA_SIZE;
+
+        new_pg->label.next_rda = 0;
+        new_pg->label.nbytes = nbytes;
+        new_pg->label.file_pgnum = pg->label.file_pgnum + 1;
+        new_pg->label.version = pg->label.version;
+        new_pg->label.sn = pg->label.sn;
+        update_label(fs, pg->page_vda);
+        update_label(fs, new_pg->page_vda);
+    }
+
+    return pos;
+}
+
+int fs_trim(struct fs *fs, struct open_file *of)
+{
+    struct page *pg;
+    uint16_t vda, rda;
+    int should_keep;
+
+    if (of->error) {
+        report_error("fs: trim: error on file");
+        return FALSE;
+    }
+
+    mark_modified(fs);
+    fs_close(of);
+
+    should_keep = TRUE;
+    vda = of->pos.vda;
+    while (vda != 0) {
+        if (vda >= fs->length) {
+            of->error = TRUE;
+            report_error("fs: trim: invalid VDA: %u", vda);
+            break;
+        }
+
+        pg = get_page_label(fs, vda);
+        rda = pg->label.next_rda;
+        mark_page_dirty(fs, vda);
+
+        if (!should_keep) {
+            /* Remove the page. */
+            pg->label.version = VERSION_FREE;
+            pg->label.prev_rda = 0;
+            pg->label.next_rda = 0;
+            mark_page_free(fs, vda);
+        }
+
+        if (vda == of->pos.vda) {
+            pg->label.nbytes = of->pos.pos;
+            /* If the current page is full, keep the next page. */
+            if (pg->label.nbytes != PAGE_DATA_SIZE) {
+                pg->label.next_rda = 0;
+                should_keep = FALSE;
+            }
+        } else if (should_keep) {
+            /* Set nbytes to zero in the page after the current. */
+            pg->label.nbytes = 0;
+            pg->label.next_rda = 0;
+            should_keep = FALSE;
+        }
+        update_label(fs, vda);
+
+        /* Go to the next page. */
+        if (!real_to_virtual(fs, rda, &vda)) {
+            of->error = TRUE;
+            report_error("fs: trim: could not convert real "
+                         "to virtual disk address");
+            break;
+        }
+    }
+
+    return TRUE;
+}
+
+int fs_extract_file_fd(const struct fs *fs, const struct file_entry *fe,
+                       int fd)
+{
+    struct file_span spans[EXTRACT_SPANS];
+    struct iovec iov[EXTRACT_SPANS];
+    struct open_file of;
+    size_t i, count;
+
+    if (!fs_open(fs, fe, &of, FALSE)) {
+        report_error("fs: extract_file: could not open filesystem file");
+        return FALSE;
+    }
+
+    /* Write the page data directly, many pages at a time. */
+    while (TRUE) {
+        count = fs_read_spans(fs, &of, spans, EXTRACT_SPANS);
+        if (of.error) {
+            report_error("fs: extract_file: error while reading");
+            return FALSE;
+        }
+        if (count == 0) break;
+
+        for (i = 0; i < count; i++) {
+            iov[i].iov_base = (void *) spans[i].data;
+            iov[i].iov_len = spans[i].length;
+        }
+
+        if (!write_iovecs(fd, iov, (int) count)) {
+            report_error("fs: extract_file: error while writing");
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+int fs_extract_file(const struct fs *fs, const struct file_entry *fe,
+                    const char *output_filename)
+{
+    int fd;
+
+    fd = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        report_error("fs: extract_file: could not open `%s` "
+                     "for writing", output_filename);
+        return FALSE;
+    }
+
+    if (!fs_extract_file_fd(fs, fe, fd)) {
+        report_error("fs: extract_file: could not extract to `%s`",
+                     output_filename);
+        close(fd);
+        return FALSE;
+    }
+
+    if (close(fd) != 0) {
+        report_error("fs: extract_file: error while writing "
+                     "`%s`", output_filename);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Auxiliary function to fs_replace_file().
+ * Maps the host file named `filename` in memory, or reads it whole
+ * if it cannot be mapped (for example, a pipe).
+ * Returns TRUE on success.
+ */
+static
+int open_host_file(struct host_file *hf, const char *filename)
+{
+    struct stat st;
+    uint8_t *data;
+    size_t capacity;
+    ssize_t ret;
+    void *ptr;
+    int fd;
+
+    hf->data = NULL;
+    hf->size = 0;
+    hf->mapped = FALSE;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        report_error("fs: open_host_file: could not open `%s`",
+                     filename);
+        return FALSE;
+    }
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        hf->size = (size_t) st.st_size;
+        if (hf->size == 0) {
+            close(fd);
+            return TRUE;
+        }
+
+        ptr = mmap(NULL, hf->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr != MAP_FAILED) {
+            hf->data = (const uint8_t *) ptr;
+            hf->mapped = TRUE;
+            close(fd);
+            return TRUE;
+        }
+        hf->size = 0;
+    }
+
+    /* Read the file in large blocks. */
+    capacity = 0;
+    data = NULL;
+    while (TRUE) {
+        if (hf->size == capacity) {
+            capacity = MAX(2 * capacity, HOST_FILE_BLOCK);
+            ptr = realloc(data, capacity);
+            if (unlikely(!ptr)) {
+                report_error("fs: open_host_file: memory exhausted");
+                goto error;
+            }
+            data = (uint8_t *) ptr;
+        }
+
+        ret = read(fd, &data[hf->size], capacity - hf->size);
+        if (ret < 0) {
+            report_error("fs: open_host_file: error while reading `%s`",
+                         filename);
+            goto error;
+        }
+        if (ret == 0) break;
+        hf->size += (size_t) ret;
+    }
+
+    hf->data = data;
+    close(fd);
+    return TRUE;
+
+error:
+    if (data) free((void *) data);
+    hf->size = 0;
+    close(fd);
+    return FALSE;
+}
+
+/* Releases the contents of the host file `hf`. */
+static
+void close_host_file(struct host_file *hf)
+{
+    if (hf->mapped) {
+        munmap((void *) hf->data, hf->size);
+    } else if (hf->data) {
+        free((void *) hf->data);
+    }
+    hf->data = NULL;
+    hf->size = 0;
+    hf->mapped = FALSE;
+}
+
+/* Auxiliary function to fs_replace_file().
+ * Replaces the contents of the file `fe` with the `len` bytes in
+ * `src`. The pages of the file are reused, and all missing pages are
+ * allocated at once (contiguously, if possible). The data is copied
+ * straight into the pages, and the last page hint is updated.
+ * Returns TRUE on success.
+ */
+static
+int write_file_contents(struct fs *fs, const struct file_entry *fe,
+                        const uint8_t *src, size_t len)
+{
+    struct page *leader_pg, *pg;
+    uint16_t *vdas;
+    uint16_t vda, rda, num_pages, num_existing, i, nbytes;
+
+    if (fe->leader_vda >= fs->length) {
+        report_error("fs: replace_file: invalid VDA: %u", fe->leader_vda);
+        return FALSE;
+    }
+
+    /* The last page is never full (as in the Alto). */
+    if (len / PAGE_DATA_SIZE + 1 >= fs->length) {
+        report_error("fs: replace_file: disk full");
+        return FALSE;
+    }
+    num_pages = (uint16_t) (len / PAGE_DATA_SIZE + 1);
+
+    leader_pg = get_page(fs, fe->leader_vda);
+    if (leader_pg->label.version != fe->version
+        || leader_pg->label.sn.word1 != fe->sn.word1
+        || leader_pg->label.sn.word2 != fe->sn.word2) {
+        report_error("fs: replace_file: invalid leader page at VDA = %u",
+                     fe->leader_vda);
+        return FALSE;
+    }
+
+    vdas = (uint16_t *) malloc(fs->length * sizeof(uint16_t));
+    if (unlikely(!vdas)) {
+        report_error("fs: replace_file: memory exhausted");
+        return FALSE;
+    }
+
+    /* Collect the existing pages of the file. */
+    num_existing = 0;
+    rda = leader_pg->label.next_rda;
+    while (rda != 0) {
+        if (!real_to_virtual(fs, rda, &vda) || vda == 0
+            || num_existing + 1 >= fs->length) {
+            report_error("fs: replace_file: broken file chain");
+            free((void *) vdas);
+            return FALSE;
+        }
+
+        vdas[num_existing++] = vda;
+        rda = get_page_label(fs, vda)->label.next_rda;
+    }
+
+    mark_modified(fs);
+    if (num_pages > num_existing) {
+        vda = (num_existing > 0) ? vdas[num_existing - 1] : fe->leader_vda;
+        if (!allocate_pages(fs, vda, num_pages - num_existing,
+                            &vdas[num_existing])) {
+            free((void *) vdas);
+            return FALSE;
+        }
+    }
+
+    /* Release the pages that are no longer needed. */
+    for (i = num_pages; i < num_existing; i++) {
+        pg = get_page_label(fs, vdas[i]);
+        pg->label.version = VERSION_FREE;
+        pg->label.prev_rda = 0;
+        pg->label.next_rda = 0;
+        mark_page_free(fs, vdas[i]);
+        mark_page_dirty(fs, vdas[i]);
+        update_label(fs, vdas[i]);
+    }
+
+    for (i = 0; i < num_pages; i++) {
+        pg = get_page_for_write(fs, vdas[i]);
+
+        nbytes = PAGE_DATA_SIZE;
+        if (i + 1 == num_pages)
+            nbytes = (uint16_t) (len - ((size_t) i) * PAGE_DATA_SIZE);
+
+        if (nbytes > 0)
+            memcpy(pg->data, &src[((size_t) i) * PAGE_DATA_SIZE], nbytes);
+        memset(&pg->data[nbytes], 0, PAGE_DATA_SIZE - nbytes);
+
+        virtual_to_real(fs, (i > 0) ? vdas[i - 1] : fe->leader_vda,
+                        &pg->label.prev_rda);
+        pg->label.next_rda = 0;
+        if (i + 1 < num_pages)
+            virtual_to_real(fs, vdas[i + 1], &pg->label.next_rda);
+
+        pg->label.nbytes = nbytes;
+        pg->label.file_pgnum = i + 1;
+        pg->label.version = fe->version;
+        pg->label.sn = fe->sn;
+        mark_page_dirty(fs, vdas[i]);
+        update_label(fs, vdas[i]);
+    }
+
+    virtual_to_real(fs, vdas[0], &leader_pg->label.next_rda);
+    write_word_bs(leader_pg->data, LEADER_LASTPAGEHINT,
+                  vdas[num_pages - 1]);
+    write_word_bs(leader_pg->data, LEADER_LASTPAGEHINT + 2, num_pages);
+    write_word_bs(leader_pg->data, LEADER_LASTPAGEHINT + 4, nbytes);
+    mark_page_dirty(fs, fe->leader_vda);
+    update_label(fs, fe->leader_vda);
+
+    free((void *) vdas);
+    return TRUE;
+}
+
+int fs_replace_file(struct fs *fs, const struct file_entry *fe,
+                    const char *input_filename)
+{
+    struct host_file hf;
+    int ret;
+
+    if (!open_host_file(&hf, input_filename)) {
+        report_error("fs: replace_file: could not read `%s`",
+                     input_filename);
+        return FALSE;
+    }
+
+    ret = write_file_contents(fs, fe, hf.data, hf.size);
+    close_host_file(&hf);
+
+    if (!ret) {
+        report_error("fs: replace_file: error while writing");
+        return FALSE;
+    }
+
+    /* The file may have grown or shrunk. */
+    return update_disk_descriptor(fs, NULL);
+}
+
+int fs_file_entry(const struct fs *fs, uint16_t leader_vda,
+                  struct file_entry *fe)
+{
+    const struct page *pg;
+
+    if (leader_vda >= fs->length) {
+        report_error("fs: file_entry: invalid VDA: %u",
+                     leader_vda);
+        return FALSE;
+    }
+
+    pg = get_page_label(fs, leader_vda);
+    fe->sn = pg->label.sn;
+    fe->version = pg->label.version;
+    fe->blank = 0;
+    fe->leader_vda = leader_vda;
+    return TRUE;
+}
+
+/* Discards the file index `idx` (its memory belongs to the storage
+ * of the filesystem, and it is reused when the index is rebuilt).
+ */
+static
+void release_index(struct file_index *idx)
+{
+    idx->entries = NULL;
+    idx->leaders = NULL;
+    idx->sn_buckets = NULL;
+    idx->name_buckets = NULL;
+
+    idx->num_entries = 0;
+    idx->num_buckets = 0;
+    idx->valid = FALSE;
+}
+
+/* Computes the hash of the serial number `sn`.
+ * Returns the hash value.
+ */
+static
+uint32_t hash_sn(const struct serial_number *sn)
+{
+    uint32_t h;
+
+    h = (((uint32_t) sn->word1) << 16) | sn->word2;
+    h *= 0x9E3779B1U;
+    return h ^ (h >> 15);
+}
+
+/* Computes the hash of the NUL-terminated string `name`.
+ * Returns the hash value.
+ */
+static
+uint32_t hash_name(const char *name)
+{
+    uint32_t h;
+
+    /* FNV-1a hash. */
+    h = 2166136261U;
+    while (*name) {
+        h ^= (uint8_t) *name++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/* Finds the entry of the file index `idx` for the file with
+ * serial number `sn` and version `version`.
+ * Returns the entry, or NULL if not found.
+ */
+static
+struct index_entry *index_find_sn(const struct file_index *idx,
+                                  const struct serial_number *sn,
+                                  uint16_t version)
+{
+    struct index_entry *e;
+    uint32_t i;
+
+    i = idx->sn_buckets[hash_sn(sn) & (idx->num_buckets - 1)];
+    while (i != INDEX_NONE) {
+        e = &idx->entries[i];
+        if (e->fe.sn.word1 == sn->word1 && e->fe.sn.word2 == sn->word2
+            && e->fe.version == version)
+            return e;
+        i = e->next_sn;
+    }
+    return NULL;
+}
+
+/* Builds the file index (if not built yet) in a single pass over
+ * the labels of the pages.
+ * Returns TRUE on success.
+ */
+static
+int build_index(const struct fs *fs)
+{
+    struct file_index *idx;
+    struct index_entry *e;
+    struct index_tail *tails, *t;
+    const struct label_table *lt;
+    const uint8_t *data;
+    uint32_t i, num_tails, h;
+    unsigned int mask;
+    uint16_t vda, group;
+
+    idx = fs->index;
+    if (idx->valid) return TRUE;
+    release_index(idx);
+
+    if (!build_label_table(fs)) return FALSE;
+    lt = fs->labels;
+
+    /* There is at most one entry (and one last page) per page. */
+    idx->entries = fs->storage->entries;
+    idx->leaders = fs->storage->leaders;
+    tails = fs->storage->tails;
+    for (vda = 0; vda < fs->length; vda++)
+        idx->leaders[vda] = INDEX_NONE;
+
+    num_tails = 0;
+    for (group = 0; group < fs->length; group += LABEL_GROUP) {
+        /* Only the leader pages and the last pages are relevant. */
+        mask = used_label_mask(fs, group)
+            & (label_mask(lt->file_pgnum, group, 0)
+               | label_mask(lt->next_rda, group, 0));
+
+        for (; mask != 0; mask &= mask - 1) {
+            vda = group + __builtin_ctz(mask);
+            if (lt->file_pgnum[vda] == 0) {
+                idx->leaders[vda] = idx->num_entries;
+                e = &idx->entries[idx->num_entries++];
+                e->fe.sn.word1 = lt->sn_word1[vda];
+                e->fe.sn.word2 = lt->sn_word2[vda];
+                e->fe.version = lt->version[vda];
+                e->fe.blank = 0;
+                e->fe.leader_vda = vda;
+
+                data = get_page(fs, vda)->data;
+                copy_name(e->filename,
+                          (const char *) &data[LEADER_FILENAME]);
+                e->num_pages = 0;
+                e->last_nbytes = 0;
+                e->ambiguous = FALSE;
             }
 
-            if (other_pg->label.sn.word1 != pg->label.sn.word1
-                || other_pg->label.sn.word2 != pg->label.sn.word2) {
-                report_error("fs: check_integrity: "
-                             "differing file serial numbers (backwards) "
-                             "at VDA = %u", vda);
-                success = FALSE;
-                continue;
+            if (lt->next_rda[vda] == 0) {
+                t = &tails[num_tails++];
+                t->sn.word1 = lt->sn_word1[vda];
+                t->sn.word2 = lt->sn_word2[vda];
+                t->version = lt->version[vda];
+                t->file_pgnum = lt->file_pgnum[vda];
+                t->nbytes = lt->nbytes[vda];
+            }
+        }
+    }
+
+    idx->num_buckets = index_buckets(idx->num_entries);
+    idx->sn_buckets = fs->storage->sn_buckets;
+    idx->name_buckets = fs->storage->name_buckets;
+
+    for (i = 0; i < idx->num_buckets; i++) {
+        idx->sn_buckets[i] = INDEX_NONE;
+        idx->name_buckets[i] = INDEX_NONE;
+    }
+
+    /* Insert in reverse order so that the chains are sorted by VDA. */
+    for (i = idx->num_entries; i-- > 0;) {
+        e = &idx->entries[i];
+        h = hash_sn(&e->fe.sn) & (idx->num_buckets - 1);
+        e->next_sn = idx->sn_buckets[h];
+        idx->sn_buckets[h] = i;
+
+        h = hash_name(e->filename) & (idx->num_buckets - 1);
+        e->next_name = idx->name_buckets[h];
+        idx->name_buckets[h] = i;
+    }
+
+    /* Now associate the last pages to the files. */
+    for (i = 0; i < num_tails; i++) {
+        t = &tails[i];
+        e = index_find_sn(idx, &t->sn, t->version);
+        if (!e || e->ambiguous) continue;
+
+        if (e->num_pages != 0) {
+            e->num_pages = 0;
+            e->ambiguous = TRUE;
+            continue;
+        }
+
+        e->num_pages = t->file_pgnum + 1;
+        e->last_nbytes = t->nbytes;
+    }
+
+    idx->valid = TRUE;
+    return TRUE;
+}
+
+int fs_find_serial_number(const struct fs *fs,
+                          const struct serial_number *sn,
+                          struct file_entry *fe)
+{
+    const struct file_index *idx;
+    const struct index_entry *e;
+    uint32_t i;
+
+    if (!build_index(fs)) {
+        report_error("fs: find_serial_number: could not build index");
+        return FALSE;
+    }
+
+    idx = fs->index;
+    i = idx->sn_buckets[hash_sn(sn) & (idx->num_buckets - 1)];
+    while (i != INDEX_NONE) {
+        e = &idx->entries[i];
+        if (e->fe.sn.word1 == sn->word1 && e->fe.sn.word2 == sn->word2) {
+            *fe = e->fe;
+            return TRUE;
+        }
+        i = e->next_sn;
+    }
+    return FALSE;
+}
+
+/* Auxiliary function to fs_file_length().
+ * Obtains the length of the file `fe` from the file index.
+ * Returns TRUE if the length is known.
+ */
+static
+int indexed_file_length(const struct fs *fs, const struct file_entry *fe,
+                        size_t *length)
+{
+    const struct index_entry *e;
+    uint32_t i;
+
+    if (!build_index(fs)) return FALSE;
+    if (fe->leader_vda >= fs->length) return FALSE;
+
+    i = fs->index->leaders[fe->leader_vda];
+    if (i == INDEX_NONE) return FALSE;
+
+    e = &fs->index->entries[i];
+    if (e->num_pages == 0
+        || e->fe.version != fe->version
+        || e->fe.sn.word1 != fe->sn.word1
+        || e->fe.sn.word2 != fe->sn.word2)
+        return FALSE;
+
+    /* All the pages except the leader and the last one are full. */
+    if (e->num_pages == 1) {
+        *length = 0;
+    } else {
+        *length = ((size_t) e->num_pages - 2) * PAGE_DATA_SIZE
+            + e->last_nbytes;
+    }
+    return TRUE;
+}
+
+/* Auxiliary function to fs_file_length().
+ * Computes the length of the file `fe` from its last page hint in
+ * the leader page. The hint is only used if it is consistent with
+ * the label of the hinted page.
+ * Returns TRUE if the hint is valid.
+ */
+static
+int hinted_file_length(const struct fs *fs, const struct file_entry *fe,
+                       size_t *length)
+{
+    const struct page *pg;
+    struct file_info finfo;
+    const struct file_position *last;
+
+    if (!fs_file_info(fs, fe, &finfo)) return FALSE;
+
+    last = &finfo.last_page;
+    if (last->vda >= fs->length || last->pgnum == 0) return FALSE;
+
+    pg = get_page_label(fs, last->vda);
+    if (pg->label.file_pgnum != last->pgnum
+        || pg->label.next_rda != 0
+        || pg->label.nbytes != last->pos
+        || pg->label.version != fe->version
+        || pg->label.sn.word1 != fe->sn.word1
+        || pg->label.sn.word2 != fe->sn.word2)
+        return FALSE;
+
+    /* All the other pages (except the leader) are full. */
+    *length = ((size_t) last->pgnum - 1) * PAGE_DATA_SIZE + last->pos;
+    return TRUE;
+}
+
+int fs_file_length(const struct fs *fs, const struct file_entry *fe,
+                   int strict, size_t *length)
+{
+    struct open_file of;
+    size_t l, nbytes;
+
+    if (!strict) {
+        if (hinted_file_length(fs, fe, length)) return TRUE;
+        if (indexed_file_length(fs, fe, length)) return TRUE;
+    }
+
+    if (!fs_open(fs, fe, &of, FALSE)) {
+        report_error("fs: file_length: could not open filesystem file");
+        return FALSE;
+    }
+
+    l = 0;
+    while (TRUE) {
+        nbytes = fs_read(fs, &of, NULL, PAGE_DATA_SIZE);
+        if (of.error) {
+            report_error("fs: file_length: error while reading");
+            return FALSE;
+        }
+
+        l += nbytes;
+        if (nbytes != PAGE_DATA_SIZE) break;
+    }
+
+    *length = l;
+    return TRUE;
+}
+
+int fs_file_info(const struct fs *fs, const struct file_entry *fe,
+                 struct file_info *finfo)
+{
+    const struct page *pg;
+
+    if (fe->leader_vda >= fs->length) {
+        report_error("fs: file_info: invalid VDA: %u",
+                     fe->leader_vda);
+        return FALSE;
+    }
+
+    pg = get_page(fs, fe->leader_vda);
+    COUNT_STAT(fs, leaders_decoded);
+    copy_name(finfo->filename, (const char *) &pg->data[LEADER_FILENAME]);
+    finfo->created = read_alto_time(pg->data, LEADER_CREATED);
+    finfo->written = read_alto_time(pg->data, LEADER_WRITTEN);
+    finfo->read = read_alto_time(pg->data, LEADER_READ);
+
+    finfo->consecutive = pg->data[LEADER_CONSECUTIVE];
+    finfo->change_sn = pg->data[LEADER_CHANGESN];
+
+    finfo->dir_fe.sn.word1 = read_word_bs(pg->data, LEADER_DIRFPHINT);
+    finfo->dir_fe.sn.word2 = read_word_bs(pg->data, LEADER_DIRFPHINT + 2);
+    finfo->dir_fe.version = read_word_bs(pg->data, LEADER_DIRFPHINT + 4);
+    finfo->dir_fe.blank = read_word_bs(pg->data, LEADER_DIRFPHINT + 6);
+    finfo->dir_fe.leader_vda = read_word_bs(pg->data, LEADER_DIRFPHINT + 8);
+
+    finfo->last_page.vda = read_word_bs(pg->data, LEADER_LASTPAGEHINT);
+    finfo->last_page.pgnum = read_word_bs(pg->data, LEADER_LASTPAGEHINT + 2);
+    finfo->last_page.pos = read_word_bs(pg->data, LEADER_LASTPAGEHINT + 4);
+    return TRUE;
+}
+
+/* Releases the memory used by the directory cache `dc`. */
+static
+void release_dir_cache(struct dir_cache *dc)
+{
+    struct cached_dir *cd;
+    size_t i;
+
+    for (i = 0; i < dc->num_dirs; i++) {
+        cd = &dc->dirs[i];
+        if (cd->entries) free((void *) cd->entries);
+        if (cd->buckets) free((void *) cd->buckets);
+        if (cd->next) free((void *) cd->next);
+    }
+
+    if (dc->dirs) free((void *) dc->dirs);
+    dc->dirs = NULL;
+    dc->num_dirs = 0;
+    dc->capacity = 0;
+}
+
+/* Auxiliary callback used by cache_directory().
+ * The `arg` parameter is a pointer to the cached_dir structure.
+ */
+static
+int cache_directory_cb(const struct fs *fs,
+                       const struct directory_entry *de,
+                       void *arg)
+{
+    struct cached_dir *cd;
+    struct directory_entry *entries;
+
+    cd = (struct cached_dir *) arg;
+    if (cd->num_entries == cd->capacity) {
+        cd->capacity = (cd->capacity == 0) ? 64 : 2 * cd->capacity;
+        entries = (struct directory_entry *)
+            realloc(cd->entries,
+                    cd->capacity * sizeof(struct directory_entry));
+        if (unlikely(!entries)) {
+            report_error("fs: cache_directory: memory exhausted");
+            return -1;
+        }
+        cd->entries = entries;
+    }
+
+    cd->entries[cd->num_entries++] = *de;
+    return 1;
+}
+
+/* Obtains the cached directory `fe`, adding it to the cache if
+ * it is not there yet.
+ * Returns the cached directory, or NULL on error.
+ */
+static
+const struct cached_dir *cache_directory(const struct fs *fs,
+                                         const struct file_entry *fe)
+{
+    struct dir_cache *dc;
+    struct cached_dir *cd, *dirs;
+    uint32_t i, h;
+    size_t j;
+
+    dc = fs->dir_cache;
+    for (j = 0; j < dc->num_dirs; j++) {
+        cd = &dc->dirs[j];
+        if (cd->fe.sn.word1 == fe->sn.word1
+            && cd->fe.sn.word2 == fe->sn.word2
+            && cd->fe.version == fe->version
+            && cd->fe.leader_vda == fe->leader_vda)
+            return cd;
+    }
+
+    if (dc->num_dirs == dc->capacity) {
+        dc->capacity = (dc->capacity == 0) ? 8 : 2 * dc->capacity;
+        dirs = (struct cached_dir *)
+            realloc(dc->dirs, dc->capacity * sizeof(struct cached_dir));
+        if (unlikely(!dirs)) {
+            report_error("fs: cache_directory: memory exhausted");
+            return NULL;
+        }
+        dc->dirs = dirs;
+    }
+
+    cd = &dc->dirs[dc->num_dirs];
+    memset(cd, 0, sizeof(struct cached_dir));
+    cd->fe = *fe;
+
+    if (!fs_scan_directory(fs, fe, &cache_directory_cb, cd))
+        goto error;
+
+    cd->num_buckets = MIN_BUCKETS;
+    while (cd->num_buckets < 2 * cd->num_entries)
+        cd->num_buckets *= 2;
+
+    cd->buckets = (uint32_t *) malloc(cd->num_buckets * sizeof(uint32_t));
+    cd->next = (uint32_t *)
+        malloc((cd->num_entries + 1) * sizeof(uint32_t));
+    if (unlikely(!cd->buckets || !cd->next)) {
+        report_error("fs: cache_directory: memory exhausted");
+        goto error;
+    }
+
+    for (i = 0; i < cd->num_buckets; i++)
+        cd->buckets[i] = INDEX_NONE;
+
+    /* Insert in reverse order, so that the first entry in the
+     * directory is found first.
+     */
+    for (i = cd->num_entries; i-- > 0;) {
+        h = hash_name(cd->entries[i].filename) & (cd->num_buckets - 1);
+        cd->next[i] = cd->buckets[h];
+        cd->buckets[h] = i;
+    }
+
+    dc->num_dirs++;
+    return cd;
+
+error:
+    if (cd->entries) free((void *) cd->entries);
+    if (cd->buckets) free((void *) cd->buckets);
+    if (cd->next) free((void *) cd->next);
+    return NULL;
+}
+
+/* Auxiliary function to fs_find_file().
+ * Finds the file named `name` in the directory `dir_fe`. The
+ * parameter `fe` will be populated with the entry of the file.
+ * Returns TRUE if the file was found, or FALSE if not found, or
+ * -1 on error.
+ */
+static
+int lookup_directory(const struct fs *fs, const struct file_entry *dir_fe,
+                     const char *name, struct file_entry *fe)
+{
+    const struct cached_dir *cd;
+    uint32_t i;
+
+    cd = cache_directory(fs, dir_fe);
+    if (!cd) return -1;
+
+    i = cd->buckets[hash_name(name) & (cd->num_buckets - 1)];
+    while (i != INDEX_NONE) {
+        if (strcmp(cd->entries[i].filename, name) == 0) {
+            *fe = cd->entries[i].fe;
+            return TRUE;
+        }
+        i = cd->next[i];
+    }
+    return FALSE;
+}
+
+int fs_find_file(const struct fs *fs, const char *filename,
+                 struct file_entry *fe)
+{
+    char name[FILENAME_LENGTH];
+    struct file_entry root_fe;
+    struct file_entry cur_fe;
+    size_t pos, npos, flen;
+    int ret;
+
+    if (!fs_file_entry(fs, 1, &root_fe)) {
+        report_error("fs: find_file: error finding SysDir");
+        return FALSE;
+    }
+
+    pos = 0;
+    cur_fe = root_fe;
+    while (filename[pos]) {
+        if (filename[pos] == '<') {
+            cur_fe = root_fe;
+            pos++;
+            continue;
+        }
+
+        npos = pos + 1;
+        while (filename[npos]) {
+            if (filename[npos] == '<' || filename[npos] == '>')
+                break;
+            npos++;
+        }
+
+        flen = npos - pos;
+        if (flen >= FILENAME_LENGTH) return FALSE;
+
+        memcpy(name, &filename[pos], flen);
+        name[flen] = '\0';
+
+        ret = lookup_directory(fs, &cur_fe, name, &cur_fe);
+        if (ret < 0) {
+            report_error("fs: find_file: could not scan directory");
+            return FALSE;
+        }
+
+        if (!ret) return FALSE;
+
+        if (filename[npos] == '>') {
+            /* Checks if its a directory. */
+            if (!(cur_fe.sn.word1 & SN_DIRECTORY)) {
+                report_error("fs: find_file: not a valid directory");
+                return FALSE;
             }
+            npos++;
+        }
 
-            /* First page is special, so not test it. */
-            if (other_pg->label.next_rda != rda && vda != 0) {
-                report_error("fs: check_integrity: "
-                             "broken link (backwards) at VDA = %u",
-                             vda);
-                success = FALSE;
-                continue;
+        pos = npos;
+    }
+
+    *fe = cur_fe;
+    return TRUE;
+}
+
+
+int fs_scavenge_file(const struct fs *fs, const char *filename,
+                     struct file_entry *fe)
+{
+    const struct file_index *idx;
+    const struct index_entry *e;
+    uint32_t i;
+    int found;
+
+    if (!build_index(fs)) {
+        report_error("fs: scavenge_file: could not scan filesystem");
+        return FALSE;
+    }
+
+    /* Check if there exists only one file with the given name. */
+    found = 0;
+    idx = fs->index;
+    i = idx->name_buckets[hash_name(filename) & (idx->num_buckets - 1)];
+    while (i != INDEX_NONE) {
+        e = &idx->entries[i];
+        if (strcmp(e->filename, filename) == 0) {
+            *fe = e->fe;
+            found++;
+        }
+        i = e->next_name;
+    }
+
+    return (found == 1);
+}
+
+int fs_scan_files(const struct fs *fs, scan_files_cb cb, void *arg)
+{
+    const struct label_table *lt;
+    struct file_entry fe;
+    unsigned int mask;
+    uint16_t vda, group;
+    int ret;
+
+    if (!build_label_table(fs)) {
+        report_error("fs: scan_files: could not build the label table");
+        return FALSE;
+    }
+
+    lt = fs->labels;
+    for (group = 0; group < fs->length; group += LABEL_GROUP) {
+        mask = used_label_mask(fs, group)
+            & label_mask(lt->file_pgnum, group, 0);
+
+        for (; mask != 0; mask &= mask - 1) {
+            vda = group + __builtin_ctz(mask);
+            fe.sn.word1 = lt->sn_word1[vda];
+            fe.sn.word2 = lt->sn_word2[vda];
+            fe.version = lt->version[vda];
+            fe.blank = 0;
+            fe.leader_vda = vda;
+
+            ret = cb(fs, &fe, arg);
+            if (ret < 0) {
+                report_error("fs: scan_files: error while scanning");
+                return FALSE;
             }
+            if (ret == 0) return TRUE;
+        }
+    }
+
+    return TRUE;
+}
+
+/* Walks all the entries of the directory `fe` (including the free
+ * ones), calling `cb` for each of them with the extra parameter `arg`.
+ * The callback should return a positive number to continue, zero
+ * to stop, and a negative number on error.
+ * Returns TRUE on success.
+ */
+static
+int walk_directory(const struct fs *fs, const struct file_entry *fe,
+                   walk_directory_cb cb, void *arg)
+{
+    struct raw_dir_entry re;
+    struct open_file of;
+    uint16_t w;
+    uint8_t buffer[128];
+    size_t to_read, nbytes;
+    int ret;
+
+    if (!fs_open(fs, fe, &of, FALSE)) {
+        report_error("fs: scan_directory: could not open directory");
+        return FALSE;
+    }
+
+    re.offset = 0;
+    while (TRUE) {
+        nbytes = fs_read(fs, &of, buffer, 2);
+        if (of.error) goto error_read;
+
+        if (nbytes == 0) break;
+        if (nbytes != 2) goto error_short;
+
+        w = read_word_bs(buffer, 0);
+        re.is_valid = ((w >> 10) == DIR_ENTRY_VALID);
+
+        re.length = (w & DIR_ENTRY_LEN_MASK);
+        if (re.length == 0) {
+            report_error("fs: scan_directory: invalid entry length");
+            return FALSE;
+        }
+
+        to_read = 2 * ((size_t) re.length);
+        if (to_read > sizeof(buffer)) {
+            nbytes = fs_read(fs, &of, &buffer[2], sizeof(buffer) - 2);
+            if (of.error) goto error_read;
+            if (nbytes != sizeof(buffer) - 2) goto error_short;
+
+            nbytes = fs_read(fs, &of, NULL, to_read - sizeof(buffer));
+            if (of.error) goto error_read;
+            if (nbytes != to_read - sizeof(buffer)) goto error_short;
         } else {
-            if (pg->label.nbytes < PAGE_DATA_SIZE) {
-                report_error("fs: check_integrity: "
-                             "short leader page at VDA = %u", vda);
-                success = FALSE;
-                continue;
-            }
+            nbytes = fs_read(fs, &of, &buffer[2], to_read - 2);
+            if (of.error) goto error_read;
+            if (nbytes != to_read - 2) goto error_short;
+        }
+
+        if (re.is_valid) {
+            COUNT_STAT(fs, dir_entries);
+            re.de.fe.sn.word1 = read_word_bs(buffer, DIRECTORY_SN);
+            re.de.fe.sn.word2 = read_word_bs(buffer, 2 + DIRECTORY_SN);
+            re.de.fe.version = read_word_bs(buffer, DIRECTORY_VERSION);
+            re.de.fe.blank = 0;
+            re.de.fe.leader_vda = read_word_bs(buffer,
+                                               DIRECTORY_LEADER_VDA);
+            copy_name(re.de.filename,
+                      (const char *) &buffer[DIRECTORY_FILENAME]);
+        }
+
+        ret = cb(fs, &re, arg);
+        if (ret < 0) return FALSE;
+        if (ret == 0) break;
+
+        re.offset += to_read;
+    }
+
+    return TRUE;
+
+error_read:
+    report_error("fs: scan_directory: error while reading");
+    return FALSE;
+
+error_short:
+    report_error("fs: scan_directory: entry too short");
+    return FALSE;
+}
+
+/* Auxiliary function to fs_scan_directory().
+ * Passes the valid entries to the callback of fs_scan_directory().
+ */
+static
+int scan_directory_cb_adapter(const struct fs *fs,
+                              const struct raw_dir_entry *re,
+                              void *arg)
+{
+    const struct scan_directory_context *ctx;
+
+    ctx = (const struct scan_directory_context *) arg;
+    if (!re->is_valid) return 1;
+    return ctx->cb(fs, &re->de, ctx->arg);
+}
+
+int fs_scan_directory(const struct fs *fs, const struct file_entry *fe,
+                      scan_directory_cb cb, void *arg)
+{
+    struct scan_directory_context ctx;
+
+    ctx.cb = cb;
+    ctx.arg = arg;
+    return walk_directory(fs, fe, &scan_directory_cb_adapter, &ctx);
+}
+
+/* Auxiliary function to fs_create_file() and fs_delete_file().
+ * Writes `len` bytes from `src` at `offset` in the file `fe`,
+ * extending the file if needed.
+ * Returns TRUE on success.
+ */
+static
+int write_file_at(struct fs *fs, const struct file_entry *fe,
+                  size_t offset, const uint8_t *src, size_t len)
+{
+    struct open_file of;
+
+    if (!fs_open(fs, fe, &of, FALSE)) return FALSE;
+    if (fs_read(fs, &of, NULL, offset) != offset || of.error)
+        return FALSE;
+    if (fs_write(fs, &of, src, len, TRUE) != len || of.error)
+        return FALSE;
+    return TRUE;
+}
+
+/* Updates the last page hint in the leader page of the file `fe`.
+ * Returns TRUE on success.
+ */
+static
+int update_last_page_hint(struct fs *fs, const struct file_entry *fe)
+{
+    struct page *leader_pg;
+    const struct page *pg;
+    uint16_t vda, next_vda;
+
+    leader_pg = get_page(fs, fe->leader_vda);
+    vda = fe->leader_vda;
+    pg = leader_pg;
+    while (pg->label.next_rda != 0) {
+        if (!real_to_virtual(fs, pg->label.next_rda, &next_vda)
+            || next_vda == 0) {
+            report_error("fs: update_last_page_hint: broken file chain");
+            return FALSE;
+        }
+        vda = next_vda;
+        pg = get_page_label(fs, vda);
+    }
+
+    write_word_bs(leader_pg->data, LEADER_LASTPAGEHINT, vda);
+    write_word_bs(leader_pg->data, LEADER_LASTPAGEHINT + 2,
+                  pg->label.file_pgnum);
+    write_word_bs(leader_pg->data, LEADER_LASTPAGEHINT + 4,
+                  pg->label.nbytes);
+    mark_page_dirty(fs, fe->leader_vda);
+    return TRUE;
+}
+
+/* Finds the DiskDescriptor file (in SysDir).
+ * The file_entry is returned in `fe`.
+ * Returns TRUE if found, FALSE if not found, or -1 on error.
+ */
+static
+int find_disk_descriptor(const struct fs *fs, struct file_entry *fe)
+{
+    struct file_entry root_fe;
+
+    if (!fs_file_entry(fs, 1, &root_fe)) return -1;
+    return lookup_directory(fs, &root_fe, "DiskDescriptor", fe);
+}
+
+/* Updates the DiskDescriptor with the current allocation of the
+ * pages: the bit table and the number of free pages. If `last_sn`
+ * is not NULL, the last serial number is also updated.
+ * Nothing is done if the filesystem has no DiskDescriptor.
+ * Returns TRUE on success.
+ */
+static
+int update_disk_descriptor(struct fs *fs,
+                           const struct serial_number *last_sn)
+{
+    struct file_entry dd_fe;
+    struct open_file of;
+    uint8_t kdh[KDH_SIZE];
+    uint8_t *table, mask;
+    uint16_t vda, bt_size, num_free;
+    size_t size, i, nbits;
+    int ret;
+
+    ret = find_disk_descriptor(fs, &dd_fe);
+    if (ret <= 0) return (ret == 0);
+
+    if (!fs_open(fs, &dd_fe, &of, FALSE)
+        || fs_read(fs, &of, kdh, sizeof(kdh)) != sizeof(kdh)) {
+        report_error("fs: update_disk_descriptor: could not read "
+                     "DiskDescriptor");
+        return FALSE;
+    }
+
+    bt_size = read_word_bs(kdh, KDH_DISK_BT_SIZE);
+    size = 2 * ((size_t) bt_size);
+    table = (uint8_t *) calloc(size + 1, sizeof(uint8_t));
+    if (unlikely(!table)) {
+        report_error("fs: update_disk_descriptor: memory exhausted");
+        return FALSE;
+    }
+
+    if (fs_read(fs, &of, table, size) != size) {
+        free((void *) table);
+        report_error("fs: update_disk_descriptor: could not read "
+                     "the bit table");
+        return FALSE;
+    }
+
+    /* The bits are stored most significant first (1 means used). */
+    num_free = 0;
+    nbits = MIN(8 * size, (size_t) fs->length);
+    for (i = 0; i < nbits; i++) {
+        vda = (uint16_t) i;
+        mask = (uint8_t) (0x80 >> (i % 8));
+        if (vda != 0 && get_page_label(fs, vda)->label.version
+            == VERSION_FREE) {
+            table[i / 8] &= (uint8_t) ~mask;
+            num_free++;
+        } else {
+            table[i / 8] |= mask;
+        }
+    }
+
+    write_word_bs(kdh, KDH_FREE_PAGES, num_free);
+    if (last_sn) {
+        write_word_bs(kdh, KDH_LAST_SN, last_sn->word1);
+        write_word_bs(kdh, KDH_LAST_SN + 2, last_sn->word2);
+    }
+
+    ret = write_file_at(fs, &dd_fe, 0, kdh, sizeof(kdh))
+        && write_file_at(fs, &dd_fe, sizeof(kdh), table, size);
+    free((void *) table);
+
+    if (!ret) {
+        report_error("fs: update_disk_descriptor: could not write "
+                     "DiskDescriptor");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Obtains a new serial number for a file, after the last serial
+ * number recorded in the DiskDescriptor and all the serial numbers
+ * in use. The serial number is returned in `sn`.
+ * Returns TRUE on success.
+ */
+static
+int new_serial_number(struct fs *fs, struct serial_number *sn)
+{
+    struct file_entry dd_fe;
+    struct open_file of;
+    uint8_t kdh[KDH_SIZE];
+    uint32_t last, v;
+    uint32_t i;
+    int ret;
+
+    if (!build_index(fs)) return FALSE;
+
+    last = 0;
+    ret = find_disk_descriptor(fs, &dd_fe);
+    if (ret < 0) return FALSE;
+    if (ret > 0 && fs_open(fs, &dd_fe, &of, FALSE)
+        && fs_read(fs, &of, kdh, sizeof(kdh)) == sizeof(kdh)) {
+        last = read_word_bs(kdh, KDH_LAST_SN) & SN_PART1_MASK;
+        last = (last << 16) | read_word_bs(kdh, KDH_LAST_SN + 2);
+    }
+
+    for (i = 0; i < fs->index->num_entries; i++) {
+        v = fs->index->entries[i].fe.sn.word1 & SN_PART1_MASK;
+        v = (v << 16) | fs->index->entries[i].fe.sn.word2;
+        if (v > last) last = v;
+    }
+
+    last++;
+    if (last > ((SN_PART1_MASK << 16) | 0xFFFFU)) {
+        report_error("fs: new_serial_number: no more serial numbers");
+        return FALSE;
+    }
+
+    sn->word1 = (uint16_t) (last >> 16);
+    sn->word2 = (uint16_t) (last & 0xFFFF);
+    return TRUE;
+}
+
+/* Writes an Alto time `t` at `offset` in `data`. */
+static
+void write_alto_time(uint8_t *data, size_t offset, time_t t)
+{
+    uint32_t v;
+
+    v = (uint32_t) (t - 2117503696); /* see read_alto_time(). */
+    write_word_bs(data, offset, (uint16_t) (v >> 16));
+    write_word_bs(data, offset + 2, (uint16_t) (v & 0xFFFF));
+}
+
+/* Splits the path `filename` in the directory containing the file
+ * (returned in `dir_fe`) and the name of the file (in `name`).
+ * Returns TRUE on success.
+ */
+static
+int find_parent_directory(const struct fs *fs, const char *filename,
+                          struct file_entry *dir_fe, char *name)
+{
+    char dirname[MAX_DIRNAME_LENGTH];
+    size_t i, len;
+
+    len = 0;
+    for (i = 0; filename[i]; i++) {
+        if (filename[i] == '<' || filename[i] == '>') len = i + 1;
+    }
+
+    if (i - len == 0 || i - len >= FILENAME_LENGTH - 1) {
+        report_error("fs: invalid file name: %s", filename);
+        return FALSE;
+    }
+    strcpy(name, &filename[len]);
+
+    if (len == 0) {
+        if (!fs_file_entry(fs, 1, dir_fe)) return FALSE;
+    } else {
+        if (len >= sizeof(dirname)) {
+            report_error("fs: invalid file name: %s", filename);
+            return FALSE;
+        }
+        memcpy(dirname, filename, len);
+        dirname[len] = '\0';
+        if (dirname[len - 1] == '>') dirname[len - 1] = '\0';
+
+        if (dirname[0] == '\0') {
+            if (!fs_file_entry(fs, 1, dir_fe)) return FALSE;
+        } else if (!fs_find_file(fs, dirname, dir_fe)) {
+            report_error("fs: could not find directory %s", dirname);
+            return FALSE;
+        }
+    }
+
+    if (!(dir_fe->sn.word1 & SN_DIRECTORY)) {
+        report_error("fs: not a directory: %s", filename);
+        return FALSE;
+    }
+    return TRUE;
+}
 
-            if (pg->label.file_pgnum != 0) {
-                report_error("fs: check_integrity: "
-                             "file_pgnum is not zero at VDA = %u", vda);
-                success = FALSE;
-                continue;
-            }
+/* Computes the length in words of the directory entry of
+ * a file named `name`.
+ */
+static
+uint16_t directory_entry_length(const char *name)
+{
+    /* The name is a BCPL string ending with a dot. */
+    return (uint16_t) (DIRECTORY_FILENAME / 2 + (strlen(name) + 3) / 2);
+}
 
-            slen = pg->data[LEADER_FILENAME];
-            if (slen == 0 || slen >= FILENAME_LENGTH) {
-                report_error("fs: check_integrity: "
-                             "invalid filename at VDA = %u", vda);
-                success = FALSE;
-                continue;
-            }
-        }
+/* Encodes the directory entry for the file `fe` named `name` in
+ * `buffer` (which must be large enough).
+ * Returns the length of the entry in words.
+ */
+static
+uint16_t encode_directory_entry(uint8_t *buffer,
+                                const struct file_entry *fe,
+                                const char *name)
+{
+    uint16_t length;
+    size_t len;
+
+    len = strlen(name);
+    length = directory_entry_length(name);
+    memset(buffer, 0, 2 * ((size_t) length));
+    write_word_bs(buffer, 0, (DIR_ENTRY_VALID << 10) | length);
+    write_word_bs(buffer, DIRECTORY_SN, fe->sn.word1);
+    write_word_bs(buffer, DIRECTORY_SN + 2, fe->sn.word2);
+    write_word_bs(buffer, DIRECTORY_VERSION, fe->version);
+    write_word_bs(buffer, DIRECTORY_LEADER_VDA, fe->leader_vda);
+    buffer[DIRECTORY_FILENAME] = (uint8_t) (len + 1);
+    memcpy(&buffer[DIRECTORY_FILENAME + 1], name, len);
+    buffer[DIRECTORY_FILENAME + 1 + len] = '.';
+    return length;
+}
 
-        if (pg->label.next_rda != 0) {
-            if (pg->label.nbytes < PAGE_DATA_SIZE) {
-                report_error("fs: check_integrity: "
-                             "short page at VDA = %u", vda);
-                success = FALSE;
-                continue;
-            }
+/* Initializes the leader page `pg` of the file `fe` named `name`,
+ * which lives in the directory `dir_fe`. The times of the file are
+ * set to `now`. The next page of the file and the last page hint
+ * are left for the caller to fill.
+ */
+static
+void init_leader_page(struct page *pg, const struct file_entry *fe,
+                      const char *name, const struct file_entry *dir_fe,
+                      time_t now)
+{
+    size_t len;
+
+    pg->label.next_rda = 0;
+    pg->label.prev_rda = 0;
+    pg->label.unused = 0;
+    pg->label.nbytes = PAGE_DATA_SIZE;
+    pg->label.file_pgnum = 0;
+    pg->label.version = fe->version;
+    pg->label.sn = fe->sn;
+
+    len = strlen(name);
+    memset(pg->data, 0, PAGE_DATA_SIZE);
+    write_alto_time(pg->data, LEADER_CREATED, now);
+    write_alto_time(pg->data, LEADER_WRITTEN, now);
+    write_alto_time(pg->data, LEADER_READ, now);
+    pg->data[LEADER_FILENAME] = (uint8_t) (len + 1);
+    memcpy(&pg->data[LEADER_FILENAME + 1], name, len);
+    pg->data[LEADER_FILENAME + 1 + len] = '.';
+    pg->data[LEADER_PROPBEGIN] = LEADER_PROPS / 2;
+    pg->data[LEADER_PROPLEN] = (LEADER_SPARE - LEADER_PROPS) / 2;
+
+    write_word_bs(pg->data, LEADER_DIRFPHINT, dir_fe->sn.word1);
+    write_word_bs(pg->data, LEADER_DIRFPHINT + 2, dir_fe->sn.word2);
+    write_word_bs(pg->data, LEADER_DIRFPHINT + 4, dir_fe->version);
+    write_word_bs(pg->data, LEADER_DIRFPHINT + 8, dir_fe->leader_vda);
+}
 
-            if (!real_to_virtual(fs, pg->label.next_rda, &other_vda)) {
-                report_error("fs: check_integrity: "
-                             "invalid next_rda at VDA = %u", vda);
-                success = FALSE;
-                continue;
-            }
+/* Auxiliary function to insert_directory_entry().
+ * Finds the first free entry that fits the new entry.
+ */
+static
+int find_free_entry_cb(const struct fs *fs,
+                       const struct raw_dir_entry *re,
+                       void *arg)
+{
+    struct dir_slot *slot;
 
-            other_pg = &fs->pages[other_vda];
-            if (other_pg->label.file_pgnum != pg->label.file_pgnum + 1) {
-                report_error("fs: check_integrity: "
-                             "discontiguous file_pgnum (forward) "
-                             "at VDA = %u", vda);
-                success = FALSE;
-                continue;
-            }
+    slot = (struct dir_slot *) arg;
+    slot->end = re->offset + 2 * ((size_t) re->length);
+    if (re->is_valid || re->length < slot->length) return 1;
 
-            if (other_pg->label.sn.word1 != pg->label.sn.word1
-                || other_pg->label.sn.word2 != pg->label.sn.word2) {
-                report_error("fs: check_integrity: "
-                             "differing file serial numbers (forward) "
-                             "at VDA = %u", vda);
-                success = FALSE;
-                continue;
-            }
+    slot->offset = re->offset;
+    slot->free_length = re->length;
+    slot->found = TRUE;
+    return 0;
+}
 
-            /* First page is special, so not test it. */
-            if (other_pg->label.prev_rda != rda && vda != 0) {
-                report_error("fs: check_integrity: "
-                             "broken link (forward) at VDA = %u",
-                             vda);
-                success = FALSE;
-                continue;
-            }
-        }
+/* Inserts an entry for the file `fe` named `name` in the directory
+ * `dir_fe`. The first free entry that fits is reused (as the Alto
+ * does), otherwise the entry is appended to the directory.
+ * Returns TRUE on success.
+ */
+static
+int insert_directory_entry(struct fs *fs, const struct file_entry *dir_fe,
+                           const struct file_entry *fe, const char *name)
+{
+    uint8_t buffer[2 * DIR_ENTRY_MAX_LENGTH];
+    struct dir_slot slot;
+    struct open_file of;
+
+    slot.length = directory_entry_length(name);
+    slot.found = FALSE;
+    slot.end = 0;
+
+    if (!walk_directory(fs, dir_fe, &find_free_entry_cb, &slot))
+        return FALSE;
 
-        if (pg->label.prev_rda != 0) continue;
+    encode_directory_entry(buffer, fe, name);
+    if (!slot.found) slot.offset = slot.end;
+    if (!write_file_at(fs, dir_fe, slot.offset, buffer,
+                       2 * ((size_t) slot.length))) {
+        /* Cut the part of the entry that could be appended. */
+        if (!slot.found && fs_open(fs, dir_fe, &of, FALSE)
+            && fs_read(fs, &of, NULL, slot.end) == slot.end
+            && fs_trim(fs, &of))
+            update_last_page_hint(fs, dir_fe);
+        return FALSE;
     }
 
-    return success;
+    if (!slot.found) return update_last_page_hint(fs, dir_fe);
+
+    /* Leave the rest of the free entry as a smaller free entry. */
+    if (slot.free_length > slot.length) {
+        write_word_bs(buffer, 0, (DIR_ENTRY_MISSING << 10)
+                      | (slot.free_length - slot.length));
+        if (!write_file_at(fs, dir_fe,
+                           slot.offset + 2 * ((size_t) slot.length),
+                           buffer, 2))
+            return FALSE;
+    }
+    return TRUE;
 }
 
-int fs_check_integrity(const struct fs *fs)
+/* Releases the page at `vda`, marking it as free in its label and in
+ * the bitmap of free pages. The VDA of the next page of the file is
+ * returned in `next_vda` (0 if there is none).
+ */
+static
+void release_page(struct fs *fs, uint16_t vda, uint16_t *next_vda)
 {
-    if (!check_integrity_stage1(fs)) return FALSE;
-    return TRUE;
+    struct page *pg;
+
+    pg = get_page_label(fs, vda);
+    if (!real_to_virtual(fs, pg->label.next_rda, next_vda))
+        *next_vda = 0;
+
+    pg->label.version = VERSION_FREE;
+    pg->label.prev_rda = 0;
+    pg->label.next_rda = 0;
+    mark_page_free(fs, vda);
+    mark_page_dirty(fs, vda);
+    update_label(fs, vda);
 }
 
-int fs_open(const struct fs *fs, const struct file_entry *fe,
-            struct open_file *of, int include_leader)
+int fs_create_file(struct fs *fs, const char *filename,
+                   int is_directory, struct file_entry *fe)
 {
-    const struct page *pg;
-    uint16_t rda;
+    char name[FILENAME_LENGTH];
+    struct file_entry dir_fe, other_fe;
+    struct page *leader_pg, *pg;
+    uint16_t vdas[2], next_vda;
+    int ret;
 
-    if (fe->leader_vda >= fs->length) {
-        of->error = TRUE;
+    if (!find_parent_directory(fs, filename, &dir_fe, name))
+        return FALSE;
+
+    ret = lookup_directory(fs, &dir_fe, name, &other_fe);
+    if (ret < 0) return FALSE;
+    if (ret) {
+        report_error("fs: create_file: %s already exists", filename);
         return FALSE;
     }
 
-    of->fe = *fe;
-    of->pos.pgnum = 1;
-    of->pos.pos = 0;
+    if (!new_serial_number(fs, &fe->sn)) return FALSE;
+    if (is_directory) fe->sn.word1 |= SN_DIRECTORY;
+    fe->version = 1;
+    fe->blank = 0;
 
-    if (!include_leader) {
-        pg = &fs->pages[fe->leader_vda];
-        rda = pg->label.next_rda;
-        if (!real_to_virtual(fs, rda, &of->pos.vda)) {
-            of->error = TRUE;
-            return FALSE;
-        }
-    } else {
-        of->pos.vda = of->fe.leader_vda;
+    /* The leader page and an empty data page. */
+    if (!allocate_pages(fs, dir_fe.leader_vda, 2, vdas)) return FALSE;
+    fe->leader_vda = vdas[0];
+    mark_modified(fs);
+
+    leader_pg = get_page_for_write(fs, vdas[0]);
+    pg = get_page_for_write(fs, vdas[1]);
+
+    init_leader_page(leader_pg, fe, name, &dir_fe, time(NULL));
+    virtual_to_real(fs, vdas[1], &leader_pg->label.next_rda);
+
+    pg->label.next_rda = 0;
+    virtual_to_real(fs, vdas[0], &pg->label.prev_rda);
+    pg->label.nbytes = 0;
+    pg->label.file_pgnum = 1;
+    pg->label.version = fe->version;
+    pg->label.sn = fe->sn;
+    memset(pg->data, 0, PAGE_DATA_SIZE);
+
+    write_word_bs(leader_pg->data, LEADER_LASTPAGEHINT, vdas[1]);
+    write_word_bs(leader_pg->data, LEADER_LASTPAGEHINT + 2, 1);
+    write_word_bs(leader_pg->data, LEADER_LASTPAGEHINT + 4, 0);
+
+    mark_page_dirty(fs, vdas[0]);
+    mark_page_dirty(fs, vdas[1]);
+    update_label(fs, vdas[0]);
+    update_label(fs, vdas[1]);
+
+    if (!insert_directory_entry(fs, &dir_fe, fe, name)) {
+        /* Give back the pages, so that they are not left orphan. */
+        release_page(fs, vdas[0], &next_vda);
+        release_page(fs, vdas[1], &next_vda);
+        report_error("fs: create_file: could not update the directory");
+        return FALSE;
     }
 
-    of->error = FALSE;
+    if (!update_disk_descriptor(fs, &fe->sn)) return FALSE;
     return TRUE;
 }
 
-size_t fs_read(const struct fs *fs, struct open_file *of,
-               uint8_t *dst, size_t len)
+/* Auxiliary function to fs_delete_file().
+ * Finds the entry with a given name.
+ */
+static
+int find_entry_cb(const struct fs *fs,
+                  const struct raw_dir_entry *re,
+                  void *arg)
 {
-    const struct page *pg;
-    uint16_t vda, rda, nbytes;
-    size_t pos;
+    struct dir_slot *slot;
 
-    if (of->error) {
-        report_error("fs: read: error on file");
+    slot = (struct dir_slot *) arg;
+    if (!re->is_valid || strcmp(re->de.filename, slot->name) != 0)
+        return 1;
+
+    slot->offset = re->offset;
+    slot->length = re->length;
+    slot->fe = re->de.fe;
+    slot->found = TRUE;
+    return 0;
+}
+
+int fs_delete_file(struct fs *fs, const char *filename)
+{
+    char name[FILENAME_LENGTH];
+    struct file_entry dir_fe;
+    struct dir_slot slot;
+    struct page *pg;
+    uint8_t buffer[2];
+    uint16_t vda, next_vda, count;
+
+    if (!find_parent_directory(fs, filename, &dir_fe, name))
+        return FALSE;
+
+    slot.name = name;
+    slot.found = FALSE;
+    if (!walk_directory(fs, &dir_fe, &find_entry_cb, &slot))
+        return FALSE;
+
+    if (!slot.found) {
+        report_error("fs: delete_file: could not find %s", filename);
         return FALSE;
     }
 
-    pos = 0;
-    while (len > 0) {
-        vda = of->pos.vda;
+    if (slot.fe.sn.word1 & SN_DIRECTORY) {
+        report_error("fs: delete_file: %s is a directory", filename);
+        return FALSE;
+    }
 
-        /* Checks if reached the end of the file. */
-        if (vda == 0) break;
-        if (vda >= fs->length) {
-            of->error = TRUE;
-            report_error("fs: read: invalid VDA: %u", vda);
-            break;
-        }
+    if (slot.fe.leader_vda == 0 || slot.fe.leader_vda >= fs->length) {
+        report_error("fs: delete_file: invalid VDA: %u",
+                     slot.fe.leader_vda);
+        return FALSE;
+    }
 
-        pg = &fs->pages[vda];
+    /* Build the bitmap first, so that a failure leaves the file
+     * untouched.
+     */
+    if (!build_free_map(fs)) return FALSE;
 
-        /* Sanity check. */
-        if (pg->label.file_pgnum != of->pos.pgnum) {
-            of->error = TRUE;
-            report_error("fs: read: inconsistent page numbers");
-            break;
-        }
+    /* Mark the directory entry as free. */
+    write_word_bs(buffer, 0, (DIR_ENTRY_MISSING << 10) | slot.length);
+    if (!write_file_at(fs, &dir_fe, slot.offset, buffer, 2)) {
+        report_error("fs: delete_file: could not update the directory");
+        return FALSE;
+    }
 
-        /* Another sanity check. */
-        if (of->pos.pos > pg->label.nbytes) {
-            of->error = TRUE;
-            report_error("fs: read: inconsistent offset in page");
-            break;
-        }
+    /* Release all the pages of the file. */
+    mark_modified(fs);
+    vda = slot.fe.leader_vda;
+    for (count = 0; vda != 0 && count < fs->length; count++) {
+        pg = get_page_label(fs, vda);
+        if (pg->label.version == VERSION_FREE
+            || pg->label.version != slot.fe.version
+            || pg->label.sn.word1 != slot.fe.sn.word1
+            || pg->label.sn.word2 != slot.fe.sn.word2) break;
+
+        release_page(fs, vda, &next_vda);
+        vda = next_vda;
+    }
 
-        /* If has not reached the end of the page. */
-        if (of->pos.pos < pg->label.nbytes) {
-            nbytes = pg->label.nbytes - of->pos.pos;
-            if (nbytes > len) nbytes = len;
+    return update_disk_descriptor(fs, NULL);
+}
 
-            if (dst) {
-                memcpy(&dst[pos], &pg->data[of->pos.pos],
-                       nbytes);
-            }
+/* Lays out the file `fe` named `name` (in the directory `dir_fe`)
+ * contiguously, starting with the leader page at `fe->leader_vda`.
+ * The contents of the file are given by `src` (with `len` bytes).
+ * The pages must have been reserved by the caller.
+ */
+static
+void layout_file(struct fs *fs, const struct file_entry *fe,
+                 const char *name, const struct file_entry *dir_fe,
+                 const uint8_t *src, size_t len, time_t now)
+{
+    struct page *pg;
+    uint16_t vda, pgnum, num_pages, nbytes;
 
-            of->pos.pos += nbytes;
-            pos += nbytes;
-            len -= nbytes;
-            continue;
-        }
+    vda = fe->leader_vda;
+    num_pages = (uint16_t) (len / PAGE_DATA_SIZE + 1);
 
-        /* Go to the next page. */
-        rda = pg->label.next_rda;
-        if (!real_to_virtual(fs, rda, &of->pos.vda)) {
-            of->error = TRUE;
-            report_error("fs: read: could not convert real "
-                         "to virtual disk address");
-            break;
-        }
+    pg = &fs->pages[vda];
+    init_leader_page(pg, fe, name, dir_fe, now);
+    pg->label.next_rda = fs->vda_to_rda[vda + 1];
+    write_word_bs(pg->data, LEADER_LASTPAGEHINT, vda + num_pages);
+    write_word_bs(pg->data, LEADER_LASTPAGEHINT + 2, num_pages);
+    write_word_bs(pg->data, LEADER_LASTPAGEHINT + 4,
+                  (uint16_t) (len % PAGE_DATA_SIZE));
 
-        /* If there is a valid next page. */
-        if (of->pos.vda != 0) {
-            of->pos.pos = 0;
-            of->pos.pgnum += 1;
-            continue;
-        }
+    for (pgnum = 1; pgnum <= num_pages; pgnum++) {
+        vda++;
+        nbytes = (uint16_t) MIN(len, (size_t) PAGE_DATA_SIZE);
 
-        /* Reached the end of file. */
-        of->pos.pgnum = 0;
+        pg = &fs->pages[vda];
+        pg->label.prev_rda = fs->vda_to_rda[vda - 1];
+        pg->label.next_rda = (pgnum < num_pages)
+            ? fs->vda_to_rda[vda + 1] : 0;
+        pg->label.unused = 0;
+        pg->label.nbytes = nbytes;
+        pg->label.file_pgnum = pgnum;
+        pg->label.version = fe->version;
+        pg->label.sn = fe->sn;
+
+        if (nbytes > 0) memcpy(pg->data, src, nbytes);
+        src = &src[nbytes];
+        len -= nbytes;
     }
-
-    return pos;
 }
 
-/* Finds a free page within the filesystem.
- * The virtual disk address is returned in `free_vda`.
- * Returns TRUE on success.
+/* Resets all the pages of the filesystem to free pages, with
+ * valid headers.
  */
 static
-int find_free_page(struct fs *fs, uint16_t *free_vda)
+void clear_pages(struct fs *fs)
 {
+    struct page *pg;
     uint16_t vda;
-    const struct page *pg;
 
+    memset(fs->pages, 0, ((size_t) fs->length) * sizeof(struct page));
     for (vda = 0; vda < fs->length; vda++) {
         pg = &fs->pages[vda];
-        if (pg->label.version == VERSION_FREE) {
-            *free_vda = vda;
-            return TRUE;
+        pg->page_vda = vda;
+        pg->header[1] = fs->vda_to_rda[vda];
+        pg->label.version = VERSION_FREE;
+        pg->label.sn.word1 = VERSION_FREE;
+        pg->label.sn.word2 = VERSION_FREE;
+    }
+}
+
+/* Auxiliary function to fs_format() to sort the names. */
+static
+int compare_names(const void *a, const void *b)
+{
+    return strcmp(*((const char * const *) a),
+                  *((const char * const *) b));
+}
+
+/* Obtains the names of the files in SysDir (for fs_format()).
+ * The name of each of the `num_files` files in `filenames` is the
+ * last component of the host path. The array returned in `names`
+ * holds the sorted names, followed by the same names in the order
+ * of the directory (starting with SysDir and DiskDescriptor).
+ * It must be released by the caller with free().
+ * Returns TRUE on success.
+ */
+static
+int format_names(const char * const *filenames, size_t num_files,
+                 const char ***names)
+{
+    const char **sorted;
+    const char *p;
+    size_t i, len;
+
+    *names = NULL;
+    sorted = (const char **) malloc(2 * (num_files + 2)
+                                    * sizeof(const char *));
+    if (unlikely(!sorted)) {
+        report_error("fs: format: memory exhausted");
+        return FALSE;
+    }
+
+    sorted[0] = "SysDir";
+    sorted[1] = "DiskDescriptor";
+    for (i = 0; i < num_files; i++) {
+        sorted[i + 2] = filenames[i];
+        for (p = filenames[i]; *p; p++) {
+            if (*p == '/') sorted[i + 2] = &p[1];
+        }
+
+        len = strlen(sorted[i + 2]);
+        if (len == 0 || len >= FILENAME_LENGTH - 1
+            || strchr(sorted[i + 2], '<')
+            || strchr(sorted[i + 2], '>')) {
+            report_error("fs: format: invalid file name: %s",
+                         filenames[i]);
+            free((void *) sorted);
+            return FALSE;
         }
     }
-    return FALSE;
+
+    /* The second half keeps the names in order. */
+    memcpy(&sorted[num_files + 2], sorted,
+           (num_files + 2) * sizeof(const char *));
+    qsort(sorted, num_files + 2, sizeof(const char *), &compare_names);
+    for (i = 1; i < num_files + 2; i++) {
+        if (strcmp(sorted[i - 1], sorted[i]) == 0) {
+            report_error("fs: format: duplicate file name: %s",
+                         sorted[i]);
+            free((void *) sorted);
+            return FALSE;
+        }
+    }
+
+    *names = sorted;
+    return TRUE;
 }
 
-size_t fs_write(struct fs *fs, struct open_file *of,
-                const uint8_t *src, size_t len, int extend)
+int fs_format(struct fs *fs, const char * const *filenames,
+              size_t num_files)
 {
-    struct page *pg, *new_pg;
-    uint16_t vda, rda, nbytes;
-    size_t pos;
+    struct file_entry dir_fe, dd_fe, fe;
+    struct serial_number last_sn;
+    struct host_file hf;
+    const char **sorted, **names;
+    uint8_t *dir_data, *dd_data;
+    size_t i, dir_size, dd_size, pos;
+    uint16_t bt_size;
+    uint32_t vda, num_pages;
+    time_t now;
+
+    if (fs->image) {
+        report_error("fs: format: cannot format a mapped image");
+        return FALSE;
+    }
 
-    if (of->error) {
-        report_error("fs: write: error on file");
+    if (!format_names(filenames, num_files, &sorted)) return FALSE;
+
+    /* The names in the order of the directory. */
+    names = &sorted[num_files + 2];
+
+    dir_size = 0;
+    for (i = 0; i < num_files + 2; i++)
+        dir_size += 2 * ((size_t) directory_entry_length(names[i]));
+
+    bt_size = (uint16_t) ((fs->length + 15) / 16);
+    dd_size = KDH_SIZE + 2 * ((size_t) bt_size);
+
+    dir_data = (uint8_t *) calloc(dir_size + dd_size, sizeof(uint8_t));
+    if (unlikely(!dir_data)) {
+        report_error("fs: format: memory exhausted");
+        free((void *) sorted);
         return FALSE;
     }
+    dd_data = &dir_data[dir_size];
+
+    /* The boot page (VDA 0) is reserved, but left empty.
+     * SysDir comes next (at the fixed VDA 1), then the DiskDescriptor
+     * and all the files, each one in consecutive pages.
+     */
+    clear_pages(fs);
+    invalidate_state(fs);
+
+    dir_fe.sn.word1 = SN_DIRECTORY;
+    dir_fe.sn.word2 = 100;
+    dir_fe.version = 1;
+    dir_fe.blank = 0;
+    dir_fe.leader_vda = 1;
+
+    dd_fe.sn.word1 = 0;
+    dd_fe.sn.word2 = 101;
+    dd_fe.version = 1;
+    dd_fe.blank = 0;
+    dd_fe.leader_vda = (uint16_t) (2 + dir_size / PAGE_DATA_SIZE + 1);
+
+    vda = dd_fe.leader_vda + 2 + dd_size / PAGE_DATA_SIZE;
+    if (vda > fs->length) {
+        report_error("fs: format: disk too small");
+        goto error;
+    }
 
-    pos = 0;
-    while (len > 0) {
-        vda = of->pos.vda;
+    pos = encode_directory_entry(dir_data, &dir_fe, names[0]);
+    pos += encode_directory_entry(&dir_data[2 * pos], &dd_fe, names[1]);
+    pos *= 2;
+
+    now = time(NULL);
+    last_sn = dd_fe.sn;
+    for (i = 0; i < num_files; i++) {
+        if (!open_host_file(&hf, filenames[i])) {
+            report_error("fs: format: could not read `%s`",
+                         filenames[i]);
+            goto error;
+        }
 
-        /* Checks if reached the end of the file. */
-        if (vda == 0) break;
-        if (vda >= fs->length) {
-            of->error = TRUE;
-            report_error("fs: write: invalid VDA: %u", vda);
-            break;
+        num_pages = (uint32_t) (hf.size / PAGE_DATA_SIZE + 2);
+        if (hf.size >= ((size_t) fs->length) * PAGE_DATA_SIZE
+            || vda + num_pages > fs->length) {
+            report_error("fs: format: disk full while adding `%s`",
+                         filenames[i]);
+            close_host_file(&hf);
+            goto error;
         }
 
-        pg = &fs->pages[vda];
+        fe.sn.word1 = last_sn.word1;
+        fe.sn.word2 = last_sn.word2 + 1;
+        if (fe.sn.word2 == 0) fe.sn.word1++;
+        fe.version = 1;
+        fe.blank = 0;
+        fe.leader_vda = (uint16_t) vda;
+
+        layout_file(fs, &fe, names[i + 2], &dir_fe,
+                    hf.data, hf.size, now);
+        close_host_file(&hf);
+
+        pos += 2 * ((size_t) encode_directory_entry(&dir_data[pos], &fe,
+                                                    names[i + 2]));
+        last_sn = fe.sn;
+        vda += num_pages;
+    }
+
+    /* The bit table, free pages and last SN are filled later. */
+    write_word_bs(dd_data, 0, fs->dg.num_disks);
+    write_word_bs(dd_data, 2, fs->dg.num_cylinders);
+    write_word_bs(dd_data, 4, fs->dg.num_heads);
+    write_word_bs(dd_data, 6, fs->dg.num_sectors);
+    write_word_bs(dd_data, KDH_DISK_BT_SIZE, bt_size);
+
+    layout_file(fs, &dir_fe, names[0], &dir_fe, dir_data, dir_size, now);
+    layout_file(fs, &dd_fe, names[1], &dir_fe, dd_data, dd_size, now);
+
+    free((void *) dir_data);
+    free((void *) sorted);
+
+    if (!update_disk_descriptor(fs, &last_sn)) {
+        report_error("fs: format: could not write the DiskDescriptor");
+        return FALSE;
+    }
+    return TRUE;
+
+error:
+    free((void *) dir_data);
+    free((void *) sorted);
+    return FALSE;
+}
+
+/* Auxiliary function to fs_defrag().
+ * Assigns consecutive new VDAs (from `plan->next`, skipping the
+ * reserved pages) to all the pages of the file with the leader page
+ * at `leader_vda`, unless the file was already placed.
+ * Returns TRUE on success.
+ */
+static
+int place_file(const struct fs *fs, struct defrag_plan *plan,
+               uint16_t leader_vda)
+{
+    const struct page *pg;
+    uint16_t vda;
+
+    if (plan->new_vda[leader_vda] != INVALID_VDA) return TRUE;
 
-        /* Sanity check. */
-        if (pg->label.file_pgnum != of->pos.pgnum) {
-            of->error = TRUE;
-            report_error("fs: write: inconsistent page numbers");
-            break;
+    vda = leader_vda;
+    while (vda != 0) {
+        if (vda >= fs->length || plan->new_vda[vda] != INVALID_VDA) {
+            report_error("fs: defrag: broken chain at VDA = %u", vda);
+            return FALSE;
         }
 
-        /* Another sanity check. */
-        if (of->pos.pos > pg->label.nbytes) {
-            of->error = TRUE;
-            report_error("fs: write: inconsistent offset in page");
-            break;
+        while (plan->next < fs->length && plan->reserved[plan->next])
+            plan->next++;
+        if (plan->next >= fs->length) {
+            report_error("fs: defrag: not enough pages");
+            return FALSE;
         }
 
-        /* If has not reached the end of the page. */
-        if (of->pos.pos < pg->label.nbytes) {
-            nbytes = pg->label.nbytes - of->pos.pos;
-            if (nbytes > len) nbytes = len;
-
-            if (src) {
-                memcpy(&pg->data[of->pos.pos], &src[pos], nbytes);
-            }
-
-            of->pos.pos += nbytes;
-            pos += nbytes;
-            len -= nbytes;
-            continue;
+        plan->new_vda[vda] = plan->next++;
+        pg = get_page_label(fs, vda);
+        if (!real_to_virtual(fs, pg->label.next_rda, &vda)) {
+            report_error("fs: defrag: invalid next_rda at VDA = %u", vda);
+            return FALSE;
         }
+    }
+    return TRUE;
+}
 
-        /* Go to the next page. */
-        rda = pg->label.next_rda;
-        if (!real_to_virtual(fs, rda, &of->pos.vda)) {
-            of->error = TRUE;
-            report_error("fs: write: could not convert real "
-                         "to virtual disk address");
-            break;
-        }
+/* Auxiliary function to fs_defrag() to queue the subdirectories. */
+static
+int queue_directory_cb(const struct fs *fs,
+                       const struct directory_entry *de,
+                       void *arg)
+{
+    struct defrag_plan *plan;
 
+    plan = (struct defrag_plan *) arg;
+    if (!(de->fe.sn.word1 & SN_DIRECTORY)) return 1;
+    if (de->fe.leader_vda >= fs->length) return 1;
+    if (plan->new_vda[de->fe.leader_vda] != INVALID_VDA) return 1;
 
-        /* If there is a valid next page. */
-        if (of->pos.vda != 0) {
-            of->pos.pos = 0;
-            of->pos.pgnum += 1;
-            continue;
-        }
+    /* Each directory is queued at most once (by its leader). */
+    if (plan->queued[de->fe.leader_vda]) return 1;
+    plan->queued[de->fe.leader_vda] = TRUE;
+    plan->dirs[plan->num_dirs++] = de->fe;
+    return 1;
+}
 
-        if (!extend) break;
+/* Auxiliary function to fs_defrag().
+ * Plans the new layout: SysDir, the DiskDescriptor and the other
+ * directories (breadth first) come first, then the `num_hot` files
+ * in `hot_files`, and then the remaining files by their current
+ * position.
+ * Returns TRUE on success.
+ */
+static
+int plan_layout(const struct fs *fs, struct defrag_plan *plan,
+                const char * const *hot_files, size_t num_hot)
+{
+    struct file_entry fe;
+    size_t i;
+    uint16_t vda;
 
-        /* Check if the last page can be extended. */
-        of->pos.vda = vda;
-        if (pg->label.nbytes < PAGE_DATA_SIZE) {
-            nbytes = PAGE_DATA_SIZE - pg->label.nbytes;
-            if (nbytes > len) nbytes = len;
+    if (!fs_file_entry(fs, 1, &fe)) return FALSE;
+    plan->queued[1] = TRUE;
+    plan->dirs[plan->num_dirs++] = fe;
 
-            pg->label.nbytes += nbytes;
-            continue;
-        }
+    for (i = 0; i < plan->num_dirs; i++) {
+        if (!place_file(fs, plan, plan->dirs[i].leader_vda)) return FALSE;
 
-        /* Otherwise, allocate a new page. */
-        if (!find_free_page(fs, &vda)) {
-            of->error = TRUE;
-            report_error("fs: write: disk full");
-            break;
+        if (i == 0 && find_disk_descriptor(fs, &fe) > 0) {
+            if (!place_file(fs, plan, fe.leader_vda)) return FALSE;
         }
 
-        new_pg = &fs->pages[vda];
+        if (!fs_scan_directory(fs, &plan->dirs[i], &queue_directory_cb,
+                               plan))
+            return FALSE;
+    }
 
-        if (!virtual_to_real(fs, pg->page_vda, &new_pg->label.prev_rda)) {
-            of->error = TRUE;
-            report_error("fs: write: could not convert virtual "
-                         "to real disk address");
-            break;
+    for (i = 0; i < num_hot; i++) {
+        if (!fs_find_file(fs, hot_files[i], &fe)) {
+            report_error("fs: defrag: could not find `%s`", hot_files[i]);
+            return FALSE;
         }
+        if (!place_file(fs, plan, fe.leader_vda)) return FALSE;
+    }
 
-        if (!virtual_to_real(fs, new_pg->page_vda, &pg->label.next_rda)) {
-            of->error = TRUE;
-            report_error("fs: write: could not convert virtual "
-                         "to real disk address");
-            break;
-        }
+    for (vda = 1; vda < fs->length; vda++) {
+        if (!is_leader_page(get_page_label(fs, vda))) continue;
+        if (!place_file(fs, plan, vda)) return FALSE;
+    }
+    return TRUE;
+}
 
-        nbytes = len;
-        if (nbytes > PAGE_DATA_SIZE)
-            nbytes = PAGE_DATA_SIZE;
+/* Auxiliary function to fs_defrag().
+ * Converts the real address `rda` of a page to its real address
+ * in the new layout `plan`.
+ * Returns the new real address (or zero, if it is not mapped).
+ */
+static
+uint16_t relocate_rda(const struct fs *fs, const struct defrag_plan *plan,
+                      uint16_t rda)
+{
+    uint16_t vda;
 
-        new_pg->label.next_rda = 0;
-        new_pg->label.nbytes = nbytes;
-        new_pg->label.file_pgnum = pg->label.file_pgnum + 1;
-        new_pg->label.version = pg->label.version;
-        new_pg->label.sn = pg->label.sn;
-    }
+    if (rda == 0 || !real_to_virtual(fs, rda, &vda)) return 0;
+    if (plan->new_vda[vda] == INVALID_VDA) return 0;
+    return fs->vda_to_rda[plan->new_vda[vda]];
+}
 
-    return pos;
+/* Auxiliary function to fs_defrag().
+ * Converts the hint at `offset` in the data of the leader page `pg`
+ * to the new layout `plan`.
+ */
+static
+void relocate_hint(const struct fs *fs, const struct defrag_plan *plan,
+                   struct page *pg, size_t offset)
+{
+    uint16_t vda;
+
+    vda = read_word_bs(pg->data, offset);
+    if (vda < fs->length && plan->new_vda[vda] != INVALID_VDA)
+        write_word_bs(pg->data, offset, plan->new_vda[vda]);
 }
 
-int fs_trim(struct fs *fs, struct open_file *of)
+/* Auxiliary function to fs_defrag().
+ * Moves the pages to their places in the new layout `plan`, fixing
+ * the links between the pages and the hints in the leader pages.
+ * The pages left over become free pages.
+ * Returns TRUE on success.
+ */
+static
+int move_pages(struct fs *fs, const struct defrag_plan *plan)
 {
-    struct page *pg;
-    uint16_t vda, rda;
-    int should_keep;
+    struct page *old_pages, *pg;
+    uint16_t vda, new_vda;
 
-    if (of->error) {
-        report_error("fs: trim: error on file");
+    /* Decode all the pages of mapped images first. */
+    for (vda = 0; vda < fs->length; vda++)
+        get_page(fs, vda);
+
+    old_pages = (struct page *)
+        malloc(((size_t) fs->length) * sizeof(struct page));
+    if (unlikely(!old_pages)) {
+        report_error("fs: defrag: memory exhausted");
         return FALSE;
     }
+    memcpy(old_pages, fs->pages, ((size_t) fs->length) * sizeof(struct page));
 
-    should_keep = TRUE;
-    vda = of->pos.vda;
-    while (vda != 0) {
-        if (vda >= fs->length) {
-            of->error = TRUE;
-            report_error("fs: trim: invalid VDA: %u", vda);
-            break;
-        }
+    for (vda = 0; vda < fs->length; vda++) {
+        if (plan->reserved[vda]) continue;
 
         pg = &fs->pages[vda];
-        rda = pg->label.next_rda;
+        memset(pg, 0, sizeof(struct page));
+        pg->page_vda = vda;
+        pg->header[1] = fs->vda_to_rda[vda];
+        pg->label.version = VERSION_FREE;
+        pg->label.sn.word1 = VERSION_FREE;
+        pg->label.sn.word2 = VERSION_FREE;
+    }
 
-        if (!should_keep) {
-            /* Remove the page. */
-            pg->label.version = VERSION_FREE;
-            pg->label.prev_rda = 0;
-            pg->label.next_rda = 0;
+    for (vda = 0; vda < fs->length; vda++) {
+        new_vda = plan->new_vda[vda];
+        if (new_vda == INVALID_VDA || plan->reserved[vda]) continue;
+
+        pg = &fs->pages[new_vda];
+        *pg = old_pages[vda];
+        pg->page_vda = new_vda;
+        pg->header[1] = fs->vda_to_rda[new_vda];
+        pg->label.next_rda = relocate_rda(fs, plan, pg->label.next_rda);
+        pg->label.prev_rda = relocate_rda(fs, plan, pg->label.prev_rda);
+
+        if (pg->label.file_pgnum == 0) {
+            relocate_hint(fs, plan, pg, LEADER_DIRFPHINT + 8);
+            relocate_hint(fs, plan, pg, LEADER_LASTPAGEHINT);
         }
+    }
 
-        if (vda == of->pos.vda) {
-            pg->label.nbytes = of->pos.pos;
-            /* If the current page is full, keep the next page. */
-            if (pg->label.nbytes != PAGE_DATA_SIZE) {
-                pg->label.next_rda = 0;
-                should_keep = FALSE;
-            }
-        } else if (should_keep) {
-            /* Set nbytes to zero in the page after the current. */
-            pg->label.nbytes = 0;
-            pg->label.next_rda = 0;
-            should_keep = FALSE;
-        }
+    free((void *) old_pages);
+    return TRUE;
+}
 
-        /* Go to the next page. */
-        if (!real_to_virtual(fs, rda, &vda)) {
-            of->error = TRUE;
-            report_error("fs: trim: could not convert real "
-                         "to virtual disk address");
-            break;
+/* Auxiliary function to fs_defrag() and fs_repair() to collect the
+ * valid entries of a directory in the entry_list `arg` (so that the
+ * directory can be modified after the walk).
+ */
+static
+int collect_entry_cb(const struct fs *fs, const struct raw_dir_entry *re,
+                     void *arg)
+{
+    struct entry_list *list;
+    struct raw_dir_entry *entries;
+    size_t capacity;
+
+    (void) fs;
+    list = (struct entry_list *) arg;
+    list->end = re->offset + 2 * ((size_t) re->length);
+    if (!re->is_valid) return 1;
+
+    if (list->num_entries == list->capacity) {
+        capacity = (list->capacity == 0) ? 64 : 2 * list->capacity;
+        entries = (struct raw_dir_entry *)
+            realloc(list->entries, capacity * sizeof(struct raw_dir_entry));
+        if (unlikely(!entries)) {
+            report_error("fs: collect_entries: memory exhausted");
+            list->exhausted = TRUE;
+            return -1;
         }
+        list->entries = entries;
+        list->capacity = capacity;
     }
 
-    return TRUE;
+    list->entries[list->num_entries++] = *re;
+    return 1;
 }
 
-int fs_extract_file(const struct fs *fs, const struct file_entry *fe,
-                    const char *output_filename)
+/* Auxiliary function to fs_defrag().
+ * Converts the leader VDAs in the entries of all the directories
+ * to the new layout `plan`.
+ * Returns TRUE on success.
+ */
+static
+int relocate_entries(struct fs *fs, struct defrag_plan *plan)
 {
-    uint8_t buffer[PAGE_DATA_SIZE];
-    struct open_file of;
-    FILE *fp;
-    size_t nbytes;
-    size_t ret;
-
-    if (!fs_open(fs, fe, &of, FALSE)) {
-        report_error("fs: extract_file: could not open filesystem file");
-        return FALSE;
-    }
+    struct file_entry dir_fe;
+    const struct raw_dir_entry *re;
+    uint8_t buffer[2];
+    uint16_t vda;
+    size_t i, j;
 
-    fp = fopen(output_filename, "wb");
-    if (!fp) {
-        report_error("fs: extract_file: could not open `%s` "
-                     "for writing", output_filename);
-        return FALSE;
-    }
+    for (i = 0; i < plan->num_dirs; i++) {
+        vda = plan->new_vda[plan->dirs[i].leader_vda];
+        if (!fs_file_entry(fs, vda, &dir_fe)) return FALSE;
 
-    while (TRUE) {
-        nbytes = fs_read(fs, &of, buffer, sizeof(buffer));
-        if (of.error) {
-            report_error("fs: extract_file: error while reading");
-            fclose(fp);
+        plan->list.num_entries = 0;
+        if (!walk_directory(fs, &dir_fe, &collect_entry_cb, &plan->list))
             return FALSE;
-        }
 
-        if (nbytes > 0) {
-            ret = fwrite(buffer, 1, nbytes, fp);
-            if (ret != nbytes) {
-                report_error("fs: extract_file: error while writing "
-                             "`%s`", output_filename);
-                fclose(fp);
+        for (j = 0; j < plan->list.num_entries; j++) {
+            re = &plan->list.entries[j];
+            vda = re->de.fe.leader_vda;
+            if (vda >= fs->length || plan->new_vda[vda] == INVALID_VDA)
+                continue;
+
+            write_word_bs(buffer, 0, plan->new_vda[vda]);
+            if (!write_file_at(fs, &dir_fe,
+                               re->offset + DIRECTORY_LEADER_VDA,
+                               buffer, sizeof(buffer)))
                 return FALSE;
-            }
         }
-
-        if (nbytes < sizeof(buffer)) break;
     }
-
-    fclose(fp);
     return TRUE;
 }
 
-int fs_replace_file(struct fs *fs, const struct file_entry *fe,
-                    const char *input_filename)
+int fs_defrag(struct fs *fs, const char * const *hot_files,
+              size_t num_hot, size_t *num_moved)
 {
-    uint8_t buffer[PAGE_DATA_SIZE];
-    struct open_file of;
-    FILE *fp;
-    size_t nbytes;
-    size_t ret;
+    struct defrag_plan plan;
+    const struct page *pg;
+    size_t size, i;
+    uint16_t vda;
+    int ret;
 
-    if (!fs_open(fs, fe, &of, FALSE)) {
-        report_error("fs: replace_file: could not open filesystem file");
-        return FALSE;
+    *num_moved = 0;
+    plan.new_vda = (uint16_t *) malloc(fs->length * sizeof(uint16_t));
+    plan.reserved = (uint8_t *) calloc(fs->length, sizeof(uint8_t));
+    plan.queued = (uint8_t *) calloc(fs->length, sizeof(uint8_t));
+    plan.dirs = (struct file_entry *)
+        malloc(fs->length * sizeof(struct file_entry));
+    plan.num_dirs = 0;
+    plan.list.entries = NULL;
+    plan.list.num_entries = 0;
+    plan.list.capacity = 0;
+    plan.list.exhausted = FALSE;
+    plan.next = 1;
+
+    ret = FALSE;
+    if (unlikely(!plan.new_vda || !plan.reserved || !plan.queued
+                 || !plan.dirs)) {
+        report_error("fs: defrag: memory exhausted");
+        goto done;
     }
 
-    fp = fopen(input_filename, "rb");
-    if (!fp) {
-        report_error("fs: repalce_file: could not open `%s`",
-                     input_filename);
-        return FALSE;
+    /* The boot page and the bad pages stay where they are. */
+    for (vda = 0; vda < fs->length; vda++) {
+        plan.new_vda[vda] = INVALID_VDA;
+        pg = get_page_label(fs, vda);
+        if (vda == 0 || pg->label.version == VERSION_BAD) {
+            plan.new_vda[vda] = vda;
+            plan.reserved[vda] = TRUE;
+        }
     }
 
-    while (TRUE) {
-        nbytes = fread(buffer, 1, sizeof(buffer), fp);
+    if (!plan_layout(fs, &plan, hot_files, num_hot)) goto done;
 
-        if (nbytes > 0) {
-            ret = fs_write(fs, &of, buffer, nbytes, TRUE);
-            if (of.error || (ret != nbytes)) {
-                report_error("fs: replace_file: error while writing");
-                fclose(fp);
-                return FALSE;
-            }
-        }
+    for (vda = 0; vda < fs->length; vda++) {
+        if (plan.new_vda[vda] != INVALID_VDA && plan.new_vda[vda] != vda)
+            (*num_moved)++;
+    }
+
+    if (*num_moved > 0) {
+        if (!move_pages(fs, &plan)) goto done;
 
-        if (nbytes < sizeof(buffer)) break;
+        /* Everything derived from the pages is stale now, and all the
+         * pages must be written.
+         */
+        invalidate_state(fs);
+        size = (((size_t) fs->length) + FREE_MAP_BITS - 1) / FREE_MAP_BITS;
+        for (i = 0; i < size; i++)
+            fs->dirty_map[i] = ~0UL;
+
+        if (!relocate_entries(fs, &plan)) goto done;
+        if (!update_disk_descriptor(fs, NULL)) goto done;
     }
+    ret = TRUE;
+
+done:
+    if (plan.new_vda) free((void *) plan.new_vda);
+    if (plan.reserved) free((void *) plan.reserved);
+    if (plan.queued) free((void *) plan.queued);
+    if (plan.dirs) free((void *) plan.dirs);
+    if (plan.list.entries) free((void *) plan.list.entries);
+    return ret;
+}
 
-    if (!fs_trim(fs, &of)) {
-        report_error("fs: replace_file: could not trim");
-        fclose(fp);
-        return FALSE;
+/* Auxiliary function to fs_repair() to sort the used pages by file
+ * (serial number and version) and page number.
+ */
+static
+int compare_repair_pages(const void *a, const void *b)
+{
+    const struct repair_page *pa, *pb;
+
+    pa = (const struct repair_page *) a;
+    pb = (const struct repair_page *) b;
+    if (pa->sn.word1 != pb->sn.word1)
+        return (pa->sn.word1 < pb->sn.word1) ? -1 : 1;
+    if (pa->sn.word2 != pb->sn.word2)
+        return (pa->sn.word2 < pb->sn.word2) ? -1 : 1;
+    if (pa->version != pb->version)
+        return (pa->version < pb->version) ? -1 : 1;
+    if (pa->file_pgnum != pb->file_pgnum)
+        return (pa->file_pgnum < pb->file_pgnum) ? -1 : 1;
+    if (pa->vda != pb->vda)
+        return (pa->vda < pb->vda) ? -1 : 1;
+    return 0;
+}
+
+/* Auxiliary function to fs_repair().
+ * Compares the file `fe` with the serial number `sn` and `version`.
+ * Returns a negative number, zero or a positive number if the file
+ * comes before, is the same or comes after.
+ */
+static
+int compare_file_key(const struct file_entry *fe,
+                     const struct serial_number *sn, uint16_t version)
+{
+    if (fe->sn.word1 != sn->word1)
+        return (fe->sn.word1 < sn->word1) ? -1 : 1;
+    if (fe->sn.word2 != sn->word2)
+        return (fe->sn.word2 < sn->word2) ? -1 : 1;
+    if (fe->version != version)
+        return (fe->version < version) ? -1 : 1;
+    return 0;
+}
+
+/* Auxiliary function to fs_repair().
+ * Finds the recovered file with the serial number `sn` and `version`
+ * (the files are sorted, so this is a binary search).
+ * Returns the index of the file, or INDEX_NONE if not found.
+ */
+static
+uint32_t find_repair_file(const struct repair_context *ctx,
+                          const struct serial_number *sn, uint16_t version)
+{
+    uint32_t lo, hi, mid;
+    int cmp;
+
+    lo = 0;
+    hi = ctx->num_files;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        cmp = compare_file_key(&ctx->files[mid].fe, sn, version);
+        if (cmp == 0) return mid;
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
+    return INDEX_NONE;
+}
 
-    fclose(fp);
-    return TRUE;
+/* Auxiliary function to fs_repair().
+ * Releases the page at `vda`, which is not part of any file that
+ * can be recovered.
+ */
+static
+void free_repair_page(struct fs *fs, struct repair_context *ctx,
+                      uint16_t vda)
+{
+    struct page *pg;
+
+    pg = get_page_label(fs, vda);
+    pg->label.version = VERSION_FREE;
+    pg->label.prev_rda = 0;
+    pg->label.next_rda = 0;
+    mark_page_dirty(fs, vda);
+    ctx->rep->freed_pages++;
 }
 
-int fs_file_entry(const struct fs *fs, uint16_t leader_vda,
-                  struct file_entry *fe)
+/* Auxiliary function to fs_repair().
+ * Fixes the headers of all pages, and collects the used pages in
+ * `ctx->pages`. The pages with invalid labels are released.
+ */
+static
+void collect_used_pages(struct fs *fs, struct repair_context *ctx)
 {
-    const struct page *pg;
+    struct repair_page *rp;
+    struct page *pg;
+    uint16_t vda;
+
+    for (vda = 0; vda < fs->length; vda++) {
+        pg = get_page_label(fs, vda);
+        if (pg->header[0] != 0 || pg->header[1] != fs->vda_to_rda[vda]) {
+            pg->header[0] = 0;
+            pg->header[1] = fs->vda_to_rda[vda];
+            mark_page_dirty(fs, vda);
+            ctx->rep->fixed_labels++;
+        }
+
+        /* The boot page is not part of any file. */
+        if (vda == 0 || pg->label.version == VERSION_FREE) continue;
+
+        if (pg->label.version == VERSION_BAD) {
+            if (pg->label.sn.word1 != VERSION_BAD
+                || pg->label.sn.word2 != VERSION_BAD) {
+                pg->label.sn.word1 = VERSION_BAD;
+                pg->label.sn.word2 = VERSION_BAD;
+                mark_page_dirty(fs, vda);
+                ctx->rep->fixed_labels++;
+            }
+            continue;
+        }
+
+        if (pg->label.version == 0 || pg->label.nbytes > PAGE_DATA_SIZE) {
+            free_repair_page(fs, ctx, vda);
+            continue;
+        }
 
-    if (leader_vda >= fs->length) {
-        report_error("fs: file_entry: invalid VDA: %u",
-                     leader_vda);
-        return FALSE;
+        rp = &ctx->pages[ctx->num_pages++];
+        rp->sn = pg->label.sn;
+        rp->version = pg->label.version;
+        rp->file_pgnum = pg->label.file_pgnum;
+        rp->vda = vda;
     }
+}
 
-    pg = &fs->pages[leader_vda];
-    fe->sn = pg->label.sn;
-    fe->version = pg->label.version;
-    fe->blank = 0;
-    fe->leader_vda = leader_vda;
-    return TRUE;
+/* Auxiliary function to fs_repair().
+ * Writes the word `w` at `offset` in the data of the page `pg`.
+ * Returns 1 if the word changed, or 0 otherwise.
+ */
+static
+int write_hint(struct page *pg, size_t offset, uint16_t w)
+{
+    if (read_word_bs(pg->data, offset) == w) return 0;
+    write_word_bs(pg->data, offset, w);
+    return 1;
 }
 
-int fs_file_length(const struct fs *fs, const struct file_entry *fe,
-                   size_t *length)
+/* Auxiliary function to fs_repair().
+ * Links the `num` pages in `chain` (starting with the leader page)
+ * in order, and fixes the name and the last page hint of the leader.
+ */
+static
+void link_chain(struct fs *fs, struct repair_context *ctx,
+                const struct repair_page *chain, size_t num)
 {
-    struct open_file of;
-    size_t l, nbytes;
+    char name[FILENAME_LENGTH];
+    struct page *pg;
+    uint16_t prev_rda, next_rda, nbytes;
+    uint8_t slen;
+    size_t k, len;
+    int changed;
+
+    for (k = 0; k < num; k++) {
+        pg = get_page_label(fs, chain[k].vda);
+        prev_rda = (k == 0) ? 0 : fs->vda_to_rda[chain[k - 1].vda];
+        next_rda = (k + 1 == num) ? 0 : fs->vda_to_rda[chain[k + 1].vda];
+
+        /* Only the last page can be short (but not the leader). */
+        nbytes = pg->label.nbytes;
+        if (k == 0 || k + 1 < num) nbytes = PAGE_DATA_SIZE;
+
+        if (pg->label.prev_rda == prev_rda && pg->label.next_rda == next_rda
+            && pg->label.nbytes == nbytes) continue;
+
+        pg->label.prev_rda = prev_rda;
+        pg->label.next_rda = next_rda;
+        pg->label.nbytes = nbytes;
+        mark_page_dirty(fs, chain[k].vda);
+        ctx->rep->fixed_labels++;
+    }
 
-    if (!fs_open(fs, fe, &of, FALSE)) {
-        report_error("fs: file_length: could not open filesystem file");
-        return FALSE;
+    pg = get_page(fs, chain[0].vda);
+    changed = 0;
+
+    slen = pg->data[LEADER_FILENAME];
+    if (slen == 0 || slen >= FILENAME_LENGTH) {
+        sprintf(name, "Lost%u", (unsigned int) chain[0].sn.word2);
+        len = strlen(name);
+        pg->data[LEADER_FILENAME] = (uint8_t) (len + 1);
+        memcpy(&pg->data[LEADER_FILENAME + 1], name, len);
+        pg->data[LEADER_FILENAME + 1 + len] = '.';
+        changed = 1;
     }
 
-    l = 0;
-    while (TRUE) {
-        nbytes = fs_read(fs, &of, NULL, PAGE_DATA_SIZE);
-        if (of.error) {
-            report_error("fs: file_length: error while reading");
-            return FALSE;
+    changed += write_hint(pg, LEADER_LASTPAGEHINT, chain[num - 1].vda);
+    changed += write_hint(pg, LEADER_LASTPAGEHINT + 2,
+                          chain[num - 1].file_pgnum);
+    changed += write_hint(pg, LEADER_LASTPAGEHINT + 4,
+                          get_page_label(fs, chain[num - 1].vda)
+                          ->label.nbytes);
+    if (changed) {
+        mark_page_dirty(fs, chain[0].vda);
+        ctx->rep->fixed_hints++;
+    }
+}
+
+/* Auxiliary function to fs_repair().
+ * Rebuilds the chains of all files from the sorted used pages.
+ * Each file keeps its pages from the leader page up to the first
+ * missing page number; the other pages (including the pages of
+ * the files without a leader page) are released.
+ */
+static
+void link_files(struct fs *fs, struct repair_context *ctx)
+{
+    const struct repair_page *rp;
+    struct repair_file *rf;
+    size_t i, j, k, num;
+
+    for (i = 0; i < ctx->num_pages; i = j) {
+        rp = &ctx->pages[i];
+        for (j = i + 1; j < ctx->num_pages; j++) {
+            if (ctx->pages[j].sn.word1 != rp->sn.word1
+                || ctx->pages[j].sn.word2 != rp->sn.word2
+                || ctx->pages[j].version != rp->version) break;
         }
 
-        l += nbytes;
-        if (nbytes != PAGE_DATA_SIZE) break;
+        /* The chain is compacted at the start of the group. */
+        num = 0;
+        for (k = i; k < j; k++) {
+            if (ctx->pages[k].file_pgnum == num)
+                ctx->pages[i + num++] = ctx->pages[k];
+            else
+                free_repair_page(fs, ctx, ctx->pages[k].vda);
+        }
+        if (num == 0) continue;
+
+        link_chain(fs, ctx, &ctx->pages[i], num);
+
+        rf = &ctx->files[ctx->num_files];
+        rf->fe.sn = rp->sn;
+        rf->fe.version = rp->version;
+        rf->fe.blank = 0;
+        rf->fe.leader_vda = rp->vda;
+        rf->has_entry = FALSE;
+        rf->is_orphan = FALSE;
+        rf->queued = FALSE;
+        rf->root = ctx->num_files;
+        ctx->file_of[rp->vda] = ctx->num_files++;
     }
+}
 
-    *length = l;
+/* Auxiliary function to fs_repair().
+ * Gives an empty data page to the files left with the leader page
+ * alone (as fs_create_file() does), so that they can be written.
+ * Returns TRUE on success.
+ */
+static
+int complete_files(struct fs *fs, struct repair_context *ctx)
+{
+    const struct file_entry *fe;
+    struct page *leader_pg, *pg;
+    uint16_t vda;
+    uint32_t f;
+
+    for (f = 0; f < ctx->num_files; f++) {
+        fe = &ctx->files[f].fe;
+        leader_pg = get_page(fs, fe->leader_vda);
+        if (leader_pg->label.next_rda != 0) continue;
+
+        if (!allocate_pages(fs, fe->leader_vda, 1, &vda)) return FALSE;
+        pg = get_page_for_write(fs, vda);
+        pg->label.next_rda = 0;
+        pg->label.prev_rda = fs->vda_to_rda[fe->leader_vda];
+        pg->label.unused = 0;
+        pg->label.nbytes = 0;
+        pg->label.file_pgnum = 1;
+        pg->label.version = fe->version;
+        pg->label.sn = fe->sn;
+        memset(pg->data, 0, PAGE_DATA_SIZE);
+
+        leader_pg->label.next_rda = fs->vda_to_rda[vda];
+        write_word_bs(leader_pg->data, LEADER_LASTPAGEHINT, vda);
+        write_word_bs(leader_pg->data, LEADER_LASTPAGEHINT + 2, 1);
+        write_word_bs(leader_pg->data, LEADER_LASTPAGEHINT + 4, 0);
+
+        mark_page_dirty(fs, fe->leader_vda);
+        mark_page_dirty(fs, vda);
+        update_label(fs, fe->leader_vda);
+        update_label(fs, vda);
+        ctx->rep->fixed_labels++;
+    }
     return TRUE;
 }
 
-int fs_file_info(const struct fs *fs, const struct file_entry *fe,
-                 struct file_info *finfo)
+/* Auxiliary function to fs_repair().
+ * Points the directory hint in the leader page of the file `f` to
+ * the directory `d`.
+ */
+static
+void set_parent_hint(struct fs *fs, struct repair_context *ctx,
+                     uint32_t f, uint32_t d)
 {
-    const struct page *pg;
-
-    if (fe->leader_vda >= fs->length) {
-        report_error("fs: file_info: invalid VDA: %u",
-                     fe->leader_vda);
-        return FALSE;
+    const struct file_entry *dir_fe;
+    struct page *pg;
+    int changed;
+
+    dir_fe = &ctx->files[d].fe;
+    pg = get_page(fs, ctx->files[f].fe.leader_vda);
+    changed = write_hint(pg, LEADER_DIRFPHINT, dir_fe->sn.word1);
+    changed += write_hint(pg, LEADER_DIRFPHINT + 2, dir_fe->sn.word2);
+    changed += write_hint(pg, LEADER_DIRFPHINT + 4, dir_fe->version);
+    changed += write_hint(pg, LEADER_DIRFPHINT + 8, dir_fe->leader_vda);
+    if (changed) {
+        mark_page_dirty(fs, ctx->files[f].fe.leader_vda);
+        ctx->rep->fixed_hints++;
     }
+}
 
-    pg = &fs->pages[fe->leader_vda];
-    copy_name(finfo->filename, (const char *) &pg->data[LEADER_FILENAME]);
-    finfo->created = read_alto_time(pg->data, LEADER_CREATED);
-    finfo->written = read_alto_time(pg->data, LEADER_WRITTEN);
-    finfo->read = read_alto_time(pg->data, LEADER_READ);
-
-    finfo->consecutive = pg->data[LEADER_CONSECUTIVE];
-    finfo->change_sn = pg->data[LEADER_CHANGESN];
-
-    finfo->dir_fe.sn.word1 = read_word_bs(pg->data, LEADER_DIRFPHINT);
-    finfo->dir_fe.sn.word2 = read_word_bs(pg->data, LEADER_DIRFPHINT + 2);
-    finfo->dir_fe.version = read_word_bs(pg->data, LEADER_DIRFPHINT + 4);
-    finfo->dir_fe.blank = read_word_bs(pg->data, LEADER_DIRFPHINT + 6);
-    finfo->dir_fe.leader_vda = read_word_bs(pg->data, LEADER_DIRFPHINT + 8);
+/* Auxiliary function to fs_repair().
+ * Queues the file `f` to be scanned, if it is a directory that was
+ * not queued yet.
+ */
+static
+void queue_repair_dir(struct repair_context *ctx, uint32_t f)
+{
+    if (!(ctx->files[f].fe.sn.word1 & SN_DIRECTORY)) return;
+    if (ctx->files[f].queued) return;
 
-    finfo->last_page.vda = read_word_bs(pg->data, LEADER_LASTPAGEHINT);
-    finfo->last_page.pgnum = read_word_bs(pg->data, LEADER_LASTPAGEHINT + 2);
-    finfo->last_page.pos = read_word_bs(pg->data, LEADER_LASTPAGEHINT + 4);
-    return TRUE;
+    ctx->files[f].queued = TRUE;
+    ctx->dirs[ctx->num_dirs++] = f;
 }
 
-/* Auxiliary callback used by fs_find_file().
- * The `arg` parameter is a pointer to find_result structure.
+/* Auxiliary function to fs_repair().
+ * Truncates the directory `dir_fe` at `end` (the end of the last
+ * entry that could be read).
+ * Returns TRUE on success.
  */
 static
-int find_file_cb(const struct fs *fs,
-                 const struct directory_entry *de,
-                 void *arg)
+int truncate_directory(struct fs *fs, const struct file_entry *dir_fe,
+                       size_t end)
 {
-    struct find_result *res;
-    struct file_info finfo;
-
-    res = (struct find_result *) arg;
-    if (!fs_file_info(fs, &de->fe, &finfo)) {
-        report_error("fs: find_file: could not get file information");
-        return -1;
-    }
+    struct open_file of;
 
-    if (strncmp(finfo.filename, res->filename, res->flen) == 0) {
-        res->fe = de->fe;
-        res->found = TRUE;
-        /* Stop the search in this directory. */
-        return 0;
-    }
-    return 1;
+    if (!fs_open(fs, dir_fe, &of, FALSE)) return FALSE;
+    if (fs_read(fs, &of, NULL, end) != end || of.error) return FALSE;
+    if (!fs_trim(fs, &of) || of.error) return FALSE;
+    return update_last_page_hint(fs, dir_fe);
 }
 
-int fs_find_file(const struct fs *fs, const char *filename,
-                 struct file_entry *fe)
+/* Auxiliary function to fs_repair().
+ * Returns the directory from which the traversal that reached the
+ * file `f` started (SysDir or an orphan directory).
+ */
+static
+uint32_t find_repair_root(const struct repair_context *ctx, uint32_t f)
 {
-    struct find_result res;
-    struct file_entry root_fe;
-    struct file_entry cur_fe;
-    size_t pos, npos;
+    while (ctx->files[f].root != f) f = ctx->files[f].root;
+    return f;
+}
 
-    if (!fs_file_entry(fs, 1, &root_fe)) {
-        report_error("fs: find_file: error finding SysDir");
-        return FALSE;
+/* Auxiliary function to fs_repair().
+ * Fixes the entries of the directory `d`: the entries of lost files
+ * are freed, and the entries pointing to a wrong leader page are
+ * pointed to the leader with the same serial number. A directory
+ * that cannot be read to the end is truncated.
+ * Returns TRUE on success.
+ */
+static
+int repair_directory(struct fs *fs, struct repair_context *ctx, uint32_t d)
+{
+    const struct raw_dir_entry *re;
+    struct file_entry dir_fe;
+    uint8_t buffer[2];
+    uint32_t f;
+    size_t i;
+
+    dir_fe = ctx->files[d].fe;
+    ctx->list.num_entries = 0;
+    ctx->list.end = 0;
+    if (!walk_directory(fs, &dir_fe, &collect_entry_cb, &ctx->list)) {
+        /* Keep the entries before the damage. */
+        if (ctx->list.exhausted
+            || !truncate_directory(fs, &dir_fe, ctx->list.end)) {
+            report_error("fs: repair: could not repair directory "
+                         "at VDA = %u", dir_fe.leader_vda);
+            return FALSE;
+        }
+        ctx->rep->truncated_dirs++;
     }
-
-    pos = 0;
-    cur_fe = root_fe;
-    while (filename[pos]) {
-        if (filename[pos] == '<') {
-            cur_fe = root_fe;
-            pos++;
+    if (dir_fe.leader_vda == 1) ctx->sysdir_end = ctx->list.end;
+
+    for (i = 0; i < ctx->list.num_entries; i++) {
+        re = &ctx->list.entries[i];
+        f = find_repair_file(ctx, &re->de.fe.sn, re->de.fe.version);
+        if (f == INDEX_NONE) {
+            write_word_bs(buffer, 0, (DIR_ENTRY_MISSING << 10) | re->length);
+            if (!write_file_at(fs, &dir_fe, re->offset, buffer, 2))
+                return FALSE;
+            ctx->rep->removed_entries++;
             continue;
         }
 
-        npos = pos + 1;
-        while (filename[npos]) {
-            if (filename[npos] == '<' || filename[npos] == '>')
-                break;
-            npos++;
+        if (re->de.fe.leader_vda != ctx->files[f].fe.leader_vda) {
+            write_word_bs(buffer, 0, ctx->files[f].fe.leader_vda);
+            if (!write_file_at(fs, &dir_fe,
+                               re->offset + DIRECTORY_LEADER_VDA,
+                               buffer, 2))
+                return FALSE;
+            ctx->rep->fixed_entries++;
         }
 
-        res.filename = &filename[pos];
-        res.flen = npos - pos;
-        res.found = FALSE;
-
-        if (res.flen >= FILENAME_LENGTH) return FALSE;
-
-        if (!fs_scan_directory(fs, &cur_fe, &find_file_cb, &res)) {
-            report_error("fs: find_file: could not scan directory");
-            return FALSE;
+        /* An orphan directory listed by a directory outside of its
+         * own tree is not an orphan anymore. Only the orphan that
+         * closes a cycle keeps the mark, so that the cycle is still
+         * entered in SysDir (once).
+         */
+        if (ctx->files[f].is_orphan && find_repair_root(ctx, d) != f) {
+            ctx->files[f].is_orphan = FALSE;
+            ctx->files[f].root = d;
+            ctx->files[f].has_entry = FALSE;
         }
 
-        if (!res.found) return FALSE;
-        cur_fe = res.fe;
-
-        if (filename[npos] == '>') {
-            /* Checks if its a directory. */
-            if (!(cur_fe.sn.word1 & SN_DIRECTORY)) {
-                report_error("fs: find_file: not a valid directory");
-                return FALSE;
-            }
-            npos++;
+        if (!ctx->files[f].has_entry) {
+            ctx->files[f].has_entry = TRUE;
+            if (!ctx->files[f].is_orphan) ctx->files[f].root = d;
+            set_parent_hint(fs, ctx, f, d);
         }
-
-        pos = npos;
+        queue_repair_dir(ctx, f);
     }
-
-    *fe = cur_fe;
     return TRUE;
 }
 
-
-/* Auxiliary callback used by fs_scavenge_file().
- * The `arg` parameter is a pointer to find_result structure.
+/* Auxiliary function to fs_repair().
+ * Fixes all the directories, starting with SysDir. The orphan
+ * directories (not listed anywhere) are scanned as well, so that
+ * their files are not taken for orphans; they are entered in
+ * SysDir later, like the other orphans.
+ * Returns TRUE on success.
  */
 static
-int scavenge_file_cb(const struct fs *fs,
-                     const struct file_entry *fe,
-                     void *arg)
+int repair_directories(struct fs *fs, struct repair_context *ctx)
 {
-    struct scavenge_result *res;
-    struct file_info finfo;
+    struct repair_file *rf;
+    uint32_t i, f, next_orphan;
 
-    res = (struct scavenge_result *) arg;
-    if (!fs_file_info(fs, fe, &finfo)) {
-        report_error("fs: scavenge_file: could not get file information");
-        return -1;
+    f = ctx->file_of[1];
+    if (f == INDEX_NONE || !(ctx->files[f].fe.sn.word1 & SN_DIRECTORY)) {
+        report_error("fs: repair: SysDir is lost");
+        return FALSE;
     }
+    queue_repair_dir(ctx, f);
+
+    next_orphan = 0;
+    for (i = 0; TRUE; i++) {
+        while (i == ctx->num_dirs && next_orphan < ctx->num_files) {
+            rf = &ctx->files[next_orphan];
+            if (!rf->has_entry && (rf->fe.sn.word1 & SN_DIRECTORY)) {
+                rf->is_orphan = TRUE;
+                queue_repair_dir(ctx, next_orphan);
+            }
+            next_orphan++;
+        }
+        if (i == ctx->num_dirs) break;
 
-    if (strcmp(finfo.filename, res->filename) == 0) {
-        res->fe = *fe;
-        res->found++;
-        /* Continue the search (to check if there exists only one
-         * file with the given name).
-         */
+        if (!repair_directory(fs, ctx, ctx->dirs[i])) return FALSE;
     }
-    return 1;
+    return TRUE;
 }
 
-int fs_scavenge_file(const struct fs *fs, const char *filename,
-                     struct file_entry *fe)
+/* Auxiliary function to enter_orphans() to sort the orphans. */
+static
+int compare_orphans(const void *a, const void *b)
 {
-    struct scavenge_result res;
-
-    res.filename = filename;
-    res.found = 0;
-    if (!fs_scan_files(fs, &scavenge_file_cb, &res)) {
-        report_error("fs: scavenge_file: could not scan filesystem");
-        return FALSE;
-    }
-
-    if (res.found == 1) {
-        *fe = res.fe;
-        return TRUE;
-    }
-
-    return FALSE;
+    const struct repair_orphan *oa, *ob;
+    int cmp;
+
+    oa = (const struct repair_orphan *) a;
+    ob = (const struct repair_orphan *) b;
+    cmp = strcmp(oa->name, ob->name);
+    if (cmp != 0) return cmp;
+    if (oa->file != ob->file) return (oa->file < ob->file) ? -1 : 1;
+    return 0;
 }
 
-int fs_scan_files(const struct fs *fs, scan_files_cb cb, void *arg)
+/* Auxiliary function to fs_repair().
+ * Enters the orphan files in SysDir, under the name in their leader
+ * pages. A name already taken gets the serial number appended. The
+ * entries are appended to SysDir all at once.
+ * Returns TRUE on success.
+ */
+static
+int enter_orphans(struct fs *fs, struct repair_context *ctx)
 {
-    uint16_t vda;
+    char suffix[8];
+    struct repair_orphan *orphans;
+    struct repair_file *rf;
+    struct file_entry sysdir_fe, other_fe;
     const struct page *pg;
-    struct file_entry fe;
+    uint8_t *buffer;
+    size_t num, len, i;
+    uint32_t f, sysdir;
     int ret;
 
-    for (vda = 0; vda < fs->length; vda++) {
-        pg = &fs->pages[vda];
-        if (pg->label.file_pgnum != 0) continue;
-        if (pg->label.version == VERSION_FREE) continue;
-        if (pg->label.version == VERSION_BAD) continue;
-        if (pg->label.version == 0) continue;
+    num = 0;
+    for (f = 0; f < ctx->num_files; f++) {
+        rf = &ctx->files[f];
+        if (!rf->has_entry || rf->is_orphan) num++;
+    }
+    if (num == 0) return TRUE;
+
+    orphans = (struct repair_orphan *)
+        malloc(num * sizeof(struct repair_orphan));
+    buffer = (uint8_t *) malloc(num * 2 * DIR_ENTRY_MAX_LENGTH);
+    if (unlikely(!orphans || !buffer)) {
+        report_error("fs: repair: memory exhausted");
+        if (orphans) free((void *) orphans);
+        if (buffer) free((void *) buffer);
+        return FALSE;
+    }
 
-        fe.sn = pg->label.sn;
-        fe.version = pg->label.version;
-        fe.blank = 0;
-        fe.leader_vda = vda;
+    sysdir = ctx->file_of[1];
+    sysdir_fe = ctx->files[sysdir].fe;
 
-        ret = cb(fs, &fe, arg);
-        if (ret < 0) {
-            report_error("fs: scan_files: error while scanning");
-            return FALSE;
-        }
-        if (ret == 0) break;
-    }
+    num = 0;
+    for (f = 0; f < ctx->num_files; f++) {
+        rf = &ctx->files[f];
+        if (rf->has_entry && !rf->is_orphan) continue;
 
-    return TRUE;
-}
+        pg = get_page(fs, rf->fe.leader_vda);
+        copy_name(orphans[num].name,
+                  (const char *) &pg->data[LEADER_FILENAME]);
+        orphans[num].file = f;
+        num++;
 
-int fs_scan_directory(const struct fs *fs, const struct file_entry *fe,
-                      scan_directory_cb cb, void *arg)
-{
-    struct directory_entry de;
-    struct open_file of;
-    uint16_t w, de_len;
-    uint8_t buffer[128];
-    size_t to_read, nbytes;
-    int ret, is_valid;
+        rf->has_entry = TRUE;
+        set_parent_hint(fs, ctx, f, sysdir);
+    }
 
-    if (!fs_open(fs, fe, &of, FALSE)) {
-        report_error("fs: scan_directory: could not open directory");
-        return FALSE;
+    /* Backwards, so that the first of the equal names is kept. */
+    qsort(orphans, num, sizeof(struct repair_orphan), &compare_orphans);
+    for (i = num; i-- > 0;) {
+        ret = lookup_directory(fs, &sysdir_fe, orphans[i].name, &other_fe);
+        if (ret < 0) goto error;
+        if (!ret && (i == 0 || strcmp(orphans[i - 1].name,
+                                      orphans[i].name) != 0)) continue;
+
+        sprintf(suffix, "!%u", (unsigned int)
+                ctx->files[orphans[i].file].fe.sn.word2);
+        len = MIN(strlen(orphans[i].name),
+                  FILENAME_LENGTH - 2 - strlen(suffix));
+        strcpy(&orphans[i].name[len], suffix);
     }
 
-    while (TRUE) {
-        nbytes = fs_read(fs, &of, buffer, 2);
-        if (of.error) goto error_read;
+    len = 0;
+    for (i = 0; i < num; i++) {
+        len += 2 * ((size_t) encode_directory_entry(&buffer[len],
+                       &ctx->files[orphans[i].file].fe, orphans[i].name));
+    }
 
-        if (nbytes == 0) break;
-        if (nbytes != 2) goto error_short;
+    if (!write_file_at(fs, &sysdir_fe, ctx->sysdir_end, buffer, len)
+        || !update_last_page_hint(fs, &sysdir_fe)) {
+        report_error("fs: repair: could not update SysDir");
+        goto error;
+    }
 
-        w = read_word_bs(buffer, 0);
-        is_valid = ((w >> 10) == DIR_ENTRY_VALID);
+    ctx->rep->orphans = num;
+    free((void *) orphans);
+    free((void *) buffer);
+    return TRUE;
 
-        de_len = (w & DIR_ENTRY_LEN_MASK);
-        if (de_len == 0) {
-            report_error("fs: scan_directory: invalid entry length");
-            return FALSE;
-        }
+error:
+    free((void *) orphans);
+    free((void *) buffer);
+    return FALSE;
+}
 
-        to_read = 2 * ((size_t) de_len);
-        if (to_read > sizeof(buffer)) {
-            nbytes = fs_read(fs, &of, &buffer[2], sizeof(buffer) - 2);
-            if (of.error) goto error_read;
-            if (nbytes != sizeof(buffer) - 2) goto error_short;
+/* Auxiliary function to fs_repair().
+ * Rebuilds the header of the DiskDescriptor (as fs_format() does)
+ * if the file is too short for the header and the bit table. The
+ * last serial number is taken from the recovered files.
+ * Returns TRUE on success.
+ */
+static
+int repair_disk_descriptor(struct fs *fs, struct repair_context *ctx)
+{
+    struct file_entry dd_fe;
+    struct open_file of;
+    const struct serial_number *sn;
+    uint8_t kdh[KDH_SIZE];
+    uint8_t *table;
+    uint32_t last, v, f;
+    uint16_t bt_size;
+    size_t size;
+    int ret;
 
-            to_read -= sizeof(buffer);
-            nbytes = fs_read(fs, &of, NULL, to_read);
-            if (of.error) goto error_read;
-            if (nbytes != to_read) goto error_short;
-        } else {
-            nbytes = fs_read(fs, &of, &buffer[2], to_read - 2);
-            if (of.error) goto error_read;
-            if (nbytes != to_read - 2) goto error_short;
-        }
+    ret = find_disk_descriptor(fs, &dd_fe);
+    if (ret <= 0) return (ret == 0);
 
-        if (!is_valid) continue;
+    if (!fs_open(fs, &dd_fe, &of, FALSE)) return FALSE;
+    if (fs_read(fs, &of, kdh, sizeof(kdh)) == sizeof(kdh)) {
+        size = 2 * ((size_t) read_word_bs(kdh, KDH_DISK_BT_SIZE));
+        if (size > 0 && fs_read(fs, &of, NULL, size) == size)
+            return TRUE;
+    }
+    if (of.error) return FALSE;
 
-        de.fe.sn.word1 = read_word_bs(buffer, DIRECTORY_SN);
-        de.fe.sn.word2 = read_word_bs(buffer, 2 + DIRECTORY_SN);
-        de.fe.version = read_word_bs(buffer, DIRECTORY_VERSION);
-        de.fe.leader_vda = read_word_bs(buffer, DIRECTORY_LEADER_VDA);
-        copy_name(de.filename, (const char *) &buffer[DIRECTORY_FILENAME]);
+    last = 0;
+    for (f = 0; f < ctx->num_files; f++) {
+        sn = &ctx->files[f].fe.sn;
+        v = (((uint32_t) (sn->word1 & SN_PART1_MASK)) << 16) | sn->word2;
+        if (v > last) last = v;
+    }
 
-        ret = cb(fs, &de, arg);
-        if (ret < 0) return FALSE;
-        if (ret == 0) break;
+    bt_size = (uint16_t) ((fs->length + 15) / 16);
+    size = 2 * ((size_t) bt_size);
+    table = (uint8_t *) calloc(size, sizeof(uint8_t));
+    if (unlikely(!table)) {
+        report_error("fs: repair: memory exhausted");
+        return FALSE;
     }
 
+    memset(kdh, 0, sizeof(kdh));
+    write_word_bs(kdh, 0, fs->dg.num_disks);
+    write_word_bs(kdh, 2, fs->dg.num_cylinders);
+    write_word_bs(kdh, 4, fs->dg.num_heads);
+    write_word_bs(kdh, 6, fs->dg.num_sectors);
+    write_word_bs(kdh, KDH_LAST_SN, (uint16_t) (last >> 16));
+    write_word_bs(kdh, KDH_LAST_SN + 2, (uint16_t) (last & 0xFFFF));
+    write_word_bs(kdh, KDH_DISK_BT_SIZE, bt_size);
+
+    ret = write_file_at(fs, &dd_fe, 0, kdh, sizeof(kdh))
+        && write_file_at(fs, &dd_fe, sizeof(kdh), table, size)
+        && update_last_page_hint(fs, &dd_fe);
+    free((void *) table);
+
+    if (!ret) {
+        report_error("fs: repair: could not rebuild the DiskDescriptor");
+        return FALSE;
+    }
+    ctx->rep->rebuilt_descriptor = TRUE;
     return TRUE;
+}
 
-error_read:
-    report_error("fs: scan_directory: error while reading");
-    return FALSE;
+int fs_repair(struct fs *fs, struct fs_repair_report *rep)
+{
+    struct repair_context ctx;
+    size_t length;
+    uint16_t vda;
+    int ret;
 
-error_short:
-    report_error("fs: scan_directory: entry too short");
-    return FALSE;
+    memset(rep, 0, sizeof(struct fs_repair_report));
+    length = (size_t) fs->length;
+
+    ctx.rep = rep;
+    ctx.pages = (struct repair_page *)
+        malloc(length * sizeof(struct repair_page));
+    ctx.files = (struct repair_file *)
+        malloc(length * sizeof(struct repair_file));
+    ctx.file_of = (uint32_t *) malloc(length * sizeof(uint32_t));
+    ctx.dirs = (uint32_t *) malloc(length * sizeof(uint32_t));
+    ctx.num_pages = 0;
+    ctx.num_files = 0;
+    ctx.num_dirs = 0;
+    ctx.list.entries = NULL;
+    ctx.list.num_entries = 0;
+    ctx.list.capacity = 0;
+    ctx.list.end = 0;
+    ctx.list.exhausted = FALSE;
+    ctx.sysdir_end = 0;
+
+    ret = FALSE;
+    if (unlikely(!ctx.pages || !ctx.files || !ctx.file_of || !ctx.dirs)) {
+        report_error("fs: repair: memory exhausted");
+        goto done;
+    }
+
+    for (vda = 0; vda < fs->length; vda++)
+        ctx.file_of[vda] = INDEX_NONE;
+
+    /* Sorting the pages by file and page number is the only step
+     * that is not linear in the number of pages.
+     */
+    collect_used_pages(fs, &ctx);
+    qsort(ctx.pages, ctx.num_pages, sizeof(struct repair_page),
+          &compare_repair_pages);
+    link_files(fs, &ctx);
+    rep->files = ctx.num_files;
+
+    /* Everything derived from the labels is stale now (but the
+     * modified pages must stay marked as dirty).
+     */
+    fs->free_map = NULL;
+    release_label_table(fs->labels);
+    mark_modified(fs);
+
+    if (!complete_files(fs, &ctx)) goto done;
+    if (!repair_directories(fs, &ctx)) goto done;
+    if (!enter_orphans(fs, &ctx)) goto done;
+    if (!repair_disk_descriptor(fs, &ctx)) goto done;
+    if (!update_disk_descriptor(fs, NULL)) goto done;
+    ret = TRUE;
+
+done:
+    if (ctx.pages) free((void *) ctx.pages);
+    if (ctx.files) free((void *) ctx.files);
+    if (ctx.file_of) free((void *) ctx.file_of);
+    if (ctx.dirs) free((void *) ctx.dirs);
+    if (ctx.list.entries) free((void *) ctx.list.entries);
+    return ret;
 }
 
 /* Converts a real address to a virtual address.
@@ -1111,19 +6180,13 @@ error_short:
 static
 int real_to_virtual(const struct fs *fs, uint16_t rda, uint16_t *vda)
 {
-    uint16_t cylinder, head, sector;
-    const struct geometry *dg;
-
-    cylinder = (rda >> 3) & 0x1FF;
-    head = (rda >> 2) & 1;
-    sector = (rda >> 12) & 0xF;
+    uint16_t v;
 
-    dg = &fs->dg;
-    if ((cylinder >= dg->num_cylinders) || (head >= dg->num_heads)
-        || (sector >= dg->num_sectors || ((rda & 3) != 0)))
-        return FALSE;
+    COUNT_STAT(fs, translations);
+    v = fs->rda_to_vda[rda];
+    if (v == INVALID_VDA) return FALSE;
 
-    *vda = ((cylinder * dg->num_heads) + head) * dg->num_sectors + sector;
+    *vda = v;
     return TRUE;
 }
 
@@ -1135,21 +6198,32 @@ int real_to_virtual(const struct fs *fs, uint16_t rda, uint16_t *vda)
 static
 int virtual_to_real(const struct fs *fs, uint16_t vda, uint16_t *rda)
 {
-    uint16_t i, cylinder, head, sector;
-    const struct geometry *dg;
-
+    COUNT_STAT(fs, translations);
     if (vda >= fs->length) return FALSE;
-    dg = &fs->dg;
+
+    *rda = fs->vda_to_rda[vda];
+    return TRUE;
+}
+
+/* Computes the real address of the virtual address `vda` for
+ * the disk geometry `dg`.
+ * Returns the real address.
+ */
+static
+uint16_t compute_rda(const struct geometry *dg, uint16_t vda)
+{
+    uint16_t i, cylinder, head, sector, disk;
 
     i = vda;
     sector = i % dg->num_sectors;
     i /= dg->num_sectors;
     head = i % dg->num_heads;
     i /= dg->num_heads;
-    cylinder = i;
+    cylinder = i % dg->num_cylinders;
+    i /= dg->num_cylinders;
+    disk = i;
 
-    *rda = (cylinder << 3) | (head << 2) | (sector << 12);
-    return TRUE;
+    return (cylinder << 3) | (head << 2) | (disk << 1) | (sector << 12);
 }
 
 /* Copies the filename to `dst` and set the proper
@@ -1187,6 +6261,14 @@ uint16_t read_word_bs(const uint8_t *data, size_t offset)
     return w;
 }
 
+/* Writes the word `w` (in big endian format) at `offset` in `data`. */
+static
+void write_word_bs(uint8_t *data, size_t offset, uint16_t w)
+{
+    data[offset] = (uint8_t) (w >> 8);
+    data[offset + 1] = (uint8_t) (w & 0xFF);
+}
+
 /* Obtains a time_t from the Alto filesystem.
  * The alto data is located at `offset` in `data`.
  * Returns the time.
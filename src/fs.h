@@ -5,6 +5,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <time.h>
+#include "utils.h"
 
 /* Constants. */
 #define FILENAME_LENGTH                              40U
@@ -19,6 +20,10 @@
 #define VERSION_FREE                             0xFFFFU
 #define VERSION_BAD                              0xFFFEU
 
+/* Flags for fs_update_image(). */
+#define SAVE_FSYNC                                    1U
+#define SAVE_ATOMIC                                   2U
+
 /* Data structures and types. */
 
 /* The serial number of a file.
@@ -70,6 +75,21 @@ struct open_file {
     struct file_entry fe;         /* The file_entry information. */
     struct file_position pos;     /* The file_position information. */
     int error;                    /* Indicates the file has error. */
+    uint16_t *page_map;           /* The VDA of each page of the file
+                                   * by the page number (built by
+                                   * fs_seek(), or NULL).
+                                   */
+    uint16_t num_pages;           /* Number of pages in `page_map`
+                                   * (including the leader page).
+                                   */
+};
+
+/* A contiguous piece of the contents of a file, pointing directly
+ * into the data of a page (see fs_read_spans()).
+ */
+struct file_span {
+    const uint8_t *data;          /* The start of the piece. */
+    size_t length;                /* The length of the piece. */
 };
 
 /* Structure representing a filesystem page (sector). */
@@ -120,8 +140,62 @@ struct geometry {
     uint16_t num_cylinders;       /* Number of cylinders. */
     uint16_t num_heads;           /* Number of heads per cylinder. */
     uint16_t num_sectors;         /* Number of sectors per head. */
+    uint16_t num_disks;           /* Number of disks (packs). */
+};
+
+/* Counters of the work done by the filesystem functions, to find
+ * out where the time goes. They are not updated when compiled with
+ * FS_NO_STATS.
+ */
+struct fs_stats {
+    unsigned long pages_read;     /* Pages visited by fs_read() and
+                                   * fs_read_spans().
+                                   */
+    unsigned long pages_written;  /* Pages visited by fs_write(). */
+    unsigned long translations;   /* Conversions between real and
+                                   * virtual disk addresses.
+                                   */
+    unsigned long dir_entries;    /* Directory entries decoded. */
+    unsigned long leaders_decoded; /* Leader pages decoded by
+                                    * fs_file_info().
+                                    */
+    unsigned long free_probes;    /* Words of the bitmap of free
+                                   * pages examined to allocate pages.
+                                   */
+};
+
+/* The repairs done by fs_repair(). */
+struct fs_repair_report {
+    unsigned long files;          /* Files recovered from the labels. */
+    unsigned long fixed_labels;   /* Pages with a fixed header or label
+                                   * (such as the links of the chain).
+                                   */
+    unsigned long freed_pages;    /* Pages released, which were not
+                                   * part of any recoverable file.
+                                   */
+    unsigned long fixed_hints;    /* Leader pages with fixed hints. */
+    unsigned long fixed_entries;  /* Directory entries pointed to the
+                                   * right leader page.
+                                   */
+    unsigned long removed_entries; /* Entries of lost files freed. */
+    unsigned long truncated_dirs; /* Directories truncated at the first
+                                   * entry that could not be read.
+                                   */
+    unsigned long orphans;        /* Orphan files entered in SysDir. */
+    int rebuilt_descriptor;       /* If the DiskDescriptor was rebuilt
+                                   * (since it was too short).
+                                   */
 };
 
+/* The index of the files (opaque). */
+struct file_index;
+
+/* The cache of the directories (opaque). */
+struct dir_cache;
+
+/* The table of the labels of the pages (opaque). */
+struct label_table;
+
 /* Structure representing the filesystem. */
 struct fs {
     struct geometry dg;           /* The disk geometry. */
@@ -129,6 +203,54 @@ struct fs {
     uint16_t length;              /* Total length of the filesystem
                                    * in pages.
                                    */
+    const uint8_t *image;         /* The memory-mapped disk image when
+                                   * opened with fs_open_image_mmap()
+                                   * (NULL otherwise).
+                                   */
+    size_t image_size;            /* The size of the mapped image. */
+    uint8_t *page_state;          /* Decoding state of each page of
+                                   * the mapped image.
+                                   */
+    uint8_t *cache;               /* The memory-mapped sidecar cache
+                                   * holding the pages, when opened
+                                   * with fs_open_image_cached()
+                                   * (NULL otherwise).
+                                   */
+    size_t cache_size;            /* The size of the mapped cache. */
+    uint16_t *vda_to_rda;         /* Translation table from virtual
+                                   * to real disk addresses.
+                                   */
+    uint16_t *rda_to_vda;         /* Translation table from real to
+                                   * virtual disk addresses (invalid
+                                   * addresses are marked with
+                                   * 0xFFFF).
+                                   */
+    unsigned long *free_map;      /* Bitmap of the free pages (built
+                                   * on the first page allocation).
+                                   */
+    unsigned long *dirty_map;     /* Bitmap of the pages modified
+                                   * since the image was loaded.
+                                   */
+    struct file_index *index;     /* The index of the files (built
+                                   * when first needed).
+                                   */
+    struct dir_cache *dir_cache;  /* The cache of the directories
+                                   * used by fs_find_file().
+                                   */
+    struct label_table *labels;   /* The labels of all the pages,
+                                   * densely packed for the scans
+                                   * (built when first needed).
+                                   */
+    struct fs_stats *stats;       /* The counters of the work done. */
+    struct table_storage *storage; /* The storage of the tables built
+                                   * for each image (such as the label
+                                   * table), which is kept when they
+                                   * are rebuilt.
+                                   */
+    struct arena arena;           /* The allocator of all the memory
+                                   * sized by the geometry (the pages,
+                                   * the bitmaps and the tables).
+                                   */
 };
 
 /* Defines the type of the callback function for fs_scan_files().
@@ -161,6 +283,22 @@ void fs_initvar(struct fs *fs);
  */
 void fs_destroy(struct fs *fs);
 
+/* Parses the disk geometry in `str`, which is either the name of a
+ * known disk type (diablo31, diablo44, or the double disks
+ * diablo31x2 and diablo44x2) or `cylinders:heads:sectors[:disks]`.
+ * The geometry is returned in `dg`.
+ * Returns TRUE on success.
+ */
+int fs_parse_geometry(const char *str, struct geometry *dg);
+
+/* Detects the disk geometry of the image in the file named
+ * `filename` from its size (and its page headers, to tell apart
+ * the disk types of the same size).
+ * The geometry is returned in `dg`.
+ * Returns TRUE on success.
+ */
+int fs_detect_geometry(const char *filename, struct geometry *dg);
+
 /* Creates a new fs object.
  * This obeys the initvar / destroy / create protocol.
  * The parameter `dg` specifies the disk geometry.
@@ -168,20 +306,74 @@ void fs_destroy(struct fs *fs);
  */
 int fs_create(struct fs *fs, struct geometry dg);
 
+/* Discards the disk image (and all the state derived from it), so
+ * that the fs object can be reused for another image of the same
+ * geometry. The memory is kept, so nothing is allocated again when
+ * the next image is opened and its tables are built.
+ */
+void fs_reset(struct fs *fs);
+
 /* Reads the contents of the disk from a file named `filename`.
  * Returns TRUE on success.
  */
 int fs_load_image(struct fs *fs, const char *filename);
 
+/* Maps the disk image in the file named `filename` in memory
+ * (read-only). The pages are not decoded upfront, but only when
+ * they are accessed for the first time. Changes made to the
+ * filesystem are never written back to the file (but the image
+ * can be written with fs_save_image()).
+ * Returns TRUE on success.
+ */
+int fs_open_image_mmap(struct fs *fs, const char *filename);
+
 /* Writes the contents of the disk to a file named `filename`.
  * Returns TRUE on success.
  */
 int fs_save_image(const struct fs *fs, const char *filename);
 
+/* Writes the pages modified since the image was loaded (or last
+ * updated) back to the file named `filename`, which must hold the
+ * image the filesystem was read from. The pages are rewritten in
+ * place, and the rest of the file is not touched.
+ * The `flags` can be a combination of:
+ *   SAVE_FSYNC: flush the image to stable storage before returning;
+ *   SAVE_ATOMIC: instead of updating the file in place, write the
+ *     whole image to a temporary file and rename it over `filename`
+ *     (after flushing it to stable storage).
+ * Returns TRUE on success.
+ */
+int fs_update_image(const struct fs *fs, const char *filename,
+                    unsigned int flags);
+
+/* Writes the sidecar cache of the image `filename` (which must be
+ * the image the filesystem was read from, still unmodified) to
+ * `filename.cache`. The cache holds the decoded pages, the file
+ * index and the bitmap of the free pages, keyed by the inode, size
+ * and times of the image. It should only be written after the
+ * integrity of the filesystem was checked.
+ * Returns TRUE on success.
+ */
+int fs_write_cache(struct fs *fs, const char *filename);
+
+/* Opens the disk image in the file named `filename` from its
+ * sidecar cache (see fs_write_cache()), if the cache exists and the
+ * image did not change since. The pages are then mapped directly
+ * from the cache (and modified copy-on-write), and neither decoded
+ * nor checked again. Otherwise, the image is opened with
+ * fs_open_image_mmap(). Whether the cache was used is returned in
+ * `from_cache`.
+ * Returns TRUE on success.
+ */
+int fs_open_image_cached(struct fs *fs, const char *filename,
+                         int *from_cache);
+
 /* Checks the integrity of the filesystem.
+ * The check is split among (up to) `num_threads` threads, but the
+ * errors are still reported in order of the virtual disk address.
  * Returns TRUE on success.
  */
-int fs_check_integrity(const struct fs *fs);
+int fs_check_integrity(const struct fs *fs, unsigned int num_threads);
 
 /* Opens a file for reading or writing.
  * The file is specified by `fe` and the open file is stored in `of`.
@@ -192,6 +384,23 @@ int fs_check_integrity(const struct fs *fs);
 int fs_open(const struct fs *fs, const struct file_entry *fe,
             struct open_file *of, int include_leader);
 
+/* Releases the resources of the open file `of` (the page map
+ * built by fs_seek()). This can be called for any open file, and
+ * must be called for those which were used with fs_seek().
+ */
+void fs_close(struct open_file *of);
+
+/* Moves the position of the open file `of` to the byte `offset`
+ * of the contents of the file (not counting the leader page), so
+ * that the next fs_read() or fs_write() starts there. The first
+ * seek builds a map of the pages of the file, so that the later
+ * seeks do not walk the chain of pages again. The map is rebuilt
+ * when the file changes length through fs_write() or fs_trim(),
+ * but if the file is modified otherwise, it must be opened again.
+ * Returns TRUE on success (seeking past the end of the file fails).
+ */
+int fs_seek(const struct fs *fs, struct open_file *of, size_t offset);
+
 /* Reads `len` bytes of an open file `of` to `dst`.
  * If `dst` is NULL, the file pointer in `of` is still updated,
  * but no actual bytes are copied.
@@ -200,6 +409,17 @@ int fs_open(const struct fs *fs, const struct file_entry *fe,
 size_t fs_read(const struct fs *fs, struct open_file *of,
                uint8_t *dst, size_t len);
 
+/* Reads the contents of an open file `of` without copying them.
+ * Instead, up to `max_spans` spans pointing to the data of the pages
+ * of the file are stored in `spans` (at most one span per page), and
+ * the file pointer in `of` is updated past them. The spans remain
+ * valid until the filesystem is modified.
+ * Returns the number of spans, which is zero at the end of the file
+ * (or on error, which is indicated in `of`).
+ */
+size_t fs_read_spans(const struct fs *fs, struct open_file *of,
+                     struct file_span *spans, size_t max_spans);
+
 /* Writes `len` bytes of an open file `of` from `src`.  If `src` is
  * NULL, the file is zeroed. The parameter `extends` tells the function
  * to allocate free pages when it reaches the end of the file,
@@ -224,6 +444,16 @@ int fs_trim(struct fs *fs, struct open_file *of);
 int fs_extract_file(const struct fs *fs, const struct file_entry *fe,
                     const char *output_filename);
 
+/* Extracts a file from the filesystem to the (host) file descriptor
+ * `fd`, which can be a pipe. The file is written in large batches,
+ * straight from the data of the pages.
+ * The `fe` contains information about the location of the file in
+ * in the filesystem.
+ * Returns TRUE on success.
+ */
+int fs_extract_file_fd(const struct fs *fs, const struct file_entry *fe,
+                       int fd);
+
 /* Replaces a file from the filesystem.
  * Note: the file must currently exist in the filesystem!
  * The `fe` contains information about the location of the file
@@ -234,6 +464,66 @@ int fs_extract_file(const struct fs *fs, const struct file_entry *fe,
 int fs_replace_file(struct fs *fs, const struct file_entry *fe,
                     const char *input_filename);
 
+/* Creates a new (empty) file named `filename`.
+ * The `filename` can include the path of the directory where the
+ * file is created (such as `<SubDir>Name`), otherwise it is created
+ * in SysDir. If `is_directory` is TRUE, the file is a directory.
+ * The leader page is written, a new serial number is assigned (and
+ * recorded in the DiskDescriptor), and the entry is added to the
+ * directory. The parameter `fe` will be populated with the
+ * information about the new file.
+ * Returns TRUE on success.
+ */
+int fs_create_file(struct fs *fs, const char *filename,
+                   int is_directory, struct file_entry *fe);
+
+/* Deletes the file named `filename` (which cannot be a directory).
+ * The entry is removed from its directory, and all the pages of
+ * the file are released (and marked free in the DiskDescriptor).
+ * Returns TRUE on success.
+ */
+int fs_delete_file(struct fs *fs, const char *filename);
+
+/* Formats the filesystem from scratch, discarding its contents.
+ * The boot page is reserved, and SysDir and DiskDescriptor are
+ * created. Then the `num_files` host files in `filenames` are added
+ * to SysDir (named after the last component of their path), in a
+ * single pass and each one in consecutive pages.
+ * The filesystem must not be mapped (see fs_open_image_mmap()).
+ * Returns TRUE on success.
+ */
+int fs_format(struct fs *fs, const char * const *filenames,
+              size_t num_files);
+
+/* Defragments the filesystem: the pages of each file are moved to
+ * consecutive VDAs, with SysDir, the DiskDescriptor and the other
+ * directories first, followed by the `num_hot` files named in
+ * `hot_files` (in that order) and then by the remaining files.
+ * The links between the pages, the entries of the directories, the
+ * hints in the leader pages and the DiskDescriptor are updated to
+ * the new layout. The boot page and the bad pages do not move.
+ * The filesystem must have passed fs_check_integrity().
+ * The number of pages moved is returned in `num_moved`.
+ * Returns TRUE on success.
+ */
+int fs_defrag(struct fs *fs, const char * const *hot_files,
+              size_t num_hot, size_t *num_moved);
+
+/* Repairs the filesystem from the labels of the pages alone, much
+ * like the Alto Scavenger: the pages are sorted by serial number and
+ * page number to rebuild the chains of the files (the pages after
+ * a missing page, or of files without a leader page, are released),
+ * the hints in the leader pages are regenerated, the directory
+ * entries are fixed (or freed, for lost files), the directories are
+ * truncated at the first entry that cannot be read, the orphan
+ * files are entered in SysDir, and a short DiskDescriptor is rebuilt.
+ * This runs in O(n log n) time, for `n` pages. SysDir must be at
+ * VDA 1.
+ * The repairs done are returned in `rep`.
+ * Returns TRUE on success.
+ */
+int fs_repair(struct fs *fs, struct fs_repair_report *rep);
+
 /* Converts the virtual disk address of the leader page `leader_vda` of a
  * file to a file_entry object `fe`.
  * Returns TRUE on success.
@@ -243,11 +533,15 @@ int fs_file_entry(const struct fs *fs, uint16_t leader_vda,
 
 /* Determines a file length.
  * The `fe` determines the file.
+ * Unless `strict` is TRUE, the length is obtained from the last page
+ * hint in the leader page, provided that the hint agrees with the
+ * label of the hinted page. Otherwise (or if the hint is stale), all
+ * the pages of the file are visited.
  * The file length is returned in `length`.
  * Returns TRUE on success.
  */
 int fs_file_length(const struct fs *fs, const struct file_entry *fe,
-                   size_t *length);
+                   int strict, size_t *length);
 
 /* Obtains the file metadata at the leader page.
  * This includes the name of the file, access and modification times,
@@ -258,7 +552,9 @@ int fs_file_info(const struct fs *fs, const struct file_entry *fe,
                  struct file_info *finfo);
 
 /* Finds a file in the filesystem.
- * The name of the file to find is given in `filename`.
+ * The name of the file to find is given in `filename`. Each
+ * directory in the path is looked up in a hash table, built when
+ * the directory is first scanned.
  * The parameter `fe` will be populated with information about
  * the scavenged file (such as leader page virtual disk address, etc.).
  * Returns TRUE on success.
@@ -270,6 +566,8 @@ int fs_find_file(const struct fs *fs, const char *filename,
  * This is different from fs_find_file() as it does not use any information
  * about the SysDir directory, it is solely based on the leader
  * pages of files (and so relies completely on hints).
+ * The lookup is answered from the file index, which is built
+ * at the first use.
  * The name of the file to find is given in `filename`.
  * The parameter `fe` will be populated with information about
  * the scavenged file (such as leader page virtual disk address, etc.).
@@ -278,6 +576,15 @@ int fs_find_file(const struct fs *fs, const char *filename,
 int fs_scavenge_file(const struct fs *fs, const char *filename,
                      struct file_entry *fe);
 
+/* Finds the file with serial number `sn` using the file index.
+ * The parameter `fe` will be populated with information about
+ * the file (such as the leader page virtual disk address, etc.).
+ * Returns TRUE on success.
+ */
+int fs_find_serial_number(const struct fs *fs,
+                          const struct serial_number *sn,
+                          struct file_entry *fe);
+
 /* Scans the files in the filesystem.
  * The callback `cb` is used to scan the filesystem. The `arg` is
  * an extra parameter passed to the callback.
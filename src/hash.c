@@ -0,0 +1,403 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "fs.h"
+#include "utils.h"
+
+/* Constants. */
+#define SHA256_BLOCK_SIZE                            64U
+
+/* Number of spans read at once. */
+#define HASH_BATCH_SPANS                             64U
+
+/* Data structures and types. */
+
+/* The state of a SHA-256 computation. */
+struct sha256 {
+    uint32_t state[8];            /* The intermediate hash value. */
+    uint8_t block[SHA256_BLOCK_SIZE]; /* The pending input. */
+    size_t block_len;             /* Number of pending bytes. */
+    uint32_t bits_hi;             /* Number of input bits (high part). */
+    uint32_t bits_lo;             /* Number of input bits (low part). */
+};
+
+/* Auxiliary data structure used by hash_list_create(). */
+struct hash_context {
+    struct hash_list *hl;         /* The hashes. */
+    char **paths;                 /* The path of each file (by the
+                                   * leader VDA).
+                                   */
+    uint8_t *visited;             /* Visited directories (by VDA). */
+    char path[MAX_PATH_LENGTH];   /* The current directory path. */
+    size_t len;                   /* The length of the current path. */
+};
+
+/* Global variables. */
+static const uint32_t sha256_k[64] = {
+    0x428A2F98U, 0x71374491U, 0xB5C0FBCFU, 0xE9B5DBA5U,
+    0x3956C25BU, 0x59F111F1U, 0x923F82A4U, 0xAB1C5ED5U,
+    0xD807AA98U, 0x12835B01U, 0x243185BEU, 0x550C7DC3U,
+    0x72BE5D74U, 0x80DEB1FEU, 0x9BDC06A7U, 0xC19BF174U,
+    0xE49B69C1U, 0xEFBE4786U, 0x0FC19DC6U, 0x240CA1CCU,
+    0x2DE92C6FU, 0x4A7484AAU, 0x5CB0A9DCU, 0x76F988DAU,
+    0x983E5152U, 0xA831C66DU, 0xB00327C8U, 0xBF597FC7U,
+    0xC6E00BF3U, 0xD5A79147U, 0x06CA6351U, 0x14292967U,
+    0x27B70A85U, 0x2E1B2138U, 0x4D2C6DFCU, 0x53380D13U,
+    0x650A7354U, 0x766A0ABBU, 0x81C2C92EU, 0x92722C85U,
+    0xA2BFE8A1U, 0xA81A664BU, 0xC24B8B70U, 0xC76C51A3U,
+    0xD192E819U, 0xD6990624U, 0xF40E3585U, 0x106AA070U,
+    0x19A4C116U, 0x1E376C08U, 0x2748774CU, 0x34B0BCB5U,
+    0x391C0CB3U, 0x4ED8AA4AU, 0x5B9CCA4FU, 0x682E6FF3U,
+    0x748F82EEU, 0x78A5636FU, 0x84C87814U, 0x8CC70208U,
+    0x90BEFFFAU, 0xA4506CEBU, 0xBEF9A3F7U, 0xC67178F2U
+};
+
+/* Functions. */
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/* Initializes the SHA-256 computation `s`. */
+static
+void sha256_init(struct sha256 *s)
+{
+    s->state[0] = 0x6A09E667U;
+    s->state[1] = 0xBB67AE85U;
+    s->state[2] = 0x3C6EF372U;
+    s->state[3] = 0xA54FF53AU;
+    s->state[4] = 0x510E527FU;
+    s->state[5] = 0x9B05688CU;
+    s->state[6] = 0x1F83D9ABU;
+    s->state[7] = 0x5BE0CD19U;
+    s->block_len = 0;
+    s->bits_hi = 0;
+    s->bits_lo = 0;
+}
+
+/* Processes one block `p` (of SHA256_BLOCK_SIZE bytes) of the
+ * SHA-256 computation `s`.
+ */
+static
+void sha256_block(struct sha256 *s, const uint8_t *p)
+{
+    uint32_t w[64], v[8];
+    uint32_t t1, t2;
+    unsigned int i;
+
+    for (i = 0; i < 16; i++) {
+        w[i] = (((uint32_t) p[4 * i]) << 24)
+            | (((uint32_t) p[4 * i + 1]) << 16)
+            | (((uint32_t) p[4 * i + 2]) << 8)
+            | ((uint32_t) p[4 * i + 3]);
+    }
+
+    for (i = 16; i < 64; i++) {
+        t1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        t2 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        w[i] = t1 + w[i - 7] + t2 + w[i - 16];
+    }
+
+    memcpy(v, s->state, sizeof(v));
+    for (i = 0; i < 64; i++) {
+        t1 = v[7] + (ROTR(v[4], 6) ^ ROTR(v[4], 11) ^ ROTR(v[4], 25))
+            + ((v[4] & v[5]) ^ (~v[4] & v[6])) + sha256_k[i] + w[i];
+        t2 = (ROTR(v[0], 2) ^ ROTR(v[0], 13) ^ ROTR(v[0], 22))
+            + ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+        v[7] = v[6];
+        v[6] = v[5];
+        v[5] = v[4];
+        v[4] = v[3] + t1;
+        v[3] = v[2];
+        v[2] = v[1];
+        v[1] = v[0];
+        v[0] = t1 + t2;
+    }
+
+    for (i = 0; i < 8; i++)
+        s->state[i] += v[i];
+}
+
+/* Adds the `len` bytes in `data` to the SHA-256 computation `s`. */
+static
+void sha256_update(struct sha256 *s, const uint8_t *data, size_t len)
+{
+    size_t n;
+    uint32_t bits;
+
+    /* The length in bits is kept in 64 bits (as two words). */
+    bits = (uint32_t) (len << 3);
+    s->bits_lo += bits;
+    if (s->bits_lo < bits) s->bits_hi++;
+    s->bits_hi += (uint32_t) ((len >> 29) & 0xFFFFFFFFUL);
+
+    if (s->block_len > 0) {
+        n = MIN(len, SHA256_BLOCK_SIZE - s->block_len);
+        memcpy(&s->block[s->block_len], data, n);
+        s->block_len += n;
+        data += n;
+        len -= n;
+        if (s->block_len < SHA256_BLOCK_SIZE) return;
+
+        sha256_block(s, s->block);
+        s->block_len = 0;
+    }
+
+    while (len >= SHA256_BLOCK_SIZE) {
+        sha256_block(s, data);
+        data += SHA256_BLOCK_SIZE;
+        len -= SHA256_BLOCK_SIZE;
+    }
+
+    memcpy(s->block, data, len);
+    s->block_len = len;
+}
+
+/* Finishes the SHA-256 computation `s`, and stores the result
+ * in `digest`.
+ */
+static
+void sha256_final(struct sha256 *s, uint8_t *digest)
+{
+    uint32_t words[2];
+    unsigned int i;
+
+    words[0] = s->bits_hi;
+    words[1] = s->bits_lo;
+
+    s->block[s->block_len++] = 0x80;
+    if (s->block_len > SHA256_BLOCK_SIZE - 8) {
+        memset(&s->block[s->block_len], 0,
+               SHA256_BLOCK_SIZE - s->block_len);
+        sha256_block(s, s->block);
+        s->block_len = 0;
+    }
+
+    memset(&s->block[s->block_len], 0, SHA256_BLOCK_SIZE - s->block_len);
+    for (i = 0; i < 8; i++) {
+        s->block[SHA256_BLOCK_SIZE - 8 + i] =
+            (uint8_t) (words[i / 4] >> (24 - 8 * (i % 4)));
+    }
+    sha256_block(s, s->block);
+
+    for (i = 0; i < HASH_SIZE; i++)
+        digest[i] = (uint8_t) (s->state[i / 4] >> (24 - 8 * (i % 4)));
+}
+
+void hash_list_initvar(struct hash_list *hl)
+{
+    hl->hashes = NULL;
+    hl->num_hashes = 0;
+    hl->capacity = 0;
+}
+
+void hash_list_destroy(struct hash_list *hl)
+{
+    size_t i;
+
+    if (hl->hashes) {
+        for (i = 0; i < hl->num_hashes; i++) {
+            if (hl->hashes[i].path) free((void *) hl->hashes[i].path);
+        }
+        free((void *) hl->hashes);
+    }
+    hash_list_initvar(hl);
+}
+
+/* Callback to find the paths of the files of a directory. */
+static
+int path_cb(const struct fs *fs, const struct directory_entry *de,
+            void *arg)
+{
+    struct hash_context *ctx;
+    size_t len, name_len;
+    int ret;
+
+    ctx = (struct hash_context *) arg;
+    if (de->fe.leader_vda >= fs->length) {
+        report_error("hash: invalid VDA in directory entry: %u",
+                     de->fe.leader_vda);
+        return -1;
+    }
+
+    len = ctx->len;
+    name_len = strlen(de->filename);
+    if (len + name_len + 2 > sizeof(ctx->path)) {
+        report_error("hash: path too long: %s", ctx->path);
+        return -1;
+    }
+    memcpy(&ctx->path[len], de->filename, name_len + 1);
+
+    if (!(de->fe.sn.word1 & SN_DIRECTORY)) {
+        /* The first path found is kept. */
+        if (ctx->paths[de->fe.leader_vda]) return 1;
+
+        ctx->paths[de->fe.leader_vda] = (char *) malloc(len + name_len + 1);
+        if (unlikely(!ctx->paths[de->fe.leader_vda])) {
+            report_error("hash: memory exhausted");
+            return -1;
+        }
+        strcpy(ctx->paths[de->fe.leader_vda], ctx->path);
+        ctx->path[len] = '\0';
+        return 1;
+    }
+
+    /* Do not visit the same directory twice
+     * (for example, SysDir contains itself).
+     */
+    if (ctx->visited[de->fe.leader_vda]) {
+        ctx->path[len] = '\0';
+        return 1;
+    }
+    ctx->visited[de->fe.leader_vda] = TRUE;
+
+    ctx->len = len + name_len + 1;
+    ctx->path[ctx->len - 1] = '>';
+    ctx->path[ctx->len] = '\0';
+
+    ret = fs_scan_directory(fs, &de->fe, &path_cb, ctx);
+
+    ctx->len = len;
+    ctx->path[len] = '\0';
+    return (ret) ? 1 : -1;
+}
+
+/* Callback to hash the contents of a file. */
+static
+int hash_file_cb(const struct fs *fs, const struct file_entry *fe,
+                 void *arg)
+{
+    struct file_span spans[HASH_BATCH_SPANS];
+    struct hash_context *ctx;
+    struct hash_list *hl;
+    struct file_hash *fh;
+    struct open_file of;
+    struct sha256 s;
+    size_t i, count, capacity;
+
+    ctx = (struct hash_context *) arg;
+    if (fe->sn.word1 & SN_DIRECTORY) return 1;
+
+    hl = ctx->hl;
+    if (hl->num_hashes == hl->capacity) {
+        capacity = (hl->capacity == 0) ? 256 : 2 * hl->capacity;
+        fh = (struct file_hash *)
+            realloc(hl->hashes, capacity * sizeof(struct file_hash));
+        if (unlikely(!fh)) {
+            report_error("hash: memory exhausted");
+            return -1;
+        }
+        hl->hashes = fh;
+        hl->capacity = capacity;
+    }
+
+    if (!fs_open(fs, fe, &of, FALSE)) {
+        report_error("hash: could not open file at VDA = %u",
+                     fe->leader_vda);
+        return -1;
+    }
+
+    fh = &hl->hashes[hl->num_hashes];
+    fh->fe = *fe;
+    fh->length = 0;
+
+    sha256_init(&s);
+    while (TRUE) {
+        count = fs_read_spans(fs, &of, spans, HASH_BATCH_SPANS);
+        if (of.error) {
+            report_error("hash: error while reading file at VDA = %u",
+                         fe->leader_vda);
+            return -1;
+        }
+        if (count == 0) break;
+
+        for (i = 0; i < count; i++) {
+            sha256_update(&s, spans[i].data, spans[i].length);
+            fh->length += spans[i].length;
+        }
+    }
+    sha256_final(&s, fh->digest);
+
+    /* The path now belongs to the hash. */
+    fh->path = ctx->paths[fe->leader_vda];
+    ctx->paths[fe->leader_vda] = NULL;
+    hl->num_hashes++;
+    return 1;
+}
+
+int hash_list_create(struct hash_list *hl, const struct fs *fs)
+{
+    struct hash_context ctx;
+    struct file_entry root_fe;
+    uint16_t vda;
+    int success;
+
+    hash_list_initvar(hl);
+    if (!fs_file_entry(fs, 1, &root_fe)) return FALSE;
+
+    ctx.hl = hl;
+    ctx.path[0] = '\0';
+    ctx.len = 0;
+    ctx.paths = (char **) calloc(fs->length, sizeof(char *));
+    ctx.visited = (uint8_t *) calloc(fs->length, sizeof(uint8_t));
+    if (unlikely(!ctx.paths || !ctx.visited)) {
+        report_error("hash: memory exhausted");
+        if (ctx.paths) free((void *) ctx.paths);
+        if (ctx.visited) free((void *) ctx.visited);
+        return FALSE;
+    }
+    ctx.visited[root_fe.leader_vda] = TRUE;
+
+    /* Find the paths first, so that the files can be read in order
+     * of their leader pages (roughly sequentially).
+     */
+    success = fs_scan_directory(fs, &root_fe, &path_cb, &ctx)
+        && fs_scan_files(fs, &hash_file_cb, &ctx);
+
+    for (vda = 0; vda < fs->length; vda++) {
+        if (ctx.paths[vda]) free((void *) ctx.paths[vda]);
+    }
+    free((void *) ctx.paths);
+    free((void *) ctx.visited);
+
+    if (!success) hash_list_destroy(hl);
+    return success;
+}
+
+void hash_format(char *str, const uint8_t *digest)
+{
+    unsigned int i;
+
+    for (i = 0; i < HASH_SIZE; i++)
+        sprintf(&str[2 * i], "%02x", digest[i]);
+}
+
+int hash_append_json(struct string_buffer *sb, const char *image,
+                     const struct file_hash *fh)
+{
+    char hex[2 * HASH_SIZE + 1];
+
+    hash_format(hex, fh->digest);
+
+    if (!strbuf_printf(sb, "{")) return FALSE;
+    if (image) {
+        if (!strbuf_printf(sb, "\"image\": ")
+            || !strbuf_append_json(sb, image)
+            || !strbuf_printf(sb, ", "))
+            return FALSE;
+    }
+
+    if (!strbuf_printf(sb, "\"path\": ")) return FALSE;
+    if (fh->path) {
+        if (!strbuf_append_json(sb, fh->path)) return FALSE;
+    } else {
+        if (!strbuf_printf(sb, "null")) return FALSE;
+    }
+
+    return strbuf_printf(sb, ", \"sn\": %u, \"length\": %u, "
+                         "\"sha256\": \"%s\"}",
+                         ((fh->fe.sn.word1 & SN_PART1_MASK) << 16)
+                         | fh->fe.sn.word2,
+                         (unsigned int) fh->length, hex);
+}
@@ -0,0 +1,67 @@
+
+#ifndef __HASH_H
+#define __HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "fs.h"
+#include "utils.h"
+
+/* Constants. */
+#define HASH_SIZE                                    32U
+
+/* Data structures and types. */
+
+/* The hash of the contents of a file. */
+struct file_hash {
+    struct file_entry fe;         /* The file. */
+    char *path;                   /* The path of the file from SysDir
+                                   * (such as `SubDir>Name`), or NULL
+                                   * if no directory lists the file.
+                                   */
+    size_t length;                /* The length of the contents. */
+    uint8_t digest[HASH_SIZE];    /* The SHA-256 of the contents. */
+};
+
+/* The hashes of all the files of a filesystem. */
+struct hash_list {
+    struct file_hash *hashes;     /* The hashes of the files. */
+    size_t num_hashes;            /* Number of hashes. */
+    size_t capacity;              /* Capacity of `hashes`. */
+};
+
+/* Functions. */
+
+/* Initializes the hash_list variable.
+ * This obeys the initvar / destroy / create protocol.
+ */
+void hash_list_initvar(struct hash_list *hl);
+
+/* Destroys the hash_list object (and releases the used memory).
+ * This obeys the initvar / destroy / create protocol.
+ */
+void hash_list_destroy(struct hash_list *hl);
+
+/* Creates a hash_list object with the hashes of the contents of all
+ * the files (but not the directories) in the filesystem `fs`. The
+ * paths come from the directory hierarchy starting at SysDir, and
+ * the files are hashed in order of their leader pages, straight
+ * from the data of the pages (see fs_read_spans()).
+ * This obeys the initvar / destroy / create protocol.
+ * Returns TRUE on success.
+ */
+int hash_list_create(struct hash_list *hl, const struct fs *fs);
+
+/* Formats the `digest` as hexadecimal digits in `str` (which must
+ * have room for 2 * HASH_SIZE + 1 characters).
+ */
+void hash_format(char *str, const uint8_t *digest);
+
+/* Appends the hash `fh` as a JSON object to `sb`. If `image` is not
+ * NULL, the object starts with the filename of the disk image.
+ * Returns TRUE on success.
+ */
+int hash_append_json(struct string_buffer *sb, const char *image,
+                     const struct file_hash *fh);
+
+#endif /* __HASH_H */
@@ -1,11 +1,71 @@
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
+#include "batch.h"
 #include "fs.h"
+#include "hash.h"
+#include "server.h"
+#include "tar.h"
 #include "utils.h"
 
+/* Constants. */
+/* Formats of the statistics (see print_stats()). */
+#define STATS_NONE                                    0
+#define STATS_TEXT                                    1
+#define STATS_JSON                                    2
+
+/* Data structures and types. */
+
+/* Options for printing the files. */
+struct print_options {
+    int verbose;                  /* The verbosity level. */
+    int strict;                   /* Do not trust the length hints. */
+};
+
+/* Auxiliary data structure used by extract_matching(). */
+struct match_context {
+    const char *prefix;           /* The directory part of the pattern. */
+    size_t prefix_len;            /* The length of the prefix. */
+    const char *pattern;          /* The pattern of the filenames. */
+    int out_fd;                   /* Where to write the files (if
+                                   * not negative).
+                                   */
+    size_t count;                 /* Number of extracted files. */
+};
+
+/* The time spent in each phase of the run (in seconds). */
+struct phase_times {
+    double load;                  /* Loading (and decoding) the disk. */
+    double check;                 /* Checking the integrity. */
+    double operation;             /* Performing the requested
+                                   * operations.
+                                   */
+    double save;                  /* Writing the disk back. */
+};
+
+/* Global variables. */
+
+/* Where the progress messages are printed (it is stderr when the
+ * extracted data goes to stdout).
+ */
+static FILE *status_fp;
+
+/* Auxiliary data structure used by mirror_files(). */
+struct mirror_context {
+    char path[MAX_PATH_LENGTH];   /* The current output path. */
+    size_t len;                   /* The length of the current path. */
+    uint8_t *visited;             /* Visited directories (by VDA). */
+    size_t count;                 /* Number of extracted files. */
+    int verbose;                  /* The verbosity level. */
+};
 
 /* Prints the details of a file_info structure. */
 static
@@ -43,17 +103,19 @@ int print_files_cb(const struct fs *fs,
                    const struct file_entry *fe,
                    void *arg)
 {
+    const struct print_options *opts;
     struct file_info finfo;
     size_t length;
     int verbose;
 
-    verbose = *((int *) arg);
+    opts = (const struct print_options *) arg;
+    verbose = opts->verbose;
     if (!fs_file_info(fs, fe, &finfo)) {
         report_error("main: could not get file information");
         return -1;
     }
 
-    if (!fs_file_length(fs, fe, &length)) {
+    if (!fs_file_length(fs, fe, opts->strict, &length)) {
         report_error("main: could not get file length");
         return -1;
     }
@@ -79,16 +141,16 @@ int print_files_cb(const struct fs *fs,
 }
 
 /* Main function to print the files in the filesystem.
- * The verbosity level is indicated by `verbose`.
+ * The verbosity level (and other options) are indicated by `opts`.
  * Returns TRUE on success.
  */
 static
-int print_files(const struct fs *fs, int verbose)
+int print_files(const struct fs *fs, const struct print_options *opts)
 {
-    if (!verbose)
+    if (!opts->verbose)
         printf("VDA    SN     VER    SIZE    FILENAME\n");
 
-    if (!fs_scan_files(fs, &print_files_cb, &verbose)) {
+    if (!fs_scan_files(fs, &print_files_cb, (void *) opts)) {
         report_error("main: could not print files");
         return FALSE;
     }
@@ -102,18 +164,20 @@ int print_dir_cb(const struct fs *fs,
                  const struct directory_entry *de,
                  void *arg)
 {
+    const struct print_options *opts;
     struct file_info finfo;
     size_t length;
     int verbose;
 
-    verbose = *((int *) arg);
+    opts = (const struct print_options *) arg;
+    verbose = opts->verbose;
 
     if (!fs_file_info(fs, &de->fe, &finfo)) {
         report_error("main: could not get file information");
         return -1;
     }
 
-    if (!fs_file_length(fs, &de->fe, &length)) {
+    if (!fs_file_length(fs, &de->fe, opts->strict, &length)) {
         report_error("main: could not get file length");
         return -1;
     }
@@ -139,18 +203,18 @@ int print_dir_cb(const struct fs *fs,
 }
 
 /* Main function to print the files in the directory pointed by `fe`.
- * The verbosity level is indicated by `verbose`.
+ * The verbosity level (and other options) are indicated by `opts`.
  * Returns TRUE on success.
  */
 static
 int print_directory(const struct fs *fs,
                     const struct file_entry *fe,
-                    int verbose)
+                    const struct print_options *opts)
 {
-    if (!verbose)
+    if (!opts->verbose)
         printf("VDA    SN     VER    SIZE    FILENAME\n");
 
-    if (!fs_scan_directory(fs, fe, &print_dir_cb, &verbose)) {
+    if (!fs_scan_directory(fs, fe, &print_dir_cb, (void *) opts)) {
         report_error("main: could not print directory");
         return FALSE;
     }
@@ -159,19 +223,531 @@ int print_directory(const struct fs *fs,
 }
 
 
+/* Finds the file named `filename` (or scavenges it if
+ * `do_scavenge` is TRUE). The file_entry is returned in `fe`.
+ * Returns TRUE on success.
+ */
+static
+int find_file(const struct fs *fs, const char *filename,
+              int do_scavenge, struct file_entry *fe)
+{
+    if (do_scavenge) {
+        if (!fs_scavenge_file(fs, filename, fe)) {
+            report_error("main: could not scavenge %s", filename);
+            return FALSE;
+        }
+    } else {
+        if (!fs_find_file(fs, filename, fe)) {
+            report_error("main: could not find %s", filename);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* Extracts the file `fe` to the host file `output_filename`, or
+ * to the file descriptor `out_fd` if it is not negative.
+ * The `name` is the name of the file in the filesystem, used
+ * for reporting.
+ * Returns TRUE on success.
+ */
+static
+int extract_one(const struct fs *fs, const struct file_entry *fe,
+                const char *name, const char *output_filename,
+                int out_fd)
+{
+    int ret;
+
+    if (out_fd >= 0)
+        ret = fs_extract_file_fd(fs, fe, out_fd);
+    else
+        ret = fs_extract_file(fs, fe, output_filename);
+
+    if (!ret) {
+        report_error("main: could not extract %s", name);
+        return FALSE;
+    }
+
+    fprintf(status_fp, "extracted `%s` successfully\n", name);
+    return TRUE;
+}
+
+/* Auxiliary function used by the extract_matching callbacks.
+ * Extracts the file `fe` named `filename` if it matches the pattern.
+ * Returns 1 to continue scanning, or -1 on error.
+ */
+static
+int extract_if_matches(const struct fs *fs, const struct file_entry *fe,
+                       const char *filename, struct match_context *ctx)
+{
+    char name[MAX_PATH_LENGTH];
+
+    if (fnmatch(ctx->pattern, filename, 0) != 0) return 1;
+
+    if (ctx->prefix_len + strlen(filename) >= sizeof(name)) {
+        report_error("main: name too long: %s", filename);
+        return -1;
+    }
+
+    memcpy(name, ctx->prefix, ctx->prefix_len);
+    strcpy(&name[ctx->prefix_len], filename);
+
+    if (!extract_one(fs, fe, name, name, ctx->out_fd)) return -1;
+    ctx->count++;
+    return 1;
+}
+
+/* Callback to extract the matching files of a directory. */
+static
+int extract_dir_cb(const struct fs *fs,
+                   const struct directory_entry *de,
+                   void *arg)
+{
+    return extract_if_matches(fs, &de->fe, de->filename,
+                              (struct match_context *) arg);
+}
+
+/* Callback to extract the matching files of the filesystem
+ * (using the names in the leader pages).
+ */
+static
+int extract_files_cb(const struct fs *fs,
+                     const struct file_entry *fe,
+                     void *arg)
+{
+    struct file_info finfo;
+
+    if (!fs_file_info(fs, fe, &finfo)) {
+        report_error("main: could not get file information");
+        return -1;
+    }
+
+    return extract_if_matches(fs, fe, finfo.filename,
+                              (struct match_context *) arg);
+}
+
+/* Extracts all files matching the glob `pattern`. The directory
+ * part of the pattern (such as `<dir>`) selects the directory
+ * to search. If `do_scavenge` is TRUE, the pattern is matched
+ * against the names in the leader pages of all files instead.
+ * The files are written to `out_fd`, if it is not negative.
+ * Returns TRUE on success.
+ */
+static
+int extract_matching(const struct fs *fs, const char *pattern,
+                     int do_scavenge, int out_fd)
+{
+    char dirname[MAX_PATH_LENGTH];
+    struct match_context ctx;
+    struct file_entry dir_fe;
+    size_t i, len;
+    int ret;
+
+    /* Split the directory part from the pattern. */
+    len = 0;
+    for (i = 0; pattern[i]; i++) {
+        if (pattern[i] == '<' || pattern[i] == '>') len = i + 1;
+    }
+
+    ctx.prefix = pattern;
+    ctx.prefix_len = len;
+    ctx.pattern = &pattern[len];
+    ctx.out_fd = out_fd;
+    ctx.count = 0;
+
+    if (do_scavenge) {
+        ctx.prefix_len = 0;
+        ret = fs_scan_files(fs, &extract_files_cb, &ctx);
+    } else {
+        if (len >= sizeof(dirname)) {
+            report_error("main: name too long: %s", pattern);
+            return FALSE;
+        }
+
+        memcpy(dirname, pattern, len);
+        dirname[(len > 0) ? len - 1 : 0] = '\0';
+        if (dirname[0] == '\0' || strcmp(dirname, "<") == 0) {
+            if (!fs_file_entry(fs, 1, &dir_fe)) return FALSE;
+        } else {
+            if (!find_file(fs, dirname, FALSE, &dir_fe)) return FALSE;
+        }
+
+        if (!(dir_fe.sn.word1 & SN_DIRECTORY)) {
+            report_error("main: %s is not a directory", dirname);
+            return FALSE;
+        }
+
+        ret = fs_scan_directory(fs, &dir_fe, &extract_dir_cb, &ctx);
+    }
+
+    if (!ret) return FALSE;
+    if (ctx.count == 0) {
+        report_error("main: no files matching %s", pattern);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Extracts the file named `name`, or all the files matching it if
+ * it is a glob pattern. If `out_fd` is not negative, the contents
+ * are written there (one file after the other) instead of to host
+ * files named after them.
+ * Returns TRUE on success.
+ */
+static
+int extract_files(const struct fs *fs, const char *name, int do_scavenge,
+                  int out_fd)
+{
+    struct file_entry fe;
+
+    if (strpbrk(name, "*?[")) {
+        return extract_matching(fs, name, do_scavenge, out_fd);
+    }
+
+    if (!find_file(fs, name, do_scavenge, &fe)) return FALSE;
+    return extract_one(fs, &fe, name, name, out_fd);
+}
+
+/* Appends `name` to the current output path of `ctx`.
+ * Returns TRUE on success.
+ */
+static
+int mirror_push(struct mirror_context *ctx, const char *name)
+{
+    size_t len;
+
+    len = strlen(name);
+    if (ctx->len + len + 2 > sizeof(ctx->path)) {
+        report_error("main: path too long: %s", ctx->path);
+        return FALSE;
+    }
+
+    ctx->path[ctx->len] = '/';
+    memcpy(&ctx->path[ctx->len + 1], name, len + 1);
+    ctx->len += len + 1;
+    return TRUE;
+}
+
+/* Creates the directory `path` in the host filesystem.
+ * Returns TRUE on success.
+ */
+static
+int make_directory(const char *path)
+{
+    if (mkdir(path, 0777) != 0 && errno != EEXIST) {
+        report_error("main: could not create directory `%s`", path);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Tests if the file name `name` can be used as is for a host file
+ * inside the output directory (that is, if it is not empty, not `.`
+ * or `..`, and it has no `/`).
+ */
+static
+int is_safe_host_name(const char *name)
+{
+    if (name[0] == '\0' || strcmp(name, ".") == 0
+        || strcmp(name, "..") == 0) return FALSE;
+    return (strchr(name, '/') == NULL);
+}
+
+/* Callback to mirror the files of a directory. */
+static
+int mirror_cb(const struct fs *fs,
+              const struct directory_entry *de,
+              void *arg)
+{
+    struct mirror_context *ctx;
+    size_t len;
+    int ret;
+
+    ctx = (struct mirror_context *) arg;
+    if (de->fe.leader_vda >= fs->length) {
+        report_error("main: invalid VDA in directory entry: %u",
+                     de->fe.leader_vda);
+        return -1;
+    }
+
+    /* A crafted image must not write outside the output directory. */
+    if (!is_safe_host_name(de->filename)) {
+        report_error("main: invalid file name for the host: `%s`",
+                     de->filename);
+        return -1;
+    }
+
+    len = ctx->len;
+    if (de->fe.sn.word1 & SN_DIRECTORY) {
+        /* Do not visit the same directory twice
+         * (for example, SysDir contains itself).
+         */
+        if (ctx->visited[de->fe.leader_vda]) return 1;
+        ctx->visited[de->fe.leader_vda] = TRUE;
+
+        if (!mirror_push(ctx, de->filename)) return -1;
+        ret = make_directory(ctx->path)
+            && fs_scan_directory(fs, &de->fe, &mirror_cb, ctx);
+    } else {
+        if (!mirror_push(ctx, de->filename)) return -1;
+        ret = fs_extract_file(fs, &de->fe, ctx->path);
+        if (!ret) {
+            report_error("main: could not extract %s", de->filename);
+        } else {
+            if (ctx->verbose)
+                fprintf(status_fp, "extracted `%s`\n", ctx->path);
+            ctx->count++;
+        }
+    }
+
+    ctx->len = len;
+    ctx->path[len] = '\0';
+    return (ret) ? 1 : -1;
+}
+
+/* Extracts all the files of the directory hierarchy starting at
+ * SysDir to the host directory `outdir`.
+ * Returns TRUE on success.
+ */
+static
+int mirror_files(const struct fs *fs, const char *outdir, int verbose)
+{
+    struct mirror_context ctx;
+    struct file_entry root_fe;
+    int ret;
+
+    if (strlen(outdir) >= sizeof(ctx.path)) {
+        report_error("main: path too long: %s", outdir);
+        return FALSE;
+    }
+
+    if (!fs_file_entry(fs, 1, &root_fe)) return FALSE;
+    if (!make_directory(outdir)) return FALSE;
+
+    ctx.visited = (uint8_t *) calloc(fs->length, sizeof(uint8_t));
+    if (unlikely(!ctx.visited)) {
+        report_error("main: memory exhausted");
+        return FALSE;
+    }
+
+    strcpy(ctx.path, outdir);
+    ctx.len = strlen(outdir);
+    ctx.count = 0;
+    ctx.verbose = verbose;
+    ctx.visited[root_fe.leader_vda] = TRUE;
+
+    ret = fs_scan_directory(fs, &root_fe, &mirror_cb, &ctx);
+    free((void *) ctx.visited);
+
+    if (!ret) {
+        report_error("main: could not extract to `%s`", outdir);
+        return FALSE;
+    }
+
+    fprintf(status_fp, "extracted %u files to `%s` successfully\n",
+            (unsigned int) ctx.count, outdir);
+    return TRUE;
+}
+
+/* Adds a new file named `filename` (which can include the path of
+ * the directory) with the contents of the host file having the
+ * same name (without the path).
+ * Returns TRUE on success.
+ */
+static
+int add_file(struct fs *fs, const char *filename)
+{
+    struct file_entry fe;
+    const char *host_filename;
+    const char *p;
+
+    host_filename = filename;
+    for (p = filename; *p; p++) {
+        if (*p == '<' || *p == '>') host_filename = &p[1];
+    }
+
+    if (!fs_create_file(fs, filename, FALSE, &fe)) return FALSE;
+    if (!fs_replace_file(fs, &fe, host_filename)) {
+        /* Do not leave an empty (or partial) file behind. */
+        fs_delete_file(fs, filename);
+        return FALSE;
+    }
+
+    fprintf(status_fp, "added `%s` successfully\n", filename);
+    return TRUE;
+}
+
+/* Obtains the current time (in seconds). */
+static
+double now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((double) ts.tv_sec) + 1e-9 * ((double) ts.tv_nsec);
+}
+
+/* Prints the time spent in each phase `pt` and the counters of the
+ * work done by the filesystem `fs`, as text or as one JSON line
+ * (according to `format`).
+ */
+static
+void print_stats(const struct fs *fs, const struct phase_times *pt,
+                 int format)
+{
+    const struct fs_stats *st;
+
+    st = fs->stats;
+    if (format == STATS_JSON) {
+        fprintf(status_fp, "{\"load_s\": %.6f, \"check_s\": %.6f, "
+                "\"operation_s\": %.6f, \"save_s\": %.6f",
+                pt->load, pt->check, pt->operation, pt->save);
+#ifndef FS_NO_STATS
+        fprintf(status_fp, ", \"pages_read\": %lu, "
+                "\"pages_written\": %lu, \"translations\": %lu, "
+                "\"dir_entries\": %lu, \"leaders_decoded\": %lu, "
+                "\"free_probes\": %lu",
+                st->pages_read, st->pages_written, st->translations,
+                st->dir_entries, st->leaders_decoded, st->free_probes);
+#endif
+        fprintf(status_fp, "}\n");
+        return;
+    }
+
+    fprintf(status_fp, "load time:          %.6f s\n", pt->load);
+    fprintf(status_fp, "check time:         %.6f s\n", pt->check);
+    fprintf(status_fp, "operation time:     %.6f s\n", pt->operation);
+    fprintf(status_fp, "save time:          %.6f s\n", pt->save);
+#ifndef FS_NO_STATS
+    fprintf(status_fp, "pages read:         %lu\n", st->pages_read);
+    fprintf(status_fp, "pages written:      %lu\n", st->pages_written);
+    fprintf(status_fp, "translations:       %lu\n", st->translations);
+    fprintf(status_fp, "directory entries:  %lu\n", st->dir_entries);
+    fprintf(status_fp, "leaders decoded:    %lu\n", st->leaders_decoded);
+    fprintf(status_fp, "free page probes:   %lu\n", st->free_probes);
+#else
+    (void) st;
+#endif
+}
+
+/* Prints the hash of the contents of each file of `fs` as one JSON
+ * line, for the disk image named `image`.
+ * Returns TRUE on success.
+ */
+static
+int print_hashes(const struct fs *fs, const char *image)
+{
+    struct hash_list hl;
+    struct string_buffer sb;
+    size_t i;
+    int ret;
+
+    if (!hash_list_create(&hl, fs)) {
+        report_error("main: could not hash the files");
+        return FALSE;
+    }
+
+    if (!strbuf_create(&sb, 256)) {
+        hash_list_destroy(&hl);
+        return FALSE;
+    }
+
+    ret = TRUE;
+    for (i = 0; ret && i < hl.num_hashes; i++) {
+        sb.len = 0;
+        sb.str[0] = '\0';
+        ret = hash_append_json(&sb, image, &hl.hashes[i])
+            && strbuf_printf(&sb, "\n");
+        if (ret) fputs(sb.str, stdout);
+    }
+
+    strbuf_destroy(&sb);
+    hash_list_destroy(&hl);
+    return ret;
+}
+
+/* Prints the repairs `rep` done by fs_repair(). */
+static
+void print_repair_report(const struct fs_repair_report *rep)
+{
+    fprintf(status_fp, "files recovered:    %lu\n", rep->files);
+    fprintf(status_fp, "labels fixed:       %lu\n", rep->fixed_labels);
+    fprintf(status_fp, "pages freed:        %lu\n", rep->freed_pages);
+    fprintf(status_fp, "hints fixed:        %lu\n", rep->fixed_hints);
+    fprintf(status_fp, "entries fixed:      %lu\n", rep->fixed_entries);
+    fprintf(status_fp, "entries removed:    %lu\n", rep->removed_entries);
+    fprintf(status_fp, "dirs truncated:     %lu\n", rep->truncated_dirs);
+    fprintf(status_fp, "orphans entered:    %lu\n", rep->orphans);
+    if (rep->rebuilt_descriptor)
+        fprintf(status_fp, "DiskDescriptor rebuilt\n");
+}
+
 /* Prints the usage information to the console output. */
 static
 void usage(const char *prog_name)
 {
     printf("Usage:\n");
     printf(" %s [options] disk\n", prog_name);
+    printf(" %s --batch [-j threads] [--manifest file] [-l] disk...\n",
+           prog_name);
+    printf(" %s --mkfs [--manifest file] disk [file...]\n", prog_name);
+    printf(" %s --serve [--socket path] [disk...]\n", prog_name);
     printf("where:\n");
     printf("  -l            Lists all files in the filesystem\n");
     printf("  -d dirname    Lists the contents of a directory\n");
-    printf("  -e filename   Extracts a given file\n");
+    printf("  -e filename   Extracts a given file (can be repeated, and\n");
+    printf("                accepts glob patterns such as `*.bcpl`)\n");
+    printf("  -E outdir     Extracts all files under SysDir to outdir\n");
+    printf("  -o output     Writes the files extracted with -e (or the\n");
+    printf("                archive of --tar) to output instead (use\n");
+    printf("                `-` for the standard output)\n");
+    printf("  --tar         Writes a tar archive of all files under\n");
+    printf("                SysDir (to the standard output by default)\n");
+    printf("  --hash        Prints the SHA-256 of the contents of each\n");
+    printf("                file as one JSON line (with --batch, also\n");
+    printf("                the files repeated across the disks)\n");
     printf("  -r filename   Replaces a given file\n");
+    printf("  -a filename   Adds a new file with the contents of the\n");
+    printf("                host file of the same name (can be\n");
+    printf("                repeated, and accepts `SubDir>Name`)\n");
+    printf("  -k filename   Deletes a given file (can be repeated)\n");
+    printf("  --repair      Rebuilds the files, the hints and the\n");
+    printf("                directories from the page labels\n");
+    printf("  --defrag      Moves the pages of each file to consecutive\n");
+    printf("                addresses (directories first)\n");
+    printf("  --hot file    Places the file right after the directories\n");
+    printf("                with --defrag (can be repeated)\n");
     printf("  -s            Scavenges files instead of finding them\n");
     printf("  -v            Increase verbosity\n");
+    printf("  --strict      Do not trust the file length hints\n");
+    printf("  --fsync       Flushes the disk to storage after changes\n");
+    printf("  --atomic      Rewrites the disk to a temporary file and\n");
+    printf("                renames it after changes (instead of\n");
+    printf("                updating the modified pages in place)\n");
+    printf("  --batch       Checks many disks in parallel and reports\n");
+    printf("                one JSON line per disk (with -l, the files)\n");
+    printf("  -j threads    Number of threads for checking the disk\n");
+    printf("                (or the disks, with --batch)\n");
+    printf("  --stats       Prints the time spent in each phase and the\n");
+    printf("                counters of the work done (or one JSON line\n");
+    printf("                with --stats=json)\n");
+    printf("  --cache       Keeps the decoded disk in disk.cache, to\n");
+    printf("                open it faster while it does not change\n");
+    printf("  --mkfs        Creates a new disk with the given files\n");
+    printf("  --serve       Keeps the disks open and runs the commands\n");
+    printf("                read from the standard input, answering\n");
+    printf("                each one with a JSON line\n");
+    printf("  --socket p    Reads the commands of --serve from the\n");
+    printf("                clients of the Unix socket p instead\n");
+    printf("  --manifest f  Reads the disks for --batch (or the files\n");
+    printf("                for --mkfs) from file f\n");
+    printf("  -g geometry   Sets the disk geometry, which is either a\n");
+    printf("                disk type (diablo31, diablo44, or the\n");
+    printf("                double disks diablo31x2 and diablo44x2)\n");
+    printf("                or cylinders:heads:sectors[:disks]\n");
+    printf("                (by default, it is detected from the size\n");
+    printf("                of the disk, or diablo31 for --mkfs)\n");
     printf("  --help        Print this help\n");
 }
 
@@ -179,27 +755,89 @@ int main(int argc, char **argv)
 {
 
     const char *disk_filename;
-    const char *extract_filename;
+    const char **extract_names;
+    const char **add_names;
+    const char **delete_names;
+    const char **hot_names;
+    const char **images;
+    const char * const *files;
+    const char *manifest_filename;
+    const char *socket_path;
+    const char *mirror_dir;
     const char *replace_filename;
     const char *dirname;
+    const char *output_filename;
     struct geometry dg;
     struct fs fs;
     struct file_entry fe;
-    int list_files, do_scavenge;
-    int i, is_last;
-    int verbose;
+    struct print_options opts;
+    struct batch_options bopts;
+    struct server_options sopts;
+    struct manifest m;
+    struct phase_times pt;
+    struct fs_repair_report rep;
+    int list_files, do_scavenge, do_batch, do_tar, do_mkfs, do_hash;
+    int i, is_last, num_extract, num_images, out_fd;
+    int num_add, num_delete, is_modified, has_geometry;
+    int use_cache, from_cache, stats_format, do_defrag;
+    int do_repair, do_serve;
+    double start;
+    unsigned int num_threads, save_flags;
+    size_t num_files, num_hot, num_moved;
+    long num_cpus;
+
+    fs_initvar(&fs);
+    manifest_initvar(&m);
+    status_fp = stdout;
+    out_fd = -1;
 
     disk_filename = NULL;
-    extract_filename = NULL;
+    num_extract = 0;
+    num_add = 0;
+    num_delete = 0;
+    num_hot = 0;
+    mirror_dir = NULL;
     replace_filename = NULL;
     dirname = NULL;
+    output_filename = NULL;
     list_files = FALSE;
     do_scavenge = FALSE;
-    verbose = 0;
+    do_batch = FALSE;
+    do_tar = FALSE;
+    do_hash = FALSE;
+    do_mkfs = FALSE;
+    use_cache = FALSE;
+    from_cache = FALSE;
+    do_defrag = FALSE;
+    do_repair = FALSE;
+    do_serve = FALSE;
+    is_modified = FALSE;
+    stats_format = STATS_NONE;
+    memset(&pt, 0, sizeof(pt));
+    num_images = 0;
+    manifest_filename = NULL;
+    socket_path = NULL;
+    opts.verbose = 0;
+    opts.strict = FALSE;
 
     dg.num_cylinders = 203;
     dg.num_heads = 2;
     dg.num_sectors = 12;
+    dg.num_disks = 1;
+    has_geometry = FALSE;
+
+    num_threads = 0;
+    save_flags = 0;
+    extract_names = (const char **) malloc(argc * sizeof(const char *));
+    add_names = (const char **) malloc(argc * sizeof(const char *));
+    delete_names = (const char **) malloc(argc * sizeof(const char *));
+    hot_names = (const char **) malloc(argc * sizeof(const char *));
+    images = (const char **) malloc(argc * sizeof(const char *));
+    if (unlikely(!extract_names || !add_names || !delete_names
+                 || !hot_names || !images)) {
+        report_error("main: memory exhausted");
+        goto error;
+    }
 
     for (i = 1; i < argc; i++) {
         is_last = (i + 1 == argc);
@@ -208,101 +846,347 @@ int main(int argc, char **argv)
         } else if (strcmp("-d", argv[i]) == 0) {
             if (is_last) {
                 report_error("main: please specify the directory to list");
-                return 1;
+                goto error;
             }
             dirname = argv[++i];
         } else if (strcmp("-e", argv[i]) == 0) {
             if (is_last) {
                 report_error("main: please specify the file to extract");
-                return 1;
+                goto error;
             }
-            extract_filename = argv[++i];
+            extract_names[num_extract++] = argv[++i];
+        } else if (strcmp("-E", argv[i]) == 0) {
+            if (is_last) {
+                report_error("main: please specify the output directory");
+                goto error;
+            }
+            mirror_dir = argv[++i];
+        } else if (strcmp("-o", argv[i]) == 0) {
+            if (is_last) {
+                report_error("main: please specify the output file");
+                goto error;
+            }
+            output_filename = argv[++i];
+        } else if (strcmp("--tar", argv[i]) == 0) {
+            do_tar = TRUE;
+        } else if (strcmp("--hash", argv[i]) == 0) {
+            do_hash = TRUE;
         } else if (strcmp("-r", argv[i]) == 0) {
             if (is_last) {
                 report_error("main: please specify the file to replace");
-                return 1;
+                goto error;
             }
             replace_filename = argv[++i];
+        } else if (strcmp("-a", argv[i]) == 0) {
+            if (is_last) {
+                report_error("main: please specify the file to add");
+                goto error;
+            }
+            add_names[num_add++] = argv[++i];
+        } else if (strcmp("-k", argv[i]) == 0) {
+            if (is_last) {
+                report_error("main: please specify the file to delete");
+                goto error;
+            }
+            delete_names[num_delete++] = argv[++i];
+        } else if (strcmp("--repair", argv[i]) == 0) {
+            do_repair = TRUE;
+        } else if (strcmp("--defrag", argv[i]) == 0) {
+            do_defrag = TRUE;
+        } else if (strcmp("--hot", argv[i]) == 0) {
+            if (is_last) {
+                report_error("main: please specify the file to place first");
+                goto error;
+            }
+            hot_names[num_hot++] = argv[++i];
         } else if (strcmp("-s", argv[i]) == 0) {
             do_scavenge = TRUE;
         } else if (strcmp("-v", argv[i]) == 0) {
-            verbose++;
+            opts.verbose++;
+        } else if (strcmp("--strict", argv[i]) == 0) {
+            opts.strict = TRUE;
+        } else if (strcmp("--fsync", argv[i]) == 0) {
+            save_flags |= SAVE_FSYNC;
+        } else if (strcmp("--atomic", argv[i]) == 0) {
+            save_flags |= SAVE_ATOMIC;
+        } else if (strcmp("--batch", argv[i]) == 0) {
+            do_batch = TRUE;
+        } else if (strcmp("--serve", argv[i]) == 0) {
+            do_serve = TRUE;
+        } else if (strcmp("--socket", argv[i]) == 0) {
+            if (is_last) {
+                report_error("main: please specify the socket name");
+                goto error;
+            }
+            socket_path = argv[++i];
+        } else if (strcmp("-g", argv[i]) == 0) {
+            if (is_last) {
+                report_error("main: please specify the disk geometry");
+                goto error;
+            }
+            if (!fs_parse_geometry(argv[++i], &dg)) goto error;
+            has_geometry = TRUE;
+        } else if (strcmp("--cache", argv[i]) == 0) {
+            use_cache = TRUE;
+        } else if (strcmp("--stats", argv[i]) == 0) {
+            stats_format = STATS_TEXT;
+        } else if (strcmp("--stats=json", argv[i]) == 0) {
+            stats_format = STATS_JSON;
+        } else if (strcmp("--mkfs", argv[i]) == 0) {
+            do_mkfs = TRUE;
+        } else if (strcmp("-j", argv[i]) == 0) {
+            if (is_last || atoi(argv[i + 1]) <= 0) {
+                report_error("main: please specify the number of threads");
+                goto error;
+            }
+            num_threads = (unsigned int) atoi(argv[++i]);
+        } else if (strcmp("--manifest", argv[i]) == 0) {
+            if (is_last) {
+                report_error("main: please specify the manifest file");
+                goto error;
+            }
+            manifest_filename = argv[++i];
         } else if (strcmp("--help", argv[i]) == 0
                    || strcmp("-h", argv[i]) == 0) {
             usage(argv[0]);
-            return 0;
+            goto success;
         } else {
             disk_filename = argv[i];
+            images[num_images++] = argv[i];
+        }
+    }
+
+    if (do_batch) {
+        if (stats_format != STATS_NONE) {
+            report_error("main: --stats does not work with --batch");
+            goto error;
+        }
+
+        /* By default, use one thread per processor. */
+        if (num_threads == 0) {
+            num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            num_threads = (num_cpus > 0) ? (unsigned int) num_cpus : 1;
+        }
+
+        bopts.dg = dg;
+        bopts.detect_geometry = !has_geometry;
+        bopts.num_threads = num_threads;
+        bopts.list_files = list_files;
+        bopts.strict = opts.strict;
+        bopts.hash_files = do_hash;
+
+        if (manifest_filename) {
+            if (num_images > 0) {
+                report_error("main: cannot mix a manifest with disk names");
+                goto error;
+            }
+            if (!manifest_create(&m, manifest_filename)) goto error;
+            if (!batch_process(m.images, m.num_images, &bopts))
+                goto error;
+        } else {
+            if (num_images == 0) {
+                report_error("main: must specify the disk file names");
+                goto error;
+            }
+            if (!batch_process(images, (size_t) num_images, &bopts))
+                goto error;
         }
+        goto success;
+    }
+
+    if (do_serve) {
+        sopts.dg = dg;
+        sopts.detect_geometry = !has_geometry;
+        sopts.num_threads = num_threads;
+        sopts.strict = opts.strict;
+        sopts.save_flags = save_flags;
+        sopts.socket_path = socket_path;
+
+        if (!server_run(images, (size_t) num_images, &sopts)) goto error;
+        goto success;
     }
 
     if (!disk_filename) {
         report_error("main: must specify the disk file name");
-        return 1;
+        goto error;
     }
 
-    fs_initvar(&fs);
+    if (do_mkfs) {
+        /* The first name is the disk, and the rest are the files. */
+        disk_filename = images[0];
+        if (manifest_filename) {
+            if (num_images > 1) {
+                report_error("main: cannot mix a manifest with file names");
+                goto error;
+            }
+            if (!manifest_create(&m, manifest_filename)) goto error;
+            files = m.images;
+            num_files = m.num_images;
+        } else {
+            files = &images[1];
+            num_files = (size_t) (num_images - 1);
+        }
+
+        if (unlikely(!fs_create(&fs, dg))) {
+            report_error("main: could not create disk");
+            goto error;
+        }
+
+        start = now_seconds();
+        if (!fs_format(&fs, files, num_files)) {
+            report_error("main: could not format disk");
+            goto error;
+        }
+        pt.operation = now_seconds() - start;
+
+        start = now_seconds();
+        if (!fs_save_image(&fs, disk_filename)) {
+            report_error("main: could not save image");
+            goto error;
+        }
+        pt.save = now_seconds() - start;
+
+        printf("disk image `%s` created with %u files\n",
+               disk_filename, (unsigned int) num_files);
+        if (stats_format != STATS_NONE) print_stats(&fs, &pt, stats_format);
+        goto success;
+    }
+
+    start = now_seconds();
+    if (!has_geometry) {
+        if (!fs_detect_geometry(disk_filename, &dg)) goto error;
+    }
 
     if (unlikely(!fs_create(&fs, dg))) {
         report_error("main: could not create disk");
         goto error;
     }
 
-    printf("loading disk image `%s`\n", disk_filename);
-    if (!fs_load_image(&fs, disk_filename)) {
+    /* Do not mix the progress messages with the extracted data. */
+    if (do_tar && !output_filename) output_filename = "-";
+    if (do_hash || (output_filename && strcmp(output_filename, "-") == 0))
+        status_fp = stderr;
+
+    fprintf(status_fp, "loading disk image `%s`\n", disk_filename);
+
+    /* The pages are only decoded when needed (and only the modified
+     * pages are written back).
+     */
+    if (use_cache) {
+        if (!fs_open_image_cached(&fs, disk_filename, &from_cache)) {
+            report_error("main: could not load disk image");
+            goto error;
+        }
+    } else if (!fs_open_image_mmap(&fs, disk_filename)) {
         report_error("main: could not load disk image");
         goto error;
     }
 
-    if (!fs_check_integrity(&fs)) {
-        report_error("main: invalid disk");
-        goto error;
+    pt.load = now_seconds() - start;
+
+    /* The repaired disk is checked again (and not cached, since it
+     * differs from the image until it is saved).
+     */
+    if (do_repair) {
+        start = now_seconds();
+        if (!fs_repair(&fs, &rep)) {
+            report_error("main: could not repair disk");
+            goto error;
+        }
+        pt.check = now_seconds() - start;
+
+        print_repair_report(&rep);
+        if (rep.fixed_labels || rep.freed_pages || rep.fixed_hints
+            || rep.fixed_entries || rep.removed_entries
+            || rep.truncated_dirs || rep.orphans
+            || rep.rebuilt_descriptor)
+            is_modified = TRUE;
+        use_cache = FALSE;
+        from_cache = FALSE;
     }
 
-    if (extract_filename != NULL) {
-        if (do_scavenge) {
-            if (!fs_scavenge_file(&fs, extract_filename, &fe)) {
-                report_error("main: could not scavenge %s", extract_filename);
-                goto error;
-            }
+    /* The cache is only written for disks that passed the check. */
+    if (!from_cache) {
+        start = now_seconds();
+        if (!fs_check_integrity(&fs, MAX(num_threads, 1U))) {
+            report_error("main: invalid disk");
+            goto error;
+        }
+        pt.check += now_seconds() - start;
+
+        if (use_cache && !fs_write_cache(&fs, disk_filename))
+            report_error("main: could not write the cache");
+    }
+
+    start = now_seconds();
+
+    if (output_filename) {
+        if (strcmp(output_filename, "-") == 0) {
+            fflush(stdout);
+            out_fd = STDOUT_FILENO;
         } else {
-            if (!fs_find_file(&fs, extract_filename, &fe)) {
-                report_error("main: could not find %s", extract_filename);
+            out_fd = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC,
+                          0666);
+            if (out_fd < 0) {
+                report_error("main: could not open `%s` for writing",
+                             output_filename);
                 goto error;
             }
         }
+    }
 
-        if (!fs_extract_file(&fs, &fe, extract_filename)) {
-            report_error("main: could not extract %s", extract_filename);
+    for (i = 0; i < num_extract; i++) {
+        if (!extract_files(&fs, extract_names[i], do_scavenge, out_fd))
+            goto error;
+    }
+
+    if (do_tar) {
+        if (!tar_write_fs(&fs, out_fd, opts.strict)) {
+            report_error("main: could not write the tar archive");
             goto error;
         }
+    }
 
-        printf("extracted `%s` successfully\n", extract_filename);
+    if (mirror_dir) {
+        if (!mirror_files(&fs, mirror_dir, opts.verbose)) goto error;
+    }
+
+    if (do_hash) {
+        if (!print_hashes(&fs, disk_filename)) goto error;
     }
 
     if (list_files) {
-        if (!print_files(&fs, verbose)) goto error;
+        if (!print_files(&fs, &opts)) goto error;
     }
 
     if (dirname) {
-        if (do_scavenge) {
-            if (!fs_scavenge_file(&fs, dirname, &fe)) {
-                report_error("main: could not scavenge %s", dirname);
-                goto error;
-            }
-        } else {
-            if (!fs_find_file(&fs, dirname, &fe)) {
-                report_error("main: could not find %s", dirname);
-                goto error;
-            }
-        }
+        if (!find_file(&fs, dirname, do_scavenge, &fe)) goto error;
 
         if (!(fe.sn.word1 & SN_DIRECTORY)) {
             report_error("main: %s is not a directory", dirname);
             goto error;
         }
 
-        if (!print_directory(&fs, &fe, verbose)) goto error;
+        if (!print_directory(&fs, &fe, &opts)) goto error;
+    }
+
+    for (i = 0; i < num_delete; i++) {
+        if (!fs_delete_file(&fs, delete_names[i])) {
+            report_error("main: could not delete %s", delete_names[i]);
+            goto error;
+        }
+
+        fprintf(status_fp, "deleted `%s` successfully\n",
+                delete_names[i]);
+        is_modified = TRUE;
+    }
+
+    for (i = 0; i < num_add; i++) {
+        if (!add_file(&fs, add_names[i])) {
+            report_error("main: could not add %s", add_names[i]);
+            goto error;
+        }
+        is_modified = TRUE;
     }
 
     if (replace_filename) {
@@ -315,20 +1199,61 @@ int main(int argc, char **argv)
             goto error;
         }
 
-        printf("replaced `%s` successfully\n", replace_filename);
+        fprintf(status_fp, "replaced `%s` successfully\n",
+                replace_filename);
+        is_modified = TRUE;
+    }
+
+    if (do_defrag) {
+        if (!fs_defrag(&fs, hot_names, num_hot, &num_moved)) {
+            report_error("main: could not defragment disk");
+            goto error;
+        }
+
+        fprintf(status_fp, "disk defragmented (%u pages moved)\n",
+                (unsigned int) num_moved);
+        if (num_moved > 0) is_modified = TRUE;
+    }
+
+    pt.operation = now_seconds() - start;
 
-        if (!fs_save_image(&fs, disk_filename)) {
+    if (is_modified) {
+        start = now_seconds();
+        if (!fs_update_image(&fs, disk_filename, save_flags)) {
             report_error("main: could not save image");
             goto error;
         }
+        pt.save = now_seconds() - start;
 
-        printf("disk image `%s` written successfully\n", disk_filename);
+        fprintf(status_fp, "disk image `%s` written successfully\n",
+                disk_filename);
     }
 
+    if (stats_format != STATS_NONE) print_stats(&fs, &pt, stats_format);
+
+success:
+    if (out_fd > STDOUT_FILENO && close(out_fd) != 0) {
+        report_error("main: error while writing `%s`", output_filename);
+        out_fd = -1;
+        goto error;
+    }
+    if (extract_names) free((void *) extract_names);
+    if (add_names) free((void *) add_names);
+    if (delete_names) free((void *) delete_names);
+    if (hot_names) free((void *) hot_names);
+    if (images) free((void *) images);
+    manifest_destroy(&m);
     fs_destroy(&fs);
     return 0;
 
 error:
+    if (out_fd > STDOUT_FILENO) close(out_fd);
+    if (extract_names) free((void *) extract_names);
+    if (add_names) free((void *) add_names);
+    if (delete_names) free((void *) delete_names);
+    if (hot_names) free((void *) hot_names);
+    if (images) free((void *) images);
+    manifest_destroy(&m);
     fs_destroy(&fs);
     return 1;
 }
@@ -1,5 +1,11 @@
-OBJS := $(OBJS) fs.o main.o utils.o
+OBJS := $(OBJS) batch.o fs.o hash.o main.o server.o tar.o utils.o
+BENCH_OBJS := $(BENCH_OBJS) bench.o fs.o utils.o
 
+batch.o: batch.c batch.h fs.h hash.h utils.h
+bench.o: bench.c fs.h utils.h
 fs.o: fs.c fs.h utils.h
-main.o: main.c fs.h utils.h
+hash.o: hash.c hash.h fs.h utils.h
+main.o: main.c batch.h fs.h hash.h server.h tar.h utils.h
+server.o: server.c server.h fs.h utils.h
+tar.o: tar.c tar.h fs.h utils.h
 utils.o: utils.c utils.h
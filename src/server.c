@@ -0,0 +1,717 @@
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "server.h"
+#include "fs.h"
+#include "utils.h"
+
+/* Constants. */
+#define MAX_LINE_LENGTH                             4096U
+#define MAX_ARGS                                       4U
+
+/* Data structures and types. */
+
+/* A disk image kept resident by the server. */
+struct server_image {
+    char *name;                   /* The handle of the image. */
+    char *filename;               /* The filename of the image. */
+    struct fs fs;                 /* The filesystem. */
+    int is_modified;              /* If it has unflushed changes. */
+};
+
+/* The state of the server. */
+struct server {
+    const struct server_options *opts; /* The options. */
+    struct server_image **images; /* The open images. */
+    size_t num_images;            /* Number of open images. */
+    size_t capacity;              /* Capacity of `images`. */
+    struct string_buffer body;    /* The fields of the response. */
+    struct string_buffer errors;  /* The errors (as a JSON list). */
+    int quit;                     /* If the server should stop. */
+};
+
+/* Defines the type of the function that executes a command.
+ * The arguments (after the command name) are in `args`.
+ * Returns TRUE on success.
+ */
+typedef int (*command_fn)(struct server *srv, char **args,
+                          size_t num_args);
+
+/* A command of the server. */
+struct command {
+    const char *name;             /* The name of the command. */
+    size_t min_args;              /* Minimum number of arguments. */
+    size_t max_args;              /* Maximum number of arguments. */
+    command_fn fn;                /* The function that executes it. */
+};
+
+/* Functions. */
+
+/* Returns a copy of the string `str` (or NULL on error). */
+static
+char *copy_string(const char *str)
+{
+    char *copy;
+    size_t len;
+
+    len = strlen(str);
+    copy = (char *) malloc(len + 1);
+    if (unlikely(!copy)) {
+        report_error("server: memory exhausted");
+        return NULL;
+    }
+    memcpy(copy, str, len + 1);
+    return copy;
+}
+
+/* Returns the position of the image with handle `name`, or
+ * `srv->num_images` if there is no such image.
+ */
+static
+size_t image_index(const struct server *srv, const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < srv->num_images; i++) {
+        if (strcmp(srv->images[i]->name, name) == 0) break;
+    }
+    return i;
+}
+
+/* Finds the image with handle `name`.
+ * Returns the image, or NULL if it is not open.
+ */
+static
+struct server_image *find_image(const struct server *srv, const char *name)
+{
+    size_t i;
+
+    i = image_index(srv, name);
+    if (i == srv->num_images) {
+        report_error("server: image `%s` is not open", name);
+        return NULL;
+    }
+    return srv->images[i];
+}
+
+/* Releases the image `si`. */
+static
+void free_image(struct server_image *si)
+{
+    fs_destroy(&si->fs);
+    if (si->name) free((void *) si->name);
+    if (si->filename) free((void *) si->filename);
+    free((void *) si);
+}
+
+/* Opens the disk image `filename` (and checks its integrity),
+ * and keeps it under the handle `name`.
+ * Returns TRUE on success.
+ */
+static
+int open_image(struct server *srv, const char *name, const char *filename)
+{
+    struct server_image *si;
+    struct server_image **images;
+    struct geometry dg;
+    size_t capacity;
+
+    if (image_index(srv, name) != srv->num_images) {
+        report_error("server: image `%s` is already open", name);
+        return FALSE;
+    }
+
+    if (srv->num_images == srv->capacity) {
+        capacity = (srv->capacity > 0) ? 2 * srv->capacity : 8;
+        images = (struct server_image **)
+            realloc(srv->images, capacity * sizeof(struct server_image *));
+        if (unlikely(!images)) {
+            report_error("server: memory exhausted");
+            return FALSE;
+        }
+        srv->images = images;
+        srv->capacity = capacity;
+    }
+
+    si = (struct server_image *) malloc(sizeof(struct server_image));
+    if (unlikely(!si)) {
+        report_error("server: memory exhausted");
+        return FALSE;
+    }
+    fs_initvar(&si->fs);
+    si->is_modified = FALSE;
+    si->name = copy_string(name);
+    si->filename = copy_string(filename);
+
+    dg = srv->opts->dg;
+    if (!si->name || !si->filename
+        || (srv->opts->detect_geometry
+            && !fs_detect_geometry(filename, &dg))
+        || !fs_create(&si->fs, dg)
+        || !fs_open_image_mmap(&si->fs, filename)
+        || !fs_check_integrity(&si->fs, MAX(srv->opts->num_threads, 1U))) {
+        report_error("server: could not open `%s`", filename);
+        free_image(si);
+        return FALSE;
+    }
+
+    srv->images[srv->num_images++] = si;
+    return TRUE;
+}
+
+/* Finds the file `path` of the image with handle `name`. The image
+ * is returned in `psi`, and the file in `fe`.
+ * Returns TRUE on success.
+ */
+static
+int find_image_file(const struct server *srv, const char *name,
+                    const char *path, struct server_image **psi,
+                    struct file_entry *fe)
+{
+    *psi = find_image(srv, name);
+    if (!*psi) return FALSE;
+
+    if (!fs_find_file(&(*psi)->fs, path, fe)) {
+        report_error("server: could not find %s", path);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Appends the fields describing the file `fe` (with leader page
+ * information `finfo`) to `sb`.
+ */
+static
+void append_file(struct string_buffer *sb, const struct file_entry *fe,
+                 const struct file_info *finfo, size_t length)
+{
+    strbuf_printf(sb, "\"vda\": %u, \"sn\": %u, \"version\": %u, "
+                  "\"length\": %u, \"directory\": %s, \"name\": ",
+                  fe->leader_vda,
+                  ((fe->sn.word1 & SN_PART1_MASK) << 16) | fe->sn.word2,
+                  fe->version, (unsigned int) length,
+                  (fe->sn.word1 & SN_DIRECTORY) ? "true" : "false");
+    strbuf_append_json(sb, finfo->filename);
+}
+
+/* Callback to list the files of an image. */
+static
+int list_cb(const struct fs *fs, const struct file_entry *fe, void *arg)
+{
+    struct server *srv;
+    struct file_info finfo;
+    size_t length;
+
+    srv = (struct server *) arg;
+    if (!fs_file_info(fs, fe, &finfo)) return -1;
+    if (!fs_file_length(fs, fe, srv->opts->strict, &length)) return -1;
+
+    if (srv->body.str[srv->body.len - 1] != '[')
+        strbuf_printf(&srv->body, ", ");
+    strbuf_printf(&srv->body, "{");
+    append_file(&srv->body, fe, &finfo, length);
+    strbuf_printf(&srv->body, "}");
+    return 1;
+}
+
+/* Callback to list the entries of a directory. */
+static
+int dir_cb(const struct fs *fs, const struct directory_entry *de,
+           void *arg)
+{
+    struct server *srv;
+    struct file_info finfo;
+    size_t length;
+
+    srv = (struct server *) arg;
+    if (!fs_file_info(fs, &de->fe, &finfo)) return -1;
+    if (!fs_file_length(fs, &de->fe, srv->opts->strict, &length))
+        return -1;
+
+    /* The name in the entry is the one that counts. */
+    memcpy(finfo.filename, de->filename, FILENAME_LENGTH);
+    if (srv->body.str[srv->body.len - 1] != '[')
+        strbuf_printf(&srv->body, ", ");
+    strbuf_printf(&srv->body, "{");
+    append_file(&srv->body, &de->fe, &finfo, length);
+    strbuf_printf(&srv->body, "}");
+    return 1;
+}
+
+/* Executes `open name image`. */
+static
+int cmd_open(struct server *srv, char **args, size_t num_args)
+{
+    (void) num_args;
+    if (!open_image(srv, args[0], args[1])) return FALSE;
+    strbuf_printf(&srv->body, ", \"pages\": %u",
+                  (unsigned int) srv->images[srv->num_images - 1]->fs.length);
+    return TRUE;
+}
+
+/* Executes `close name`. */
+static
+int cmd_close(struct server *srv, char **args, size_t num_args)
+{
+    size_t i;
+
+    (void) num_args;
+    i = image_index(srv, args[0]);
+    if (i == srv->num_images) {
+        report_error("server: image `%s` is not open", args[0]);
+        return FALSE;
+    }
+    if (srv->images[i]->is_modified) {
+        report_error("server: image `%s` has unflushed changes", args[0]);
+        return FALSE;
+    }
+
+    free_image(srv->images[i]);
+    srv->num_images--;
+    memmove(&srv->images[i], &srv->images[i + 1],
+            (srv->num_images - i) * sizeof(struct server_image *));
+    return TRUE;
+}
+
+/* Executes `images`. */
+static
+int cmd_images(struct server *srv, char **args, size_t num_args)
+{
+    const struct server_image *si;
+    size_t i;
+
+    (void) args;
+    (void) num_args;
+    strbuf_printf(&srv->body, ", \"images\": [");
+    for (i = 0; i < srv->num_images; i++) {
+        si = srv->images[i];
+        if (i > 0) strbuf_printf(&srv->body, ", ");
+        strbuf_printf(&srv->body, "{\"name\": ");
+        strbuf_append_json(&srv->body, si->name);
+        strbuf_printf(&srv->body, ", \"image\": ");
+        strbuf_append_json(&srv->body, si->filename);
+        strbuf_printf(&srv->body, ", \"pages\": %u, \"modified\": %s}",
+                      (unsigned int) si->fs.length,
+                      (si->is_modified) ? "true" : "false");
+    }
+    strbuf_printf(&srv->body, "]");
+    return TRUE;
+}
+
+/* Executes `list name`. */
+static
+int cmd_list(struct server *srv, char **args, size_t num_args)
+{
+    struct server_image *si;
+
+    (void) num_args;
+    si = find_image(srv, args[0]);
+    if (!si) return FALSE;
+
+    strbuf_printf(&srv->body, ", \"files\": [");
+    if (!fs_scan_files(&si->fs, &list_cb, srv)) return FALSE;
+    strbuf_printf(&srv->body, "]");
+    return TRUE;
+}
+
+/* Executes `dir name [path]`. */
+static
+int cmd_dir(struct server *srv, char **args, size_t num_args)
+{
+    struct server_image *si;
+    struct file_entry fe;
+    const char *path;
+
+    path = (num_args > 1) ? args[1] : "SysDir";
+    if (!find_image_file(srv, args[0], path, &si, &fe)) return FALSE;
+    if (!(fe.sn.word1 & SN_DIRECTORY)) {
+        report_error("server: %s is not a directory", path);
+        return FALSE;
+    }
+
+    strbuf_printf(&srv->body, ", \"entries\": [");
+    if (!fs_scan_directory(&si->fs, &fe, &dir_cb, srv)) return FALSE;
+    strbuf_printf(&srv->body, "]");
+    return TRUE;
+}
+
+/* Executes `stat name path`. */
+static
+int cmd_stat(struct server *srv, char **args, size_t num_args)
+{
+    struct server_image *si;
+    struct file_entry fe;
+    struct file_info finfo;
+    size_t length;
+
+    (void) num_args;
+    if (!find_image_file(srv, args[0], args[1], &si, &fe)) return FALSE;
+    if (!fs_file_info(&si->fs, &fe, &finfo)) return FALSE;
+    if (!fs_file_length(&si->fs, &fe, srv->opts->strict, &length))
+        return FALSE;
+
+    strbuf_printf(&srv->body, ", ");
+    append_file(&srv->body, &fe, &finfo, length);
+    strbuf_printf(&srv->body, ", \"created\": %ld, \"written\": %ld, "
+                  "\"read\": %ld", (long) finfo.created,
+                  (long) finfo.written, (long) finfo.read);
+    return TRUE;
+}
+
+/* Executes `extract name path hostfile`. */
+static
+int cmd_extract(struct server *srv, char **args, size_t num_args)
+{
+    struct server_image *si;
+    struct file_entry fe;
+    size_t length;
+
+    (void) num_args;
+    if (!find_image_file(srv, args[0], args[1], &si, &fe)) return FALSE;
+    if (!fs_file_length(&si->fs, &fe, srv->opts->strict, &length))
+        return FALSE;
+    if (!fs_extract_file(&si->fs, &fe, args[2])) {
+        report_error("server: could not extract %s", args[1]);
+        return FALSE;
+    }
+
+    strbuf_printf(&srv->body, ", \"length\": %u", (unsigned int) length);
+    return TRUE;
+}
+
+/* Executes `replace name path hostfile`. */
+static
+int cmd_replace(struct server *srv, char **args, size_t num_args)
+{
+    struct server_image *si;
+    struct file_entry fe;
+    size_t length;
+
+    (void) num_args;
+    if (!find_image_file(srv, args[0], args[1], &si, &fe)) return FALSE;
+
+    /* Even a failed replacement may have changed some pages. */
+    si->is_modified = TRUE;
+    if (!fs_replace_file(&si->fs, &fe, args[2])) {
+        report_error("server: could not replace %s", args[1]);
+        return FALSE;
+    }
+    if (!fs_file_length(&si->fs, &fe, srv->opts->strict, &length))
+        return FALSE;
+
+    strbuf_printf(&srv->body, ", \"length\": %u", (unsigned int) length);
+    return TRUE;
+}
+
+/* Executes `flush name`. */
+static
+int cmd_flush(struct server *srv, char **args, size_t num_args)
+{
+    struct server_image *si;
+    int written;
+
+    (void) num_args;
+    si = find_image(srv, args[0]);
+    if (!si) return FALSE;
+
+    written = si->is_modified;
+    if (si->is_modified) {
+        if (!fs_update_image(&si->fs, si->filename,
+                             srv->opts->save_flags)) {
+            report_error("server: could not save `%s`", si->filename);
+            return FALSE;
+        }
+        si->is_modified = FALSE;
+    }
+
+    strbuf_printf(&srv->body, ", \"written\": %s",
+                  (written) ? "true" : "false");
+    return TRUE;
+}
+
+/* Executes `quit`. */
+static
+int cmd_quit(struct server *srv, char **args, size_t num_args)
+{
+    size_t i;
+    int ret;
+
+    (void) args;
+    (void) num_args;
+    ret = TRUE;
+    for (i = 0; i < srv->num_images; i++) {
+        if (srv->images[i]->is_modified) {
+            report_error("server: image `%s` has unflushed changes",
+                         srv->images[i]->name);
+            ret = FALSE;
+        }
+    }
+
+    if (ret) srv->quit = TRUE;
+    return ret;
+}
+
+/* The commands of the server. */
+static const struct command commands[] = {
+    { "open",    2, 2, &cmd_open    },
+    { "close",   1, 1, &cmd_close   },
+    { "images",  0, 0, &cmd_images  },
+    { "list",    1, 1, &cmd_list    },
+    { "dir",     1, 2, &cmd_dir     },
+    { "stat",    2, 2, &cmd_stat    },
+    { "extract", 3, 3, &cmd_extract },
+    { "replace", 3, 3, &cmd_replace },
+    { "flush",   1, 1, &cmd_flush   },
+    { "quit",    0, 0, &cmd_quit    },
+    { NULL,      0, 0, NULL         }
+};
+
+/* Splits the `line` in place into at most `max_args` words
+ * (separated by blanks), which are returned in `args`.
+ * Returns the number of words, or `max_args + 1` if there are more.
+ */
+static
+size_t split_line(char *line, char **args, size_t max_args)
+{
+    size_t num_args;
+    char *p;
+
+    num_args = 0;
+    p = line;
+    while (TRUE) {
+        while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+        if (*p == '\0') break;
+        if (num_args == max_args) return max_args + 1;
+
+        args[num_args++] = p;
+        while (*p && *p != ' ' && *p != '\t'
+               && *p != '\r' && *p != '\n') p++;
+        if (*p == '\0') break;
+        *p++ = '\0';
+    }
+    return num_args;
+}
+
+/* Executes the command in `line` and writes the response to `out`.
+ * Empty lines and lines starting with `#` are ignored.
+ * Returns TRUE if the response was written.
+ */
+static
+int execute_line(struct server *srv, char *line, FILE *out)
+{
+    char *args[MAX_ARGS + 1];
+    const struct command *cmd;
+    size_t num_args;
+    int success;
+
+    num_args = split_line(line, args, MAX_ARGS + 1);
+    if (num_args == 0 || args[0][0] == '#') return TRUE;
+
+    srv->body.len = 0;
+    srv->body.str[0] = '\0';
+    srv->errors.len = 0;
+    srv->errors.str[0] = '\0';
+
+    /* Route the errors of this command to its response. */
+    set_error_handler(&collect_json_error, &srv->errors);
+    for (cmd = commands; cmd->name; cmd++) {
+        if (strcmp(cmd->name, args[0]) == 0) break;
+    }
+    if (!cmd->name) {
+        report_error("server: unknown command `%s`", args[0]);
+        success = FALSE;
+    } else if (num_args - 1 < cmd->min_args
+               || num_args - 1 > cmd->max_args) {
+        report_error("server: wrong number of arguments for `%s`",
+                     cmd->name);
+        success = FALSE;
+    } else {
+        success = cmd->fn(srv, &args[1], num_args - 1);
+    }
+    set_error_handler(NULL, NULL);
+
+    if (success) {
+        fprintf(out, "{\"ok\": true%s}\n", srv->body.str);
+    } else {
+        fprintf(out, "{\"ok\": false, \"errors\": [%s]}\n",
+                srv->errors.str);
+    }
+    return (fflush(out) == 0);
+}
+
+/* Reads one line from `in` into `line` (of `size` bytes), dropping
+ * the newline. A line that is too long or that contains a NUL byte is
+ * consumed but not stored, and `*valid` is set to FALSE.
+ * Returns FALSE at the end of the input.
+ */
+static
+int read_line(FILE *in, char *line, size_t size, int *valid)
+{
+    size_t len;
+    int c;
+
+    len = 0;
+    *valid = TRUE;
+    while (TRUE) {
+        c = getc(in);
+        if (c == EOF) {
+            if (len == 0 && *valid) return FALSE;
+            break;
+        }
+        if (c == '\n') break;
+        if (c == '\0' || len + 1 == size) {
+            *valid = FALSE;
+            continue;
+        }
+        line[len++] = (char) c;
+    }
+    line[len] = '\0';
+    return TRUE;
+}
+
+/* Serves the commands read from `in`, writing the responses to `out`,
+ * until the end of the input or the `quit` command.
+ */
+static
+void serve_stream(struct server *srv, FILE *in, FILE *out)
+{
+    char line[MAX_LINE_LENGTH];
+    int valid;
+
+    while (!srv->quit && read_line(in, line, sizeof(line), &valid)) {
+        if (!valid) {
+            fprintf(out, "{\"ok\": false, \"errors\": "
+                    "[\"server: line too long or not text\"]}\n");
+            if (fflush(out) != 0) break;
+            continue;
+        }
+
+        if (!execute_line(srv, line, out)) break;
+    }
+}
+
+/* Serves the clients of the Unix socket `path`, one at a time,
+ * until the `quit` command.
+ * Returns TRUE on success.
+ */
+static
+int serve_socket(struct server *srv, const char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    FILE *in, *out;
+    int fd, cfd, ret;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        report_error("server: socket name `%s` is too long", path);
+        return FALSE;
+    }
+
+    /* Only a stale socket is removed (never a regular file). */
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        report_error("server: could not create socket: %s",
+                     strerror(errno));
+        return FALSE;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+        || listen(fd, 8) != 0) {
+        report_error("server: could not listen on `%s`: %s",
+                     path, strerror(errno));
+        close(fd);
+        return FALSE;
+    }
+
+    /* A client that goes away should not stop the server. */
+    signal(SIGPIPE, SIG_IGN);
+
+    ret = TRUE;
+    while (!srv->quit) {
+        cfd = accept(fd, NULL, NULL);
+        if (cfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            report_error("server: could not accept connection: %s",
+                         strerror(errno));
+            ret = FALSE;
+            break;
+        }
+
+        in = fdopen(cfd, "r");
+        out = (in) ? fdopen(dup(cfd), "w") : NULL;
+        if (unlikely(!in || !out)) {
+            report_error("server: could not open connection");
+            if (in) fclose(in); else close(cfd);
+            continue;
+        }
+
+        serve_stream(srv, in, out);
+        fclose(out);
+        fclose(in);
+    }
+
+    close(fd);
+    unlink(path);
+    return ret;
+}
+
+int server_run(const char * const *images, size_t num_images,
+               const struct server_options *opts)
+{
+    struct server srv;
+    size_t i;
+    int ret;
+
+    srv.opts = opts;
+    srv.images = NULL;
+    srv.num_images = 0;
+    srv.capacity = 0;
+    srv.quit = FALSE;
+    strbuf_initvar(&srv.errors);
+
+    ret = FALSE;
+    if (!strbuf_create(&srv.body, 4096)) return FALSE;
+    if (!strbuf_create(&srv.errors, 256)) goto done;
+
+    for (i = 0; i < num_images; i++) {
+        if (!open_image(&srv, images[i], images[i])) goto done;
+    }
+
+    if (opts->socket_path) {
+        ret = serve_socket(&srv, opts->socket_path);
+    } else {
+        serve_stream(&srv, stdin, stdout);
+        ret = TRUE;
+    }
+
+    /* The input may end before the changes were flushed. */
+    for (i = 0; i < srv.num_images; i++) {
+        if (srv.images[i]->is_modified) {
+            report_error("server: discarding the unflushed changes "
+                         "to `%s`", srv.images[i]->name);
+            ret = FALSE;
+        }
+    }
+
+done:
+    for (i = 0; i < srv.num_images; i++)
+        free_image(srv.images[i]);
+    if (srv.images) free((void *) srv.images);
+    strbuf_destroy(&srv.errors);
+    strbuf_destroy(&srv.body);
+    return ret;
+}
@@ -0,0 +1,55 @@
+
+#ifndef __SERVER_H
+#define __SERVER_H
+
+#include <stddef.h>
+#include "fs.h"
+
+/* Data structures and types. */
+
+/* Options for the server mode. */
+struct server_options {
+    struct geometry dg;           /* The disk geometry. */
+    int detect_geometry;          /* Detect the geometry of each image
+                                   * instead of using `dg`.
+                                   */
+    unsigned int num_threads;     /* Number of threads for checking
+                                   * the images when they are opened.
+                                   */
+    int strict;                   /* Do not trust the length hints. */
+    unsigned int save_flags;      /* The flags for fs_update_image(). */
+    const char *socket_path;      /* Listen on this Unix socket instead
+                                   * of the standard input (or NULL).
+                                   */
+};
+
+/* Functions. */
+
+/* Runs the server mode, which keeps the disk images resident and
+ * serves the commands read (one per line) from the standard input,
+ * or from the clients of the Unix socket `opts->socket_path`, one
+ * connection at a time. Each command is answered with one JSON line:
+ *   open name image   opens the image under the handle `name`;
+ *   close name        closes it (refused while it has changes);
+ *   images            lists the open images;
+ *   list name         lists all the files;
+ *   dir name [path]   lists a directory (SysDir by default);
+ *   stat name path    describes a file;
+ *   extract name path hostfile
+ *   replace name path hostfile
+ *                     copy the contents of a file to (or from)
+ *                     a host file;
+ *   flush name        writes the modified pages back to the image;
+ *   quit              stops the server (refused while any image
+ *                     has changes).
+ * If the input ends while some image has unflushed changes, they
+ * are discarded and reported.
+ * The images in `images` (there are `num_images` of them) are opened
+ * at the start, with their filenames as handles.
+ * The options are given by `opts`.
+ * Returns TRUE on success.
+ */
+int server_run(const char * const *images, size_t num_images,
+               const struct server_options *opts);
+
+#endif /* __SERVER_H */
@@ -0,0 +1,390 @@
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "tar.h"
+#include "fs.h"
+#include "utils.h"
+
+/* Constants. */
+#define TAR_BLOCK_SIZE                              512U
+#define TAR_NAME_LENGTH                             100U
+#define TAR_PREFIX_LENGTH                           155U
+
+/* Number of buffers written at once. */
+#define TAR_BATCH_IOVECS                             64U
+
+/* Number of headers that can be queued at once. */
+#define TAR_BATCH_HEADERS                            16U
+
+/* Offsets within the ustar header. */
+#define TAR_NAME                                      0U
+#define TAR_MODE                                    100U
+#define TAR_UID                                     108U
+#define TAR_GID                                     116U
+#define TAR_SIZE                                    124U
+#define TAR_MTIME                                   136U
+#define TAR_CHKSUM                                  148U
+#define TAR_TYPEFLAG                                156U
+#define TAR_MAGIC                                   257U
+#define TAR_VERSION                                 263U
+#define TAR_PREFIX                                  345U
+
+/* Data structures and types. */
+
+/* An entry of the archive. */
+struct tar_entry {
+    struct file_entry fe;         /* The file (or directory). */
+    char *path;                   /* The path in the archive. */
+    int is_dir;                   /* If it is a directory. */
+    size_t order;                 /* The order in which it was found. */
+};
+
+/* Auxiliary data structure used to build and write the archive. */
+struct tar_context {
+    const struct fs *fs;          /* The filesystem. */
+    int fd;                       /* The output file descriptor. */
+    int strict;                   /* Do not trust the length hints. */
+
+    struct tar_entry *entries;    /* The entries of the archive. */
+    size_t num_entries;           /* Number of entries. */
+    size_t capacity;              /* Capacity of `entries`. */
+    uint8_t *visited;             /* Visited directories (by VDA). */
+    char path[MAX_PATH_LENGTH];   /* The current directory path. */
+    size_t len;                   /* The length of the current path. */
+
+    struct iovec iov[TAR_BATCH_IOVECS]; /* The pending buffers. */
+    int iovcnt;                   /* Number of pending buffers. */
+    uint8_t headers[TAR_BATCH_HEADERS][TAR_BLOCK_SIZE];
+                                  /* Storage for the pending headers. */
+    unsigned int num_headers;     /* Number of pending headers. */
+};
+
+/* Global variables. */
+static const uint8_t zero_block[2 * TAR_BLOCK_SIZE];
+
+/* Functions. */
+
+/* Writes all the pending buffers of `ctx`.
+ * Returns TRUE on success.
+ */
+static
+int flush_output(struct tar_context *ctx)
+{
+    int ret;
+
+    ret = write_iovecs(ctx->fd, ctx->iov, ctx->iovcnt);
+    ctx->iovcnt = 0;
+    ctx->num_headers = 0;
+    if (!ret) report_error("tar: error while writing");
+    return ret;
+}
+
+/* Queues the buffer `data` of length `len` for writing.
+ * The buffer must remain valid until the next flush.
+ * Returns TRUE on success.
+ */
+static
+int queue_output(struct tar_context *ctx, const void *data, size_t len)
+{
+    if (len == 0) return TRUE;
+    if (ctx->iovcnt == TAR_BATCH_IOVECS) {
+        if (!flush_output(ctx)) return FALSE;
+    }
+
+    ctx->iov[ctx->iovcnt].iov_base = (void *) data;
+    ctx->iov[ctx->iovcnt].iov_len = len;
+    ctx->iovcnt++;
+    return TRUE;
+}
+
+/* Writes the `value` in octal in the field `dst` of `len` bytes
+ * (including the terminating NUL character).
+ */
+static
+void write_octal(uint8_t *dst, size_t len, unsigned long value)
+{
+    dst[--len] = '\0';
+    while (len-- > 0) {
+        dst[len] = (uint8_t) ('0' + (value & 7));
+        value >>= 3;
+    }
+}
+
+/* Queues the ustar header for the file `path` (of length `size`).
+ * Returns TRUE on success.
+ */
+static
+int queue_header(struct tar_context *ctx, const char *path,
+                 size_t size, time_t mtime, int is_dir)
+{
+    uint8_t *hdr;
+    size_t i, len, split;
+    unsigned long sum;
+
+    len = strlen(path);
+    split = 0;
+    if (len > TAR_NAME_LENGTH) {
+        /* Split the path in the prefix and the name. */
+        for (i = 0; i < len && i <= TAR_PREFIX_LENGTH; i++) {
+            if (path[i] == '/' && len - i - 1 <= TAR_NAME_LENGTH)
+                split = i;
+        }
+        if (split == 0) {
+            report_error("tar: path too long: %s", path);
+            return FALSE;
+        }
+    }
+
+    /* Make sure the header is queued in the same batch. */
+    if (ctx->num_headers == TAR_BATCH_HEADERS
+        || ctx->iovcnt == TAR_BATCH_IOVECS) {
+        if (!flush_output(ctx)) return FALSE;
+    }
+
+    hdr = ctx->headers[ctx->num_headers++];
+    memset(hdr, 0, TAR_BLOCK_SIZE);
+
+    if (split > 0) {
+        memcpy(&hdr[TAR_PREFIX], path, split);
+        memcpy(&hdr[TAR_NAME], &path[split + 1], len - split - 1);
+    } else {
+        memcpy(&hdr[TAR_NAME], path, len);
+    }
+
+    write_octal(&hdr[TAR_MODE], 8, (is_dir) ? 0755 : 0644);
+    write_octal(&hdr[TAR_UID], 8, 0);
+    write_octal(&hdr[TAR_GID], 8, 0);
+    write_octal(&hdr[TAR_SIZE], 12, (unsigned long) size);
+    write_octal(&hdr[TAR_MTIME], 12,
+                (mtime > 0) ? (unsigned long) mtime : 0);
+    hdr[TAR_TYPEFLAG] = (is_dir) ? '5' : '0';
+    memcpy(&hdr[TAR_MAGIC], "ustar", 6);
+    memcpy(&hdr[TAR_VERSION], "00", 2);
+
+    /* The checksum is computed with the field filled with spaces. */
+    memset(&hdr[TAR_CHKSUM], ' ', 8);
+    sum = 0;
+    for (i = 0; i < TAR_BLOCK_SIZE; i++) sum += hdr[i];
+    write_octal(&hdr[TAR_CHKSUM], 7, sum);
+
+    return queue_output(ctx, hdr, TAR_BLOCK_SIZE);
+}
+
+/* Adds an entry for the file `fe` to the archive, with the name
+ * `name` under the current directory.
+ * Returns TRUE on success.
+ */
+static
+int add_entry(struct tar_context *ctx, const struct file_entry *fe,
+              const char *name, int is_dir)
+{
+    struct tar_entry *entries;
+    size_t len, capacity;
+    char *path;
+
+    len = strlen(name);
+    if (ctx->len + len + 2 > sizeof(ctx->path)) {
+        report_error("tar: path too long: %s/%s", ctx->path, name);
+        return FALSE;
+    }
+
+    if (ctx->num_entries == ctx->capacity) {
+        capacity = MAX(2 * ctx->capacity, 64);
+        entries = (struct tar_entry *)
+            realloc(ctx->entries, capacity * sizeof(struct tar_entry));
+        if (unlikely(!entries)) goto error_mem;
+        ctx->entries = entries;
+        ctx->capacity = capacity;
+    }
+
+    path = (char *) malloc(ctx->len + len + 2);
+    if (unlikely(!path)) goto error_mem;
+
+    memcpy(path, ctx->path, ctx->len);
+    memcpy(&path[ctx->len], name, len);
+    path[ctx->len + len] = (is_dir) ? '/' : '\0';
+    path[ctx->len + len + 1] = '\0';
+
+    ctx->entries[ctx->num_entries].fe = *fe;
+    ctx->entries[ctx->num_entries].path = path;
+    ctx->entries[ctx->num_entries].is_dir = is_dir;
+    ctx->entries[ctx->num_entries].order = ctx->num_entries;
+    ctx->num_entries++;
+    return TRUE;
+
+error_mem:
+    report_error("tar: memory exhausted");
+    return FALSE;
+}
+
+/* Callback to collect the entries of a directory. */
+static
+int collect_cb(const struct fs *fs,
+               const struct directory_entry *de,
+               void *arg)
+{
+    struct tar_context *ctx;
+    size_t len;
+    int ret;
+
+    ctx = (struct tar_context *) arg;
+    if (de->fe.leader_vda >= fs->length) {
+        report_error("tar: invalid VDA in directory entry: %u",
+                     de->fe.leader_vda);
+        return -1;
+    }
+
+    if (!(de->fe.sn.word1 & SN_DIRECTORY))
+        return (add_entry(ctx, &de->fe, de->filename, FALSE)) ? 1 : -1;
+
+    /* Do not visit the same directory twice
+     * (for example, SysDir contains itself).
+     */
+    if (ctx->visited[de->fe.leader_vda]) return 1;
+    ctx->visited[de->fe.leader_vda] = TRUE;
+
+    if (!add_entry(ctx, &de->fe, de->filename, TRUE)) return -1;
+
+    len = ctx->len;
+    strcpy(ctx->path, ctx->entries[ctx->num_entries - 1].path);
+    ctx->len = strlen(ctx->path);
+
+    ret = fs_scan_directory(fs, &de->fe, &collect_cb, ctx);
+
+    ctx->len = len;
+    ctx->path[len] = '\0';
+    return (ret) ? 1 : -1;
+}
+
+/* Compares two tar entries. The directories come first (in the order
+ * they were found), and then the files by the leader VDA.
+ */
+static
+int compare_entries(const void *p1, const void *p2)
+{
+    const struct tar_entry *e1, *e2;
+
+    e1 = (const struct tar_entry *) p1;
+    e2 = (const struct tar_entry *) p2;
+    if (e1->is_dir != e2->is_dir) return (e1->is_dir) ? -1 : 1;
+    if (!e1->is_dir && e1->fe.leader_vda != e2->fe.leader_vda)
+        return (e1->fe.leader_vda < e2->fe.leader_vda) ? -1 : 1;
+    if (e1->order != e2->order) return (e1->order < e2->order) ? -1 : 1;
+    return 0;
+}
+
+/* Writes the entry `te` (the header and the contents) to the archive.
+ * Returns TRUE on success.
+ */
+static
+int write_entry(struct tar_context *ctx, const struct tar_entry *te)
+{
+    struct file_span spans[TAR_BATCH_IOVECS];
+    struct file_info finfo;
+    struct open_file of;
+    size_t i, count, length, total;
+
+    if (!fs_file_info(ctx->fs, &te->fe, &finfo)) {
+        report_error("tar: could not get file information");
+        return FALSE;
+    }
+
+    if (te->is_dir)
+        return queue_header(ctx, te->path, 0, finfo.written, TRUE);
+
+    if (!fs_file_length(ctx->fs, &te->fe, ctx->strict, &length)) {
+        report_error("tar: could not get the length of %s", te->path);
+        return FALSE;
+    }
+
+    if (!queue_header(ctx, te->path, length, finfo.written, FALSE))
+        return FALSE;
+
+    if (!fs_open(ctx->fs, &te->fe, &of, FALSE)) {
+        report_error("tar: could not open %s", te->path);
+        return FALSE;
+    }
+
+    /* The spans remain valid, so they can be batched across files. */
+    total = 0;
+    while (TRUE) {
+        if (ctx->iovcnt == TAR_BATCH_IOVECS) {
+            if (!flush_output(ctx)) return FALSE;
+        }
+
+        count = fs_read_spans(ctx->fs, &of, spans,
+                              TAR_BATCH_IOVECS - ctx->iovcnt);
+        if (of.error) {
+            report_error("tar: error while reading %s", te->path);
+            return FALSE;
+        }
+        if (count == 0) break;
+
+        for (i = 0; i < count; i++) {
+            queue_output(ctx, spans[i].data, spans[i].length);
+            total += spans[i].length;
+        }
+    }
+
+    if (total != length) {
+        report_error("tar: inconsistent length of %s", te->path);
+        return FALSE;
+    }
+
+    /* Pad the contents to a whole block. */
+    return queue_output(ctx, zero_block,
+                        (TAR_BLOCK_SIZE - (length % TAR_BLOCK_SIZE))
+                        % TAR_BLOCK_SIZE);
+}
+
+int tar_write_fs(const struct fs *fs, int fd, int strict)
+{
+    struct tar_context ctx;
+    struct file_entry root_fe;
+    size_t i;
+    int success;
+
+    if (!fs_file_entry(fs, 1, &root_fe)) return FALSE;
+
+    ctx.fs = fs;
+    ctx.fd = fd;
+    ctx.strict = strict;
+    ctx.entries = NULL;
+    ctx.num_entries = 0;
+    ctx.capacity = 0;
+    ctx.path[0] = '\0';
+    ctx.len = 0;
+    ctx.iovcnt = 0;
+    ctx.num_headers = 0;
+
+    ctx.visited = (uint8_t *) calloc(fs->length, sizeof(uint8_t));
+    if (unlikely(!ctx.visited)) {
+        report_error("tar: memory exhausted");
+        return FALSE;
+    }
+    ctx.visited[root_fe.leader_vda] = TRUE;
+
+    success = fs_scan_directory(fs, &root_fe, &collect_cb, &ctx);
+    if (success) {
+        qsort(ctx.entries, ctx.num_entries, sizeof(struct tar_entry),
+              &compare_entries);
+
+        for (i = 0; success && i < ctx.num_entries; i++)
+            success = write_entry(&ctx, &ctx.entries[i]);
+
+        /* The archive ends with two zero blocks. */
+        success = success
+            && queue_output(&ctx, zero_block, sizeof(zero_block))
+            && flush_output(&ctx);
+    }
+
+    for (i = 0; i < ctx.num_entries; i++)
+        free((void *) ctx.entries[i].path);
+    if (ctx.entries) free((void *) ctx.entries);
+    free((void *) ctx.visited);
+    return success;
+}
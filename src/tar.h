@@ -0,0 +1,21 @@
+
+#ifndef __TAR_H
+#define __TAR_H
+
+#include "fs.h"
+
+/* Functions. */
+
+/* Writes the directory hierarchy starting at SysDir as a tar (ustar)
+ * archive to the file descriptor `fd` (which can be a pipe).
+ * The directories come first, followed by the files in order of
+ * their leader pages, so that the disk is read roughly sequentially.
+ * The contents are written in large batches, straight from the data
+ * of the pages (without any temporary files).
+ * Unless `strict` is TRUE, the file lengths are taken from the
+ * length hints (see fs_file_length()).
+ * Returns TRUE on success.
+ */
+int tar_write_fs(const struct fs *fs, int fd, int strict);
+
+#endif /* __TAR_H */
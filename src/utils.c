@@ -1,16 +1,569 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include "utils.h"
 
+/* Data structures and types. */
+
+/* The error handler of a thread. */
+struct error_route {
+    error_handler handler;        /* The handler function. */
+    void *arg;                    /* The extra argument. */
+    int active;                   /* If the handler is running (errors
+                                   * raised by the handler itself go
+                                   * to stderr).
+                                   */
+};
+
+/* A block of memory of an arena (followed by the memory itself). */
+struct arena_block {
+    struct arena_block *next;     /* The previous block. */
+    size_t size;                  /* The size of the memory. */
+    size_t used;                  /* Number of bytes given out. */
+};
+
+/* Defines the type of the byte swapping kernels (see swap_bytes()). */
+typedef void (*swap_kernel)(uint8_t *dst, const uint8_t *src, size_t len);
+
+/* Constants. */
+#define MAX_ERROR_LENGTH                           1024U
+
+/* The offset of the memory of an arena block. */
+#define ARENA_HEADER              ARENA_ROUND(sizeof(struct arena_block))
+
+/* Global variables. */
+static pthread_once_t error_once = PTHREAD_ONCE_INIT;
+static pthread_key_t error_key;
+static pthread_mutex_t error_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t filter_lock = PTHREAD_MUTEX_INITIALIZER;
+static swap_kernel swap_impl;
+
+/* Functions. */
+
+/* Initializes the key of the per-thread error handlers. */
+static
+void init_error_key(void)
+{
+    pthread_key_create(&error_key, &free);
+}
+
 void report_error(const char *fmt, ...)
 {
+    struct error_route *route;
+    char msg[MAX_ERROR_LENGTH];
     va_list ap;
 
+    pthread_once(&error_once, &init_error_key);
+    route = (struct error_route *) pthread_getspecific(error_key);
+    if (route && route->handler && !route->active) {
+        va_start(ap, fmt);
+        vsnprintf(msg, sizeof(msg), fmt, ap);
+        va_end(ap);
+        route->active = TRUE;
+        route->handler(msg, route->arg);
+        route->active = FALSE;
+        return;
+    }
+
+    /* Do not interleave the messages from multiple threads. */
+    pthread_mutex_lock(&error_lock);
     fflush(stdout);
     va_start(ap, fmt);
     vfprintf(stderr, fmt, ap);
     va_end(ap);
     fprintf(stderr, "\n");
+    pthread_mutex_unlock(&error_lock);
+}
+
+void set_error_handler(error_handler handler, void *arg)
+{
+    struct error_route *route;
+
+    pthread_once(&error_once, &init_error_key);
+    route = (struct error_route *) pthread_getspecific(error_key);
+    if (!route) {
+        if (!handler) return;
+        route = (struct error_route *) malloc(sizeof(struct error_route));
+        if (unlikely(!route)) return;
+        pthread_setspecific(error_key, route);
+    }
+
+    route->handler = handler;
+    route->arg = arg;
+    route->active = FALSE;
+}
+
+void get_error_handler(error_handler *handler, void **arg)
+{
+    const struct error_route *route;
+
+    pthread_once(&error_once, &init_error_key);
+    route = (const struct error_route *) pthread_getspecific(error_key);
+    *handler = (route) ? route->handler : NULL;
+    *arg = (route) ? route->arg : NULL;
+}
+
+void collect_json_error(const char *msg, void *arg)
+{
+    struct string_buffer *sb;
+    size_t len;
+
+    sb = (struct string_buffer *) arg;
+    len = sb->len;
+    if ((len == 0 || strbuf_printf(sb, ", "))
+        && strbuf_append_json(sb, msg))
+        return;
+
+    /* Drop the partial entry (the errors raised by a handler are not
+     * routed to it, so this goes to stderr).
+     */
+    sb->len = len;
+    sb->str[len] = '\0';
+    report_error("%s", msg);
+}
+
+int write_iovecs(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t ret;
+    size_t nbytes;
+
+    while (iovcnt > 0) {
+        ret = writev(fd, iov, iovcnt);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            return FALSE;
+        }
+
+        nbytes = (size_t) ret;
+        while (iovcnt > 0 && nbytes >= iov->iov_len) {
+            nbytes -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if (iovcnt > 0) {
+            iov->iov_base = &((uint8_t *) iov->iov_base)[nbytes];
+            iov->iov_len -= nbytes;
+        }
+    }
+    return TRUE;
 }
 
+int filter_start(struct filter *flt, const char * const *argv, int fd,
+                 int is_writer)
+{
+    sigset_t set;
+    int fds[2];
+    int ret;
+
+    flt->name = argv[0];
+    flt->pid = -1;
+    flt->fp = NULL;
+    flt->is_writer = FALSE;
+
+    /* Do not leak the pipe to other programs. The pipe is not
+     * created with its flags at once (pipe2() is not POSIX), so
+     * the filters are started one at a time, lest another thread
+     * forks before they are set.
+     */
+    pthread_mutex_lock(&filter_lock);
+    if (pipe(fds) != 0) {
+        pthread_mutex_unlock(&filter_lock);
+        report_error("utils: filter_start: could not create a pipe");
+        return FALSE;
+    }
+
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+    flt->pid = fork();
+    if (flt->pid < 0) {
+        pthread_mutex_unlock(&filter_lock);
+        report_error("utils: filter_start: could not start `%s`",
+                     argv[0]);
+        close(fds[0]);
+        close(fds[1]);
+        return FALSE;
+    }
+
+    if (flt->pid == 0) {
+        /* Only async-signal-safe functions in the child. */
+        if (is_writer) {
+            ret = dup2(fds[0], STDIN_FILENO) >= 0
+                && dup2(fd, STDOUT_FILENO) >= 0;
+        } else {
+            ret = dup2(fd, STDIN_FILENO) >= 0
+                && dup2(fds[1], STDOUT_FILENO) >= 0;
+        }
+        if (ret) execvp(argv[0], (char * const *) argv);
+        _exit(127);
+    }
+    pthread_mutex_unlock(&filter_lock);
+
+    if (is_writer) {
+        /* Only the parent blocks SIGPIPE (not the program). */
+        sigemptyset(&set);
+        sigaddset(&set, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &set, &flt->old_mask);
+        flt->is_writer = TRUE;
+
+        close(fds[0]);
+        flt->fp = fdopen(fds[1], "wb");
+        if (!flt->fp) close(fds[1]);
+    } else {
+        close(fds[1]);
+        flt->fp = fdopen(fds[0], "rb");
+        if (!flt->fp) close(fds[0]);
+    }
+
+    if (!flt->fp) {
+        report_error("utils: filter_start: could not open the pipe");
+        filter_finish(flt);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+int filter_finish(struct filter *flt)
+{
+    sigset_t set;
+    int ret, status, sig;
+
+    ret = TRUE;
+    if (flt->fp && fclose(flt->fp) != 0) ret = FALSE;
+    flt->fp = NULL;
+
+    if (flt->is_writer) {
+        /* Discard the SIGPIPE raised by writing to a closed pipe
+         * (the failed write was already noticed) before the signal
+         * is unblocked.
+         */
+        if (!sigismember(&flt->old_mask, SIGPIPE)) {
+            sigpending(&set);
+            if (sigismember(&set, SIGPIPE)) {
+                sigemptyset(&set);
+                sigaddset(&set, SIGPIPE);
+                sigwait(&set, &sig);
+            }
+        }
+        pthread_sigmask(SIG_SETMASK, &flt->old_mask, NULL);
+        flt->is_writer = FALSE;
+    }
+
+    if (flt->pid > 0) {
+        while (waitpid(flt->pid, &status, 0) < 0) {
+            if (errno != EINTR) {
+                status = -1;
+                break;
+            }
+        }
+
+        if (status == -1) {
+            report_error("utils: filter_finish: could not wait for `%s`",
+                         flt->name);
+            ret = FALSE;
+        } else if (WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+            report_error("utils: filter_finish: could not run `%s`",
+                         flt->name);
+            ret = FALSE;
+        } else if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+            report_error("utils: filter_finish: `%s` exited with "
+                         "status %d", flt->name, WEXITSTATUS(status));
+            ret = FALSE;
+        } else if (WIFSIGNALED(status)) {
+            report_error("utils: filter_finish: `%s` was killed by "
+                         "signal %d", flt->name, WTERMSIG(status));
+            ret = FALSE;
+        } else if (!ret) {
+            report_error("utils: filter_finish: could not close "
+                         "the pipe of `%s`", flt->name);
+        }
+    }
+    flt->pid = -1;
+    return ret;
+}
+
+/* Swaps the bytes of the `len / 2` words in `src` one at a time. */
+static
+void swap_bytes_scalar(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    size_t j;
+
+    for (j = 0; j + 1 < len; j += 2) {
+        dst[j] = src[j + 1];
+        dst[j + 1] = src[j];
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+/* Swaps the bytes of the words with SSE2 shifts (8 words at a time). */
+static __attribute__((target ("sse2")))
+void swap_bytes_sse2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    __m128i v;
+    size_t j;
+
+    for (j = 0; j + 16 <= len; j += 16) {
+        v = _mm_loadu_si128((const __m128i *) &src[j]);
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128((__m128i *) &dst[j], v);
+    }
+    swap_bytes_scalar(&dst[j], &src[j], len - j);
+}
+
+/* Swaps the bytes of the words with SSSE3 shuffles (8 words at
+ * a time).
+ */
+static __attribute__((target ("ssse3")))
+void swap_bytes_ssse3(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    __m128i v, mask;
+    size_t j;
+
+    mask = _mm_set_epi8(14, 15, 12, 13, 10, 11, 8, 9,
+                        6, 7, 4, 5, 2, 3, 0, 1);
+    for (j = 0; j + 16 <= len; j += 16) {
+        v = _mm_loadu_si128((const __m128i *) &src[j]);
+        v = _mm_shuffle_epi8(v, mask);
+        _mm_storeu_si128((__m128i *) &dst[j], v);
+    }
+    swap_bytes_scalar(&dst[j], &src[j], len - j);
+}
+
+/* Swaps the bytes of the words with AVX2 shuffles (16 words at
+ * a time).
+ */
+static __attribute__((target ("avx2")))
+void swap_bytes_avx2(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    __m256i v, mask;
+    size_t j;
+
+    mask = _mm256_set_epi8(14, 15, 12, 13, 10, 11, 8, 9,
+                           6, 7, 4, 5, 2, 3, 0, 1,
+                           14, 15, 12, 13, 10, 11, 8, 9,
+                           6, 7, 4, 5, 2, 3, 0, 1);
+    for (j = 0; j + 32 <= len; j += 32) {
+        v = _mm256_loadu_si256((const __m256i *) &src[j]);
+        v = _mm256_shuffle_epi8(v, mask);
+        _mm256_storeu_si256((__m256i *) &dst[j], v);
+    }
+    swap_bytes_ssse3(&dst[j], &src[j], len - j);
+}
+#elif defined(__ARM_NEON)
+/* Swaps the bytes of the words with NEON (8 words at a time). */
+static
+void swap_bytes_neon(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    size_t j;
+
+    for (j = 0; j + 16 <= len; j += 16)
+        vst1q_u8(&dst[j], vrev16q_u8(vld1q_u8(&src[j])));
+    swap_bytes_scalar(&dst[j], &src[j], len - j);
+}
+#endif
+
+/* Selects the fastest byte swapping kernel for this CPU.
+ * It runs before main(), so that swap_bytes() can use `swap_impl`
+ * without any synchronization.
+ */
+static __attribute__((constructor))
+void init_swap_kernel(void)
+{
+    swap_impl = &swap_bytes_scalar;
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        swap_impl = &swap_bytes_avx2;
+    else if (__builtin_cpu_supports("ssse3"))
+        swap_impl = &swap_bytes_ssse3;
+    else if (__builtin_cpu_supports("sse2"))
+        swap_impl = &swap_bytes_sse2;
+#elif defined(__ARM_NEON)
+    swap_impl = &swap_bytes_neon;
+#endif
+}
+
+void swap_bytes(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    swap_impl(dst, src, len);
+}
+
+void strbuf_initvar(struct string_buffer *sb)
+{
+    sb->str = NULL;
+    sb->len = 0;
+    sb->capacity = 0;
+}
+
+void strbuf_destroy(struct string_buffer *sb)
+{
+    if (sb->str) free((void *) sb->str);
+    sb->str = NULL;
+}
+
+int strbuf_create(struct string_buffer *sb, size_t capacity)
+{
+    strbuf_initvar(sb);
+
+    sb->capacity = capacity + 1;
+    sb->str = (char *) malloc(sb->capacity);
+    if (unlikely(!sb->str)) {
+        report_error("utils: strbuf_create: memory exhausted");
+        return FALSE;
+    }
+
+    sb->str[0] = '\0';
+    return TRUE;
+}
+
+/* Makes sure there is room for `extra` characters (plus the NUL
+ * byte) in the string buffer `sb`.
+ * Returns TRUE on success.
+ */
+static
+int strbuf_reserve(struct string_buffer *sb, size_t extra)
+{
+    size_t capacity;
+    char *str;
+
+    if (sb->len + extra < sb->capacity) return TRUE;
+
+    capacity = MAX(2 * sb->capacity, sb->len + extra + 1);
+    str = (char *) realloc(sb->str, capacity);
+    if (unlikely(!str)) {
+        report_error("utils: strbuf_reserve: memory exhausted");
+        return FALSE;
+    }
+
+    sb->str = str;
+    sb->capacity = capacity;
+    return TRUE;
+}
+
+int strbuf_printf(struct string_buffer *sb, const char *fmt, ...)
+{
+    va_list ap;
+    size_t avail;
+    int n;
+
+    avail = sb->capacity - sb->len;
+    va_start(ap, fmt);
+    n = vsnprintf(&sb->str[sb->len], avail, fmt, ap);
+    va_end(ap);
+    if (n < 0) return FALSE;
+
+    if (((size_t) n) >= avail) {
+        if (!strbuf_reserve(sb, (size_t) n)) return FALSE;
+
+        va_start(ap, fmt);
+        vsnprintf(&sb->str[sb->len], sb->capacity - sb->len, fmt, ap);
+        va_end(ap);
+    }
+
+    sb->len += (size_t) n;
+    return TRUE;
+}
+
+int strbuf_append_json(struct string_buffer *sb, const char *str)
+{
+    unsigned char c;
+
+    /* Reserve enough for the common case. */
+    if (!strbuf_reserve(sb, strlen(str) + 2)) return FALSE;
+
+    sb->str[sb->len++] = '"';
+    for (; *str; str++) {
+        c = (unsigned char) *str;
+        if (c == '"' || c == '\\') {
+            if (!strbuf_printf(sb, "\\%c", c)) return FALSE;
+        } else if (c < 0x20) {
+            if (!strbuf_printf(sb, "\\u%04x", c)) return FALSE;
+        } else {
+            if (!strbuf_reserve(sb, 1)) return FALSE;
+            sb->str[sb->len++] = (char) c;
+        }
+    }
+
+    if (!strbuf_reserve(sb, 1)) return FALSE;
+    sb->str[sb->len++] = '"';
+    sb->str[sb->len] = '\0';
+    return TRUE;
+}
+
+void arena_initvar(struct arena *a)
+{
+    a->blocks = NULL;
+    a->block_size = 0;
+}
+
+void arena_destroy(struct arena *a)
+{
+    struct arena_block *b;
+
+    while (a->blocks) {
+        b = a->blocks;
+        a->blocks = b->next;
+        free((void *) b);
+    }
+}
+
+/* Adds a new block with room for `size` bytes to the arena `a`.
+ * Returns the new block, or NULL if out of memory.
+ */
+static
+struct arena_block *arena_grow(struct arena *a, size_t size)
+{
+    struct arena_block *b;
+
+    b = (struct arena_block *) malloc(ARENA_HEADER + size);
+    if (unlikely(!b)) return NULL;
+
+    b->next = a->blocks;
+    b->size = size;
+    b->used = 0;
+    a->blocks = b;
+    return b;
+}
+
+int arena_create(struct arena *a, size_t block_size)
+{
+    arena_initvar(a);
+
+    a->block_size = block_size;
+    if (unlikely(!arena_grow(a, block_size))) {
+        report_error("utils: arena_create: memory exhausted");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+    struct arena_block *b;
+    void *ptr;
+
+    size = ARENA_ROUND(size);
+    b = a->blocks;
+    if (!b || b->size - b->used < size) {
+        b = arena_grow(a, MAX(size, a->block_size));
+        if (unlikely(!b)) return NULL;
+    }
+
+    ptr = &((uint8_t *) b)[ARENA_HEADER + b->used];
+    b->used += size;
+    return ptr;
+}
@@ -3,7 +3,11 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 /* Make sure these constants are defined. */
 #ifndef TRUE
@@ -28,17 +32,176 @@
 #define likely(x)   __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
+/* The maximum length of the paths built by the program (of the host
+ * files, and of the files of an image spelled as `<Dir>Name`).
+ */
+#define MAX_PATH_LENGTH                            4096U
+
+/* The alignment of the memory given out by arena_alloc(), and the
+ * size actually taken from the arena by an allocation of `size`.
+ */
+#define ARENA_ALIGN                                  16U
+#define ARENA_ROUND(size)                                              \
+    (((size) + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1))
+
 /* Other useful macros. */
 #define __inline__ __inline__
 #define __aligned__(x) __attribute__((aligned (x)))
 #define __restrict__ __restrict__
 
+/* Data structures and types. */
+
+/* Defines the type of the function that receives the error
+ * messages of a thread (see set_error_handler()).
+ * The formatted message is given in `msg`.
+ */
+typedef void (*error_handler)(const char *msg, void *arg);
+
+/* A growable NUL-terminated string buffer. */
+struct string_buffer {
+    char *str;                    /* The contents of the buffer. */
+    size_t len;                   /* The length of the string. */
+    size_t capacity;              /* The allocated size of `str`. */
+};
+
+/* A bump allocator: the memory is given out in order from large
+ * blocks, and it is only released all at once (see arena_destroy()).
+ */
+struct arena {
+    struct arena_block *blocks;   /* The blocks (the newest first). */
+    size_t block_size;            /* The minimum size of a new block. */
+};
+
+/* A program running as a filter, connected to this process with
+ * a pipe (see filter_start()).
+ */
+struct filter {
+    const char *name;             /* The name of the program. */
+    pid_t pid;                    /* The process of the program. */
+    FILE *fp;                     /* The end of the pipe used by this
+                                   * process.
+                                   */
+    int is_writer;                /* If this process writes to it. */
+    sigset_t old_mask;            /* The signal mask of the writing
+                                   * thread before SIGPIPE was blocked.
+                                   */
+};
+
 /* Functions */
 
-/* Reports an error to stderr.
+/* Reports an error to stderr (or to the error handler of the
+ * calling thread, if there is one).
  * This function follows the same parameter convetion as printf().
+ * It is safe to call it from multiple threads.
  */
 void report_error(const char *fmt, ...)
     __attribute__((format (printf, 1, 2)));
 
+/* Sets the error handler of the calling thread.
+ * All subsequent errors reported by this thread are routed to
+ * `handler`, which also receives the extra parameter `arg`.
+ * If `handler` is NULL, the errors are reported to stderr again.
+ */
+void set_error_handler(error_handler handler, void *arg);
+
+/* Obtains the error handler of the calling thread (and its extra
+ * parameter), so that it can be restored later.
+ * If the thread has no handler, `handler` is set to NULL.
+ */
+void get_error_handler(error_handler *handler, void **arg);
+
+/* Error handler that appends the messages to the string buffer
+ * given as its extra parameter (a `struct string_buffer *`), as
+ * a comma-separated list of JSON strings. A message that cannot be
+ * appended is reported to stderr instead.
+ */
+void collect_json_error(const char *msg, void *arg);
+
+/* Writes all the `iovcnt` buffers in `iov` to the file descriptor
+ * `fd`, resuming after partial writes (the entries of `iov` are
+ * modified in that case).
+ * Returns TRUE on success.
+ */
+int write_iovecs(int fd, struct iovec *iov, int iovcnt);
+
+/* Starts the program given by `argv` (with `argv[0]` searched in
+ * the PATH) as a filter.
+ * If `is_writer` is FALSE, the program reads from the file
+ * descriptor `fd`, and its output can be read from `flt->fp`.
+ * Otherwise, the data written to `flt->fp` is the input of the
+ * program, which writes its output to `fd`; SIGPIPE is blocked in
+ * the calling thread until filter_finish(), so that writing to
+ * a program that exited early just fails with EPIPE.
+ * Returns TRUE on success.
+ */
+int filter_start(struct filter *flt, const char * const *argv, int fd,
+                 int is_writer);
+
+/* Closes the pipe of the filter `flt` and waits for its program
+ * to exit. It must be called by the thread that started the filter.
+ * Returns TRUE if both the pipe was closed successfully and the
+ * program exited with success (otherwise the error is reported).
+ */
+int filter_finish(struct filter *flt);
+
+/* Copies the `len` bytes in `src` to `dst`, swapping the two bytes
+ * of each 16-bit word (an odd trailing byte is not copied). The
+ * buffers must not overlap, unless `dst` is equal to `src`.
+ * The fastest implementation for the running CPU is chosen when
+ * the program starts.
+ */
+void swap_bytes(uint8_t *dst, const uint8_t *src, size_t len);
+
+/* Initializes the string buffer variable.
+ * This obeys the initvar / destroy / create protocol.
+ */
+void strbuf_initvar(struct string_buffer *sb);
+
+/* Destroys the string buffer (and releases the used memory).
+ * This obeys the initvar / destroy / create protocol.
+ */
+void strbuf_destroy(struct string_buffer *sb);
+
+/* Creates a new (empty) string buffer with room for `capacity`
+ * characters. This obeys the initvar / destroy / create protocol.
+ * Returns TRUE on success.
+ */
+int strbuf_create(struct string_buffer *sb, size_t capacity);
+
+/* Appends formatted text to the string buffer `sb`.
+ * This function follows the same parameter convetion as printf().
+ * Returns TRUE on success.
+ */
+int strbuf_printf(struct string_buffer *sb, const char *fmt, ...)
+    __attribute__((format (printf, 2, 3)));
+
+/* Appends the string `str` to the string buffer `sb` as a quoted
+ * JSON string (escaping the special characters).
+ * Returns TRUE on success.
+ */
+int strbuf_append_json(struct string_buffer *sb, const char *str);
+
+/* Initializes the arena variable.
+ * This obeys the initvar / destroy / create protocol.
+ */
+void arena_initvar(struct arena *a);
+
+/* Destroys the arena (and releases all the memory given out by it).
+ * This obeys the initvar / destroy / create protocol.
+ */
+void arena_destroy(struct arena *a);
+
+/* Creates a new arena, with a first block of `block_size` bytes
+ * (the arena grows by blocks of at least this size).
+ * This obeys the initvar / destroy / create protocol.
+ * Returns TRUE on success.
+ */
+int arena_create(struct arena *a, size_t block_size);
+
+/* Allocates `size` bytes from the arena `a` (suitably aligned for
+ * any type). The memory is not initialized.
+ * Returns the allocated memory, or NULL if out of memory.
+ */
+void *arena_alloc(struct arena *a, size_t size);
+
 #endif /* __UTILS_H */